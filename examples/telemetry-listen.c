@@ -40,36 +40,35 @@ static void save_telemetry(nvme_ctrl_t c)
 	char buf[0x1000];
 	size_t log_size;
 	int ret, fd;
-	struct nvme_telemetry_log *log;
 	time_t s;
-
-	/* Clear the log (rae == false) at the end to see new telemetry events later */
-	ret = nvme_get_ctrl_telemetry(nvme_ctrl_get_fd(c), false, &log, NVME_TELEMETRY_DA_3, &log_size);
-	if (ret)
-		return;
+	struct nvme_telemetry_stream_args args = {
+		.args_size = sizeof(args),
+		.fd = nvme_ctrl_get_fd(c),
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.lid = NVME_LOG_LID_TELEMETRY_CTRL,
+		.da = NVME_TELEMETRY_DA_3,
+		/* Clear the log (rae == false) at the end to see new telemetry events later */
+		.rae = false,
+		.size = &log_size,
+	};
 
 	s = time(NULL);
 	ret = snprintf(buf, sizeof(buf), "/var/log/%s-telemetry-%ld",
 		nvme_ctrl_get_subsysnqn(c), s);
-	if (ret < 0) {
-		free(log);
+	if (ret < 0)
 		return;
-	}
 
 	fd = open(buf, O_CREAT|O_WRONLY, S_IRUSR|S_IRGRP);
-	if (fd < 0) {
-		free(log);
+	if (fd < 0)
 		return;
-	}
 
-	ret = write(fd, log, log_size);
-	if (ret < 0)
+	args.out_fd = fd;
+	ret = nvme_stream_telemetry(&args);
+	if (ret)
 		printf("failed to write telemetry log\n");
 	else
-		printf("telemetry log save as %s, wrote:%d size:%zd\n", buf,
-			ret, log_size);
+		printf("telemetry log save as %s, size:%zd\n", buf, log_size);
 	close(fd);
-	free(log);
 }
 
 static void check_telemetry(nvme_ctrl_t c, int ufd)
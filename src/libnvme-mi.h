@@ -16,6 +16,8 @@ extern "C" {
 #include "nvme/types.h"
 #include "nvme/mi.h"
 #include "nvme/log.h"
+#include "nvme/stats.h"
+#include "nvme/trace.h"
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,394 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ *
+ * Passthrough command backends: the ioctl backend, and a recorder and
+ * replayer for command traffic. Recordings are a file header followed by
+ * one entry per command, each holding the command, its completion and the
+ * data returned by the device, all in host byte order. The data is padded
+ * to keep the entries 8 byte aligned.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+#include "private.h"
+
+#define NVME_REC_MAGIC		"NVMEREC"
+#define NVME_REC_VERSION	1
+#define NVME_REC_PAD(len)	(-(len) & 7)
+
+struct nvme_rec_file_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 rsvd;
+};
+
+struct nvme_rec_entry {
+	__u8 admin;
+	__u8 rsvd[3];
+	__s32 err;
+	__s32 error;
+	__u32 data_len;
+	__u32 metadata_len;
+	__u32 rsvd2;
+	struct nvme_passthru_cmd64 cmd;
+};
+
+struct nvme_recorder {
+	FILE *fp;
+	nvme_submit_fn_t fn;
+	void *arg;
+	pthread_mutex_t lock;
+	bool failed;
+};
+
+struct nvme_replay_group {
+	const struct nvme_rec_entry *key;
+	int *idx;
+	int nr;
+	int next;
+};
+
+struct nvme_replay {
+	void *buf;
+	const struct nvme_rec_entry **recs;
+	int nr_recs;
+	struct nvme_replay_group *groups;
+	int nr_buckets;
+	pthread_mutex_t lock;
+};
+
+nvme_submit_fn_t nvme_submit_backend;
+void *nvme_submit_backend_arg;
+
+void nvme_set_submit_backend(nvme_submit_fn_t fn, void *arg)
+{
+	nvme_submit_backend = fn;
+	nvme_submit_backend_arg = arg;
+}
+
+int nvme_submit_ioctl(void *arg, int fd, bool admin,
+		      struct nvme_passthru_cmd64 *cmd)
+{
+	return ioctl(fd, admin ? NVME_IOCTL_ADMIN64_CMD : NVME_IOCTL_IO64_CMD,
+		     cmd);
+}
+
+/* The data transfer direction is encoded in the two low opcode bits */
+static bool nvme_cmd_returns_data(__u8 opcode)
+{
+	return opcode & 2;
+}
+
+struct nvme_recorder *nvme_recorder_open(const char *path,
+					 nvme_submit_fn_t fn, void *arg)
+{
+	struct nvme_rec_file_hdr hdr = {
+		.magic = NVME_REC_MAGIC,
+		.version = NVME_REC_VERSION,
+	};
+	struct nvme_recorder *rec;
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	rec->fp = fopen(path, "we");
+	if (!rec->fp) {
+		free(rec);
+		return NULL;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, rec->fp) != 1) {
+		fclose(rec->fp);
+		free(rec);
+		return NULL;
+	}
+	rec->fn = fn ? fn : nvme_submit_ioctl;
+	rec->arg = arg;
+	pthread_mutex_init(&rec->lock, NULL);
+	return rec;
+}
+
+int nvme_recorder_submit(void *r, int fd, bool admin,
+			 struct nvme_passthru_cmd64 *cmd)
+{
+	struct nvme_recorder *rec = r;
+	struct nvme_rec_entry e = {
+		.admin = admin,
+	};
+	static const __u8 zeroes[8];
+	size_t pad;
+	int err, error;
+
+	err = rec->fn(rec->arg, fd, admin, cmd);
+	error = err < 0 ? errno : 0;
+
+	e.err = err;
+	e.error = error;
+	e.cmd = *cmd;
+	e.cmd.addr = 0;
+	e.cmd.metadata = 0;
+	if (!err && nvme_cmd_returns_data(cmd->opcode)) {
+		if (cmd->addr)
+			e.data_len = cmd->data_len;
+		if (cmd->metadata)
+			e.metadata_len = cmd->metadata_len;
+	}
+	pad = NVME_REC_PAD((size_t)e.data_len + e.metadata_len);
+
+	pthread_mutex_lock(&rec->lock);
+	if (fwrite(&e, sizeof(e), 1, rec->fp) != 1 ||
+	    (e.data_len && fwrite((void *)(uintptr_t)cmd->addr,
+				  e.data_len, 1, rec->fp) != 1) ||
+	    (e.metadata_len && fwrite((void *)(uintptr_t)cmd->metadata,
+				      e.metadata_len, 1, rec->fp) != 1) ||
+	    (pad && fwrite(zeroes, pad, 1, rec->fp) != 1))
+		rec->failed = true;
+	pthread_mutex_unlock(&rec->lock);
+
+	errno = error;
+	return err;
+}
+
+int nvme_recorder_close(struct nvme_recorder *rec)
+{
+	bool failed = rec->failed;
+
+	if (fclose(rec->fp))
+		failed = true;
+	pthread_mutex_destroy(&rec->lock);
+	free(rec);
+	if (failed) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static bool nvme_replay_match(const struct nvme_rec_entry *e, bool admin,
+			      const struct nvme_passthru_cmd64 *cmd)
+{
+	const struct nvme_passthru_cmd64 *c = &e->cmd;
+
+	return e->admin == admin && c->opcode == cmd->opcode &&
+		c->nsid == cmd->nsid && c->cdw2 == cmd->cdw2 &&
+		c->cdw3 == cmd->cdw3 && c->cdw10 == cmd->cdw10 &&
+		c->cdw11 == cmd->cdw11 && c->cdw12 == cmd->cdw12 &&
+		c->cdw13 == cmd->cdw13 && c->cdw14 == cmd->cdw14 &&
+		c->cdw15 == cmd->cdw15 && c->data_len == cmd->data_len &&
+		c->metadata_len == cmd->metadata_len;
+}
+
+static unsigned int nvme_replay_hash(bool admin,
+				     const struct nvme_passthru_cmd64 *cmd)
+{
+	__u32 v[] = {
+		admin << 8 | cmd->opcode, cmd->nsid, cmd->cdw10, cmd->cdw11,
+		cmd->cdw12, cmd->cdw13, cmd->cdw14, cmd->cdw15,
+	};
+	__u32 h = 2166136261u;
+	int i;
+
+	for (i = 0; i < sizeof(v) / sizeof(v[0]); i++)
+		h = (h ^ v[i]) * 16777619u;
+	return h;
+}
+
+static struct nvme_replay_group *
+nvme_replay_lookup(struct nvme_replay *rp, bool admin,
+		   const struct nvme_passthru_cmd64 *cmd, bool insert)
+{
+	unsigned int i = nvme_replay_hash(admin, cmd) & (rp->nr_buckets - 1);
+
+	for (;;) {
+		struct nvme_replay_group *g = &rp->groups[i];
+
+		if (!g->key)
+			return insert ? g : NULL;
+		if (nvme_replay_match(g->key, admin, cmd))
+			return g;
+		i = (i + 1) & (rp->nr_buckets - 1);
+	}
+}
+
+static int nvme_replay_index(struct nvme_replay *rp)
+{
+	int i;
+
+	rp->nr_buckets = 16;
+	while (rp->nr_buckets < 2 * rp->nr_recs)
+		rp->nr_buckets <<= 1;
+	rp->groups = calloc(rp->nr_buckets, sizeof(*rp->groups));
+	if (!rp->groups)
+		return -1;
+
+	for (i = 0; i < rp->nr_recs; i++) {
+		const struct nvme_rec_entry *e = rp->recs[i];
+		struct nvme_replay_group *g;
+		int *idx;
+
+		g = nvme_replay_lookup(rp, e->admin, &e->cmd, true);
+		idx = realloc(g->idx, (g->nr + 1) * sizeof(*g->idx));
+		if (!idx)
+			return -1;
+		g->key = e;
+		g->idx = idx;
+		g->idx[g->nr++] = i;
+	}
+	return 0;
+}
+
+static int nvme_replay_parse(struct nvme_replay *rp, size_t len)
+{
+	const struct nvme_rec_file_hdr *hdr = rp->buf;
+	size_t off = sizeof(*hdr), data_len;
+	int alloc = 0;
+
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, NVME_REC_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != NVME_REC_VERSION)
+		goto err_proto;
+
+	while (off < len) {
+		const struct nvme_rec_entry *e = rp->buf + off;
+
+		if (len - off < sizeof(*e))
+			goto err_proto;
+		off += sizeof(*e);
+		/* Replay copies at most the buffer sizes of the command */
+		if (e->data_len > e->cmd.data_len ||
+		    e->metadata_len > e->cmd.metadata_len)
+			goto err_proto;
+		data_len = (size_t)e->data_len + e->metadata_len;
+		data_len += NVME_REC_PAD(data_len);
+		if (len - off < data_len)
+			goto err_proto;
+		off += data_len;
+
+		if (rp->nr_recs == alloc) {
+			const struct nvme_rec_entry **recs;
+
+			alloc = alloc ? alloc * 2 : 64;
+			recs = realloc(rp->recs, alloc * sizeof(*recs));
+			if (!recs)
+				return -1;
+			rp->recs = recs;
+		}
+		rp->recs[rp->nr_recs++] = e;
+	}
+	return 0;
+
+err_proto:
+	errno = EPROTO;
+	return -1;
+}
+
+struct nvme_replay *nvme_replay_open(const char *path)
+{
+	struct nvme_replay *rp;
+	struct stat st;
+	ssize_t ret;
+	size_t len = 0;
+	int fd;
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&rp->lock, NULL);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto err_free;
+	if (fstat(fd, &st) < 0)
+		goto err_close;
+	/* Keep entries aligned for direct access */
+	rp->buf = aligned_alloc(8, (st.st_size + 7) & ~7ULL ?: 8);
+	if (!rp->buf)
+		goto err_close;
+	while (len < st.st_size) {
+		ret = read(fd, rp->buf + len, st.st_size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	close(fd);
+
+	if (nvme_replay_parse(rp, len) < 0)
+		goto err_free;
+	if (nvme_replay_index(rp) < 0) {
+		nvme_replay_close(rp);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return rp;
+
+err_close:
+	close(fd);
+err_free:
+	nvme_replay_close(rp);
+	return NULL;
+}
+
+int nvme_replay_submit(void *r, int fd, bool admin,
+		       struct nvme_passthru_cmd64 *cmd)
+{
+	struct nvme_replay *rp = r;
+	const struct nvme_rec_entry *e;
+	struct nvme_replay_group *g;
+	const __u8 *data;
+
+	pthread_mutex_lock(&rp->lock);
+	g = nvme_replay_lookup(rp, admin, cmd, false);
+	if (!g) {
+		pthread_mutex_unlock(&rp->lock);
+		errno = ENODATA;
+		return -1;
+	}
+	e = rp->recs[g->idx[g->next]];
+	if (g->next < g->nr - 1)
+		g->next++;
+	pthread_mutex_unlock(&rp->lock);
+
+	data = (const __u8 *)(e + 1);
+	if (e->data_len && cmd->addr)
+		memcpy((void *)(uintptr_t)cmd->addr, data, e->data_len);
+	if (e->metadata_len && cmd->metadata)
+		memcpy((void *)(uintptr_t)cmd->metadata, data + e->data_len,
+		       e->metadata_len);
+	cmd->result = e->cmd.result;
+
+	if (e->err < 0)
+		errno = e->error;
+	return e->err;
+}
+
+void nvme_replay_close(struct nvme_replay *rp)
+{
+	int i;
+
+	if (rp->groups) {
+		for (i = 0; i < rp->nr_buckets; i++)
+			free(rp->groups[i].idx);
+		free(rp->groups);
+	}
+	pthread_mutex_destroy(&rp->lock);
+	free(rp->recs);
+	free(rp->buf);
+	free(rp);
+}
@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_BACKEND_H
+#define _LIBNVME_BACKEND_H
+
+#include <stdbool.h>
+
+#include "ioctl.h"
+
+/**
+ * DOC: backend.h
+ *
+ * Passthrough command backends
+ *
+ * All admin and I/O passthrough commands, including those issued by the
+ * command helpers in ioctl.h, are handed to the submit backend. The
+ * default backend issues the NVMe ioctls. A replacement backend allows
+ * recording the commands sent to a device, replaying them later, or
+ * running against a simulated controller without NVMe hardware.
+ */
+
+/**
+ * typedef nvme_submit_fn_t - Passthrough command backend
+ * @arg:	Argument passed to nvme_set_submit_backend()
+ * @fd:		File descriptor the command was submitted to
+ * @admin:	True for admin commands, false for I/O commands
+ * @cmd:	Command, the 32-bit passthrough commands are converted
+ *
+ * The backend transfers data to and from the buffers at &cmd->addr and
+ * &cmd->metadata and sets &cmd->result.
+ *
+ * Return: The same as the NVMe passthrough ioctls: 0 on success, the
+ * NVMe status if positive, or -1 with errno set.
+ */
+typedef int (*nvme_submit_fn_t)(void *arg, int fd, bool admin,
+				struct nvme_passthru_cmd64 *cmd);
+
+/**
+ * nvme_set_submit_backend() - Replace the passthrough command backend
+ * @fn:		Backend, or NULL to restore the ioctl backend
+ * @arg:	Argument passed to @fn
+ *
+ * Must not be called while other threads submit commands.
+ */
+void nvme_set_submit_backend(nvme_submit_fn_t fn, void *arg);
+
+/**
+ * nvme_submit_ioctl() - The ioctl backend
+ * @arg:	Unused
+ * @fd:		File descriptor of an NVMe device
+ * @admin:	True for admin commands, false for I/O commands
+ * @cmd:	Command to submit
+ *
+ * Submits @cmd with the 64-bit passthrough ioctls. Backends which wrap
+ * the real device, such as the recorder, call this.
+ *
+ * Return: See &nvme_submit_fn_t.
+ */
+int nvme_submit_ioctl(void *arg, int fd, bool admin,
+		      struct nvme_passthru_cmd64 *cmd);
+
+/**
+ * struct nvme_recorder - Opaque command recorder
+ */
+struct nvme_recorder;
+
+/**
+ * nvme_recorder_open() - Record passthrough commands to a file
+ * @path:	File to create
+ * @fn:		Backend to pass the commands to, or NULL for the ioctl
+ *		backend
+ * @arg:	Argument passed to @fn
+ *
+ * Install the recorder with
+ * nvme_set_submit_backend(nvme_recorder_submit, rec). Each command is
+ * passed to @fn and written to @path with its completion and the data
+ * returned by the device. Data sent to the device is not recorded.
+ *
+ * Return: Recorder, or NULL with errno set.
+ */
+struct nvme_recorder *nvme_recorder_open(const char *path,
+					 nvme_submit_fn_t fn, void *arg);
+
+/**
+ * nvme_recorder_submit() - Recording backend
+ * @rec:	Recorder returned by nvme_recorder_open()
+ * @fd:		File descriptor the command was submitted to
+ * @admin:	True for admin commands, false for I/O commands
+ * @cmd:	Command to submit
+ *
+ * Return: See &nvme_submit_fn_t.
+ */
+int nvme_recorder_submit(void *rec, int fd, bool admin,
+			 struct nvme_passthru_cmd64 *cmd);
+
+/**
+ * nvme_recorder_close() - Flush and close a recording
+ * @rec:	Recorder returned by nvme_recorder_open()
+ *
+ * Return: 0 on success, or -1 with errno set if the recording could not
+ * be written completely.
+ */
+int nvme_recorder_close(struct nvme_recorder *rec);
+
+/**
+ * struct nvme_replay - Opaque command replayer
+ */
+struct nvme_replay;
+
+/**
+ * nvme_replay_open() - Load a recording for replay
+ * @path:	File written by a &struct nvme_recorder
+ *
+ * Install the replayer with
+ * nvme_set_submit_backend(nvme_replay_submit, rp). Each command is
+ * answered with the first not yet replayed record of a command with the
+ * same type, opcode, nsid, command dwords and data length, regardless of
+ * the file descriptor. Once all matching records have been replayed, the
+ * last one is repeated.
+ *
+ * Return: Replayer, or NULL with errno set. EPROTO if @path is not a
+ * valid recording.
+ */
+struct nvme_replay *nvme_replay_open(const char *path);
+
+/**
+ * nvme_replay_submit() - Replaying backend
+ * @rp:		Replayer returned by nvme_replay_open()
+ * @fd:		Ignored
+ * @admin:	True for admin commands, false for I/O commands
+ * @cmd:	Command to answer
+ *
+ * Return: See &nvme_submit_fn_t. ENODATA if no matching command was
+ * recorded.
+ */
+int nvme_replay_submit(void *rp, int fd, bool admin,
+		       struct nvme_passthru_cmd64 *cmd);
+
+/**
+ * nvme_replay_close() - Free a replayer
+ * @rp:		Replayer returned by nvme_replay_open()
+ */
+void nvme_replay_close(struct nvme_replay *rp);
+
+/**
+ * struct nvme_sim_config - Simulated controller configuration
+ * @nr_namespaces:	Number of namespaces, NSIDs 1 to @nr_namespaces
+ * @ns_blocks:		Size of each namespace in logical blocks
+ * @lba_shift:		Logical block size as a power of two, 9 if 0
+ * @latency_us:		Time each command takes in microseconds
+ * @fail_ppm:		Share of commands failing, in parts per million
+ * @fail_status:	Status of failing commands, NVME_SC_INTERNAL if 0
+ * @seed:		Seed for choosing the failing commands
+ *
+ * Namespace data is kept in memory, so @ns_blocks should be small.
+ */
+struct nvme_sim_config {
+	__u32 nr_namespaces;
+	__u64 ns_blocks;
+	__u8 lba_shift;
+	__u32 latency_us;
+	__u32 fail_ppm;
+	__u16 fail_status;
+	unsigned int seed;
+};
+
+/**
+ * struct nvme_sim - Opaque simulated controller
+ */
+struct nvme_sim;
+
+/**
+ * nvme_sim_create() - Create a simulated controller
+ * @cfg:	Configuration
+ *
+ * Install the simulator with nvme_set_submit_backend(nvme_sim_submit, sim).
+ * It answers Identify (controller, namespace and active namespace list),
+ * Get Log Page with zeroed logs, Get and Set Features, and Read, Write,
+ * Write Zeroes, Flush and Dataset Management. Other opcodes fail with
+ * NVME_SC_INVALID_OPCODE. All file descriptors address the same
+ * controller.
+ *
+ * Return: Simulator, or NULL with errno set.
+ */
+struct nvme_sim *nvme_sim_create(const struct nvme_sim_config *cfg);
+
+/**
+ * nvme_sim_submit() - Simulated controller backend
+ * @sim:	Simulator returned by nvme_sim_create()
+ * @fd:		Ignored
+ * @admin:	True for admin commands, false for I/O commands
+ * @cmd:	Command to execute
+ *
+ * Return: See &nvme_submit_fn_t.
+ */
+int nvme_sim_submit(void *sim, int fd, bool admin,
+		    struct nvme_passthru_cmd64 *cmd);
+
+/**
+ * nvme_sim_free() - Free a simulated controller
+ * @sim:	Simulator returned by nvme_sim_create()
+ */
+void nvme_sim_free(struct nvme_sim *sim);
+
+#endif /* _LIBNVME_BACKEND_H */
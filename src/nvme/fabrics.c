@@ -37,6 +37,7 @@
 #include "util.h"
 #include "log.h"
 #include "private.h"
+#include "trace.h"
 
 #define NVMF_HOSTID_SIZE	37
 #define UUID_SIZE		37  /* 1b4e28ba-2fa1-11d2-883f-0016d3cca427 + \0 */
@@ -44,6 +45,11 @@
 #define NVMF_HOSTNQN_FILE	SYSCONFDIR "/nvme/hostnqn"
 #define NVMF_HOSTID_FILE	SYSCONFDIR "/nvme/hostid"
 
+/* Most records whose log page length still fits an unsigned int */
+#define NVMF_DISC_MAX_NUMREC						\
+	((UINT_MAX - sizeof(struct nvmf_discovery_log)) /		\
+	 sizeof(struct nvmf_disc_log_entry))
+
 const char *nvmf_dev = "/dev/nvme-fabrics";
 
 /**
@@ -508,10 +514,30 @@ static int build_options(nvme_host_t h, nvme_ctrl_t c, char **argstr)
 	return 0;
 }
 
+static void nvmf_trace_connect(__u64 start, int len, int ret)
+{
+	nvme_trace_probe(NVME_TRACE_CONNECT, -1, nvme_fabrics_type_connect,
+			 0, 0, 0, len, ret);
+	if (nvme_tracing(start)) {
+		struct nvme_trace_record rec = {
+			.start_ns = start,
+			.id = -1,
+			.source = NVME_TRACE_CONNECT,
+			.opcode = nvme_fabrics_type_connect,
+			.data_len = len,
+			.result = ret < 0 ? 0 : ret,
+			.status = ret < 0 ? ret : 0,
+		};
+
+		__nvme_trace_cmd(&rec);
+	}
+}
+
 static int __nvmf_add_ctrl(nvme_root_t r, const char *argstr)
 {
 	int ret, fd, len = strlen(argstr);
 	char buf[0x1000], *options, *p;
+	__u64 start = nvme_cmd_start();
 
 	fd = open(nvmf_dev, O_RDWR);
 	if (fd < 0) {
@@ -572,6 +598,7 @@ static int __nvmf_add_ctrl(nvme_root_t r, const char *argstr)
 	ret = -ENVME_CONNECT_PARSE;
 out_close:
 	close(fd);
+	nvmf_trace_connect(start, strlen(argstr), ret);
 	return ret;
 }
 
@@ -756,11 +783,11 @@ nvme_ctrl_t nvmf_connect_disc_entry(nvme_host_t h,
 	return NULL;
 }
 
-static int nvme_discovery_log(int fd, __u32 len, struct nvmf_discovery_log *log, bool rae)
+static int nvme_discovery_log(nvme_ctrl_t c, __u32 len,
+			      struct nvmf_discovery_log *log, bool rae)
 {
 	struct nvme_get_log_args args = {
 		.args_size = sizeof(args),
-		.fd = fd,
 		.nsid = NVME_NSID_NONE,
 		.lsp = NVME_LOG_LSP_NONE,
 		.lsi = NVME_LOG_LSI_NONE,
@@ -775,7 +802,7 @@ static int nvme_discovery_log(int fd, __u32 len, struct nvmf_discovery_log *log,
 		.ot = false,
 	};
 
-	return nvme_get_log_page(fd, 4096, &args);
+	return nvme_ctrl_get_log_page(c, &args);
 }
 
 int nvmf_get_discovery_log(nvme_ctrl_t c, struct nvmf_discovery_log **logp,
@@ -799,10 +826,11 @@ int nvmf_get_discovery_log(nvme_ctrl_t c, struct nvmf_discovery_log **logp,
 	memset(log, 0, hdr);
 
 	nvme_msg(r, LOG_DEBUG, "%s: discover length %d\n", name, 0x100);
-	ret = nvme_discovery_log(nvme_ctrl_get_fd(c), 0x100, log, true);
+	ret = nvme_discovery_log(c, 0x100, log, true);
 	if (ret) {
-		nvme_msg(r, LOG_INFO, "%s: discover failed, error %d\n",
-			 name, errno);
+		nvme_msg_cmd(r, LOG_INFO, name, 0, nvme_admin_get_log_page,
+			     ret > 0 ? ret : -errno,
+			     "%s: discover failed, error %d\n", name, errno);
 		goto out_free_log;
 	}
 
@@ -814,6 +842,14 @@ int nvmf_get_discovery_log(nvme_ctrl_t c, struct nvmf_discovery_log **logp,
 			*logp = log;
 			return 0;
 		}
+		if (numrec > NVMF_DISC_MAX_NUMREC) {
+			nvme_msg(r, LOG_ERR,
+				 "%s: discovery log with %" PRIu64 " records is too large\n",
+				 name, numrec);
+			errno = EINVAL;
+			ret = -1;
+			goto out_free_log;
+		}
 
 		size = sizeof(struct nvmf_discovery_log) +
 			sizeof(struct nvmf_disc_log_entry) * (numrec);
@@ -829,11 +865,13 @@ int nvmf_get_discovery_log(nvme_ctrl_t c, struct nvmf_discovery_log **logp,
 		memset(log, 0, size);
 
 		nvme_msg(r, LOG_DEBUG, "%s: discover length %d\n", name, size);
-		ret = nvme_discovery_log(nvme_ctrl_get_fd(c), size, log, false);
+		ret = nvme_discovery_log(c, size, log, false);
 		if (ret) {
-			nvme_msg(r, LOG_INFO,
-				 "%s: discover try %d/%d failed, error %d\n",
-				 name, retries, max_retries, errno);
+			nvme_msg_cmd(r, LOG_INFO, name, 0,
+				     nvme_admin_get_log_page,
+				     ret > 0 ? ret : -errno,
+				     "%s: discover try %d/%d failed, error %d\n",
+				     name, retries, max_retries, errno);
 			goto out_free_log;
 		}
 
@@ -841,11 +879,13 @@ int nvmf_get_discovery_log(nvme_ctrl_t c, struct nvmf_discovery_log **logp,
 		nvme_msg(r, LOG_DEBUG,
 			 "%s: discover genctr %" PRIu64 ", retry\n",
 			 name, genctr);
-		ret = nvme_discovery_log(nvme_ctrl_get_fd(c), hdr, log, true);
+		ret = nvme_discovery_log(c, hdr, log, true);
 		if (ret) {
-			nvme_msg(r, LOG_INFO,
-				 "%s: discover try %d/%d failed, error %d\n",
-				 name, retries, max_retries, errno);
+			nvme_msg_cmd(r, LOG_INFO, name, 0,
+				     nvme_admin_get_log_page,
+				     ret > 0 ? ret : -errno,
+				     "%s: discover try %d/%d failed, error %d\n",
+				     name, retries, max_retries, errno);
 			goto out_free_log;
 		}
 	} while (genctr != le64_to_cpu(log->genctr) &&
@@ -871,6 +911,279 @@ out_free_log:
 	return ret;
 }
 
+struct nvmf_disc_index_entry {
+	struct nvmf_disc_index_entry *next;
+	struct nvmf_disc_log_entry *e;
+	const char *transport;
+	char subnqn[NVME_NQN_LENGTH + 1];
+	char traddr[NVMF_TRADDR_SIZE + 1];
+	char trsvcid[NVMF_TRSVCID_SIZE + 1];
+	bool matched;
+};
+
+struct nvmf_disc_index_ctrl {
+	struct nvmf_disc_index_ctrl *next;
+	nvme_ctrl_t c;
+	bool matched;
+};
+
+struct nvmf_disc_index {
+	nvme_host_t h;
+	unsigned int mask;
+	struct nvmf_disc_index_entry **entries;
+	struct nvmf_disc_index_ctrl **ctrls;
+	struct nvmf_disc_index_entry *entry_pool;
+	struct nvmf_disc_index_ctrl *ctrl_pool;
+	int nr_entries;
+	int nr_ctrls;
+};
+
+static inline __u32 nvmf_disc_hash_str(__u32 hash, const char *s, bool icase)
+{
+	/* FNV-1a; traddr is compared case-insensitively, so hash it that way */
+	for (; s && *s; s++) {
+		hash ^= icase ? (unsigned char)tolower(*s) : (unsigned char)*s;
+		hash *= 16777619;
+	}
+	/* field separator, so that ("ab", "c") and ("a", "bc") differ */
+	hash ^= 0xff;
+	return hash * 16777619;
+}
+
+static __u32 nvmf_disc_hash(const char *subnqn, const char *transport,
+			    const char *traddr, const char *trsvcid)
+{
+	__u32 hash = 2166136261;
+
+	hash = nvmf_disc_hash_str(hash, subnqn, false);
+	hash = nvmf_disc_hash_str(hash, transport, false);
+	hash = nvmf_disc_hash_str(hash, traddr, true);
+	return nvmf_disc_hash_str(hash, trsvcid, false);
+}
+
+static inline const char *nvmf_disc_str(const char *s)
+{
+	return s ? s : "";
+}
+
+static bool nvmf_disc_ctrl_match(nvme_ctrl_t c,
+				 struct nvmf_disc_index_entry *ie)
+{
+	return !strcmp(nvmf_disc_str(nvme_ctrl_get_subsysnqn(c)), ie->subnqn) &&
+		!strcmp(nvmf_disc_str(c->transport), ie->transport) &&
+		!strcasecmp(nvmf_disc_str(c->traddr), ie->traddr) &&
+		!strcmp(nvmf_disc_str(c->trsvcid), ie->trsvcid);
+}
+
+/* Discovery log page fields are fixed size and space padded */
+static void nvmf_disc_copy_field(char *dst, const char *src, size_t len)
+{
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	strchomp(dst, len);
+	if (len && dst[0] == ' ')
+		dst[0] = '\0';
+}
+
+nvmf_disc_index_t nvmf_disc_index_create(nvme_host_t h,
+					 struct nvmf_discovery_log *log)
+{
+	struct nvmf_disc_index *idx;
+	size_t size = 16;
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	__u64 i, numrec = log ? le64_to_cpu(log->numrec) : 0;
+	int nr_ctrls = 0;
+
+	/* Same bound as nvmf_get_discovery_log(), so size cannot overflow */
+	if (numrec > NVMF_DISC_MAX_NUMREC) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	nvme_for_each_subsystem(h, s)
+		nvme_subsystem_for_each_ctrl(s, c)
+			nr_ctrls++;
+
+	/* keep the load factor at most 1 for both tables */
+	while (size < numrec || size < nr_ctrls)
+		size <<= 1;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	idx->h = h;
+	idx->mask = size - 1;
+	idx->entries = calloc(size, sizeof(*idx->entries));
+	idx->ctrls = calloc(size, sizeof(*idx->ctrls));
+	idx->entry_pool = calloc(numrec ? numrec : 1,
+				 sizeof(*idx->entry_pool));
+	idx->ctrl_pool = calloc(nr_ctrls ? nr_ctrls : 1,
+				sizeof(*idx->ctrl_pool));
+	if (!idx->entries || !idx->ctrls ||
+	    !idx->entry_pool || !idx->ctrl_pool) {
+		nvmf_disc_index_free(idx);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < numrec; i++) {
+		struct nvmf_disc_index_entry *ie = &idx->entry_pool[i];
+		struct nvmf_disc_log_entry *e = &log->entries[i];
+		__u32 hash;
+
+		ie->e = e;
+		ie->transport = nvmf_trtype_str(e->trtype);
+		nvmf_disc_copy_field(ie->subnqn, e->subnqn, sizeof(e->subnqn));
+		nvmf_disc_copy_field(ie->traddr, e->traddr, sizeof(e->traddr));
+		nvmf_disc_copy_field(ie->trsvcid, e->trsvcid,
+				     sizeof(e->trsvcid));
+		hash = nvmf_disc_hash(ie->subnqn, ie->transport,
+				      ie->traddr, ie->trsvcid) & idx->mask;
+		ie->next = idx->entries[hash];
+		idx->entries[hash] = ie;
+	}
+	idx->nr_entries = numrec;
+
+	nvme_for_each_subsystem(h, s) {
+		nvme_subsystem_for_each_ctrl(s, c) {
+			struct nvmf_disc_index_ctrl *ic;
+			__u32 hash;
+
+			ic = &idx->ctrl_pool[idx->nr_ctrls++];
+			ic->c = c;
+			hash = nvmf_disc_hash(nvme_ctrl_get_subsysnqn(c),
+					      c->transport, c->traddr,
+					      c->trsvcid) & idx->mask;
+			ic->next = idx->ctrls[hash];
+			idx->ctrls[hash] = ic;
+		}
+	}
+
+	return idx;
+}
+
+void nvmf_disc_index_free(nvmf_disc_index_t idx)
+{
+	if (!idx)
+		return;
+	free(idx->entries);
+	free(idx->ctrls);
+	free(idx->entry_pool);
+	free(idx->ctrl_pool);
+	free(idx);
+}
+
+static struct nvmf_disc_index_entry *
+__nvmf_disc_index_lookup(nvmf_disc_index_t idx, const char *subnqn,
+			 const char *transport, const char *traddr,
+			 const char *trsvcid)
+{
+	struct nvmf_disc_index_entry *ie;
+	__u32 hash;
+
+	subnqn = nvmf_disc_str(subnqn);
+	transport = nvmf_disc_str(transport);
+	traddr = nvmf_disc_str(traddr);
+	trsvcid = nvmf_disc_str(trsvcid);
+	hash = nvmf_disc_hash(subnqn, transport, traddr, trsvcid);
+	for (ie = idx->entries[hash & idx->mask]; ie; ie = ie->next) {
+		if (!strcmp(ie->subnqn, subnqn) &&
+		    !strcmp(ie->transport, transport) &&
+		    !strcasecmp(ie->traddr, traddr) &&
+		    !strcmp(ie->trsvcid, trsvcid))
+			return ie;
+	}
+	return NULL;
+}
+
+struct nvmf_disc_log_entry *nvmf_disc_index_lookup(nvmf_disc_index_t idx,
+		const char *subnqn, const char *transport,
+		const char *traddr, const char *trsvcid)
+{
+	struct nvmf_disc_index_entry *ie;
+
+	ie = __nvmf_disc_index_lookup(idx, subnqn, transport,
+				      traddr, trsvcid);
+	return ie ? ie->e : NULL;
+}
+
+static nvme_ctrl_t __nvmf_disc_index_ctrl(nvmf_disc_index_t idx,
+					  struct nvmf_disc_index_entry *ie,
+					  bool connected)
+{
+	struct nvmf_disc_index_ctrl *ic;
+	__u32 hash;
+
+	hash = nvmf_disc_hash(ie->subnqn, ie->transport,
+			      ie->traddr, ie->trsvcid);
+	for (ic = idx->ctrls[hash & idx->mask]; ic; ic = ic->next) {
+		if (connected && !ic->c->name)
+			continue;
+		if (nvmf_disc_ctrl_match(ic->c, ie))
+			return ic->c;
+	}
+	return NULL;
+}
+
+nvme_ctrl_t nvmf_disc_index_connected(nvmf_disc_index_t idx,
+				      struct nvmf_disc_log_entry *e)
+{
+	struct nvmf_disc_index_entry ie = { .e = e };
+
+	ie.transport = nvmf_trtype_str(e->trtype);
+	nvmf_disc_copy_field(ie.subnqn, e->subnqn, sizeof(e->subnqn));
+	nvmf_disc_copy_field(ie.traddr, e->traddr, sizeof(e->traddr));
+	nvmf_disc_copy_field(ie.trsvcid, e->trsvcid, sizeof(e->trsvcid));
+
+	return __nvmf_disc_index_ctrl(idx, &ie, true);
+}
+
+int nvmf_disc_index_diff(nvmf_disc_index_t idx, nvmf_disc_diff_cb_t cb,
+			 void *arg)
+{
+	struct nvmf_disc_index_ctrl *ic;
+	int i, ret;
+
+	for (i = 0; i < idx->nr_ctrls; i++)
+		idx->ctrl_pool[i].matched = false;
+
+	for (i = 0; i < idx->nr_entries; i++) {
+		struct nvmf_disc_index_entry *ie = &idx->entry_pool[i];
+		__u32 hash;
+		nvme_ctrl_t c = NULL;
+
+		hash = nvmf_disc_hash(ie->subnqn, ie->transport,
+				      ie->traddr, ie->trsvcid);
+		for (ic = idx->ctrls[hash & idx->mask]; ic; ic = ic->next) {
+			if (!nvmf_disc_ctrl_match(ic->c, ie))
+				continue;
+			ic->matched = true;
+			if (!c)
+				c = ic->c;
+		}
+		ret = cb(idx, c ? NVMF_DISC_DIFF_KNOWN : NVMF_DISC_DIFF_NEW,
+			 ie->e, c, arg);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < idx->nr_ctrls; i++) {
+		ic = &idx->ctrl_pool[i];
+		if (ic->matched)
+			continue;
+		/* discovery controllers never show up in their own log */
+		if (nvme_ctrl_is_discovery_ctrl(ic->c))
+			continue;
+		ret = cb(idx, NVMF_DISC_DIFF_STALE, NULL, ic->c, arg);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 #define PATH_UUID_IBM	"/proc/device-tree/ibm,partition-uuid"
 
 static int uuid_from_device_tree(char *system_uuid)
@@ -1062,6 +1375,155 @@ char *nvmf_hostid_from_file()
 	return nvmf_read_file(NVMF_HOSTID_FILE, NVMF_HOSTID_SIZE);
 }
 
+#define NVMF_HOST_CACHE_MAGIC	"# libnvme host identity cache v1"
+
+/*
+ * The cache is only valid as long as the files it was derived from are
+ * unchanged; record their identity (or absence) so that validating the
+ * cache costs a stat() instead of re-reading DMI and device-tree data.
+ */
+static void nvmf_host_src_sig(const char *f, char *sig, size_t len)
+{
+	struct stat st;
+
+	if (stat(f, &st) < 0) {
+		snprintf(sig, len, "none");
+		return;
+	}
+	snprintf(sig, len, "%llu %llu %lld.%09ld",
+		 (unsigned long long)st.st_ino,
+		 (unsigned long long)st.st_size,
+		 (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+static int nvmf_host_cache_read(nvme_root_t r)
+{
+	char line[NVMF_NQN_SIZE + 64], sig[64];
+	char *hostnqn = NULL, *hostid = NULL;
+	bool nqn_valid = false, id_valid = false;
+	FILE *f;
+	char *p;
+
+	f = fopen(r->host_cache_file, "re");
+	if (!f)
+		return -1;
+
+	if (!fgets(line, sizeof(line), f) ||
+	    strncmp(line, NVMF_HOST_CACHE_MAGIC, strlen(NVMF_HOST_CACHE_MAGIC)))
+		goto out;
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((p = startswith(line, "hostnqn-src "))) {
+			nvmf_host_src_sig(NVMF_HOSTNQN_FILE, sig, sizeof(sig));
+			nqn_valid = !strcmp(p, sig);
+		} else if ((p = startswith(line, "hostid-src "))) {
+			nvmf_host_src_sig(NVMF_HOSTID_FILE, sig, sizeof(sig));
+			id_valid = !strcmp(p, sig);
+		} else if ((p = startswith(line, "hostnqn ")) && !hostnqn) {
+			hostnqn = strdup(p);
+		} else if ((p = startswith(line, "hostid ")) && !hostid) {
+			hostid = strdup(p);
+		}
+	}
+
+	if (nqn_valid && id_valid && hostnqn &&
+	    startswith(hostnqn, "nqn.")) {
+		r->hostnqn = hostnqn;
+		r->hostid = hostid;
+		fclose(f);
+		return 0;
+	}
+out:
+	nvme_msg(r, LOG_DEBUG, "discarding stale host cache %s\n",
+		 r->host_cache_file);
+	free(hostnqn);
+	free(hostid);
+	fclose(f);
+	return -1;
+}
+
+static void nvmf_host_cache_write(nvme_root_t r)
+{
+	char nqn_sig[64], id_sig[64];
+	char *tmp;
+	FILE *f;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", r->host_cache_file) < 0)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		nvme_msg(r, LOG_DEBUG, "failed to create %s: %s\n",
+			 tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+	fchmod(fd, 0644);
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto out_unlink;
+	}
+
+	nvmf_host_src_sig(NVMF_HOSTNQN_FILE, nqn_sig, sizeof(nqn_sig));
+	nvmf_host_src_sig(NVMF_HOSTID_FILE, id_sig, sizeof(id_sig));
+	fprintf(f, "%s\nhostnqn-src %s\nhostid-src %s\nhostnqn %s\n",
+		NVMF_HOST_CACHE_MAGIC, nqn_sig, id_sig, r->hostnqn);
+	if (r->hostid)
+		fprintf(f, "hostid %s\n", r->hostid);
+	if (fclose(f) || rename(tmp, r->host_cache_file) < 0) {
+		nvme_msg(r, LOG_DEBUG, "failed to write %s: %s\n",
+			 r->host_cache_file, strerror(errno));
+		goto out_unlink;
+	}
+	free(tmp);
+	return;
+
+out_unlink:
+	unlink(tmp);
+	free(tmp);
+}
+
+int nvmf_host_identity(nvme_root_t r, const char **hostnqn,
+		       const char **hostid)
+{
+	if (!r->hostnqn &&
+	    (!r->host_cache_file || nvmf_host_cache_read(r) < 0)) {
+		r->hostnqn = nvmf_hostnqn_from_file();
+		if (!r->hostnqn)
+			r->hostnqn = nvmf_hostnqn_generate();
+		if (!r->hostnqn) {
+			errno = ENOMEM;
+			return -1;
+		}
+		r->hostid = nvmf_hostid_from_file();
+		if (r->host_cache_file)
+			nvmf_host_cache_write(r);
+	}
+
+	*hostnqn = r->hostnqn;
+	*hostid = r->hostid;
+	return 0;
+}
+
+int nvme_set_host_identity_cache(nvme_root_t r, const char *cache_file)
+{
+	char *f = NULL;
+
+	if (cache_file) {
+		f = strdup(cache_file);
+		if (!f) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	free(r->host_cache_file);
+	r->host_cache_file = f;
+	return 0;
+}
+
 /**
  * nvmf_get_tel() - Calculate the amount of memory needed for a DIE.
  * @hostsymname:	Symbolic name (may be NULL)
@@ -1142,6 +1604,33 @@ static void nvmf_fill_die(struct nvmf_ext_die *die, struct nvme_host *h,
 	die->numexat = cpu_to_le16(numexat);
 }
 
+/**
+ * struct nvmf_dim_entity - Entity Name and Version sent with DIM
+ * @ename:	Entity Name (ENAME)
+ * @ever:	Entity Version (EVER)
+ *
+ * Both only depend on the local system, so batch registrations look
+ * them up once instead of once per discovery controller.
+ */
+struct nvmf_dim_entity {
+	char ename[NVMF_ENAME_LEN];
+	char ever[NVMF_EVER_LEN];
+};
+
+static void nvmf_dim_entity_init(nvme_root_t r, struct nvmf_dim_entity *ent)
+{
+	int ret;
+
+	ret = get_entity_name(ent->ename, sizeof(ent->ename));
+	if (ret <= 0)
+		nvme_msg(r, LOG_INFO, "Failed to retrieve ENAME. %s.\n",
+			 strerror(errno));
+
+	ret = get_entity_version(ent->ever, sizeof(ent->ever));
+	if (ret <= 0)
+		nvme_msg(r, LOG_INFO, "Failed to retrieve EVER.\n");
+}
+
 /**
  * nvmf_dim() - Explicit reg, dereg, reg-update issuing DIM
  * @c:		Host NVMe controller instance maintaining the admin queue used to
@@ -1156,6 +1645,7 @@ static void nvmf_fill_die(struct nvmf_ext_die *die, struct nvme_host *h,
  *		registered.
  * @result:	Location where to save the command-specific result returned by
  *		the discovery controller.
+ * @ent:	Entity Name and Version to send, or NULL to look them up.
  *
  * Perform explicit registration, deregistration, or
  * registration-update (specified by @tas) by sending a Discovery
@@ -1166,7 +1656,7 @@ static void nvmf_fill_die(struct nvmf_ext_die *die, struct nvme_host *h,
  */
 static int nvmf_dim(nvme_ctrl_t c, enum nvmf_dim_tas tas, __u8 trtype,
 		    __u8 adrfam, const char *reg_addr, union nvmf_tsas *tsas,
-		    __u32 *result)
+		    __u32 *result, const struct nvmf_dim_entity *ent)
 {
 	nvme_root_t r = c->s && c->s->h ? c->s->h->r : NULL;
 	struct nvmf_dim_data *dim;
@@ -1242,14 +1732,21 @@ static int nvmf_dim(nvme_ctrl_t c, enum nvmf_dim_tas tas, __u8 trtype,
 	memcpy(dim->eid, c->s->h->hostnqn,
 	       MIN(sizeof(dim->eid), strlen(c->s->h->hostnqn)));
 
-	ret = get_entity_name(dim->ename, sizeof(dim->ename));
-	if (ret <= 0)
-		nvme_msg(r, LOG_INFO, "%s: Failed to retrieve ENAME. %s.\n",
-			 c->name, strerror(errno));
+	if (ent) {
+		memcpy(dim->ename, ent->ename, sizeof(dim->ename));
+		memcpy(dim->ever, ent->ever, sizeof(dim->ever));
+	} else {
+		ret = get_entity_name(dim->ename, sizeof(dim->ename));
+		if (ret <= 0)
+			nvme_msg(r, LOG_INFO,
+				 "%s: Failed to retrieve ENAME. %s.\n",
+				 c->name, strerror(errno));
 
-	ret = get_entity_version(dim->ever, sizeof(dim->ever));
-	if (ret <= 0)
-		nvme_msg(r, LOG_INFO, "%s: Failed to retrieve EVER.\n", c->name);
+		ret = get_entity_version(dim->ever, sizeof(dim->ever));
+		if (ret <= 0)
+			nvme_msg(r, LOG_INFO, "%s: Failed to retrieve EVER.\n",
+				 c->name);
+	}
 
 	die = &dim->die->extended;
 	nvmf_fill_die(die, c->s->h, tel, trtype, adrfam, reg_addr, tsas);
@@ -1358,5 +1855,73 @@ int nvmf_register_ctrl(nvme_ctrl_t c, enum nvmf_dim_tas tas, __u32 *result)
 	 * to retrieve the source address from the socket and use that
 	 * as the registration address.
 	 */
-	return nvmf_dim(c, tas, NVMF_TRTYPE_TCP, nvme_get_adrfam(c), "", NULL, result);
+	return nvmf_dim(c, tas, NVMF_TRTYPE_TCP, nvme_get_adrfam(c), "", NULL,
+			result, NULL);
+}
+
+struct nvmf_register_batch {
+	nvme_ctrl_t *ctrls;
+	struct nvmf_register_status *status;
+	enum nvmf_dim_tas tas;
+	struct nvmf_dim_entity ent;
+};
+
+static void nvmf_register_one(void *arg, int i)
+{
+	struct nvmf_register_batch *b = arg;
+	struct nvmf_register_status *st = &b->status[i];
+	nvme_ctrl_t c = b->ctrls[i];
+	int ret;
+
+	st->c = c;
+	st->result = 0;
+	st->err = 0;
+
+	/*
+	 * cntrltype and dctype are cached in the controller once
+	 * fetched, so repeated batches only pay for the DIM itself.
+	 */
+	if (!nvmf_is_registration_supported(c)) {
+		st->err = ENOTSUP;
+		return;
+	}
+
+	ret = nvmf_dim(c, b->tas, NVMF_TRTYPE_TCP, nvme_get_adrfam(c), "",
+		       NULL, &st->result, &b->ent);
+	if (ret < 0)
+		st->err = errno ? errno : EIO;
+	else if (ret > 0)
+		st->err = nvme_status_to_errno(ret, true);
+}
+
+int nvmf_register_ctrls(nvme_ctrl_t *ctrls, int nr_ctrls,
+			enum nvmf_dim_tas tas, int max_threads,
+			struct nvmf_register_status *status)
+{
+	struct nvmf_register_batch b = {
+		.ctrls = ctrls,
+		.status = status,
+		.tas = tas,
+	};
+	nvme_root_t r = NULL;
+	int i, failed = 0;
+
+	if (nr_ctrls < 0 || (nr_ctrls && (!ctrls || !status))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!nr_ctrls)
+		return 0;
+
+	if (ctrls[0]->s && ctrls[0]->s->h)
+		r = ctrls[0]->s->h->r;
+	nvmf_dim_entity_init(r, &b.ent);
+
+	nvme_run_parallel(nr_ctrls, max_threads, nvmf_register_one, &b);
+
+	for (i = 0; i < nr_ctrls; i++) {
+		if (status[i].err)
+			failed++;
+	}
+	return failed;
 }
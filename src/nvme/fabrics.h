@@ -204,6 +204,100 @@ int nvmf_add_ctrl(nvme_host_t h, nvme_ctrl_t c,
 int nvmf_get_discovery_log(nvme_ctrl_t c, struct nvmf_discovery_log **logp,
 			   int max_retries);
 
+/**
+ * typedef nvmf_disc_index_t - Lookup index over a discovery log page
+ *
+ * Built by nvmf_disc_index_create(); keys discovery log entries and the
+ * controllers of a host by (subsystem NQN, transport, traddr, trsvcid).
+ */
+typedef struct nvmf_disc_index *nvmf_disc_index_t;
+
+/**
+ * enum nvmf_disc_diff - Result of comparing a log entry with the tree
+ * @NVMF_DISC_DIFF_NEW:		Entry without a matching controller
+ * @NVMF_DISC_DIFF_KNOWN:	Entry with a matching controller
+ * @NVMF_DISC_DIFF_STALE:	Controller without a matching entry
+ */
+enum nvmf_disc_diff {
+	NVMF_DISC_DIFF_NEW,
+	NVMF_DISC_DIFF_KNOWN,
+	NVMF_DISC_DIFF_STALE,
+};
+
+/**
+ * typedef nvmf_disc_diff_cb_t - Callback for nvmf_disc_index_diff()
+ *
+ * Invoked with the index, the kind of change, the log entry (NULL for
+ * %NVMF_DISC_DIFF_STALE), the controller (NULL for %NVMF_DISC_DIFF_NEW)
+ * and the caller argument. A non-zero return value stops the walk.
+ */
+typedef int (*nvmf_disc_diff_cb_t)(nvmf_disc_index_t idx,
+				   enum nvmf_disc_diff diff,
+				   struct nvmf_disc_log_entry *e,
+				   nvme_ctrl_t c, void *arg);
+
+/**
+ * nvmf_disc_index_create() - Index a discovery log page
+ * @h:		Host whose controllers are indexed alongside the log
+ * @log:	Discovery log page as returned by nvmf_get_discovery_log()
+ *
+ * Builds hash tables over the entries of @log and the controllers
+ * currently known below @h, so that lookups no longer need to scan the
+ * log page or the tree. The index references @log and the controllers
+ * of @h; it has to be rebuilt when either changes.
+ *
+ * Return: The index, or NULL with errno set on failure; errno is %EINVAL
+ * if @log holds more records than nvmf_get_discovery_log() accepts
+ */
+nvmf_disc_index_t nvmf_disc_index_create(nvme_host_t h,
+					 struct nvmf_discovery_log *log);
+
+/**
+ * nvmf_disc_index_free() - Free a discovery log index
+ * @idx:	Index returned by nvmf_disc_index_create()
+ */
+void nvmf_disc_index_free(nvmf_disc_index_t idx);
+
+/**
+ * nvmf_disc_index_lookup() - Find a discovery log entry
+ * @idx:	Discovery log index
+ * @subnqn:	Subsystem NQN
+ * @transport:	Transport name, e.g. "tcp"
+ * @traddr:	Transport address, compared case-insensitively
+ * @trsvcid:	Transport service id, may be NULL
+ *
+ * Return: The matching log entry, or NULL if none exists
+ */
+struct nvmf_disc_log_entry *nvmf_disc_index_lookup(nvmf_disc_index_t idx,
+		const char *subnqn, const char *transport,
+		const char *traddr, const char *trsvcid);
+
+/**
+ * nvmf_disc_index_connected() - Check whether a log entry is connected
+ * @idx:	Discovery log index
+ * @e:		Discovery log page entry
+ *
+ * Return: The connected controller matching @e, or NULL if there is none
+ */
+nvme_ctrl_t nvmf_disc_index_connected(nvmf_disc_index_t idx,
+				      struct nvmf_disc_log_entry *e);
+
+/**
+ * nvmf_disc_index_diff() - Compare the log page with the host's controllers
+ * @idx:	Discovery log index
+ * @cb:		Callback invoked for each difference
+ * @arg:	Argument passed to @cb
+ *
+ * Calls @cb for every log entry, in log page order, as either
+ * %NVMF_DISC_DIFF_NEW or %NVMF_DISC_DIFF_KNOWN, followed by every
+ * non-discovery controller that has no log entry as %NVMF_DISC_DIFF_STALE.
+ *
+ * Return: 0 once all entries are processed, or the non-zero value
+ * returned by @cb
+ */
+int nvmf_disc_index_diff(nvmf_disc_index_t idx, nvmf_disc_diff_cb_t cb,
+			 void *arg);
+
 /**
  * nvmf_hostnqn_generate() - Generate a machine specific host nqn
  * Returns: An nvm namespace qualified name string based on the machine
@@ -227,6 +321,21 @@ char *nvmf_hostnqn_from_file();
  */
 char *nvmf_hostid_from_file();
 
+/**
+ * nvme_set_host_identity_cache() - Persist the resolved host identity
+ * @r:		&nvme_root_t object
+ * @cache_file:	Location of the cache file, or NULL to disable persistence
+ *
+ * The host NQN and host ID resolved by nvme_default_host() are always
+ * cached in @r. When @cache_file is set, the resolved values are also
+ * stored there and reused by later processes, as long as
+ * @SYSCONFDIR@/nvme/hostnqn and @SYSCONFDIR@/nvme/hostid are unchanged.
+ * The file is typically placed on a runtime file system such as /run.
+ *
+ * Return: 0 on success; on failure -1 is returned and errno is set
+ */
+int nvme_set_host_identity_cache(nvme_root_t r, const char *cache_file);
+
 /**
  * nvmf_connect_disc_entry() - Connect controller based on the discovery log page entry
  * @h:		Host to which the controller should be connected
@@ -270,4 +379,41 @@ bool nvmf_is_registration_supported(nvme_ctrl_t c);
  */
 int nvmf_register_ctrl(nvme_ctrl_t c, enum nvmf_dim_tas tas, __u32 *result);
 
+/**
+ * struct nvmf_register_status - Outcome of one batched registration
+ * @c:		Controller instance the status refers to
+ * @result:	The command-specific result returned by the DC
+ * @err:	0 on success, otherwise the errno value describing the failure;
+ *		%ENOTSUP if the controller does not support registration
+ */
+struct nvmf_register_status {
+	nvme_ctrl_t c;
+	__u32 result;
+	int err;
+};
+
+/**
+ * nvmf_register_ctrls() - Perform a registration task with several DCs
+ * @ctrls:	Array of discovery controller instances
+ * @nr_ctrls:	Number of entries in @ctrls
+ * @tas:	Task field of the Command Dword 10 (cdw10), as for
+ *		nvmf_register_ctrl()
+ * @max_threads: Maximum number of registrations in flight, or 0 for the
+ *		library default
+ * @status:	Array of @nr_ctrls entries receiving the per-controller outcome
+ *
+ * Same as calling nvmf_register_ctrl() for every controller in @ctrls, but
+ * the DIM commands are issued concurrently. The Identify data used to
+ * decide whether a controller supports registration is cached in the
+ * controller, and the entity name and version are looked up once per
+ * call. Each controller must appear at most once in @ctrls, and no other
+ * thread may use them while the call is in progress.
+ *
+ * Return: The number of controllers for which the task failed, or -1 with
+ * errno set if the arguments are invalid
+ */
+int nvmf_register_ctrls(nvme_ctrl_t *ctrls, int nr_ctrls,
+			enum nvmf_dim_tas tas, int max_threads,
+			struct nvmf_register_status *status);
+
 #endif /* _LIBNVME_FABRICS_H */
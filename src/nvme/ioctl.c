@@ -20,7 +20,11 @@
 #include <ccan/build_assert/build_assert.h>
 #include <ccan/endian/endian.h>
 
+#include "backend.h"
 #include "ioctl.h"
+#include "private.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 static int nvme_verify_chr(int fd)
@@ -75,21 +79,81 @@ int nvme_get_nsid(int fd, __u32 *nsid)
 	return -1 * (errno != 0);
 }
 
+static bool nvme_ioctl_is_admin(unsigned long ioctl_cmd)
+{
+	return ioctl_cmd == NVME_IOCTL_ADMIN_CMD ||
+		ioctl_cmd == NVME_IOCTL_ADMIN64_CMD;
+}
+
 static int nvme_submit_passthru64(int fd, unsigned long ioctl_cmd,
 				  struct nvme_passthru_cmd64 *cmd,
 				  __u64 *result)
 {
-	int err = ioctl(fd, ioctl_cmd, cmd);
+	bool admin = nvme_ioctl_is_admin(ioctl_cmd);
+	__u64 start = nvme_cmd_start();
+	int err;
 
+	if (nvme_submit_backend)
+		err = nvme_submit_backend(nvme_submit_backend_arg, fd, admin,
+					  cmd);
+	else
+		err = ioctl(fd, ioctl_cmd, cmd);
+
+	nvme_trace_passthru(start, admin ? NVME_TRACE_ADMIN : NVME_TRACE_IO,
+			    fd, cmd, err);
+	nvme_stats_record(start, admin ? NVME_STATS_ADMIN : NVME_STATS_IO,
+			  cmd->opcode, fd, err);
 	if (err >= 0 && result)
 		*result = cmd->result;
 	return err;
 }
 
+/* Backends only take 64-bit commands, convert the legacy command */
+static int nvme_submit_backend32(int fd, bool admin,
+				 struct nvme_passthru_cmd *cmd)
+{
+	struct nvme_passthru_cmd64 cmd64 = {
+		.opcode		= cmd->opcode,
+		.flags		= cmd->flags,
+		.rsvd1		= cmd->rsvd1,
+		.nsid		= cmd->nsid,
+		.cdw2		= cmd->cdw2,
+		.cdw3		= cmd->cdw3,
+		.metadata	= cmd->metadata,
+		.addr		= cmd->addr,
+		.metadata_len	= cmd->metadata_len,
+		.data_len	= cmd->data_len,
+		.cdw10		= cmd->cdw10,
+		.cdw11		= cmd->cdw11,
+		.cdw12		= cmd->cdw12,
+		.cdw13		= cmd->cdw13,
+		.cdw14		= cmd->cdw14,
+		.cdw15		= cmd->cdw15,
+		.timeout_ms	= cmd->timeout_ms,
+	};
+	int err;
+
+	err = nvme_submit_backend(nvme_submit_backend_arg, fd, admin, &cmd64);
+	cmd->result = cmd64.result;
+	return err;
+}
+
 static int nvme_submit_passthru(int fd, unsigned long ioctl_cmd,
 				struct nvme_passthru_cmd *cmd, __u32 *result)
 {
-	int err = ioctl(fd, ioctl_cmd, cmd);
+	bool admin = nvme_ioctl_is_admin(ioctl_cmd);
+	__u64 start = nvme_cmd_start();
+	int err;
+
+	if (nvme_submit_backend)
+		err = nvme_submit_backend32(fd, admin, cmd);
+	else
+		err = ioctl(fd, ioctl_cmd, cmd);
+
+	nvme_trace_passthru(start, admin ? NVME_TRACE_ADMIN : NVME_TRACE_IO,
+			    fd, cmd, err);
+	nvme_stats_record(start, admin ? NVME_STATS_ADMIN : NVME_STATS_IO,
+			  cmd->opcode, fd, err);
 
 	if (err >= 0 && result)
 		*result = cmd->result;
@@ -1336,6 +1400,7 @@ int nvme_get_lba_status(struct nvme_get_lba_status_args *args)
 		.opcode =  nvme_admin_get_lba_status,
 		.nsid = args->nsid,
 		.addr = (__u64)(uintptr_t)args->lbas,
+		.data_len = (args->mndw + 1) << 2,
 		.cdw10 = cdw10,
 		.cdw11 = cdw11,
 		.cdw12 = cdw12,
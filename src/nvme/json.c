@@ -7,28 +7,761 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
-
-#include <json.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "fabrics.h"
 #include "log.h"
 #include "private.h"
 
+/*
+ * The configuration is tokenized in a single pass over the file contents.
+ * Strings are unescaped in place, so apart from the file buffer only the
+ * token array is allocated. Lookups while merging use a hash index of the
+ * subsystems and controllers touched instead of walking the lists.
+ */
+#define JSON_MAX_DEPTH		32
+
+enum json_tok_type {
+	JSON_TOK_NULL,
+	JSON_TOK_TRUE,
+	JSON_TOK_FALSE,
+	JSON_TOK_NUMBER,
+	JSON_TOK_STRING,
+	JSON_TOK_ARRAY,
+	JSON_TOK_OBJECT,
+};
+
+struct json_tok {
+	enum json_tok_type type;
+	/* Index of the first token after this value */
+	int next;
+	/* NUL terminated for strings, the raw text for numbers */
+	const char *str;
+	int len;
+};
+
+struct json_parser {
+	char *buf;
+	size_t len;
+	size_t pos;
+	size_t line;
+	size_t line_start;
+	struct json_tok *toks;
+	int nr_toks;
+	int alloc_toks;
+	const char *err;
+	size_t err_pos;
+	size_t err_line;
+	size_t err_col;
+};
+
+static int json_fail(struct json_parser *p, const char *msg)
+{
+	if (!p->err) {
+		p->err = msg;
+		p->err_pos = p->pos;
+		p->err_line = p->line;
+		p->err_col = p->pos - p->line_start + 1;
+	}
+	return -1;
+}
+
+static void json_skip_ws(struct json_parser *p)
+{
+	for (; p->pos < p->len; p->pos++) {
+		switch (p->buf[p->pos]) {
+		case '\n':
+			p->line++;
+			p->line_start = p->pos + 1;
+			/* fallthrough */
+		case ' ':
+		case '\t':
+		case '\r':
+			continue;
+		}
+		return;
+	}
+}
+
+static int json_new_tok(struct json_parser *p, enum json_tok_type type)
+{
+	if (p->nr_toks == p->alloc_toks) {
+		int alloc = p->alloc_toks ? p->alloc_toks * 2 : 256;
+		struct json_tok *toks;
+
+		toks = realloc(p->toks, alloc * sizeof(*toks));
+		if (!toks)
+			return json_fail(p, "out of memory");
+		p->toks = toks;
+		p->alloc_toks = alloc;
+	}
+	p->toks[p->nr_toks] = (struct json_tok) { .type = type };
+	return p->nr_toks++;
+}
+
+static int json_hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int json_parse_u16(struct json_parser *p, unsigned int *u)
+{
+	int i, h;
+
+	*u = 0;
+	for (i = 0; i < 4; i++) {
+		if (p->pos >= p->len || (h = json_hex(p->buf[p->pos])) < 0)
+			return json_fail(p, "invalid \\u escape");
+		*u = *u << 4 | h;
+		p->pos++;
+	}
+	return 0;
+}
+
+static char *json_put_utf8(char *dst, unsigned int u)
+{
+	if (u < 0x80) {
+		*dst++ = u;
+	} else if (u < 0x800) {
+		*dst++ = 0xc0 | u >> 6;
+		*dst++ = 0x80 | (u & 0x3f);
+	} else if (u < 0x10000) {
+		*dst++ = 0xe0 | u >> 12;
+		*dst++ = 0x80 | ((u >> 6) & 0x3f);
+		*dst++ = 0x80 | (u & 0x3f);
+	} else {
+		*dst++ = 0xf0 | u >> 18;
+		*dst++ = 0x80 | ((u >> 12) & 0x3f);
+		*dst++ = 0x80 | ((u >> 6) & 0x3f);
+		*dst++ = 0x80 | (u & 0x3f);
+	}
+	return dst;
+}
+
+/* Unescapes in place; the result is never longer than the source */
+static int json_parse_string(struct json_parser *p)
+{
+	char *dst = p->buf + p->pos + 1;
+	int t = json_new_tok(p, JSON_TOK_STRING);
+
+	if (t < 0)
+		return -1;
+	p->toks[t].str = dst;
+	for (p->pos++; p->pos < p->len; ) {
+		unsigned char c = p->buf[p->pos];
+		unsigned int u, lo;
+
+		if (c == '"') {
+			*dst = '\0';
+			p->toks[t].len = dst - p->toks[t].str;
+			p->toks[t].next = p->nr_toks;
+			p->pos++;
+			return t;
+		}
+		if (c < 0x20)
+			return json_fail(p, "control character in string");
+		if (c != '\\') {
+			*dst++ = c;
+			p->pos++;
+			continue;
+		}
+		if (++p->pos == p->len)
+			break;
+		c = p->buf[p->pos++];
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			*dst++ = c;
+			break;
+		case 'b': *dst++ = '\b'; break;
+		case 'f': *dst++ = '\f'; break;
+		case 'n': *dst++ = '\n'; break;
+		case 'r': *dst++ = '\r'; break;
+		case 't': *dst++ = '\t'; break;
+		case 'u':
+			if (json_parse_u16(p, &u))
+				return -1;
+			if (u >= 0xd800 && u < 0xdc00) {
+				if (p->pos + 2 > p->len ||
+				    p->buf[p->pos] != '\\' ||
+				    p->buf[p->pos + 1] != 'u')
+					return json_fail(p,
+						"unpaired surrogate in \\u escape");
+				p->pos += 2;
+				if (json_parse_u16(p, &lo))
+					return -1;
+				if (lo < 0xdc00 || lo >= 0xe000)
+					return json_fail(p,
+						"unpaired surrogate in \\u escape");
+				u = 0x10000 + ((u - 0xd800) << 10) +
+					(lo - 0xdc00);
+			} else if (u >= 0xdc00 && u < 0xe000) {
+				return json_fail(p,
+					"unpaired surrogate in \\u escape");
+			} else if (!u) {
+				return json_fail(p, "NUL character in string");
+			}
+			dst = json_put_utf8(dst, u);
+			break;
+		default:
+			p->pos--;
+			return json_fail(p, "invalid escape sequence");
+		}
+	}
+	return json_fail(p, "unterminated string");
+}
+
+static bool json_isdigit(struct json_parser *p)
+{
+	return p->pos < p->len &&
+		p->buf[p->pos] >= '0' && p->buf[p->pos] <= '9';
+}
+
+static int json_parse_number(struct json_parser *p)
+{
+	size_t start = p->pos;
+	int t;
+
+	if (p->buf[p->pos] == '-')
+		p->pos++;
+	if (!json_isdigit(p))
+		return json_fail(p, "invalid number");
+	if (p->buf[p->pos++] != '0')
+		while (json_isdigit(p))
+			p->pos++;
+	if (p->pos < p->len && p->buf[p->pos] == '.') {
+		p->pos++;
+		if (!json_isdigit(p))
+			return json_fail(p, "invalid number");
+		while (json_isdigit(p))
+			p->pos++;
+	}
+	if (p->pos < p->len && (p->buf[p->pos] | 0x20) == 'e') {
+		p->pos++;
+		if (p->pos < p->len &&
+		    (p->buf[p->pos] == '+' || p->buf[p->pos] == '-'))
+			p->pos++;
+		if (!json_isdigit(p))
+			return json_fail(p, "invalid number");
+		while (json_isdigit(p))
+			p->pos++;
+	}
+
+	t = json_new_tok(p, JSON_TOK_NUMBER);
+	if (t < 0)
+		return -1;
+	p->toks[t].str = p->buf + start;
+	p->toks[t].len = p->pos - start;
+	p->toks[t].next = p->nr_toks;
+	return t;
+}
+
+static int json_parse_literal(struct json_parser *p, const char *lit,
+			      enum json_tok_type type)
+{
+	size_t len = strlen(lit);
+	int t;
+
+	if (p->len - p->pos < len || memcmp(p->buf + p->pos, lit, len))
+		return json_fail(p, "invalid literal");
+	p->pos += len;
+	t = json_new_tok(p, type);
+	if (t >= 0)
+		p->toks[t].next = p->nr_toks;
+	return t;
+}
+
+static int json_parse_value(struct json_parser *p, int depth);
+
+static int json_parse_container(struct json_parser *p, int depth,
+				bool object)
+{
+	char close = object ? '}' : ']';
+	int t;
+
+	if (depth > JSON_MAX_DEPTH)
+		return json_fail(p, "nesting too deep");
+	t = json_new_tok(p, object ? JSON_TOK_OBJECT : JSON_TOK_ARRAY);
+	if (t < 0)
+		return -1;
+	p->pos++;
+	json_skip_ws(p);
+	if (p->pos < p->len && p->buf[p->pos] == close) {
+		p->pos++;
+		p->toks[t].next = p->nr_toks;
+		return t;
+	}
+	for (;;) {
+		if (object) {
+			json_skip_ws(p);
+			if (p->pos >= p->len || p->buf[p->pos] != '"')
+				return json_fail(p, "expected object key");
+			if (json_parse_string(p) < 0)
+				return -1;
+			json_skip_ws(p);
+			if (p->pos >= p->len || p->buf[p->pos] != ':')
+				return json_fail(p, "expected ':'");
+			p->pos++;
+		}
+		if (json_parse_value(p, depth + 1) < 0)
+			return -1;
+		json_skip_ws(p);
+		if (p->pos >= p->len)
+			return json_fail(p, object ? "unterminated object" :
+					 "unterminated array");
+		if (p->buf[p->pos] == close)
+			break;
+		if (p->buf[p->pos] != ',')
+			return json_fail(p, object ? "expected ',' or '}'" :
+					 "expected ',' or ']'");
+		p->pos++;
+	}
+	p->pos++;
+	p->toks[t].next = p->nr_toks;
+	return t;
+}
+
+static int json_parse_value(struct json_parser *p, int depth)
+{
+	json_skip_ws(p);
+	if (p->pos >= p->len)
+		return json_fail(p, "unexpected end of input");
+
+	switch (p->buf[p->pos]) {
+	case '{':
+		return json_parse_container(p, depth, true);
+	case '[':
+		return json_parse_container(p, depth, false);
+	case '"':
+		return json_parse_string(p);
+	case 't':
+		return json_parse_literal(p, "true", JSON_TOK_TRUE);
+	case 'f':
+		return json_parse_literal(p, "false", JSON_TOK_FALSE);
+	case 'n':
+		return json_parse_literal(p, "null", JSON_TOK_NULL);
+	case '-':
+	case '0' ... '9':
+		return json_parse_number(p);
+	}
+	return json_fail(p, "unexpected character");
+}
+
+static int json_parse(struct json_parser *p)
+{
+	p->line = 1;
+	if (json_parse_value(p, 0) < 0)
+		return -1;
+	json_skip_ws(p);
+	if (p->pos < p->len)
+		return json_fail(p, "trailing characters after JSON value");
+	return 0;
+}
+
+static char *json_read_file(int fd, size_t *len)
+{
+	size_t size = 0, alloc = 4096;
+	struct stat st;
+	char *buf, *tmp;
+	ssize_t ret;
+
+	if (!fstat(fd, &st) && st.st_size > 0)
+		alloc = st.st_size + 1;
+	buf = malloc(alloc);
+	if (!buf)
+		return NULL;
+	for (;;) {
+		if (size + 1 >= alloc) {
+			alloc *= 2;
+			tmp = realloc(buf, alloc);
+			if (!tmp) {
+				free(buf);
+				errno = ENOMEM;
+				return NULL;
+			}
+			buf = tmp;
+		}
+		ret = read(fd, buf + size, alloc - size - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return NULL;
+		}
+		if (!ret)
+			break;
+		size += ret;
+	}
+	buf[size] = '\0';
+	*len = size;
+	return buf;
+}
+
+/* Value of @key in the object token @obj, NULL if absent or null */
+static const struct json_tok *json_obj_get(struct json_parser *p, int obj,
+					   const char *key)
+{
+	const struct json_tok *val = NULL;
+	int i;
+
+	if (p->toks[obj].type != JSON_TOK_OBJECT)
+		return NULL;
+	for (i = obj + 1; i < p->toks[obj].next; i = p->toks[i + 1].next) {
+		if (!strcmp(p->toks[i].str, key))
+			val = &p->toks[i + 1];
+	}
+	return val && val->type != JSON_TOK_NULL ? val : NULL;
+}
+
+/* Scalars other than strings are returned as their JSON text */
+static const char *json_tok_str(const struct json_tok *t, char *scratch,
+				size_t size)
+{
+	switch (t->type) {
+	case JSON_TOK_STRING:
+		return t->str;
+	case JSON_TOK_NUMBER:
+		snprintf(scratch, size, "%.*s", t->len, t->str);
+		return scratch;
+	case JSON_TOK_TRUE:
+		return "true";
+	case JSON_TOK_FALSE:
+		return "false";
+	default:
+		return NULL;
+	}
+}
+
+static int json_tok_int(const struct json_tok *t)
+{
+	long long v;
+
+	switch (t->type) {
+	case JSON_TOK_TRUE:
+		return 1;
+	case JSON_TOK_NUMBER:
+	case JSON_TOK_STRING:
+		if (memchr(t->str, '.', t->len) || memchr(t->str, 'e', t->len) ||
+		    memchr(t->str, 'E', t->len))
+			v = strtod(t->str, NULL);
+		else
+			v = strtoll(t->str, NULL, 10);
+		if (v > INT32_MAX)
+			return INT32_MAX;
+		if (v < INT32_MIN)
+			return INT32_MIN;
+		return v;
+	default:
+		return 0;
+	}
+}
+
+static bool json_tok_bool(const struct json_tok *t)
+{
+	switch (t->type) {
+	case JSON_TOK_TRUE:
+		return true;
+	case JSON_TOK_NUMBER:
+		return strtod(t->str, NULL) != 0;
+	case JSON_TOK_STRING:
+		return t->len != 0;
+	default:
+		return false;
+	}
+}
+
+enum json_index_kind {
+	JSON_INDEX_SUBSYS,
+	JSON_INDEX_SUBSYS_WILD,
+	JSON_INDEX_CTRL,
+	JSON_INDEX_CTRL_WILD,
+	JSON_INDEX_PARENT,
+};
+
+struct json_index_entry {
+	const void *parent;
+	void *obj;
+	__u32 hash;
+	enum json_index_kind kind;
+	int next;
+};
+
+struct json_index {
+	int *buckets;
+	__u32 mask;
+	struct json_index_entry *entries;
+	int nr;
+	int alloc;
+};
+
+static __u32 json_hash_str(__u32 hash, const char *s, bool icase)
+{
+	/* FNV-1a, traddr is compared case-insensitively */
+	for (; s && *s; s++) {
+		hash ^= icase ? (unsigned char)tolower(*s) : (unsigned char)*s;
+		hash *= 16777619;
+	}
+	hash ^= 0xff;
+	return hash * 16777619;
+}
+
+static __u32 json_hash(enum json_index_kind kind, const void *parent,
+		       const char *s1, const char *s2, const char *s3)
+{
+	uintptr_t ptr = (uintptr_t)parent;
+	__u32 hash = 2166136261;
+	size_t i;
+
+	for (i = 0; i < sizeof(ptr); i++) {
+		hash ^= (ptr >> (i * 8)) & 0xff;
+		hash *= 16777619;
+	}
+	hash ^= kind;
+	hash *= 16777619;
+	hash = json_hash_str(hash, s1, false);
+	hash = json_hash_str(hash, s2, true);
+	return json_hash_str(hash, s3, false);
+}
+
+static int json_index_add(struct json_index *idx, enum json_index_kind kind,
+			  const void *parent, void *obj, __u32 hash)
+{
+	struct json_index_entry *e;
+	int i;
+
+	if (idx->nr == idx->alloc) {
+		int alloc = idx->alloc ? idx->alloc * 2 : 1024;
+		int *buckets;
+
+		e = realloc(idx->entries, alloc * sizeof(*e));
+		if (!e)
+			return -1;
+		idx->entries = e;
+		buckets = malloc(alloc * sizeof(*buckets));
+		if (!buckets)
+			return -1;
+		free(idx->buckets);
+		idx->buckets = buckets;
+		idx->alloc = alloc;
+		idx->mask = alloc - 1;
+		/* Rehash, keeping the chain order */
+		memset(buckets, -1, alloc * sizeof(*buckets));
+		for (i = idx->nr - 1; i >= 0; i--) {
+			e = &idx->entries[i];
+			e->next = buckets[e->hash & idx->mask];
+			buckets[e->hash & idx->mask] = i;
+		}
+	}
+	e = &idx->entries[idx->nr];
+	e->parent = parent;
+	e->obj = obj;
+	e->hash = hash;
+	e->kind = kind;
+	e->next = idx->buckets[hash & idx->mask];
+	idx->buckets[hash & idx->mask] = idx->nr++;
+	return 0;
+}
+
+static int json_index_first(struct json_index *idx, enum json_index_kind kind,
+			    const void *parent, __u32 hash)
+{
+	int i = idx->alloc ? idx->buckets[hash & idx->mask] : -1;
+
+	while (i >= 0 && (idx->entries[i].hash != hash ||
+			  idx->entries[i].kind != kind ||
+			  idx->entries[i].parent != parent))
+		i = idx->entries[i].next;
+	return i;
+}
+
+static int json_index_next(struct json_index *idx, int i)
+{
+	struct json_index_entry *e = &idx->entries[i];
+
+	for (i = e->next; i >= 0; i = idx->entries[i].next) {
+		if (idx->entries[i].hash == e->hash &&
+		    idx->entries[i].kind == e->kind &&
+		    idx->entries[i].parent == e->parent)
+			break;
+	}
+	return i;
+}
+
+static int json_index_subsys(struct json_index *idx, nvme_host_t h,
+			     nvme_subsystem_t s)
+{
+	if (!s->subsysnqn)
+		return json_index_add(idx, JSON_INDEX_SUBSYS_WILD, h, s,
+				      json_hash(JSON_INDEX_SUBSYS_WILD, h,
+						NULL, NULL, NULL));
+	return json_index_add(idx, JSON_INDEX_SUBSYS, h, s,
+			      json_hash(JSON_INDEX_SUBSYS, h, s->subsysnqn,
+					NULL, NULL));
+}
+
+static int json_index_ctrl(struct json_index *idx, nvme_subsystem_t s,
+			   nvme_ctrl_t c)
+{
+	if (!c->traddr || !c->trsvcid)
+		return json_index_add(idx, JSON_INDEX_CTRL_WILD, s, c,
+				      json_hash(JSON_INDEX_CTRL_WILD, s,
+						NULL, NULL, NULL));
+	return json_index_add(idx, JSON_INDEX_CTRL, s, c,
+			      json_hash(JSON_INDEX_CTRL, s, c->transport,
+					c->traddr, c->trsvcid));
+}
+
+/* Index the children of @parent the first time it is seen */
+static int json_index_parent(struct json_index *idx, const void *parent,
+			     bool host)
+{
+	__u32 hash = json_hash(JSON_INDEX_PARENT, parent, NULL, NULL, NULL);
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	int ret = 0;
+
+	if (json_index_first(idx, JSON_INDEX_PARENT, parent, hash) >= 0)
+		return 0;
+	if (json_index_add(idx, JSON_INDEX_PARENT, parent, NULL, hash))
+		return -1;
+
+	/* In reverse, so that chains are in list order */
+	if (host) {
+		nvme_host_t h = (nvme_host_t)parent;
+
+		list_for_each_rev(&h->subsystems, s, entry)
+			ret |= json_index_subsys(idx, h, s);
+	} else {
+		s = (nvme_subsystem_t)parent;
+		list_for_each_rev(&s->ctrls, c, entry)
+			ret |= json_index_ctrl(idx, s, c);
+	}
+	return ret ? -1 : 0;
+}
+
+static nvme_subsystem_t json_lookup_subsys(struct json_index *idx,
+					   nvme_host_t h, const char *nqn)
+{
+	nvme_subsystem_t s;
+	int i;
+
+	if (json_index_parent(idx, h, true))
+		return nvme_lookup_subsystem(h, NULL, nqn);
+
+	i = json_index_first(idx, JSON_INDEX_SUBSYS, h,
+			     json_hash(JSON_INDEX_SUBSYS, h, nqn, NULL, NULL));
+	for (; i >= 0; i = json_index_next(idx, i)) {
+		s = idx->entries[i].obj;
+		if (!strcmp(s->subsysnqn, nqn))
+			return s;
+	}
+	i = json_index_first(idx, JSON_INDEX_SUBSYS_WILD, h,
+			     json_hash(JSON_INDEX_SUBSYS_WILD, h,
+				       NULL, NULL, NULL));
+	if (i >= 0)
+		return idx->entries[i].obj;
+
+	s = nvme_alloc_subsystem(h, NULL, nqn);
+	if (s)
+		json_index_subsys(idx, h, s);
+	return s;
+}
+
+static bool json_ctrl_match(nvme_ctrl_t c, const char *transport,
+			    const char *traddr, const char *host_traddr,
+			    const char *host_iface, const char *trsvcid)
+{
+	/* Same rules as __nvme_lookup_ctrl() */
+	if (strcmp(c->transport, transport))
+		return false;
+	if (traddr && c->traddr && strcasecmp(c->traddr, traddr))
+		return false;
+	if (host_traddr && c->cfg.host_traddr &&
+	    strcmp(c->cfg.host_traddr, host_traddr))
+		return false;
+	if (host_iface && c->cfg.host_iface &&
+	    strcmp(c->cfg.host_iface, host_iface))
+		return false;
+	if (trsvcid && c->trsvcid && strcmp(c->trsvcid, trsvcid))
+		return false;
+	return true;
+}
+
+static nvme_ctrl_t json_lookup_ctrl(struct json_index *idx,
+				    nvme_subsystem_t s, const char *transport,
+				    const char *traddr, const char *host_traddr,
+				    const char *host_iface, const char *trsvcid)
+{
+	nvme_ctrl_t c = NULL;
+	int i;
+
+	/* Without both keys any controller may match, walk the list */
+	if (!traddr || !trsvcid || json_index_parent(idx, s, false)) {
+		c = __nvme_lookup_ctrl(s, transport, traddr, host_traddr,
+				       host_iface, trsvcid, NULL);
+		goto out;
+	}
+
+	i = json_index_first(idx, JSON_INDEX_CTRL, s,
+			     json_hash(JSON_INDEX_CTRL, s, transport,
+				       traddr, trsvcid));
+	for (; i >= 0; i = json_index_next(idx, i)) {
+		if (json_ctrl_match(idx->entries[i].obj, transport, traddr,
+				    host_traddr, host_iface, trsvcid))
+			return idx->entries[i].obj;
+	}
+	i = json_index_first(idx, JSON_INDEX_CTRL_WILD, s,
+			     json_hash(JSON_INDEX_CTRL_WILD, s,
+				       NULL, NULL, NULL));
+	for (; i >= 0; i = json_index_next(idx, i)) {
+		if (json_ctrl_match(idx->entries[i].obj, transport, traddr,
+				    host_traddr, host_iface, trsvcid))
+			return idx->entries[i].obj;
+	}
+out:
+	if (c)
+		return c;
+	c = __nvme_add_ctrl(s, transport, traddr, host_traddr,
+			    host_iface, trsvcid);
+	/* Only indexed if the controllers of @s have been indexed before */
+	if (c && json_index_first(idx, JSON_INDEX_PARENT, s,
+				  json_hash(JSON_INDEX_PARENT, s,
+					    NULL, NULL, NULL)) >= 0)
+		json_index_ctrl(idx, s, c);
+	return c;
+}
+
 #define JSON_UPDATE_INT_OPTION(c, k, a, o)				\
-	if (!strcmp(# a, k ) && !c->a) c->a = json_object_get_int(o);
+	if (!strcmp(# a, k ) && !c->a) c->a = json_tok_int(o);
 #define JSON_UPDATE_BOOL_OPTION(c, k, a, o)				\
-	if (!strcmp(# a, k ) && !c->a) c->a = json_object_get_boolean(o);
+	if (!strcmp(# a, k ) && !c->a) c->a = json_tok_bool(o);
 
-static void json_update_attributes(nvme_ctrl_t c,
-				   struct json_object *ctrl_obj)
+static void json_update_attributes(nvme_ctrl_t c, struct json_parser *p,
+				   int port)
 {
 	struct nvme_fabrics_config *cfg = nvme_ctrl_get_config(c);
+	int i;
+
+	for (i = port + 1; i < p->toks[port].next; i = p->toks[i + 1].next) {
+		const char *key_str = p->toks[i].str;
+		const struct json_tok *val_obj = &p->toks[i + 1];
 
-	json_object_object_foreach(ctrl_obj, key_str, val_obj) {
 		JSON_UPDATE_INT_OPTION(cfg, key_str,
 				       nr_io_queues, val_obj);
 		JSON_UPDATE_INT_OPTION(cfg, key_str,
@@ -43,11 +776,11 @@ static void json_update_attributes(nvme_ctrl_t c,
 				       reconnect_delay, val_obj);
 		if (!strcmp("ctrl_loss_tmo", key_str) &&
 		    cfg->ctrl_loss_tmo != NVMF_DEF_CTRL_LOSS_TMO)
-			cfg->ctrl_loss_tmo = json_object_get_int(val_obj);
+			cfg->ctrl_loss_tmo = json_tok_int(val_obj);
 		JSON_UPDATE_INT_OPTION(cfg, key_str,
 				       fast_io_fail_tmo, val_obj);
 		if (!strcmp("tos", key_str) && cfg->tos != -1)
-			cfg->tos = json_object_get_int(val_obj);
+			cfg->tos = json_tok_int(val_obj);
 		JSON_UPDATE_BOOL_OPTION(cfg, key_str,
 					duplicate_connect, val_obj);
 		JSON_UPDATE_BOOL_OPTION(cfg, key_str,
@@ -67,98 +800,98 @@ static void json_update_attributes(nvme_ctrl_t c,
 	}
 }
 
-static void json_parse_port(nvme_subsystem_t s, struct json_object *port_obj)
+#define JSON_SCRATCH_SIZE	32
+
+static const char *json_get_str(struct json_parser *p, int obj,
+				const char *key, char *scratch)
+{
+	const struct json_tok *t = json_obj_get(p, obj, key);
+
+	return t ? json_tok_str(t, scratch, JSON_SCRATCH_SIZE) : NULL;
+}
+
+static void json_parse_port(struct json_parser *p, struct json_index *idx,
+			    nvme_subsystem_t s, int port)
 {
+	char scratch[5][JSON_SCRATCH_SIZE];
+	const char *transport, *traddr, *host_traddr, *host_iface, *trsvcid;
+	const char *key;
 	nvme_ctrl_t c;
-	struct json_object *attr_obj;
-	const char *transport, *traddr = NULL;
-	const char *host_traddr = NULL, *host_iface = NULL, *trsvcid = NULL;
 
-	attr_obj = json_object_object_get(port_obj, "transport");
-	if (!attr_obj)
+	transport = json_get_str(p, port, "transport", scratch[0]);
+	if (!transport)
 		return;
-	transport = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "traddr");
-	if (attr_obj)
-		traddr = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "host_traddr");
-	if (attr_obj)
-		host_traddr = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "host_iface");
-	if (attr_obj)
-		host_iface = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "trsvcid");
-	if (attr_obj)
-		trsvcid = json_object_get_string(attr_obj);
-	c = nvme_lookup_ctrl(s, transport, traddr, host_traddr,
-			     host_iface, trsvcid, NULL);
+	traddr = json_get_str(p, port, "traddr", scratch[1]);
+	host_traddr = json_get_str(p, port, "host_traddr", scratch[2]);
+	host_iface = json_get_str(p, port, "host_iface", scratch[3]);
+	trsvcid = json_get_str(p, port, "trsvcid", scratch[4]);
+	c = json_lookup_ctrl(idx, s, transport, traddr, host_traddr,
+			     host_iface, trsvcid);
 	if (!c)
 		return;
-	json_update_attributes(c, port_obj);
-	attr_obj = json_object_object_get(port_obj, "dhchap_key");
-	if (attr_obj)
-		nvme_ctrl_set_dhchap_key(c, json_object_get_string(attr_obj));
+	json_update_attributes(c, p, port);
+	key = json_get_str(p, port, "dhchap_key", scratch[0]);
+	if (key)
+		nvme_ctrl_set_dhchap_key(c, key);
 }
 
-static void json_parse_subsys(nvme_host_t h, struct json_object *subsys_obj)
+static void json_parse_subsys(struct json_parser *p, struct json_index *idx,
+			      nvme_host_t h, int subsys)
 {
-	struct json_object *nqn_obj, *port_array;
+	char scratch[JSON_SCRATCH_SIZE];
+	const struct json_tok *ports;
 	nvme_subsystem_t s;
 	const char *nqn;
-	int p;
+	int i;
 
-	nqn_obj = json_object_object_get(subsys_obj, "nqn");
-	if (!nqn_obj)
+	nqn = json_get_str(p, subsys, "nqn", scratch);
+	if (!nqn)
 		return;
-	nqn = json_object_get_string(nqn_obj);
-	s = nvme_lookup_subsystem(h, NULL, nqn);
-	port_array = json_object_object_get(subsys_obj, "ports");
-	if (!port_array)
+	s = json_lookup_subsys(idx, h, nqn);
+	if (!s)
 		return;
-	for (p = 0; p < json_object_array_length(port_array); p++) {
-		struct json_object *port_obj;
-
-		port_obj = json_object_array_get_idx(port_array, p);
-		if (port_obj)
-			json_parse_port(s, port_obj);
-	}
+	ports = json_obj_get(p, subsys, "ports");
+	if (!ports || ports->type != JSON_TOK_ARRAY)
+		return;
+	for (i = ports - p->toks + 1; i < ports->next; i = p->toks[i].next)
+		json_parse_port(p, idx, s, i);
 }
 
-static void json_parse_host(nvme_root_t r, struct json_object *host_obj)
+static void json_parse_host(struct json_parser *p, struct json_index *idx,
+			    nvme_root_t r, int host)
 {
-	struct json_object *attr_obj, *subsys_array, *subsys_obj;
+	char scratch[2][JSON_SCRATCH_SIZE];
+	const struct json_tok *subsys_array;
+	const char *hostnqn, *hostid, *attr;
 	nvme_host_t h;
-	const char *hostnqn, *hostid = NULL;
-	int s;
+	int i;
 
-	attr_obj = json_object_object_get(host_obj, "hostnqn");
-	if (!attr_obj)
+	hostnqn = json_get_str(p, host, "hostnqn", scratch[0]);
+	if (!hostnqn)
 		return;
-	hostnqn = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(host_obj, "hostid");
-	if (attr_obj)
-		hostid = json_object_get_string(attr_obj);
+	hostid = json_get_str(p, host, "hostid", scratch[1]);
 	h = nvme_lookup_host(r, hostnqn, hostid);
-	attr_obj = json_object_object_get(host_obj, "dhchap_key");
-	if (attr_obj)
-		nvme_host_set_dhchap_key(h, json_object_get_string(attr_obj));
-	attr_obj = json_object_object_get(host_obj, "hostsymname");
-	if (attr_obj)
-		nvme_host_set_hostsymname(h, json_object_get_string(attr_obj));
-	subsys_array = json_object_object_get(host_obj, "subsystems");
-	if (!subsys_array)
+	if (!h)
 		return;
-	for (s = 0; s < json_object_array_length(subsys_array); s++) {
-		subsys_obj = json_object_array_get_idx(subsys_array, s);
-		if (subsys_obj)
-			json_parse_subsys(h, subsys_obj);
-	}
+	attr = json_get_str(p, host, "dhchap_key", scratch[0]);
+	if (attr)
+		nvme_host_set_dhchap_key(h, attr);
+	attr = json_get_str(p, host, "hostsymname", scratch[0]);
+	if (attr)
+		nvme_host_set_hostsymname(h, attr);
+	subsys_array = json_obj_get(p, host, "subsystems");
+	if (!subsys_array || subsys_array->type != JSON_TOK_ARRAY)
+		return;
+	for (i = subsys_array - p->toks + 1; i < subsys_array->next;
+	     i = p->toks[i].next)
+		json_parse_subsys(p, idx, h, i);
 }
 
 int json_read_config(nvme_root_t r, const char *config_file)
 {
-	struct json_object *json_root, *host_obj;
-	int fd, h;
+	struct json_parser p = { };
+	struct json_index idx = { };
+	int fd, h, ret = 0;
 
 	fd = open(config_file, O_RDONLY);
 	if (fd < 0) {
@@ -166,301 +899,656 @@ int json_read_config(nvme_root_t r, const char *config_file)
 			 config_file, strerror(errno));
 		return fd;
 	}
-	json_root = json_object_from_fd(fd);
-	if (!json_root) {
+	p.buf = json_read_file(fd, &p.len);
+	close(fd);
+	if (!p.buf) {
 		nvme_msg(r, LOG_DEBUG, "Failed to read %s, %s\n",
-			config_file, json_util_get_last_err());
+			 config_file, strerror(errno));
 		errno = EPROTO;
-		close(fd);
 		return -1;
 	}
-	for (h = 0; h < json_object_array_length(json_root); h++) {
-		host_obj = json_object_array_get_idx(json_root, h);
-		if (host_obj)
-			json_parse_host(r, host_obj);
+	if (json_parse(&p)) {
+		nvme_msg(r, LOG_ERR, "Failed to parse %s:%zu:%zu: %s\n",
+			 config_file, p.err_line, p.err_col, p.err);
+		errno = EPROTO;
+		ret = -1;
+		goto out;
 	}
-	json_object_put(json_root);
-	close(fd);
-	return 0;
+	if (p.toks[0].type != JSON_TOK_ARRAY)
+		goto out;
+	for (h = 1; h < p.toks[0].next; h = p.toks[h].next)
+		json_parse_host(&p, &idx, r, h);
+out:
+	free(idx.buckets);
+	free(idx.entries);
+	free(p.toks);
+	free(p.buf);
+	return ret;
+}
+
+/*
+ * The tree dump is written as it is walked instead of being built as a
+ * json-c object first. The output matches json_object_to_fd() with
+ * JSON_C_TO_STRING_PRETTY byte for byte.
+ */
+#define JSON_STREAM_BUF_SIZE	4096
+#define JSON_STREAM_MAX_DEPTH	8
+
+struct json_stream {
+	int fd;
+	FILE *fp;
+	int err;
+	int depth;
+	bool has_children[JSON_STREAM_MAX_DEPTH];
+	size_t len;
+	char buf[JSON_STREAM_BUF_SIZE];
+};
+
+static void json_stream_flush(struct json_stream *js)
+{
+	size_t off = 0;
+
+	if (js->err)
+		goto out;
+	if (js->fp) {
+		if (fwrite(js->buf, 1, js->len, js->fp) != js->len)
+			js->err = errno ? errno : EIO;
+		goto out;
+	}
+	while (off < js->len) {
+		ssize_t ret = write(js->fd, js->buf + off, js->len - off);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			js->err = errno;
+			break;
+		}
+		off += ret;
+	}
+out:
+	js->len = 0;
+}
+
+static void json_stream_write(struct json_stream *js, const char *s,
+			      size_t len)
+{
+	while (len) {
+		size_t n = JSON_STREAM_BUF_SIZE - js->len;
+
+		if (n > len)
+			n = len;
+		memcpy(js->buf + js->len, s, n);
+		js->len += n;
+		s += n;
+		len -= n;
+		if (js->len == JSON_STREAM_BUF_SIZE)
+			json_stream_flush(js);
+	}
+}
+
+static void json_stream_puts(struct json_stream *js, const char *s)
+{
+	json_stream_write(js, s, strlen(s));
+}
+
+/* Same escaping as json-c without JSON_C_TO_STRING_NOSLASHESCAPE */
+static void json_stream_string(struct json_stream *js, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *start = s;
+
+	if (!s) {
+		json_stream_puts(js, "null");
+		return;
+	}
+	json_stream_puts(js, "\"");
+	for (; *s; s++) {
+		unsigned char c = *s;
+		char esc[7] = "\\";
+
+		switch (c) {
+		case '\b': esc[1] = 'b'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		case '\f': esc[1] = 'f'; break;
+		case '"':
+		case '\\':
+		case '/':
+			esc[1] = c;
+			break;
+		default:
+			if (c >= ' ')
+				continue;
+			sprintf(esc + 1, "u00%c%c", hex[c >> 4], hex[c & 0xf]);
+			break;
+		}
+		json_stream_write(js, start, s - start);
+		json_stream_puts(js, esc);
+		start = s + 1;
+	}
+	json_stream_write(js, start, s - start);
+	json_stream_puts(js, "\"");
+}
+
+static void json_stream_indent(struct json_stream *js, int level)
+{
+	int i;
+
+	for (i = 0; i < level; i++)
+		json_stream_puts(js, "  ");
+}
+
+/* Starts a member of the current object, or an element if @key is NULL */
+static void json_stream_key(struct json_stream *js, const char *key)
+{
+	if (js->has_children[js->depth])
+		json_stream_puts(js, ",\n");
+	js->has_children[js->depth] = true;
+	json_stream_indent(js, js->depth + 1);
+	if (key) {
+		json_stream_string(js, key);
+		json_stream_puts(js, ":");
+	}
+}
+
+static void json_stream_open(struct json_stream *js, const char *key,
+			     const char *open)
+{
+	if (js->depth >= 0)
+		json_stream_key(js, key);
+	json_stream_puts(js, open);
+	json_stream_puts(js, "\n");
+	js->has_children[++js->depth] = false;
+}
+
+static void json_stream_close(struct json_stream *js, const char *close)
+{
+	if (js->has_children[js->depth])
+		json_stream_puts(js, "\n");
+	json_stream_indent(js, js->depth--);
+	json_stream_puts(js, close);
+}
+
+static void json_stream_add_string(struct json_stream *js, const char *key,
+				   const char *value)
+{
+	json_stream_key(js, key);
+	json_stream_string(js, value);
 }
 
-#define JSON_STRING_OPTION(c, p, o)					\
-	if ((c)->o && strcmp((c)->o, "none"))				\
-		json_object_object_add((p), # o ,			\
-				       json_object_new_string((c)->o))
-#define JSON_INT_OPTION(c, p, o, d)					\
+static void json_stream_add_int(struct json_stream *js, const char *key,
+				int value)
+{
+	char num[16];
+
+	sprintf(num, "%d", value);
+	json_stream_key(js, key);
+	json_stream_puts(js, num);
+}
+
+static void json_stream_add_bool(struct json_stream *js, const char *key,
+				 bool value)
+{
+	json_stream_key(js, key);
+	json_stream_puts(js, value ? "true" : "false");
+}
+
+#define JSON_STREAM_INT_OPTION(c, js, o, d)				\
 	if ((c)->o != d)						\
-		json_object_object_add((p), # o ,			\
-				       json_object_new_int((c)->o))
-#define JSON_BOOL_OPTION(c, p, o)					\
+		json_stream_add_int((js), # o , (c)->o)
+#define JSON_STREAM_BOOL_OPTION(c, js, o)				\
 	if ((c)->o)							\
-		json_object_object_add((p), # o ,			\
-				       json_object_new_boolean((c)->o))
+		json_stream_add_bool((js), # o , (c)->o)
 
-static void json_update_port(struct json_object *ctrl_array, nvme_ctrl_t c)
+static void json_dump_ctrl(struct json_stream *js, nvme_ctrl_t c)
 {
 	struct nvme_fabrics_config *cfg = nvme_ctrl_get_config(c);
-	struct json_object *port_obj = json_object_new_object();
-	const char *transport, *value;
+	const char *name, *transport, *value;
 
+	json_stream_open(js, NULL, "{");
+	name = nvme_ctrl_get_name(c);
+	if (name && strlen(name))
+		json_stream_add_string(js, "name", name);
 	transport = nvme_ctrl_get_transport(c);
-	json_object_object_add(port_obj, "transport",
-			       json_object_new_string(transport));
+	json_stream_add_string(js, "transport", transport);
 	value = nvme_ctrl_get_traddr(c);
 	if (value)
-		json_object_object_add(port_obj, "traddr",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "traddr", value);
 	value = nvme_ctrl_get_host_traddr(c);
 	if (value)
-		json_object_object_add(port_obj, "host_traddr",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "host_traddr", value);
 	value = nvme_ctrl_get_host_iface(c);
 	if (value)
-		json_object_object_add(port_obj, "host_iface",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "host_iface", value);
 	value = nvme_ctrl_get_trsvcid(c);
 	if (value)
-		json_object_object_add(port_obj, "trsvcid",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "trsvcid", value);
 	value = nvme_ctrl_get_dhchap_key(c);
 	if (value)
-		json_object_object_add(port_obj, "dhchap_key",
-				       json_object_new_string(value));
-	JSON_INT_OPTION(cfg, port_obj, nr_io_queues, 0);
-	JSON_INT_OPTION(cfg, port_obj, nr_write_queues, 0);
-	JSON_INT_OPTION(cfg, port_obj, nr_poll_queues, 0);
-	JSON_INT_OPTION(cfg, port_obj, queue_size, 0);
-	JSON_INT_OPTION(cfg, port_obj, keep_alive_tmo, 0);
-	JSON_INT_OPTION(cfg, port_obj, reconnect_delay, 0);
+		json_stream_add_string(js, "dhchap_key", value);
+	JSON_STREAM_INT_OPTION(cfg, js, nr_io_queues, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, nr_write_queues, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, nr_poll_queues, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, queue_size, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, keep_alive_tmo, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, reconnect_delay, 0);
 	if (strcmp(transport, "loop")) {
-		JSON_INT_OPTION(cfg, port_obj, ctrl_loss_tmo,
-				NVMF_DEF_CTRL_LOSS_TMO);
-		JSON_INT_OPTION(cfg, port_obj, fast_io_fail_tmo, 0);
-	}
-	JSON_INT_OPTION(cfg, port_obj, tos, -1);
-	JSON_BOOL_OPTION(cfg, port_obj, duplicate_connect);
-	JSON_BOOL_OPTION(cfg, port_obj, disable_sqflow);
-	JSON_BOOL_OPTION(cfg, port_obj, hdr_digest);
-	JSON_BOOL_OPTION(cfg, port_obj, data_digest);
-	JSON_BOOL_OPTION(cfg, port_obj, tls);
+		JSON_STREAM_INT_OPTION(cfg, js, ctrl_loss_tmo,
+				       NVMF_DEF_CTRL_LOSS_TMO);
+		JSON_STREAM_INT_OPTION(cfg, js, fast_io_fail_tmo, 0);
+	}
+	JSON_STREAM_INT_OPTION(cfg, js, tos, -1);
+	JSON_STREAM_BOOL_OPTION(cfg, js, duplicate_connect);
+	JSON_STREAM_BOOL_OPTION(cfg, js, disable_sqflow);
+	JSON_STREAM_BOOL_OPTION(cfg, js, hdr_digest);
+	JSON_STREAM_BOOL_OPTION(cfg, js, data_digest);
+	JSON_STREAM_BOOL_OPTION(cfg, js, tls);
 	if (nvme_ctrl_is_persistent(c))
-		json_object_object_add(port_obj, "persistent",
-				       json_object_new_boolean(true));
+		json_stream_add_bool(js, "persistent", true);
 	if (nvme_ctrl_is_discovery_ctrl(c))
-		json_object_object_add(port_obj, "discovery",
-				       json_object_new_boolean(true));
-	json_object_array_add(ctrl_array, port_obj);
+		json_stream_add_bool(js, "discovery", true);
+	json_stream_close(js, "}");
 }
 
-static void json_update_subsys(struct json_object *subsys_array,
-			       nvme_subsystem_t s)
+static void json_dump_subsys(struct json_stream *js, nvme_subsystem_t s)
 {
 	nvme_ctrl_t c;
-	const char *subsysnqn = nvme_subsystem_get_nqn(s);
-	struct json_object *subsys_obj = json_object_new_object();
-	struct json_object *port_array;
-
-	/* Skip discovery subsystems as the nqn is not unique */
-	if (!strcmp(subsysnqn, NVME_DISC_SUBSYS_NAME))
-		return;
 
-	json_object_object_add(subsys_obj, "nqn",
-			       json_object_new_string(subsysnqn));
-	port_array = json_object_new_array();
-	nvme_subsystem_for_each_ctrl(s, c) {
-		json_update_port(port_array, c);
+	json_stream_open(js, NULL, "{");
+	json_stream_add_string(js, "name", nvme_subsystem_get_name(s));
+	json_stream_add_string(js, "nqn", nvme_subsystem_get_nqn(s));
+	if (nvme_subsystem_first_ctrl(s)) {
+		json_stream_open(js, "controllers", "[");
+		nvme_subsystem_for_each_ctrl(s, c)
+			json_dump_ctrl(js, c);
+		json_stream_close(js, "]");
 	}
-	if (json_object_array_length(port_array))
-		json_object_object_add(subsys_obj, "ports", port_array);
-	else
-		json_object_put(port_array);
-	json_object_array_add(subsys_array, subsys_obj);
+	json_stream_close(js, "}");
 }
 
-int json_update_config(nvme_root_t r, const char *config_file)
+int json_dump_tree(nvme_root_t r, int fd, FILE *fp)
 {
+	struct json_stream *js;
 	nvme_host_t h;
-	struct json_object *json_root, *host_obj;
-	struct json_object *subsys_array;
-	int ret = 0;
+	int err;
 
-	json_root = json_object_new_array();
+	js = calloc(1, sizeof(*js));
+	if (!js) {
+		errno = ENOMEM;
+		return -1;
+	}
+	js->fd = fd;
+	js->fp = fp;
+	js->depth = -1;
+
+	json_stream_open(js, NULL, "{");
+	json_stream_open(js, "hosts", "[");
 	nvme_for_each_host(r, h) {
 		nvme_subsystem_t s;
-		const char *hostnqn, *hostid, *dhchap_key, *hostsymname;
+		const char *hostid, *dhchap_key;
 
-		host_obj = json_object_new_object();
-		if (!host_obj)
-			continue;
-		hostnqn = nvme_host_get_hostnqn(h);
-		json_object_object_add(host_obj, "hostnqn",
-				       json_object_new_string(hostnqn));
+		json_stream_open(js, NULL, "{");
+		json_stream_add_string(js, "hostnqn",
+				       nvme_host_get_hostnqn(h));
 		hostid = nvme_host_get_hostid(h);
 		if (hostid)
-			json_object_object_add(host_obj, "hostid",
-					       json_object_new_string(hostid));
+			json_stream_add_string(js, "hostid", hostid);
 		dhchap_key = nvme_host_get_dhchap_key(h);
 		if (dhchap_key)
-			json_object_object_add(host_obj, "dhchap_key",
-					       json_object_new_string(dhchap_key));
-		hostsymname = nvme_host_get_hostsymname(h);
-		if (hostsymname)
-			json_object_object_add(host_obj, "hostsymname",
-					       json_object_new_string(hostsymname));
-		subsys_array = json_object_new_array();
-		nvme_for_each_subsystem(h, s) {
-			json_update_subsys(subsys_array, s);
+			json_stream_add_string(js, "dhchap_key", dhchap_key);
+		if (nvme_first_subsystem(h)) {
+			json_stream_open(js, "subsystems", "[");
+			nvme_for_each_subsystem(h, s)
+				json_dump_subsys(js, s);
+			json_stream_close(js, "]");
 		}
-		if (json_object_array_length(subsys_array))
-			json_object_object_add(host_obj, "subsystems",
-						    subsys_array);
-		else
-			json_object_put(subsys_array);
-		json_object_array_add(json_root, host_obj);
-	}
-	if (!config_file)
-		ret = json_object_to_fd(1, json_root, JSON_C_TO_STRING_PRETTY);
-	else
-		ret = json_object_to_file_ext(config_file, json_root,
-					      JSON_C_TO_STRING_PRETTY);
-	if (ret < 0) {
-		nvme_msg(r, LOG_ERR, "Failed to write to %s, %s\n",
-			 config_file ? "stdout" : config_file,
-			 json_util_get_last_err());
-		ret = -1;
+		json_stream_close(js, "}");
+	}
+	json_stream_close(js, "]");
+	json_stream_close(js, "}");
+	json_stream_flush(js);
+	if (fp && !js->err && fflush(fp))
+		js->err = errno;
+
+	err = js->err;
+	free(js);
+	if (err) {
+		nvme_msg(r, LOG_ERR, "Failed to write tree, %s\n",
+			 strerror(err));
 		errno = EIO;
+		return -1;
 	}
-	json_object_put(json_root);
+	return 0;
+}
 
-	return ret;
+/*
+ * The configuration is written with the same stream as the tree dump.
+ * Each subsystem and controller caches its serialized JSON, which is
+ * dropped whenever it changes, so an update only regenerates what
+ * changed since the last one.
+ */
+static void json_stream_fragment(struct json_stream *js, const char *frag)
+{
+	if (js->has_children[js->depth])
+		json_stream_puts(js, ",\n");
+	js->has_children[js->depth] = true;
+	json_stream_puts(js, frag);
 }
 
-static void json_dump_ctrl(struct json_object *ctrl_array, nvme_ctrl_t c)
+/* Serializes @fn as the first element at @depth */
+static char *json_config_fragment(int depth,
+				  void (*fn)(struct json_stream *, void *),
+				  void *arg)
 {
-	struct nvme_fabrics_config *cfg = nvme_ctrl_get_config(c);
-	struct json_object *ctrl_obj = json_object_new_object();
-	const char *name, *transport, *value;
+	struct json_stream *js;
+	char *buf = NULL;
+	size_t size;
+	int err;
 
-	name = nvme_ctrl_get_name(c);
-	if (name && strlen(name))
-		json_object_object_add(ctrl_obj, "name",
-				       json_object_new_string(name));
+	js = calloc(1, sizeof(*js));
+	if (!js)
+		return NULL;
+	js->fp = open_memstream(&buf, &size);
+	if (!js->fp) {
+		free(js);
+		return NULL;
+	}
+	js->depth = depth;
+	fn(js, arg);
+	json_stream_flush(js);
+	err = js->err;
+	if (fclose(js->fp) || err) {
+		free(buf);
+		buf = NULL;
+	}
+	free(js);
+	return buf;
+}
+
+static void json_config_port(struct json_stream *js, void *arg)
+{
+	nvme_ctrl_t c = arg;
+	struct nvme_fabrics_config *cfg = &c->cfg;
+	const char *transport, *value;
+
+	json_stream_open(js, NULL, "{");
 	transport = nvme_ctrl_get_transport(c);
-	json_object_object_add(ctrl_obj, "transport",
-			       json_object_new_string(transport));
+	json_stream_add_string(js, "transport", transport);
 	value = nvme_ctrl_get_traddr(c);
 	if (value)
-		json_object_object_add(ctrl_obj, "traddr",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "traddr", value);
 	value = nvme_ctrl_get_host_traddr(c);
 	if (value)
-		json_object_object_add(ctrl_obj, "host_traddr",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "host_traddr", value);
 	value = nvme_ctrl_get_host_iface(c);
 	if (value)
-		json_object_object_add(ctrl_obj, "host_iface",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "host_iface", value);
 	value = nvme_ctrl_get_trsvcid(c);
 	if (value)
-		json_object_object_add(ctrl_obj, "trsvcid",
-				       json_object_new_string(value));
+		json_stream_add_string(js, "trsvcid", value);
 	value = nvme_ctrl_get_dhchap_key(c);
 	if (value)
-		json_object_object_add(ctrl_obj, "dhchap_key",
-				       json_object_new_string(value));
-	JSON_INT_OPTION(cfg, ctrl_obj, nr_io_queues, 0);
-	JSON_INT_OPTION(cfg, ctrl_obj, nr_write_queues, 0);
-	JSON_INT_OPTION(cfg, ctrl_obj, nr_poll_queues, 0);
-	JSON_INT_OPTION(cfg, ctrl_obj, queue_size, 0);
-	JSON_INT_OPTION(cfg, ctrl_obj, keep_alive_tmo, 0);
-	JSON_INT_OPTION(cfg, ctrl_obj, reconnect_delay, 0);
+		json_stream_add_string(js, "dhchap_key", value);
+	JSON_STREAM_INT_OPTION(cfg, js, nr_io_queues, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, nr_write_queues, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, nr_poll_queues, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, queue_size, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, keep_alive_tmo, 0);
+	JSON_STREAM_INT_OPTION(cfg, js, reconnect_delay, 0);
 	if (strcmp(transport, "loop")) {
-		JSON_INT_OPTION(cfg, ctrl_obj, ctrl_loss_tmo,
-				NVMF_DEF_CTRL_LOSS_TMO);
-		JSON_INT_OPTION(cfg, ctrl_obj, fast_io_fail_tmo, 0);
-	}
-	JSON_INT_OPTION(cfg, ctrl_obj, tos, -1);
-	JSON_BOOL_OPTION(cfg, ctrl_obj, duplicate_connect);
-	JSON_BOOL_OPTION(cfg, ctrl_obj, disable_sqflow);
-	JSON_BOOL_OPTION(cfg, ctrl_obj, hdr_digest);
-	JSON_BOOL_OPTION(cfg, ctrl_obj, data_digest);
-	JSON_BOOL_OPTION(cfg, ctrl_obj, tls);
+		JSON_STREAM_INT_OPTION(cfg, js, ctrl_loss_tmo,
+				       NVMF_DEF_CTRL_LOSS_TMO);
+		JSON_STREAM_INT_OPTION(cfg, js, fast_io_fail_tmo, 0);
+	}
+	JSON_STREAM_INT_OPTION(cfg, js, tos, -1);
+	JSON_STREAM_BOOL_OPTION(cfg, js, duplicate_connect);
+	JSON_STREAM_BOOL_OPTION(cfg, js, disable_sqflow);
+	JSON_STREAM_BOOL_OPTION(cfg, js, hdr_digest);
+	JSON_STREAM_BOOL_OPTION(cfg, js, data_digest);
+	JSON_STREAM_BOOL_OPTION(cfg, js, tls);
 	if (nvme_ctrl_is_persistent(c))
-		json_object_object_add(ctrl_obj, "persistent",
-				       json_object_new_boolean(true));
+		json_stream_add_bool(js, "persistent", true);
 	if (nvme_ctrl_is_discovery_ctrl(c))
-		json_object_object_add(ctrl_obj, "discovery",
-				       json_object_new_boolean(true));
-	json_object_array_add(ctrl_array, ctrl_obj);
+		json_stream_add_bool(js, "discovery", true);
+	json_stream_close(js, "}");
 }
 
-static void json_dump_subsys(struct json_object *subsys_array,
-			       nvme_subsystem_t s)
+static void json_config_subsys(struct json_stream *js, void *arg)
 {
+	nvme_subsystem_t s = arg;
 	nvme_ctrl_t c;
-	struct json_object *subsys_obj = json_object_new_object();
-	struct json_object *ctrl_array;
 
-	json_object_object_add(subsys_obj, "name",
-			       json_object_new_string(nvme_subsystem_get_name(s)));
-	json_object_object_add(subsys_obj, "nqn",
-			       json_object_new_string(nvme_subsystem_get_nqn(s)));
-	ctrl_array = json_object_new_array();
-	nvme_subsystem_for_each_ctrl(s, c) {
-		json_dump_ctrl(ctrl_array, c);
+	json_stream_open(js, NULL, "{");
+	json_stream_add_string(js, "nqn", nvme_subsystem_get_nqn(s));
+	if (nvme_subsystem_first_ctrl(s)) {
+		json_stream_open(js, "ports", "[");
+		nvme_subsystem_for_each_ctrl(s, c) {
+			if (!c->config_json)
+				c->config_json = json_config_fragment(js->depth,
+							json_config_port, c);
+			if (!c->config_json) {
+				js->err = ENOMEM;
+				break;
+			}
+			json_stream_fragment(js, c->config_json);
+		}
+		json_stream_close(js, "]");
 	}
-	if (json_object_array_length(ctrl_array))
-		json_object_object_add(subsys_obj, "controllers", ctrl_array);
-	else
-		json_object_put(ctrl_array);
-	json_object_array_add(subsys_array, subsys_obj);
+	json_stream_close(js, "}");
 }
 
-int json_dump_tree(nvme_root_t r)
+static int json_config_serialize(nvme_root_t r, char **buf, size_t *len)
 {
+	struct json_stream *js;
 	nvme_host_t h;
-	struct json_object *json_root, *host_obj;
-	struct json_object *host_array, *subsys_array;
-	int ret = 0;
+	int err;
+
+	js = calloc(1, sizeof(*js));
+	if (!js)
+		return ENOMEM;
+	*buf = NULL;
+	js->fp = open_memstream(buf, len);
+	if (!js->fp) {
+		err = errno;
+		free(js);
+		return err;
+	}
+	js->depth = -1;
 
-	json_root = json_object_new_object();
-	host_array = json_object_new_array();
+	json_stream_open(js, NULL, "[");
 	nvme_for_each_host(r, h) {
+		const char *hostid, *dhchap_key, *hostsymname;
+		bool has_subsys = false;
 		nvme_subsystem_t s;
-		const char *hostid, *dhchap_key;
 
-		host_obj = json_object_new_object();
-		json_object_object_add(host_obj, "hostnqn",
-				       json_object_new_string(nvme_host_get_hostnqn(h)));
+		json_stream_open(js, NULL, "{");
+		json_stream_add_string(js, "hostnqn",
+				       nvme_host_get_hostnqn(h));
 		hostid = nvme_host_get_hostid(h);
 		if (hostid)
-			json_object_object_add(host_obj, "hostid",
-					       json_object_new_string(hostid));
+			json_stream_add_string(js, "hostid", hostid);
 		dhchap_key = nvme_host_get_dhchap_key(h);
 		if (dhchap_key)
-			json_object_object_add(host_obj, "dhchap_key",
-					       json_object_new_string(dhchap_key));
-		subsys_array = json_object_new_array();
+			json_stream_add_string(js, "dhchap_key", dhchap_key);
+		hostsymname = nvme_host_get_hostsymname(h);
+		if (hostsymname)
+			json_stream_add_string(js, "hostsymname", hostsymname);
 		nvme_for_each_subsystem(h, s) {
-			json_dump_subsys(subsys_array, s);
+			/* Skip discovery subsystems as the nqn is not unique */
+			if (!strcmp(nvme_subsystem_get_nqn(s),
+				    NVME_DISC_SUBSYS_NAME))
+				continue;
+			if (!has_subsys) {
+				json_stream_open(js, "subsystems", "[");
+				has_subsys = true;
+			}
+			if (!s->config_json)
+				s->config_json = json_config_fragment(js->depth,
+							json_config_subsys, s);
+			if (!s->config_json) {
+				js->err = ENOMEM;
+				break;
+			}
+			json_stream_fragment(js, s->config_json);
 		}
-		if (json_object_array_length(subsys_array))
-			json_object_object_add(host_obj, "subsystems",
-					       subsys_array);
-		else
-			json_object_put(subsys_array);
-		json_object_array_add(host_array, host_obj);
+		if (has_subsys)
+			json_stream_close(js, "]");
+		json_stream_close(js, "}");
 	}
-	json_object_object_add(json_root, "hosts", host_array);
+	json_stream_close(js, "]");
+	json_stream_flush(js);
 
-	ret = json_object_to_fd(1, json_root, JSON_C_TO_STRING_PRETTY);
-	if (ret < 0) {
-		nvme_msg(r, LOG_ERR, "Failed to write to stdout, %s\n",
-			 json_util_get_last_err());
-		ret = -1;
-		errno = EIO;
+	err = js->err;
+	if (fclose(js->fp) && !err)
+		err = errno;
+	free(js);
+	if (err) {
+		free(*buf);
+		*buf = NULL;
 	}
-	json_object_put(json_root);
+	return err;
+}
 
-	return ret;
+static int json_write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static bool json_config_unchanged(const char *config_file, const char *buf,
+				  size_t len)
+{
+	struct stat st;
+	size_t old_len;
+	char *old;
+	bool same;
+	int fd;
+
+	fd = open(config_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) || st.st_size != len) {
+		close(fd);
+		return false;
+	}
+	old = json_read_file(fd, &old_len);
+	close(fd);
+	same = old && old_len == len && !memcmp(old, buf, len);
+	free(old);
+	return same;
+}
+
+/*
+ * Writers are serialized with an advisory lock on '<config_file>.lock';
+ * the file itself cannot be locked as it is replaced by the rename.
+ */
+static int json_config_write(const char *config_file, const char *buf,
+			     size_t len)
+{
+	char *lock_file = NULL, *tmp_file = NULL, *dir = NULL;
+	int lock_fd = -1, fd = -1, dir_fd, err = 0;
+	mode_t mode = 0644;
+	struct stat st;
+
+	if (asprintf(&lock_file, "%s.lock", config_file) < 0 ||
+	    asprintf(&tmp_file, "%s.XXXXXX", config_file) < 0) {
+		err = ENOMEM;
+		goto out;
+	}
+	lock_fd = open(lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lock_fd < 0) {
+		err = errno;
+		goto out;
+	}
+	while (flock(lock_fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			err = errno;
+			goto out;
+		}
+	}
+
+	if (json_config_unchanged(config_file, buf, len))
+		goto out;
+
+	if (!stat(config_file, &st))
+		mode = st.st_mode & 07777;
+	fd = mkostemp(tmp_file, O_CLOEXEC);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+	if (fchmod(fd, mode) || json_write_all(fd, buf, len) || fsync(fd)) {
+		err = errno;
+		goto out_unlink;
+	}
+	if (close(fd)) {
+		fd = -1;
+		err = errno;
+		goto out_unlink;
+	}
+	fd = -1;
+	if (rename(tmp_file, config_file)) {
+		err = errno;
+		goto out_unlink;
+	}
+
+	/* Make the rename itself durable */
+	dir = strdup(config_file);
+	if (dir) {
+		dir_fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+		free(dir);
+	}
+	goto out;
+
+out_unlink:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp_file);
+out:
+	if (lock_fd >= 0)
+		close(lock_fd);
+	free(tmp_file);
+	free(lock_file);
+	return err;
+}
+
+int json_update_config(nvme_root_t r, const char *config_file)
+{
+	size_t len;
+	char *buf;
+	int err;
+
+	err = json_config_serialize(r, &buf, &len);
+	if (!err) {
+		if (!config_file)
+			err = json_write_all(STDOUT_FILENO, buf, len) ?
+				errno : 0;
+		else
+			err = json_config_write(config_file, buf, len);
+		free(buf);
+	}
+	if (err) {
+		nvme_msg(r, LOG_ERR, "Failed to write to %s, %s\n",
+			 config_file ? config_file : "stdout",
+			 strerror(err));
+		errno = EIO;
+		return -1;
+	}
+	return 0;
 }
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/param.h>
 #include <sys/stat.h>
@@ -89,6 +90,50 @@ close_fd:
 	return -1;
 }
 
+__u32 nvme_mdts_to_xfer_len(__u8 mdts)
+{
+	/*
+	 * MDTS is in units of the minimum memory page size, which needs
+	 * access to CAP. Assume 4k, the smallest page size.
+	 */
+	if (!mdts || mdts > 8)
+		return NVME_MAX_XFER_LEN;
+	return MIN(NVME_MAX_XFER_LEN, NVME_MIN_XFER_LEN << mdts);
+}
+
+__u32 nvme_fwug_to_xfer_len(const struct nvme_id_ctrl *id)
+{
+	__u32 xfer = nvme_mdts_to_xfer_len(id->mdts);
+	__u32 gran;
+
+	/* 0: no information, 0xff: no restriction */
+	if (!id->fwug || id->fwug == 0xff)
+		return xfer;
+
+	/*
+	 * Every piece but the last should be a multiple of FWUG. Never
+	 * exceed MDTS for that though, the controller would reject every
+	 * piece.
+	 */
+	gran = id->fwug * NVME_MIN_XFER_LEN;
+	if (xfer < gran)
+		return xfer;
+	return xfer - xfer % gran;
+}
+
+int nvme_get_max_xfer_len(int fd, __u32 *xfer_len)
+{
+	struct nvme_id_ctrl id;
+	int err;
+
+	err = nvme_identify_ctrl(fd, &id);
+	if (err)
+		return err;
+
+	*xfer_len = nvme_mdts_to_xfer_len(id.mdts);
+	return 0;
+}
+
 int nvme_fw_download_seq(int fd, __u32 size, __u32 xfer, __u32 offset,
 			 void *buf)
 {
@@ -103,15 +148,24 @@ int nvme_fw_download_seq(int fd, __u32 size, __u32 xfer, __u32 offset,
 		.result = NULL,
 	};
 
+	if (!xfer) {
+		struct nvme_id_ctrl id;
+
+		err = nvme_identify_ctrl(fd, &id);
+		if (err)
+			return err;
+		xfer = nvme_fwug_to_xfer_len(&id);
+	}
+
 	while (size > 0) {
 		args.data_len = MIN(xfer, size);
 		err = nvme_fw_download(&args);
 		if (err)
 			break;
 
-		args.data += xfer;
-		size -= xfer;
-		args.offset += xfer;
+		args.data += args.data_len;
+		size -= args.data_len;
+		args.offset += args.data_len;
 	}
 
 	return err;
@@ -124,10 +178,12 @@ int nvme_get_log_page(int fd, __u32 xfer_len, struct nvme_get_log_args *args)
 	void *ptr = args->log;
 	int ret;
 
-	/*
-	 * 4k is the smallest possible transfer unit, so restricting to 4k
-	 * avoids having to check the MDTS value of the controller.
-	 */
+	if (!xfer_len) {
+		ret = nvme_get_max_xfer_len(args->fd, &xfer_len);
+		if (ret)
+			return ret;
+	}
+
 	do {
 		xfer = data_len - offset;
 		if (xfer > xfer_len)
@@ -183,6 +239,11 @@ static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
 
 	*size = 0;
 
+	/* Needed for the transfer size and for the DA4 support check */
+	err = nvme_identify_ctrl(fd, &id_ctrl);
+	if (err)
+		return err;
+
 	log = malloc(xfer);
 	if (!log) {
 		errno = ENOMEM;
@@ -218,13 +279,6 @@ static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
 		*size = (le16_to_cpu(telem->dalb3) + 1) * xfer;
 		break;
 	case NVME_TELEMETRY_DA_4:
-		err = nvme_identify_ctrl(fd, &id_ctrl);
-		if (err) {
-			perror("identify-ctrl");
-			errno = EINVAL;
-			goto free;
-		}
-
 		if (id_ctrl.lpa & 0x40) {
 			*size = (le32_to_cpu(telem->dalb4) + 1) * xfer;
 		} else {
@@ -252,7 +306,7 @@ static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
 	args.lid = lid;
 	args.log = log;
 	args.len = *size;
-	err = nvme_get_log_page(fd, 4096, &args);
+	err = nvme_get_log_page(fd, nvme_mdts_to_xfer_len(id_ctrl.mdts), &args);
 	if (!err) {
 		*buf = log;
 		return 0;
@@ -280,6 +334,273 @@ int nvme_get_new_host_telemetry(int fd, struct nvme_telemetry_log **log,
 	return nvme_get_telemetry_log(fd, true, false, false, log, da, size);
 }
 
+/* Alignment that satisfies O_DIRECT on any logical block size */
+#define NVME_LOG_STREAM_ALIGN		4096
+
+struct nvme_telemetry_stream {
+	struct nvme_telemetry_stream_args *args;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void *buf[2];
+	size_t len[2];
+	__u64 offset[2];
+	bool full[2];
+	bool done;
+	int err;
+	size_t written;
+	size_t pad;
+};
+
+static int nvme_telemetry_stream_write(struct nvme_telemetry_stream *st,
+				       void *buf, size_t len, __u64 offset)
+{
+	struct nvme_telemetry_stream_args *args = st->args;
+	size_t wlen = len;
+
+	if (args->cb)
+		return args->cb(args->cb_arg, buf, len, offset);
+
+	if (args->flags & NVME_TELEMETRY_STREAM_DIRECT &&
+	    len % NVME_LOG_STREAM_ALIGN) {
+		/* only the last chunk may be short, pad it and trim later */
+		st->pad = NVME_LOG_STREAM_ALIGN - len % NVME_LOG_STREAM_ALIGN;
+		memset(buf + len, 0, st->pad);
+		wlen += st->pad;
+	}
+
+	while (wlen) {
+		ssize_t ret = write(args->out_fd, buf, wlen);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		wlen -= ret;
+	}
+	return 0;
+}
+
+static void *nvme_telemetry_stream_writer(void *data)
+{
+	struct nvme_telemetry_stream *st = data;
+	int i = 0;
+
+	pthread_mutex_lock(&st->lock);
+	for (;;) {
+		while (!st->full[i] && !st->done)
+			pthread_cond_wait(&st->cond, &st->lock);
+		if (!st->full[i])
+			break;
+		pthread_mutex_unlock(&st->lock);
+
+		if (nvme_telemetry_stream_write(st, st->buf[i], st->len[i],
+						st->offset[i])) {
+			pthread_mutex_lock(&st->lock);
+			st->err = errno ? errno : EIO;
+			pthread_cond_signal(&st->cond);
+			break;
+		}
+
+		pthread_mutex_lock(&st->lock);
+		st->written += st->len[i];
+		st->full[i] = false;
+		pthread_cond_signal(&st->cond);
+		i ^= 1;
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	return NULL;
+}
+
+int nvme_stream_telemetry(struct nvme_telemetry_stream_args *args)
+{
+	struct nvme_telemetry_stream st = {
+		.args = args,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct nvme_telemetry_log *telem;
+	struct nvme_id_ctrl id_ctrl;
+	bool ctrl = args->lid == NVME_LOG_LID_TELEMETRY_CTRL;
+	__u64 offset = 0, size = 0;
+	off_t start = 0;
+	int oflags = -1;
+	pthread_t writer;
+	__u32 xfer;
+	int i, err;
+	struct nvme_get_log_args log_args = {
+		.args_size = sizeof(log_args),
+		.fd = args->fd,
+		.lid = args->lid,
+		.nsid = NVME_NSID_NONE,
+		.lsp = NVME_LOG_LSP_NONE,
+		.lsi = NVME_LOG_LSI_NONE,
+		.uuidx = NVME_UUID_NONE,
+		.timeout = args->timeout,
+		.result = NULL,
+		.csi = NVME_CSI_NVM,
+		.ot = false,
+	};
+
+	if (args->args_size < sizeof(*args) ||
+	    (args->lid != NVME_LOG_LID_TELEMETRY_CTRL &&
+	     args->lid != NVME_LOG_LID_TELEMETRY_HOST) ||
+	    (ctrl && args->create) ||
+	    (!args->cb && args->out_fd < 0) ||
+	    (args->xfer_len && args->xfer_len % NVME_LOG_STREAM_ALIGN)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (args->size)
+		*args->size = 0;
+
+	err = nvme_identify_ctrl(args->fd, &id_ctrl);
+	if (err)
+		return err;
+
+	xfer = args->xfer_len ? args->xfer_len :
+		nvme_mdts_to_xfer_len(id_ctrl.mdts);
+
+	for (i = 0; i < 2; i++) {
+		if (posix_memalign(&st.buf[i], NVME_LOG_STREAM_ALIGN, xfer)) {
+			errno = ENOMEM;
+			err = -1;
+			goto free;
+		}
+	}
+
+	/* The header tells how much data is available */
+	telem = st.buf[0];
+	if (ctrl)
+		err = nvme_get_log_telemetry_ctrl(args->fd, true, 0,
+						  NVME_LOG_TELEM_BLOCK_SIZE,
+						  telem);
+	else if (args->create)
+		err = nvme_get_log_create_telemetry_host(args->fd, telem);
+	else
+		err = nvme_get_log_telemetry_host(args->fd, 0,
+						  NVME_LOG_TELEM_BLOCK_SIZE,
+						  telem);
+	if (err)
+		goto free;
+
+	if (ctrl && !telem->ctrlavail) {
+		size = NVME_LOG_TELEM_BLOCK_SIZE;
+	} else {
+		switch (args->da) {
+		case NVME_TELEMETRY_DA_1:
+			size = le16_to_cpu(telem->dalb1);
+			break;
+		case NVME_TELEMETRY_DA_2:
+			size = le16_to_cpu(telem->dalb2);
+			break;
+		case NVME_TELEMETRY_DA_3:
+			size = le16_to_cpu(telem->dalb3);
+			break;
+		case NVME_TELEMETRY_DA_4:
+			if (!(id_ctrl.lpa & 0x40)) {
+				errno = EINVAL;
+				err = -1;
+				goto free;
+			}
+			size = le32_to_cpu(telem->dalb4);
+			break;
+		default:
+			errno = EINVAL;
+			err = -1;
+			goto free;
+		}
+		size = (size + 1) * NVME_LOG_TELEM_BLOCK_SIZE;
+	}
+
+	if (!args->cb && args->flags & NVME_TELEMETRY_STREAM_DIRECT) {
+		start = lseek(args->out_fd, 0, SEEK_CUR);
+		if (start < 0) {
+			err = -1;
+			goto free;
+		}
+		/* O_DIRECT writes need an aligned file offset */
+		if (start % NVME_LOG_STREAM_ALIGN) {
+			errno = EINVAL;
+			err = -1;
+			goto free;
+		}
+		oflags = fcntl(args->out_fd, F_GETFL);
+		if (oflags < 0 ||
+		    fcntl(args->out_fd, F_SETFL, oflags | O_DIRECT) < 0) {
+			oflags = -1;
+			err = -1;
+			goto free;
+		}
+	}
+
+	if (pthread_create(&writer, NULL, nvme_telemetry_stream_writer, &st)) {
+		errno = EAGAIN;
+		err = -1;
+		goto restore;
+	}
+
+	/* Only the ctrl header read retains the AEN, so do that here too */
+	log_args.rae = true;
+	for (i = 0; offset < size; i ^= 1) {
+		__u32 len = MIN(xfer, size - offset);
+		bool failed;
+
+		pthread_mutex_lock(&st.lock);
+		while (st.full[i] && !st.err)
+			pthread_cond_wait(&st.cond, &st.lock);
+		failed = st.err;
+		pthread_mutex_unlock(&st.lock);
+		if (failed)
+			break;
+
+		if (offset + len == size)
+			log_args.rae = ctrl ? args->rae : false;
+		log_args.lpo = offset;
+		log_args.len = len;
+		log_args.log = st.buf[i];
+		err = nvme_get_log(&log_args);
+		if (err)
+			break;
+
+		pthread_mutex_lock(&st.lock);
+		st.len[i] = len;
+		st.offset[i] = offset;
+		st.full[i] = true;
+		pthread_cond_signal(&st.cond);
+		pthread_mutex_unlock(&st.lock);
+		offset += len;
+	}
+
+	pthread_mutex_lock(&st.lock);
+	st.done = true;
+	pthread_cond_signal(&st.cond);
+	pthread_mutex_unlock(&st.lock);
+	pthread_join(writer, NULL);
+
+	/* a failed write stops the fetch loop, so report it first */
+	if (st.err) {
+		errno = st.err;
+		err = -1;
+	}
+
+	if (!err && st.pad && ftruncate(args->out_fd, start + size) < 0)
+		err = -1;
+
+	if (args->size)
+		*args->size = st.written;
+restore:
+	if (oflags >= 0)
+		fcntl(args->out_fd, F_SETFL, oflags);
+free:
+	free(st.buf[0]);
+	free(st.buf[1]);
+	return err;
+}
+
 int nvme_get_lba_status_log(int fd, bool rae, struct nvme_lba_status_log **log)
 {
 	__u32 size = sizeof(struct nvme_lba_status_log);
@@ -323,7 +644,7 @@ int nvme_get_lba_status_log(int fd, bool rae, struct nvme_lba_status_log **log)
 	args.lid = NVME_LOG_LID_LBA_STATUS;
 	args.log = buf;
 	args.len = size;
-	err = nvme_get_log_page(fd, 4096, &args);
+	err = nvme_get_log_page(fd, 0, &args);
 	if (!err)
 		return 0;
 
@@ -333,6 +654,1559 @@ free:
 	return err;
 }
 
+#define NVME_LBA_SCAN_MAX_RL	0xffff
+#define NVME_LBA_SCAN_BUF_LEN	NVME_MIN_XFER_LEN
+
+struct nvme_lba_scan_range {
+	__u64 slba;
+	__u64 nlb;
+	__u8 status;
+};
+
+struct nvme_lba_scan_chunk {
+	struct nvme_lba_scan_range *ranges;
+	int nr;
+	int alloc;
+	bool done;
+};
+
+struct nvme_lba_scan {
+	struct nvme_lba_status_scan_args *args;
+	struct nvme_lba_scan_chunk *chunks;
+	__u64 end;
+	__u64 chunk_nlb;
+	int nr_chunks;
+	int next;
+	pthread_mutex_t lock;
+	struct nvme_lba_scan_range pending;
+	bool have_pending;
+	bool abort;
+	int err;
+	int errnum;
+};
+
+static int nvme_lba_scan_add(struct nvme_lba_scan_chunk *ch,
+			     __u64 slba, __u64 nlb, __u8 status)
+{
+	struct nvme_lba_scan_range *r;
+
+	if (ch->nr) {
+		r = &ch->ranges[ch->nr - 1];
+		if (r->status == status && r->slba + r->nlb == slba) {
+			r->nlb += nlb;
+			return 0;
+		}
+	}
+	if (ch->nr == ch->alloc) {
+		int alloc = ch->alloc ? ch->alloc * 2 : 64;
+
+		r = realloc(ch->ranges, alloc * sizeof(*r));
+		if (!r) {
+			errno = ENOMEM;
+			return -1;
+		}
+		ch->ranges = r;
+		ch->alloc = alloc;
+	}
+	ch->ranges[ch->nr++] = (struct nvme_lba_scan_range) {
+		.slba = slba, .nlb = nlb, .status = status,
+	};
+	return 0;
+}
+
+static int nvme_lba_scan_chunk(struct nvme_lba_scan *sc, int i,
+			       struct nvme_lba_status *lbas)
+{
+	struct nvme_lba_status_scan_args *a = sc->args;
+	struct nvme_lba_scan_chunk *ch = &sc->chunks[i];
+	const __u32 max_descs = (NVME_LBA_SCAN_BUF_LEN - sizeof(*lbas)) /
+		sizeof(struct nvme_lba_status_desc);
+	__u64 slba = a->slba + i * sc->chunk_nlb;
+	__u64 end = MIN(slba + sc->chunk_nlb, sc->end);
+	int ret;
+
+	while (slba < end && !__atomic_load_n(&sc->abort, __ATOMIC_RELAXED)) {
+		__u16 rl = MIN(end - slba, NVME_LBA_SCAN_MAX_RL);
+		__u64 next = slba + rl;
+		struct nvme_get_lba_status_args args = {
+			.slba = slba,
+			.result = NULL,
+			.lbas = lbas,
+			.args_size = sizeof(args),
+			.fd = a->fd,
+			.timeout = a->timeout,
+			.nsid = a->nsid,
+			.mndw = (NVME_LBA_SCAN_BUF_LEN >> 2) - 1,
+			.atype = a->atype,
+			.rl = rl,
+		};
+		__u32 nlsd, j;
+
+		ret = nvme_get_lba_status(&args);
+		if (ret)
+			return ret;
+
+		nlsd = MIN(le32_to_cpu(lbas->nlsd), max_descs);
+		for (j = 0; j < nlsd; j++) {
+			__u64 dslba = le64_to_cpu(lbas->descs[j].dslba);
+			__u64 dend = dslba + le32_to_cpu(lbas->descs[j].nlb);
+
+			dslba = MAX(dslba, slba);
+			dend = MIN(dend, slba + rl);
+			if (dslba >= dend)
+				continue;
+			if (nvme_lba_scan_add(ch, dslba, dend - dslba,
+					      lbas->descs[j].status))
+				return -1;
+			/* Resume after the last range if the buffer was full */
+			if (lbas->cmpc == NVME_LBA_STATUS_CMPC_INCOMPLETE &&
+			    j == nlsd - 1 && dend < next)
+				next = dend;
+		}
+		slba = next;
+	}
+	return 0;
+}
+
+static int nvme_lba_scan_emit(struct nvme_lba_scan *sc,
+			      const struct nvme_lba_scan_range *r)
+{
+	struct nvme_lba_status_desc desc = { };
+	__u64 slba = r->slba, nlb = r->nlb;
+
+	while (nlb) {
+		__u32 len = MIN(nlb, UINT32_MAX);
+
+		desc.dslba = cpu_to_le64(slba);
+		desc.nlb = cpu_to_le32(len);
+		desc.status = r->status;
+		if (sc->args->cb(sc->args->cb_arg, &desc))
+			return -1;
+		slba += len;
+		nlb -= len;
+	}
+	return 0;
+}
+
+/* Called with sc->lock held */
+static int nvme_lba_scan_flush(struct nvme_lba_scan *sc,
+			       struct nvme_lba_scan_chunk *ch)
+{
+	struct nvme_lba_scan_range *p = &sc->pending;
+	int i;
+
+	for (i = 0; i < ch->nr; i++) {
+		struct nvme_lba_scan_range *r = &ch->ranges[i];
+
+		if (sc->have_pending && p->status == r->status &&
+		    p->slba + p->nlb == r->slba) {
+			p->nlb += r->nlb;
+			continue;
+		}
+		if (sc->have_pending && nvme_lba_scan_emit(sc, p))
+			return -1;
+		*p = *r;
+		sc->have_pending = true;
+	}
+	return 0;
+}
+
+static void nvme_lba_scan_fail(struct nvme_lba_scan *sc, int err)
+{
+	if (!sc->err) {
+		sc->err = err;
+		sc->errnum = errno;
+	}
+	__atomic_store_n(&sc->abort, true, __ATOMIC_RELAXED);
+}
+
+static void nvme_lba_scan_worker(void *arg, int i)
+{
+	struct nvme_lba_scan *sc = arg;
+	struct nvme_lba_scan_chunk *ch;
+	struct nvme_lba_status *lbas;
+	int ret;
+
+	lbas = malloc(NVME_LBA_SCAN_BUF_LEN);
+	if (!lbas) {
+		errno = ENOMEM;
+		ret = -1;
+	} else {
+		ret = nvme_lba_scan_chunk(sc, i, lbas);
+		free(lbas);
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	sc->chunks[i].done = true;
+	if (ret)
+		nvme_lba_scan_fail(sc, ret);
+	while (!sc->abort && sc->next < sc->nr_chunks &&
+	       sc->chunks[sc->next].done) {
+		ch = &sc->chunks[sc->next++];
+		if (nvme_lba_scan_flush(sc, ch))
+			nvme_lba_scan_fail(sc, -1);
+		free(ch->ranges);
+		ch->ranges = NULL;
+	}
+	pthread_mutex_unlock(&sc->lock);
+}
+
+int nvme_scan_lba_status(struct nvme_lba_status_scan_args *args)
+{
+	struct nvme_lba_scan sc = { .args = args };
+	int threads = args->max_threads > 0 ? args->max_threads :
+		NVME_PARALLEL_MAX_THREADS;
+	__u64 nlb = args->nlb, nr;
+	int i, ret;
+
+	if (args->args_size < sizeof(*args) || !args->cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!nlb) {
+		struct nvme_id_ns ns;
+
+		ret = nvme_identify_ns(args->fd, args->nsid, &ns);
+		if (ret)
+			return ret;
+		if (args->slba >= le64_to_cpu(ns.nsze))
+			return 0;
+		nlb = le64_to_cpu(ns.nsze) - args->slba;
+	}
+	if (!nlb)
+		return 0;
+
+	sc.end = args->slba + nlb;
+	sc.chunk_nlb = args->chunk_nlb;
+	if (!sc.chunk_nlb) {
+		sc.chunk_nlb = (nlb + threads * 4 - 1) / (threads * 4);
+		/* Whole commands only, except for the last one */
+		sc.chunk_nlb = (sc.chunk_nlb + NVME_LBA_SCAN_MAX_RL - 1) /
+			NVME_LBA_SCAN_MAX_RL * NVME_LBA_SCAN_MAX_RL;
+	}
+	nr = (nlb + sc.chunk_nlb - 1) / sc.chunk_nlb;
+	if (nr > INT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	sc.nr_chunks = nr;
+
+	sc.chunks = calloc(sc.nr_chunks, sizeof(*sc.chunks));
+	if (!sc.chunks) {
+		errno = ENOMEM;
+		return -1;
+	}
+	pthread_mutex_init(&sc.lock, NULL);
+
+	nvme_run_parallel(sc.nr_chunks, threads, nvme_lba_scan_worker, &sc);
+
+	if (!sc.err && sc.have_pending && nvme_lba_scan_emit(&sc, &sc.pending))
+		nvme_lba_scan_fail(&sc, -1);
+
+	for (i = 0; i < sc.nr_chunks; i++)
+		free(sc.chunks[i].ranges);
+	free(sc.chunks);
+	pthread_mutex_destroy(&sc.lock);
+
+	if (sc.err)
+		errno = sc.errnum;
+	return sc.err;
+}
+
+static int nvme_pevent_fetch(struct nvme_pevent_iter *it,
+			     enum nvme_pevent_log_action action,
+			     __u64 lpo, __u32 len)
+{
+	struct nvme_get_log_args args = {
+		.args_size = sizeof(args),
+		.fd = it->fd,
+		.lid = NVME_LOG_LID_PERSISTENT_EVENT,
+		.nsid = NVME_NSID_ALL,
+		.lsp = action,
+		.lsi = NVME_LOG_LSI_NONE,
+		.uuidx = NVME_UUID_NONE,
+		.timeout = it->timeout,
+		.result = NULL,
+		.csi = NVME_CSI_NVM,
+		.log = it->buf,
+		.len = len,
+		.lpo = lpo,
+		.rae = false,
+		.ot = false,
+	};
+	int err;
+
+	it->buf_lpo = lpo;
+	it->buf_valid = 0;
+	err = nvme_get_log(&args);
+	if (!err)
+		it->buf_valid = len;
+	return err;
+}
+
+/*
+ * Make [pos, pos + len) available in the window. The log page offset has
+ * to be dword aligned, while events are not, hence the rounding.
+ */
+static int nvme_pevent_window(struct nvme_pevent_iter *it, __u64 pos,
+			      __u32 len)
+{
+	__u64 lpo = pos & ~3ULL;
+	__u64 avail = (it->tll - lpo + 3) & ~3ULL;
+	__u32 xfer = it->buf_len & ~3U;
+
+	if (pos >= it->buf_lpo && pos + len <= it->buf_lpo + it->buf_valid)
+		return 0;
+
+	if (pos - lpo + len > xfer) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return nvme_pevent_fetch(it, NVME_PEVENT_LOG_READ, lpo,
+				 MIN(avail, xfer));
+}
+
+int nvme_pevent_iter_init(struct nvme_pevent_iter *it, int fd,
+			  void *buf, __u32 buf_len)
+{
+	struct nvme_persistent_event_log *hdr = buf;
+	int err;
+
+	memset(it, 0, sizeof(*it));
+	if (!buf || buf_len < sizeof(*hdr)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	it->fd = fd;
+	it->timeout = NVME_DEFAULT_IOCTL_TIMEOUT;
+	it->buf = buf;
+	it->buf_len = buf_len;
+
+	err = nvme_pevent_fetch(it, NVME_PEVENT_LOG_EST_CTX_AND_READ, 0,
+				sizeof(*hdr));
+	if (err)
+		return err;
+
+	it->hdr = *hdr;
+	it->tll = le64_to_cpu(hdr->tll);
+	it->tnev = le32_to_cpu(hdr->tnev);
+	it->pos = sizeof(*hdr);
+	it->active = true;
+	return 0;
+}
+
+int nvme_pevent_iter_next(struct nvme_pevent_iter *it, struct nvme_pevent *ev)
+{
+	struct nvme_persistent_event_entry *e;
+	__u32 hlen, elen, vsil;
+	void *p;
+	int err;
+
+	memset(ev, 0, sizeof(*ev));
+	if (!it->active) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (it->nev >= it->tnev || it->pos + sizeof(*e) > it->tll)
+		return 0;
+
+	err = nvme_pevent_window(it, it->pos, sizeof(*e));
+	if (err)
+		return err;
+
+	e = it->buf + (it->pos - it->buf_lpo);
+	hlen = e->ehl + 3;
+	elen = le16_to_cpu(e->el);
+	vsil = le16_to_cpu(e->vsil);
+	if (hlen < sizeof(*e) || vsil > elen ||
+	    it->pos + hlen + elen > it->tll) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	err = nvme_pevent_window(it, it->pos, hlen + elen);
+	if (err) {
+		/* skip the event so the caller can carry on */
+		if (err < 0 && errno == EMSGSIZE) {
+			it->pos += hlen + elen;
+			it->nev++;
+		}
+		return err;
+	}
+
+	p = it->buf + (it->pos - it->buf_lpo);
+	ev->entry = p;
+	ev->offset = it->pos;
+	ev->vsi = vsil ? p + hlen : NULL;
+	ev->vsil = vsil;
+	ev->data = p + hlen + vsil;
+	ev->data_len = elen - vsil;
+
+	it->pos += hlen + elen;
+	it->nev++;
+	return 0;
+}
+
+int nvme_pevent_iter_release(struct nvme_pevent_iter *it)
+{
+	int err;
+
+	if (!it->active)
+		return 0;
+
+	it->active = false;
+	err = nvme_pevent_fetch(it, NVME_PEVENT_LOG_RELEASE_CTX, 0,
+				sizeof(struct nvme_persistent_event_log));
+	it->buf_valid = 0;
+	return err;
+}
+
+int nvme_error_log_reader_init(struct nvme_error_log_reader *rd, int fd,
+			       bool skip_existing)
+{
+	struct nvme_error_log_page newest;
+	struct nvme_id_ctrl id;
+	int err;
+
+	memset(rd, 0, sizeof(*rd));
+	rd->fd = fd;
+	rd->rae = true;
+
+	err = nvme_identify_ctrl(fd, &id);
+	if (err)
+		return err;
+	rd->nr_entries = id.elpe + 1;
+
+	if (!skip_existing)
+		return 0;
+
+	err = nvme_get_log_error(fd, 1, rd->rae, &newest);
+	if (err)
+		return err;
+	rd->last_count = le64_to_cpu(newest.error_count);
+	return 0;
+}
+
+int nvme_error_log_read_new(struct nvme_error_log_reader *rd,
+			    struct nvme_error_log_page *log, __u32 max,
+			    __u32 *nr, __u64 *lost)
+{
+	__u64 newest, last = rd->last_count, pending;
+	__u32 want, i;
+	int err;
+
+	*nr = 0;
+	if (lost)
+		*lost = 0;
+	if (!max) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Entry 0 is always the most recent error */
+	err = nvme_get_log_error(rd->fd, 1, rd->rae, log);
+	if (err)
+		return err;
+	newest = le64_to_cpu(log[0].error_count);
+	if (newest == last)
+		return 0;
+	if (newest < last)
+		/* the counter was reset, everything in the log is new */
+		last = 0;
+
+	pending = newest - last;
+	want = MIN(pending, MIN(max, rd->nr_entries));
+	for (;;) {
+		__u64 oldest;
+
+		if (want > 1) {
+			err = nvme_get_log_error(rd->fd, want, rd->rae, log);
+			if (err)
+				return err;
+		}
+
+		/*
+		 * Errors logged since the first read push older entries
+		 * further down the ring; read more if there is room.
+		 */
+		oldest = le64_to_cpu(log[want - 1].error_count);
+		if (!oldest || oldest <= last + 1 ||
+		    want == MIN(max, rd->nr_entries))
+			break;
+		want = MIN(want + (__u32)MIN(oldest - last - 1, UINT32_MAX),
+			   MIN(max, rd->nr_entries));
+	}
+
+	newest = le64_to_cpu(log[0].error_count);
+	for (i = 0; i < want; i++) {
+		__u64 count = le64_to_cpu(log[i].error_count);
+
+		if (!count || count <= last)
+			break;
+	}
+	*nr = i;
+	if (lost && i && newest - last > i)
+		*lost = newest - last - i;
+	rd->last_count = newest;
+	return 0;
+}
+
+int nvme_zone_iter_init(struct nvme_zone_iter *it, int fd, __u32 nsid,
+			enum nvme_zns_report_options opts, bool extended,
+			__u32 buf_len)
+{
+	struct nvme_zns_id_ns zns_ns;
+	struct nvme_id_ns ns;
+	__u8 lbaf;
+	int err;
+
+	memset(it, 0, sizeof(*it));
+	it->fd = fd;
+	it->nsid = nsid;
+	it->opts = opts;
+	it->extended = extended;
+	it->timeout = NVME_DEFAULT_IOCTL_TIMEOUT;
+
+	err = nvme_identify_ns(fd, nsid, &ns);
+	if (err)
+		return err;
+	err = nvme_zns_identify_ns(fd, nsid, &zns_ns);
+	if (err)
+		return err;
+
+	nvme_id_ns_flbas_to_lbaf_inuse(ns.flbas, &lbaf);
+	it->nsze = le64_to_cpu(ns.nsze);
+	it->zsze = le64_to_cpu(zns_ns.lbafe[lbaf].zsze);
+	if (extended)
+		it->ext_len = zns_ns.lbafe[lbaf].zdes * 64;
+	if (!it->zsze) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!buf_len) {
+		err = nvme_get_max_xfer_len(fd, &buf_len);
+		if (err)
+			return err;
+	}
+	it->buf_len = buf_len & ~3U;
+	if (it->buf_len < sizeof(struct nvme_zone_report) +
+			  sizeof(struct nvme_zns_desc) + it->ext_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	it->buf = malloc(it->buf_len);
+	if (!it->buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+int nvme_zone_iter_next(struct nvme_zone_iter *it,
+			struct nvme_zns_desc **desc, void **ext)
+{
+	__u32 stride = sizeof(struct nvme_zns_desc) + it->ext_len;
+	struct nvme_zns_desc *d;
+	int err;
+
+	*desc = NULL;
+	if (ext)
+		*ext = NULL;
+	if (!it->buf) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (it->idx == it->nr) {
+		struct nvme_zone_report *zr = it->buf;
+		__u64 max = (it->buf_len - sizeof(*zr)) / stride;
+
+		if (it->done || it->next_slba >= it->nsze)
+			return 0;
+
+		/*
+		 * A partial report returns the number of descriptors in the
+		 * buffer rather than the number of matching zones, which
+		 * tells where to continue.
+		 */
+		err = nvme_zns_report_zones(it->fd, it->nsid, it->next_slba,
+					    it->opts, it->extended, true,
+					    it->buf_len, it->buf,
+					    it->timeout, NULL);
+		if (err)
+			return err;
+
+		it->nr = MIN(le64_to_cpu(zr->nr_zones), max);
+		it->idx = 0;
+		if (!it->nr) {
+			it->done = true;
+			return 0;
+		}
+		d = it->buf + sizeof(*zr) + (it->nr - 1) * stride;
+		it->next_slba = le64_to_cpu(d->zslba) + it->zsze;
+		if (it->nr < max)
+			it->done = true;
+	}
+
+	d = it->buf + sizeof(struct nvme_zone_report) + it->idx * stride;
+	it->idx++;
+	*desc = d;
+	if (ext && it->ext_len)
+		*ext = (void *)d + sizeof(*d);
+	return 0;
+}
+
+void nvme_zone_iter_free(struct nvme_zone_iter *it)
+{
+	free(it->buf);
+	it->buf = NULL;
+}
+
+struct nvme_zone_table {
+	int fd;
+	__u32 nsid;
+	__u64 zsze;
+	__u64 nr_zones;
+	__u32 max_open;
+	__u32 max_active;
+	__u32 nr_open;
+	__u32 nr_active;
+	__u64 *wp;
+	__u64 *zcap;
+	__u8 *zs;
+};
+
+static inline bool nvme_zs_is_open(__u8 zs)
+{
+	return zs == NVME_ZNS_ZS_IMPL_OPEN || zs == NVME_ZNS_ZS_EXPL_OPEN;
+}
+
+static inline bool nvme_zs_is_active(__u8 zs)
+{
+	return nvme_zs_is_open(zs) || zs == NVME_ZNS_ZS_CLOSED;
+}
+
+static void nvme_zone_set_state(nvme_zone_table_t zt, __u64 idx, __u8 zs)
+{
+	__u8 old = zt->zs[idx];
+
+	zt->nr_open += nvme_zs_is_open(zs) - nvme_zs_is_open(old);
+	zt->nr_active += nvme_zs_is_active(zs) - nvme_zs_is_active(old);
+	zt->zs[idx] = zs;
+}
+
+static void nvme_zone_set_desc(nvme_zone_table_t zt, struct nvme_zns_desc *d)
+{
+	__u64 idx = le64_to_cpu(d->zslba) / zt->zsze;
+
+	if (idx >= zt->nr_zones)
+		return;
+	zt->wp[idx] = le64_to_cpu(d->wp);
+	zt->zcap[idx] = le64_to_cpu(d->zcap);
+	nvme_zone_set_state(zt, idx, d->zs >> 4);
+}
+
+int nvme_zone_table_refresh(nvme_zone_table_t zt)
+{
+	struct nvme_zone_iter it;
+	struct nvme_zns_desc *d;
+	int err;
+
+	err = nvme_zone_iter_init(&it, zt->fd, zt->nsid,
+				  NVME_ZNS_ZRAS_REPORT_ALL, false, 0);
+	if (err)
+		return err;
+
+	while (!(err = nvme_zone_iter_next(&it, &d, NULL)) && d)
+		nvme_zone_set_desc(zt, d);
+
+	nvme_zone_iter_free(&it);
+	return err;
+}
+
+nvme_zone_table_t nvme_zone_table_create(int fd, __u32 nsid)
+{
+	struct nvme_zns_id_ns zns_ns;
+	struct nvme_zone_table *zt;
+	struct nvme_id_ns ns;
+	__u8 lbaf;
+	int err;
+
+	err = nvme_identify_ns(fd, nsid, &ns);
+	if (!err)
+		err = nvme_zns_identify_ns(fd, nsid, &zns_ns);
+	if (err) {
+		if (err > 0)
+			errno = EIO;
+		return NULL;
+	}
+
+	zt = calloc(1, sizeof(*zt));
+	if (!zt) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	nvme_id_ns_flbas_to_lbaf_inuse(ns.flbas, &lbaf);
+	zt->fd = fd;
+	zt->nsid = nsid;
+	zt->zsze = le64_to_cpu(zns_ns.lbafe[lbaf].zsze);
+	/* MOR and MAR are 0's based, all ones means no limit */
+	zt->max_open = le32_to_cpu(zns_ns.mor) + 1;
+	zt->max_active = le32_to_cpu(zns_ns.mar) + 1;
+	if (!zt->zsze) {
+		free(zt);
+		errno = EINVAL;
+		return NULL;
+	}
+	zt->nr_zones = le64_to_cpu(ns.nsze) / zt->zsze;
+
+	zt->wp = calloc(zt->nr_zones, sizeof(*zt->wp));
+	zt->zcap = calloc(zt->nr_zones, sizeof(*zt->zcap));
+	zt->zs = calloc(zt->nr_zones, sizeof(*zt->zs));
+	if (!zt->wp || !zt->zcap || !zt->zs) {
+		nvme_zone_table_free(zt);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	err = nvme_zone_table_refresh(zt);
+	if (err) {
+		nvme_zone_table_free(zt);
+		if (err > 0)
+			errno = EIO;
+		return NULL;
+	}
+	return zt;
+}
+
+void nvme_zone_table_free(nvme_zone_table_t zt)
+{
+	if (!zt)
+		return;
+	free(zt->wp);
+	free(zt->zcap);
+	free(zt->zs);
+	free(zt);
+}
+
+__u64 nvme_zone_table_nr_zones(nvme_zone_table_t zt)
+{
+	return zt->nr_zones;
+}
+
+int nvme_zone_table_get(nvme_zone_table_t zt, __u64 idx,
+			struct nvme_zone_info *zi)
+{
+	if (idx >= zt->nr_zones) {
+		errno = EINVAL;
+		return -1;
+	}
+	zi->zslba = idx * zt->zsze;
+	zi->wp = zt->wp[idx];
+	zi->zcap = zt->zcap[idx];
+	zi->state = zt->zs[idx];
+	return 0;
+}
+
+void nvme_zone_table_counts(nvme_zone_table_t zt, __u32 *nr_open,
+			    __u32 *nr_active)
+{
+	if (nr_open)
+		*nr_open = zt->nr_open;
+	if (nr_active)
+		*nr_active = zt->nr_active;
+}
+
+static bool nvme_zone_has_room(nvme_zone_table_t zt, __u64 idx, __u32 nlb)
+{
+	return zt->wp[idx] + nlb <= idx * zt->zsze + zt->zcap[idx];
+}
+
+__s64 nvme_zone_table_pick(nvme_zone_table_t zt, __u32 nlb)
+{
+	__s64 empty = -1;
+	__u64 i;
+
+	for (i = 0; i < zt->nr_zones; i++) {
+		if (nvme_zs_is_open(zt->zs[i]) && nvme_zone_has_room(zt, i, nlb))
+			return i;
+		if (empty < 0 && zt->zs[i] == NVME_ZNS_ZS_EMPTY &&
+		    nvme_zone_has_room(zt, i, nlb))
+			empty = i;
+	}
+
+	/* opening another zone has to stay within the resource limits */
+	if (empty < 0 || (zt->max_open && zt->nr_open >= zt->max_open) ||
+	    (zt->max_active && zt->nr_active >= zt->max_active)) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return empty;
+}
+
+void nvme_zone_table_advance(nvme_zone_table_t zt, __u64 slba, __u32 nlb)
+{
+	__u64 idx = slba / zt->zsze;
+	__u64 end;
+
+	if (idx >= zt->nr_zones)
+		return;
+
+	end = idx * zt->zsze + zt->zcap[idx];
+	if (slba + nlb > zt->wp[idx])
+		zt->wp[idx] = MIN(slba + nlb, end);
+	if (zt->wp[idx] == end)
+		nvme_zone_set_state(zt, idx, NVME_ZNS_ZS_FULL);
+	else if (!nvme_zs_is_open(zt->zs[idx]))
+		nvme_zone_set_state(zt, idx, NVME_ZNS_ZS_IMPL_OPEN);
+}
+
+int nvme_zone_table_append(nvme_zone_table_t zt,
+			   struct nvme_zns_append_args *args)
+{
+	__u64 alba, *result = args->result;
+	int err;
+
+	if (!result)
+		args->result = &alba;
+	args->fd = zt->fd;
+	args->nsid = zt->nsid;
+	err = nvme_zns_append(args);
+	if (!err)
+		/* NLB is 0's based */
+		nvme_zone_table_advance(zt, *args->result, args->nlb + 1);
+	args->result = result;
+	return err;
+}
+
+static void nvme_zone_apply(nvme_zone_table_t zt, __u64 idx,
+			    enum nvme_zns_send_action zsa, bool all)
+{
+	__u8 zs = zt->zs[idx];
+	__u64 zslba = idx * zt->zsze;
+
+	switch (zsa) {
+	case NVME_ZNS_ZSA_OPEN:
+		if (zs == NVME_ZNS_ZS_CLOSED ||
+		    (!all && (zs == NVME_ZNS_ZS_EMPTY ||
+			      zs == NVME_ZNS_ZS_IMPL_OPEN)))
+			nvme_zone_set_state(zt, idx, NVME_ZNS_ZS_EXPL_OPEN);
+		break;
+	case NVME_ZNS_ZSA_CLOSE:
+		if (nvme_zs_is_open(zs))
+			nvme_zone_set_state(zt, idx, zt->wp[idx] == zslba ?
+					    NVME_ZNS_ZS_EMPTY :
+					    NVME_ZNS_ZS_CLOSED);
+		break;
+	case NVME_ZNS_ZSA_FINISH:
+		if (nvme_zs_is_active(zs) || (!all && zs == NVME_ZNS_ZS_EMPTY)) {
+			zt->wp[idx] = zslba + zt->zcap[idx];
+			nvme_zone_set_state(zt, idx, NVME_ZNS_ZS_FULL);
+		}
+		break;
+	case NVME_ZNS_ZSA_RESET:
+		if (nvme_zs_is_active(zs) || zs == NVME_ZNS_ZS_FULL) {
+			zt->wp[idx] = zslba;
+			nvme_zone_set_state(zt, idx, NVME_ZNS_ZS_EMPTY);
+		}
+		break;
+	case NVME_ZNS_ZSA_OFFLINE:
+		if (zs == NVME_ZNS_ZS_READ_ONLY)
+			nvme_zone_set_state(zt, idx, NVME_ZNS_ZS_OFFLINE);
+		break;
+	default:
+		break;
+	}
+}
+
+int nvme_zone_table_mgmt_send(nvme_zone_table_t zt,
+			      struct nvme_zns_mgmt_send_args *args)
+{
+	__u64 i;
+	int err;
+
+	args->fd = zt->fd;
+	args->nsid = zt->nsid;
+	err = nvme_zns_mgmt_send(args);
+	if (err)
+		return err;
+
+	if (args->select_all) {
+		for (i = 0; i < zt->nr_zones; i++)
+			nvme_zone_apply(zt, i, args->zsa, true);
+	} else if (args->slba / zt->zsze < zt->nr_zones) {
+		nvme_zone_apply(zt, args->slba / zt->zsze, args->zsa, false);
+	}
+	return 0;
+}
+
+int nvme_zone_table_sync_changed(nvme_zone_table_t zt, bool rae)
+{
+	struct nvme_zns_changed_zone_log log;
+	struct {
+		struct nvme_zone_report hdr;
+		struct nvme_zns_desc desc;
+	} zr;
+	__u16 nrzid;
+	int i, err;
+
+	err = nvme_get_log_zns_changed_zones(zt->fd, zt->nsid, rae, &log);
+	if (err)
+		return err;
+
+	nrzid = le16_to_cpu(log.nrzid);
+	/* all ones means the list overflowed */
+	if (nrzid == 0xffff)
+		return nvme_zone_table_refresh(zt);
+
+	for (i = 0; i < MIN(nrzid, NVME_ZNS_CHANGED_ZONES_MAX); i++) {
+		err = nvme_zns_report_zones(zt->fd, zt->nsid,
+					    le64_to_cpu(log.zid[i]),
+					    NVME_ZNS_ZRAS_REPORT_ALL, false,
+					    true, sizeof(zr), &zr,
+					    NVME_DEFAULT_IOCTL_TIMEOUT, NULL);
+		if (err)
+			return err;
+		if (le64_to_cpu(zr.hdr.nr_zones))
+			nvme_zone_set_desc(zt, &zr.desc);
+	}
+	return 0;
+}
+
+#define NVME_DSM_MAX_RANGES	256
+
+struct nvme_dsm_extent {
+	__u64 slba;
+	__u64 nlb;
+};
+
+struct nvme_dsm_plan {
+	int fd;
+	__u32 nsid;
+	__u32 attrs;
+	__u32 dmrl;
+	__u32 dmrsl;
+	__u64 dmsl;
+	struct nvme_dsm_extent *ext;
+	size_t nr;
+	size_t alloc;
+};
+
+struct nvme_dsm_submit {
+	struct nvme_dsm_plan *p;
+	struct nvme_dsm_range *ranges;
+	size_t *cmds;
+	bool abort;
+	int err;
+	int errnum;
+	pthread_mutex_t lock;
+};
+
+void nvme_dsm_plan_set_limits(nvme_dsm_plan_t p, __u8 dmrl, __u32 dmrsl,
+			      __u64 dmsl)
+{
+	p->dmrl = dmrl ? dmrl : NVME_DSM_MAX_RANGES;
+	p->dmrsl = dmrsl ? dmrsl : UINT32_MAX;
+	p->dmsl = dmsl ? dmsl : UINT64_MAX;
+}
+
+nvme_dsm_plan_t nvme_dsm_plan_create(int fd, __u32 nsid, __u32 attrs)
+{
+	struct nvme_id_ctrl_nvm id = { };
+	struct nvme_dsm_plan *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p->fd = fd;
+	p->nsid = nsid;
+	p->attrs = attrs;
+
+	/* Not all controllers support the I/O Command Set specific data */
+	if (nvme_nvm_identify_ctrl(fd, &id))
+		memset(&id, 0, sizeof(id));
+	nvme_dsm_plan_set_limits(p, id.dmrl, le32_to_cpu(id.dmrsl),
+				 le64_to_cpu(id.dmsl));
+	return p;
+}
+
+void nvme_dsm_plan_free(nvme_dsm_plan_t p)
+{
+	if (!p)
+		return;
+	free(p->ext);
+	free(p);
+}
+
+int nvme_dsm_plan_add(nvme_dsm_plan_t p, __u64 slba, __u64 nlb)
+{
+	if (!nlb)
+		return 0;
+	if (slba + nlb < slba) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (p->nr == p->alloc) {
+		size_t alloc = p->alloc ? p->alloc * 2 : 1024;
+		struct nvme_dsm_extent *ext;
+
+		ext = realloc(p->ext, alloc * sizeof(*ext));
+		if (!ext) {
+			errno = ENOMEM;
+			return -1;
+		}
+		p->ext = ext;
+		p->alloc = alloc;
+	}
+	p->ext[p->nr++] = (struct nvme_dsm_extent) {
+		.slba = slba, .nlb = nlb,
+	};
+	return 0;
+}
+
+static int nvme_dsm_extent_cmp(const void *a, const void *b)
+{
+	const struct nvme_dsm_extent *ea = a, *eb = b;
+
+	if (ea->slba != eb->slba)
+		return ea->slba < eb->slba ? -1 : 1;
+	return 0;
+}
+
+/* Sort and merge the extents in place, returns the new count */
+static size_t nvme_dsm_plan_coalesce(struct nvme_dsm_plan *p)
+{
+	size_t i, n = 0;
+
+	if (!p->nr)
+		return 0;
+
+	qsort(p->ext, p->nr, sizeof(*p->ext), nvme_dsm_extent_cmp);
+	for (i = 1; i < p->nr; i++) {
+		struct nvme_dsm_extent *cur = &p->ext[n];
+		__u64 end = cur->slba + cur->nlb;
+
+		if (p->ext[i].slba <= end) {
+			end = MAX(end, p->ext[i].slba + p->ext[i].nlb);
+			cur->nlb = end - cur->slba;
+			continue;
+		}
+		p->ext[++n] = p->ext[i];
+	}
+	return n + 1;
+}
+
+/*
+ * Pack the extents into commands. Each command is filled up to the range
+ * and size limits before the next one is started; ranges are split where
+ * a limit is reached. With @ranges NULL only the counts are computed.
+ */
+static size_t nvme_dsm_plan_pack(struct nvme_dsm_plan *p, size_t nr_ext,
+				 struct nvme_dsm_range *ranges, size_t *cmds)
+{
+	size_t i, nr_ranges = 0, nr_cmds = 0;
+	__u32 cmd_ranges = 0;
+	__u64 cmd_size = 0;
+
+	for (i = 0; i < nr_ext; i++) {
+		__u64 slba = p->ext[i].slba, nlb = p->ext[i].nlb;
+
+		while (nlb) {
+			__u64 len;
+
+			if (cmd_ranges == p->dmrl || cmd_size == p->dmsl) {
+				if (cmds)
+					cmds[nr_cmds] = nr_ranges;
+				nr_cmds++;
+				cmd_ranges = 0;
+				cmd_size = 0;
+			}
+			len = MIN(MIN(nlb, (__u64)p->dmrsl),
+				  p->dmsl - cmd_size);
+			if (ranges)
+				ranges[nr_ranges] = (struct nvme_dsm_range) {
+					.nlb = cpu_to_le32(len),
+					.slba = cpu_to_le64(slba),
+				};
+			nr_ranges++;
+			cmd_ranges++;
+			cmd_size += len;
+			slba += len;
+			nlb -= len;
+		}
+	}
+	if (cmd_ranges) {
+		if (cmds)
+			cmds[nr_cmds] = nr_ranges;
+		nr_cmds++;
+	}
+	return ranges ? nr_cmds : nr_ranges;
+}
+
+static void nvme_dsm_submit_one(void *arg, int i)
+{
+	struct nvme_dsm_submit *st = arg;
+	size_t first = i ? st->cmds[i - 1] : 0;
+	struct nvme_dsm_args args = {
+		.result = NULL,
+		.dsm = &st->ranges[first],
+		.args_size = sizeof(args),
+		.fd = st->p->fd,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.nsid = st->p->nsid,
+		.attrs = st->p->attrs,
+		.nr_ranges = st->cmds[i] - first,
+	};
+	int err;
+
+	if (__atomic_load_n(&st->abort, __ATOMIC_RELAXED))
+		return;
+
+	err = nvme_dsm(&args);
+	if (!err)
+		return;
+
+	pthread_mutex_lock(&st->lock);
+	if (!st->err) {
+		st->err = err;
+		st->errnum = errno;
+	}
+	__atomic_store_n(&st->abort, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&st->lock);
+}
+
+int nvme_dsm_plan_submit(nvme_dsm_plan_t p, int max_threads, __u32 *nr_cmds)
+{
+	struct nvme_dsm_submit st = { .p = p };
+	size_t nr_ext, nr_ranges, n;
+	int err = 0;
+
+	nr_ext = nvme_dsm_plan_coalesce(p);
+	p->nr = nr_ext;
+	if (nr_cmds)
+		*nr_cmds = 0;
+	if (!nr_ext)
+		return 0;
+
+	/* Every command holds at least one range */
+	nr_ranges = nvme_dsm_plan_pack(p, nr_ext, NULL, NULL);
+	st.ranges = malloc(nr_ranges * sizeof(*st.ranges));
+	st.cmds = malloc(nr_ranges * sizeof(*st.cmds));
+	if (!st.ranges || !st.cmds) {
+		errno = ENOMEM;
+		err = -1;
+		goto out;
+	}
+	n = nvme_dsm_plan_pack(p, nr_ext, st.ranges, st.cmds);
+	if (n > INT_MAX) {
+		errno = EINVAL;
+		err = -1;
+		goto out;
+	}
+	if (nr_cmds)
+		*nr_cmds = n;
+
+	pthread_mutex_init(&st.lock, NULL);
+	nvme_run_parallel(n, max_threads, nvme_dsm_submit_one, &st);
+	pthread_mutex_destroy(&st.lock);
+
+	err = st.err;
+	if (err)
+		errno = st.errnum;
+	else
+		p->nr = 0;
+out:
+	free(st.ranges);
+	free(st.cmds);
+	return err;
+}
+
+/* The NLB field of a source range is 0's based and 16 bits wide */
+#define NVME_COPY_MAX_RANGE_NLB	0x10000
+#define NVME_COPY_MAX_RANGES	256
+
+struct nvme_copy_move {
+	__u64 slba;
+	__u64 nlb;
+	__u64 dlba;
+};
+
+struct nvme_copy_plan {
+	int fd;
+	__u32 nsid;
+	int format;
+	bool rw;
+	bool metadata;
+	__u32 lba_size;
+	__u32 xfer_len;
+	__u32 mssrl;
+	__u64 mcl;
+	__u32 msrc;
+	struct nvme_copy_move *moves;
+	size_t nr;
+	size_t alloc;
+};
+
+struct nvme_copy_submit {
+	struct nvme_copy_plan *p;
+	struct nvme_copy_move *pieces;
+	size_t *cmds;
+	bool abort;
+	int err;
+	int errnum;
+	pthread_mutex_t lock;
+};
+
+nvme_copy_plan_t nvme_copy_plan_create(int fd, __u32 nsid)
+{
+	struct nvme_nvm_id_ns nvm_ns = { };
+	struct nvme_copy_plan *p;
+	struct nvme_id_ctrl id;
+	struct nvme_id_ns ns;
+	__u16 ocfs;
+	__u8 lbaf, pif = 0;
+	int err;
+
+	err = nvme_identify_ctrl(fd, &id);
+	if (!err)
+		err = nvme_identify_ns(fd, nsid, &ns);
+	if (err) {
+		if (err > 0)
+			errno = EIO;
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p->fd = fd;
+	p->nsid = nsid;
+
+	nvme_id_ns_flbas_to_lbaf_inuse(ns.flbas, &lbaf);
+	/* LBA data sizes from 512 bytes to 64 KiB */
+	if (ns.lbaf[lbaf].ds < 9 || ns.lbaf[lbaf].ds > 16) {
+		free(p);
+		errno = EPROTO;
+		return NULL;
+	}
+	p->lba_size = 1 << ns.lbaf[lbaf].ds;
+	p->xfer_len = nvme_mdts_to_xfer_len(id.mdts);
+
+	if (ns.dps & NVME_NS_DPS_PI_MASK &&
+	    !nvme_identify_ns_csi(fd, nsid, NVME_UUID_NONE, NVME_CSI_NVM,
+				  &nvm_ns))
+		pif = (le32_to_cpu(nvm_ns.elbaf[lbaf]) &
+		       NVME_NVM_ELBAF_PIF_MASK) >> 7;
+	/* PIF 2h is the 64b Guard format which needs format 1h descriptors */
+	p->format = pif == 2 ? 1 : 0;
+
+	ocfs = le16_to_cpu(id.ocfs);
+	p->rw = !(le16_to_cpu(id.oncs) & NVME_CTRL_ONCS_COPY) ||
+		!(ocfs & (1 << p->format));
+	/*
+	 * Read and Write would not move the metadata, and cannot transfer
+	 * an LBA larger than MDTS
+	 */
+	p->metadata = !!le16_to_cpu(ns.lbaf[lbaf].ms);
+	if (p->rw && (p->metadata || p->lba_size > p->xfer_len)) {
+		free(p);
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	p->mssrl = le16_to_cpu(ns.mssrl);
+	if (!p->mssrl || p->mssrl > NVME_COPY_MAX_RANGE_NLB)
+		p->mssrl = NVME_COPY_MAX_RANGE_NLB;
+	p->mcl = le32_to_cpu(ns.mcl);
+	if (!p->mcl)
+		p->mcl = UINT64_MAX;
+	p->msrc = ns.msrc + 1;
+	return p;
+}
+
+void nvme_copy_plan_free(nvme_copy_plan_t p)
+{
+	if (!p)
+		return;
+	free(p->moves);
+	free(p);
+}
+
+int nvme_copy_plan_format(nvme_copy_plan_t p)
+{
+	return p->rw ? -1 : p->format;
+}
+
+int nvme_copy_plan_add(nvme_copy_plan_t p, __u64 slba, __u64 nlb, __u64 dlba)
+{
+	if (!nlb)
+		return 0;
+	if (slba + nlb < slba || dlba + nlb < dlba) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (p->nr == p->alloc) {
+		size_t alloc = p->alloc ? p->alloc * 2 : 256;
+		struct nvme_copy_move *moves;
+
+		moves = realloc(p->moves, alloc * sizeof(*moves));
+		if (!moves) {
+			errno = ENOMEM;
+			return -1;
+		}
+		p->moves = moves;
+		p->alloc = alloc;
+	}
+	p->moves[p->nr++] = (struct nvme_copy_move) {
+		.slba = slba, .nlb = nlb, .dlba = dlba,
+	};
+	return 0;
+}
+
+static int nvme_copy_move_cmp(const void *a, const void *b)
+{
+	const struct nvme_copy_move *ma = a, *mb = b;
+
+	if (ma->dlba != mb->dlba)
+		return ma->dlba < mb->dlba ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Split the moves, sorted by destination, into source ranges and gather
+ * ranges with consecutive destinations into commands. With @pieces NULL
+ * only the number of ranges is computed, otherwise the number of commands
+ * is returned.
+ */
+static size_t nvme_copy_plan_pack(struct nvme_copy_plan *p,
+				  struct nvme_copy_move *pieces, size_t *cmds)
+{
+	size_t i, nr_pieces = 0, nr_cmds = 0;
+	__u32 cmd_ranges = 0;
+	__u64 cmd_size = 0, next_dlba = 0;
+
+	for (i = 0; i < p->nr; i++) {
+		struct nvme_copy_move m = p->moves[i];
+
+		while (m.nlb) {
+			__u64 len;
+
+			if (cmd_ranges && (cmd_ranges == p->msrc ||
+					   cmd_size == p->mcl ||
+					   m.dlba != next_dlba)) {
+				if (cmds)
+					cmds[nr_cmds] = nr_pieces;
+				nr_cmds++;
+				cmd_ranges = 0;
+				cmd_size = 0;
+			}
+			len = MIN(MIN(m.nlb, (__u64)p->mssrl),
+				  p->mcl - cmd_size);
+			if (pieces)
+				pieces[nr_pieces] = (struct nvme_copy_move) {
+					.slba = m.slba, .nlb = len,
+					.dlba = m.dlba,
+				};
+			nr_pieces++;
+			cmd_ranges++;
+			cmd_size += len;
+			m.slba += len;
+			m.dlba += len;
+			m.nlb -= len;
+			next_dlba = m.dlba;
+		}
+	}
+	if (cmd_ranges) {
+		if (cmds)
+			cmds[nr_cmds] = nr_pieces;
+		nr_cmds++;
+	}
+	return pieces ? nr_cmds : nr_pieces;
+}
+
+static int nvme_copy_plan_rw(struct nvme_copy_plan *p,
+			     struct nvme_copy_move *pieces, size_t nr)
+{
+	__u32 max_nlb = MIN(p->xfer_len / p->lba_size, NVME_COPY_MAX_RANGE_NLB);
+	void *buf;
+	size_t i;
+	int err = 0;
+
+	/* Not even a single LBA fits into a transfer */
+	if (!max_nlb) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (posix_memalign(&buf, getpagesize(), max_nlb * p->lba_size)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < nr && !err; i++) {
+		__u64 slba = pieces[i].slba, dlba = pieces[i].dlba;
+		__u64 nlb = pieces[i].nlb;
+
+		while (nlb && !err) {
+			__u32 len = MIN(nlb, max_nlb);
+			struct nvme_io_args args = {
+				.args_size = sizeof(args),
+				.fd = p->fd,
+				.nsid = p->nsid,
+				.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+				.result = NULL,
+				.data = buf,
+				.data_len = len * p->lba_size,
+				.nlb = len - 1,
+			};
+
+			args.slba = slba;
+			err = nvme_read(&args);
+			if (!err) {
+				args.slba = dlba;
+				err = nvme_write(&args);
+			}
+			slba += len;
+			dlba += len;
+			nlb -= len;
+		}
+	}
+	free(buf);
+	return err;
+}
+
+static int nvme_copy_plan_copy(struct nvme_copy_plan *p,
+			       struct nvme_copy_move *pieces, size_t nr)
+{
+	size_t dlen = p->format ? sizeof(struct nvme_copy_range_f1) :
+		sizeof(struct nvme_copy_range);
+	struct nvme_copy_args args = {
+		.sdlba = pieces[0].dlba,
+		.result = NULL,
+		.args_size = sizeof(args),
+		.fd = p->fd,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.nsid = p->nsid,
+		.nr = nr,
+		.format = p->format,
+	};
+	__u8 *descs;
+	size_t i;
+	int err;
+
+	descs = calloc(nr, dlen);
+	if (!descs) {
+		errno = ENOMEM;
+		return -1;
+	}
+	/* Both formats place SLBA and NLB at the same offsets */
+	for (i = 0; i < nr; i++) {
+		struct nvme_copy_range *r = (void *)(descs + i * dlen);
+
+		r->slba = cpu_to_le64(pieces[i].slba);
+		r->nlb = cpu_to_le16(pieces[i].nlb - 1);
+	}
+	args.copy = (struct nvme_copy_range *)descs;
+	err = nvme_copy(&args);
+	free(descs);
+	return err;
+}
+
+static void nvme_copy_submit_one(void *arg, int i)
+{
+	struct nvme_copy_submit *st = arg;
+	struct nvme_copy_plan *p = st->p;
+	size_t first = i ? st->cmds[i - 1] : 0;
+	size_t nr = st->cmds[i] - first;
+	int err;
+
+	if (__atomic_load_n(&st->abort, __ATOMIC_RELAXED))
+		return;
+
+	if (__atomic_load_n(&p->rw, __ATOMIC_RELAXED))
+		err = nvme_copy_plan_rw(p, &st->pieces[first], nr);
+	else {
+		err = nvme_copy_plan_copy(p, &st->pieces[first], nr);
+		if (err > 0 &&
+		    nvme_status_code_type(err) == NVME_SCT_GENERIC &&
+		    nvme_status_code(err) == NVME_SC_INVALID_OPCODE) {
+			if (p->metadata) {
+				errno = ENOTSUP;
+				err = -1;
+			} else {
+				__atomic_store_n(&p->rw, true,
+						 __ATOMIC_RELAXED);
+				err = nvme_copy_plan_rw(p, &st->pieces[first],
+							nr);
+			}
+		}
+	}
+	if (!err)
+		return;
+
+	pthread_mutex_lock(&st->lock);
+	if (!st->err) {
+		st->err = err;
+		st->errnum = errno;
+	}
+	__atomic_store_n(&st->abort, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&st->lock);
+}
+
+int nvme_copy_plan_submit(nvme_copy_plan_t p, int max_threads,
+			  __u32 *nr_cmds)
+{
+	struct nvme_copy_submit st = { .p = p };
+	size_t nr_pieces, n;
+	int err = 0;
+
+	if (nr_cmds)
+		*nr_cmds = 0;
+	if (!p->nr)
+		return 0;
+
+	qsort(p->moves, p->nr, sizeof(*p->moves), nvme_copy_move_cmp);
+	nr_pieces = nvme_copy_plan_pack(p, NULL, NULL);
+	st.pieces = malloc(nr_pieces * sizeof(*st.pieces));
+	st.cmds = malloc(nr_pieces * sizeof(*st.cmds));
+	if (!st.pieces || !st.cmds) {
+		errno = ENOMEM;
+		err = -1;
+		goto out;
+	}
+	n = nvme_copy_plan_pack(p, st.pieces, st.cmds);
+	if (n > INT_MAX) {
+		errno = EINVAL;
+		err = -1;
+		goto out;
+	}
+	if (nr_cmds)
+		*nr_cmds = n;
+
+	pthread_mutex_init(&st.lock, NULL);
+	nvme_run_parallel(n, max_threads, nvme_copy_submit_one, &st);
+	pthread_mutex_destroy(&st.lock);
+
+	err = st.err;
+	if (err)
+		errno = st.errnum;
+out:
+	p->nr = 0;
+	free(st.pieces);
+	free(st.cmds);
+	return err;
+}
+
 static int nvme_ns_attachment(int fd, __u32 nsid, __u16 num_ctrls,
 			      __u16 *ctrlist, bool attach, __u32 timeout)
 {
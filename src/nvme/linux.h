@@ -24,7 +24,8 @@
  * nvme_fw_download_seq() - Firmware download sequence
  * @fd:		File descriptor of nvme device
  * @size:	Total size of the firmware image to transfer
- * @xfer:	Maximum size to send with each partial transfer
+ * @xfer:	Maximum size to send with each partial transfer, or 0 to
+ *		derive it from the MDTS and FWUG fields of the controller
  * @offset:	Starting offset to send with this firmware downlaod
  * @buf:	Address of buffer containing all or part of the firmware image.
  *
@@ -97,10 +98,79 @@ int nvme_get_host_telemetry(int fd,  struct nvme_telemetry_log **log,
 int nvme_get_new_host_telemetry(int fd,  struct nvme_telemetry_log **log,
 		enum nvme_telemetry_da da, size_t *size);
 
+/**
+ * enum nvme_telemetry_stream_flags - Flags for nvme_stream_telemetry()
+ * @NVME_TELEMETRY_STREAM_DIRECT:	Write to &nvme_telemetry_stream_args.out_fd
+ *					with O_DIRECT. The current file offset
+ *					must be 4k aligned.
+ */
+enum nvme_telemetry_stream_flags {
+	NVME_TELEMETRY_STREAM_DIRECT	= 1 << 0,
+};
+
+/**
+ * typedef nvme_telemetry_write_cb - Consumer of streamed telemetry data
+ *
+ * Called with the callback argument, the chunk, its length and its
+ * offset within the log. Return 0 to continue, or -1 with errno set to
+ * abort the transfer.
+ */
+typedef int (*nvme_telemetry_write_cb)(void *arg, const void *buf,
+				       size_t len, __u64 offset);
+
+/**
+ * struct nvme_telemetry_stream_args - Arguments for nvme_stream_telemetry()
+ * @size:	If not NULL, set to the number of bytes delivered
+ * @cb:		Callback consuming the data; if NULL, data is written to @out_fd
+ * @cb_arg:	Argument passed to @cb
+ * @args_size:	Size of &struct nvme_telemetry_stream_args
+ * @fd:		File descriptor of nvme device
+ * @out_fd:	File descriptor the data is written to when @cb is NULL
+ * @timeout:	Timeout in ms
+ * @xfer_len:	Bytes per Get Log Page command, a multiple of 4k; 0 derives
+ *		it from the MDTS of the controller
+ * @flags:	Bitmask of &enum nvme_telemetry_stream_flags
+ * @lid:	%NVME_LOG_LID_TELEMETRY_HOST or %NVME_LOG_LID_TELEMETRY_CTRL
+ * @da:		Log page data area, valid values: &enum nvme_telemetry_da
+ * @create:	Create a new host telemetry snapshot first (host log only)
+ * @rae:	Retain asynchronous events (controller log only)
+ */
+struct nvme_telemetry_stream_args {
+	size_t *size;
+	nvme_telemetry_write_cb cb;
+	void *cb_arg;
+	int args_size;
+	int fd;
+	int out_fd;
+	__u32 timeout;
+	__u32 xfer_len;
+	__u32 flags;
+	enum nvme_cmd_get_log_lid lid;
+	enum nvme_telemetry_da da;
+	bool create;
+	bool rae;
+};
+
+/**
+ * nvme_stream_telemetry() - Stream a telemetry log without buffering it
+ * @args:	&struct nvme_telemetry_stream_args argument structure
+ *
+ * Reads the telemetry log up to the requested data area in chunks of
+ * @args->xfer_len bytes and hands each one to @args->cb or writes it to
+ * @args->out_fd. Two chunk buffers are used, so fetching the next chunk
+ * overlaps with writing the previous one and memory use does not depend
+ * on the size of the log. The callback runs on a separate thread.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_stream_telemetry(struct nvme_telemetry_stream_args *args);
+
 /**
  * nvme_get_log_page() - Get log page data
  * @fd:		File descriptor of nvme device
- * @xfer_len:	Max log transfer size per request to split the total.
+ * @xfer_len:	Max log transfer size per request to split the total, or 0
+ *		to derive it from the MDTS of the controller.
  * @args:	&struct nvme_get_log_args argument structure
  *
  * Return: The nvme command status if a response was received (see
@@ -108,6 +178,20 @@ int nvme_get_new_host_telemetry(int fd,  struct nvme_telemetry_log **log,
  */
 int nvme_get_log_page(int fd, __u32 xfer_len, struct nvme_get_log_args *args);
 
+/**
+ * nvme_get_max_xfer_len() - Largest data transfer size of a controller
+ * @fd:		File descriptor of nvme device
+ * @xfer_len:	On success, set to the transfer size in bytes
+ *
+ * Issues an Identify Controller command and converts the MDTS field,
+ * assuming a 4k minimum memory page size. The result is capped at 1 MiB.
+ * Use nvme_ctrl_get_max_xfer_len() to avoid the Identify on every call.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_get_max_xfer_len(int fd, __u32 *xfer_len);
+
 /**
  * nvme_get_ana_log_len() - Retreive size of the current ANA log
  * @fd:		File descriptor of nvme device
@@ -140,6 +224,575 @@ int nvme_get_logical_block_size(int fd, __u32 nsid, int *blksize);
  */
 int nvme_get_lba_status_log(int fd, bool rae, struct nvme_lba_status_log **log);
 
+/**
+ * typedef nvme_lba_status_cb - Consumer of scanned LBA status ranges
+ *
+ * Called with the callback argument and one LBA status descriptor. The
+ * descriptors arrive in ascending LBA order and adjacent ranges of equal
+ * status are merged. Return 0 to continue, or -1 with errno set to abort
+ * the scan.
+ */
+typedef int (*nvme_lba_status_cb)(void *arg,
+				  const struct nvme_lba_status_desc *desc);
+
+/**
+ * struct nvme_lba_status_scan_args - Arguments for nvme_scan_lba_status()
+ * @slba:	First LBA of the range to scan
+ * @nlb:	Number of LBAs to scan; 0 scans to the end of the namespace
+ * @cb:		Callback consuming the descriptors
+ * @cb_arg:	Argument passed to @cb
+ * @args_size:	Size of &struct nvme_lba_status_scan_args
+ * @fd:		File descriptor of nvme device
+ * @timeout:	Timeout in ms
+ * @nsid:	Namespace ID
+ * @chunk_nlb:	Number of LBAs in each unit of parallel work; 0 splits the
+ *		range into four chunks per thread
+ * @max_threads: Maximum number of concurrent commands; 0 selects the
+ *		library default
+ * @atype:	Action type, see &enum nvme_lba_status_atype
+ */
+struct nvme_lba_status_scan_args {
+	__u64 slba;
+	__u64 nlb;
+	nvme_lba_status_cb cb;
+	void *cb_arg;
+	int args_size;
+	int fd;
+	__u32 timeout;
+	__u32 nsid;
+	__u64 chunk_nlb;
+	int max_threads;
+	enum nvme_lba_status_atype atype;
+};
+
+/**
+ * nvme_scan_lba_status() - Scan an LBA range for potentially unrecoverable LBAs
+ * @args:	&struct nvme_lba_status_scan_args argument structure
+ *
+ * Splits the range into chunks which are scanned concurrently with Get LBA
+ * Status commands of at most 65535 LBAs each. The returned descriptors are
+ * clipped to the range, merged across command and chunk boundaries and
+ * passed to &nvme_lba_status_scan_args.cb in LBA order as soon as all
+ * preceding chunks have completed. The callback is never called
+ * concurrently.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_scan_lba_status(struct nvme_lba_status_scan_args *args);
+
+/**
+ * struct nvme_pevent_iter - Persistent Event Log iterator state
+ * @hdr:	Log header read when the context was established
+ * @buf:	Caller supplied buffer holding the current window of the log
+ * @tll:	Total Log Length in bytes
+ * @pos:	Log offset of the next event
+ * @buf_lpo:	Log offset of the first byte in @buf
+ * @fd:		File descriptor of nvme device
+ * @timeout:	Timeout in ms used for the Get Log Page commands
+ * @buf_len:	Size of @buf
+ * @buf_valid:	Number of valid bytes in @buf
+ * @tnev:	Total Number of Events
+ * @nev:	Number of events returned so far
+ * @active:	A read context is established
+ *
+ * Initialise with nvme_pevent_iter_init(); the fields are for reading only.
+ */
+struct nvme_pevent_iter {
+	struct nvme_persistent_event_log hdr;
+	void *buf;
+	__u64 tll;
+	__u64 pos;
+	__u64 buf_lpo;
+	int fd;
+	__u32 timeout;
+	__u32 buf_len;
+	__u32 buf_valid;
+	__u32 tnev;
+	__u32 nev;
+	bool active;
+};
+
+/**
+ * struct nvme_pevent - A persistent event returned by the iterator
+ * @entry:	Event header, points into the iterator buffer
+ * @vsi:	Vendor specific information, or NULL if there is none
+ * @data:	Event data; the layout depends on @entry->etype, see
+ *		&enum nvme_persistent_event_types
+ * @offset:	Offset of the event within the log
+ * @vsil:	Length of @vsi in bytes
+ * @data_len:	Length of @data in bytes
+ *
+ * All pointers are valid until the next call on the iterator.
+ */
+struct nvme_pevent {
+	struct nvme_persistent_event_entry *entry;
+	void *vsi;
+	void *data;
+	__u64 offset;
+	__u32 vsil;
+	__u32 data_len;
+};
+
+/**
+ * nvme_pevent_iter_init() - Start reading the Persistent Event Log
+ * @it:		Iterator to initialise
+ * @fd:		File descriptor of nvme device
+ * @buf:	Buffer used for all transfers, at least 512 bytes. It has to be
+ *		3 bytes larger than the largest event to be returned.
+ * @buf_len:	Size of @buf
+ *
+ * Establishes a read context on the controller and reads the log header.
+ * The log is then fetched in windows of @buf_len bytes as events are
+ * requested, so the buffer size bounds memory use, not the log size. The
+ * context must be released with nvme_pevent_iter_release().
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_pevent_iter_init(struct nvme_pevent_iter *it, int fd,
+			  void *buf, __u32 buf_len);
+
+/**
+ * nvme_pevent_iter_next() - Return the next persistent event
+ * @it:		Iterator initialised by nvme_pevent_iter_init()
+ * @ev:		Filled in with the next event
+ *
+ * The event is checked against the total log length before it is
+ * returned. An event that does not fit into the buffer fails with
+ * %EMSGSIZE and is skipped, so iteration can continue.
+ *
+ * Return: 0 on success, with @ev->entry set to NULL once all events are
+ * returned. Otherwise the nvme command status if a response was received
+ * (see &enum nvme_status_field) or -1 with errno set.
+ */
+int nvme_pevent_iter_next(struct nvme_pevent_iter *it, struct nvme_pevent *ev);
+
+/**
+ * nvme_pevent_iter_release() - Release the Persistent Event Log read context
+ * @it:		Iterator initialised by nvme_pevent_iter_init()
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_pevent_iter_release(struct nvme_pevent_iter *it);
+
+/**
+ * struct nvme_error_log_reader - Error Information log reader state
+ * @last_count:	Error count of the newest entry returned so far
+ * @fd:		File descriptor of nvme device
+ * @nr_entries:	Number of entries the controller retains (ELPE + 1)
+ * @rae:	Retain asynchronous events, set by default
+ */
+struct nvme_error_log_reader {
+	__u64 last_count;
+	int fd;
+	__u32 nr_entries;
+	bool rae;
+};
+
+/**
+ * nvme_error_log_reader_init() - Initialise an Error Information log reader
+ * @rd:		Reader to initialise
+ * @fd:		File descriptor of nvme device
+ * @skip_existing: Only report errors logged after this call
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_error_log_reader_init(struct nvme_error_log_reader *rd, int fd,
+			       bool skip_existing);
+
+/**
+ * nvme_error_log_read_new() - Read errors logged since the last call
+ * @rd:		Reader initialised by nvme_error_log_reader_init()
+ * @log:	Array receiving the new entries, newest first
+ * @max:	Number of entries @log can hold; @rd->nr_entries entries avoid
+ *		any loss caused by the buffer size
+ * @nr:		Set to the number of new entries stored in @log
+ * @lost:	If not NULL, set to the number of new errors that were no
+ *		longer in the controller's ring or did not fit into @log
+ *
+ * The controller keeps the most recent error at the start of the log, so
+ * a poll without new errors costs a single 64 byte transfer, and otherwise
+ * only the new entries are transferred. A reset of the error count is
+ * treated as if all entries in the log were new.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_error_log_read_new(struct nvme_error_log_reader *rd,
+			    struct nvme_error_log_page *log, __u32 max,
+			    __u32 *nr, __u64 *lost);
+
+/**
+ * struct nvme_zone_iter - Zone report iterator state
+ * @buf:	Report buffer, reused for every batch
+ * @nsze:	Namespace size in logical blocks
+ * @zsze:	Zone size in logical blocks
+ * @next_slba:	Start LBA of the next report
+ * @nr:		Number of descriptors in @buf
+ * @idx:	Index of the next descriptor in @buf
+ * @fd:		File descriptor of nvme device
+ * @nsid:	Namespace identifier
+ * @timeout:	Timeout in ms used for the report commands
+ * @buf_len:	Size of @buf
+ * @ext_len:	Size of the zone descriptor extension in bytes
+ * @opts:	Zone state filter
+ * @extended:	Extended reports are requested
+ * @done:	The last batch has been fetched
+ *
+ * Initialise with nvme_zone_iter_init(); the fields are for reading only.
+ */
+struct nvme_zone_iter {
+	void *buf;
+	__u64 nsze;
+	__u64 zsze;
+	__u64 next_slba;
+	__u64 nr;
+	__u64 idx;
+	int fd;
+	__u32 nsid;
+	__u32 timeout;
+	__u32 buf_len;
+	__u32 ext_len;
+	enum nvme_zns_report_options opts;
+	bool extended;
+	bool done;
+};
+
+/**
+ * nvme_zone_iter_init() - Start iterating over the zones of a namespace
+ * @it:		Iterator to initialise
+ * @fd:		File descriptor of nvme device
+ * @nsid:	Namespace identifier
+ * @opts:	Only report zones in this state, see
+ *		&enum nvme_zns_report_options
+ * @extended:	Request extended reports, which carry the zone descriptor
+ *		extension of each zone
+ * @buf_len:	Size of the report buffer, or 0 to use the maximum data
+ *		transfer size of the controller
+ *
+ * Zones are reported in batches that fill the buffer, using partial
+ * reports so that each batch continues right after the previous one.
+ * Memory use is bounded by @buf_len, whatever the number of zones.
+ * Release the buffer with nvme_zone_iter_free().
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_iter_init(struct nvme_zone_iter *it, int fd, __u32 nsid,
+			enum nvme_zns_report_options opts, bool extended,
+			__u32 buf_len);
+
+/**
+ * nvme_zone_iter_next() - Return the next zone
+ * @it:		Iterator initialised by nvme_zone_iter_init()
+ * @desc:	Set to the zone descriptor, or NULL after the last zone
+ * @ext:	If not NULL, set to the zone descriptor extension, or NULL if
+ *		there is none
+ *
+ * The returned pointers are valid until the next call on @it.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_iter_next(struct nvme_zone_iter *it,
+			struct nvme_zns_desc **desc, void **ext);
+
+/**
+ * nvme_zone_iter_free() - Release the buffer of a zone iterator
+ * @it:		Iterator initialised by nvme_zone_iter_init()
+ */
+void nvme_zone_iter_free(struct nvme_zone_iter *it);
+
+/**
+ * typedef nvme_zone_table_t - Cached zone state of a zoned namespace
+ *
+ * Created by nvme_zone_table_create().
+ */
+typedef struct nvme_zone_table *nvme_zone_table_t;
+
+/**
+ * struct nvme_zone_info - Cached state of one zone
+ * @zslba:	Zone Start LBA
+ * @wp:		Write pointer
+ * @zcap:	Zone capacity in logical blocks
+ * @state:	Zone state, see &enum nvme_zns_zs
+ */
+struct nvme_zone_info {
+	__u64 zslba;
+	__u64 wp;
+	__u64 zcap;
+	__u8 state;
+};
+
+/**
+ * nvme_zone_table_create() - Build the zone table of a namespace
+ * @fd:		File descriptor of nvme device
+ * @nsid:	Namespace identifier
+ *
+ * Reads all zones in one pass of nvme_zone_iter_next(). Afterwards, the
+ * table follows the zone state changes caused by the nvme_zone_table_*
+ * command wrappers, so allocation decisions need no management commands.
+ *
+ * Return: The zone table, or NULL with errno set on failure
+ */
+nvme_zone_table_t nvme_zone_table_create(int fd, __u32 nsid);
+
+/**
+ * nvme_zone_table_free() - Free a zone table
+ * @zt:		Zone table
+ */
+void nvme_zone_table_free(nvme_zone_table_t zt);
+
+/**
+ * nvme_zone_table_refresh() - Read the state of all zones again
+ * @zt:		Zone table
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_table_refresh(nvme_zone_table_t zt);
+
+/**
+ * nvme_zone_table_nr_zones() - Number of zones of the namespace
+ * @zt:		Zone table
+ *
+ * Return: The number of zones
+ */
+__u64 nvme_zone_table_nr_zones(nvme_zone_table_t zt);
+
+/**
+ * nvme_zone_table_get() - Return the cached state of a zone
+ * @zt:		Zone table
+ * @idx:	Zone index
+ * @zi:		Filled in with the zone state
+ *
+ * Return: 0 on success, or -1 with errno set to %EINVAL for an invalid
+ * index
+ */
+int nvme_zone_table_get(nvme_zone_table_t zt, __u64 idx,
+			struct nvme_zone_info *zi);
+
+/**
+ * nvme_zone_table_counts() - Number of open and active zones
+ * @zt:		Zone table
+ * @nr_open:	If not NULL, set to the number of open zones
+ * @nr_active:	If not NULL, set to the number of active zones
+ */
+void nvme_zone_table_counts(nvme_zone_table_t zt, __u32 *nr_open,
+			    __u32 *nr_active);
+
+/**
+ * nvme_zone_table_pick() - Choose a zone for new data
+ * @zt:		Zone table
+ * @nlb:	Number of logical blocks to be written
+ *
+ * Prefers an open zone with room for @nlb blocks. Otherwise it picks an
+ * empty zone, if opening it stays within the Maximum Open and Maximum
+ * Active Resources of the namespace.
+ *
+ * Return: The zone index, or -1 with errno set to %ENOSPC
+ */
+__s64 nvme_zone_table_pick(nvme_zone_table_t zt, __u32 nlb);
+
+/**
+ * nvme_zone_table_advance() - Account for data written to a zone
+ * @zt:		Zone table
+ * @slba:	First logical block written
+ * @nlb:	Number of logical blocks written
+ *
+ * For writes issued without nvme_zone_table_append().
+ */
+void nvme_zone_table_advance(nvme_zone_table_t zt, __u64 slba, __u32 nlb);
+
+/**
+ * nvme_zone_table_append() - Zone append, updating the zone table
+ * @zt:		Zone table
+ * @args:	&struct nvme_zns_append_args argument structure; the fd and
+ *		nsid fields are filled in from @zt
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_table_append(nvme_zone_table_t zt,
+			   struct nvme_zns_append_args *args);
+
+/**
+ * nvme_zone_table_mgmt_send() - Zone management send, updating the table
+ * @zt:		Zone table
+ * @args:	&struct nvme_zns_mgmt_send_args argument structure; the fd and
+ *		nsid fields are filled in from @zt
+ *
+ * Open, close, finish, reset and offline actions are applied to the
+ * cached state, for a single zone or all zones as selected in @args.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_table_mgmt_send(nvme_zone_table_t zt,
+			      struct nvme_zns_mgmt_send_args *args);
+
+/**
+ * nvme_zone_table_sync_changed() - Apply the Changed Zone List log
+ * @zt:		Zone table
+ * @rae:	Retain asynchronous events
+ *
+ * Reports each zone in the Changed Zone List again, typically after a
+ * Zone Descriptor Changed notice. If the list overflowed, all zones are
+ * read again.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_table_sync_changed(nvme_zone_table_t zt, bool rae);
+
+/**
+ * typedef nvme_dsm_plan_t - Dataset Management extent collector
+ *
+ * Created by nvme_dsm_plan_create().
+ */
+typedef struct nvme_dsm_plan *nvme_dsm_plan_t;
+
+/**
+ * nvme_dsm_plan_create() - Create a Dataset Management extent collector
+ * @fd:		File descriptor of nvme device
+ * @nsid:	Namespace ID
+ * @attrs:	DSM attributes, see &enum nvme_dsm_attributes
+ *
+ * The range limits are read from the I/O Command Set specific Identify
+ * Controller data structure. Controllers which do not report them are
+ * limited to 256 ranges of at most 0xffffffff LBAs per command.
+ *
+ * Return: The plan, or NULL with errno set
+ */
+nvme_dsm_plan_t nvme_dsm_plan_create(int fd, __u32 nsid, __u32 attrs);
+
+/**
+ * nvme_dsm_plan_free() - Free a Dataset Management extent collector
+ * @p:		Plan created by nvme_dsm_plan_create()
+ */
+void nvme_dsm_plan_free(nvme_dsm_plan_t p);
+
+/**
+ * nvme_dsm_plan_set_limits() - Override the range limits of a plan
+ * @p:		Plan
+ * @dmrl:	Maximum number of ranges per command, 0 for 256
+ * @dmrsl:	Maximum number of LBAs per range, 0 for no limit
+ * @dmsl:	Maximum number of LBAs per command, 0 for no limit
+ */
+void nvme_dsm_plan_set_limits(nvme_dsm_plan_t p, __u8 dmrl, __u32 dmrsl,
+			      __u64 dmsl);
+
+/**
+ * nvme_dsm_plan_add() - Add an extent to a plan
+ * @p:		Plan
+ * @slba:	Starting LBA
+ * @nlb:	Number of LBAs
+ *
+ * Extents may be added in any order and may overlap.
+ *
+ * Return: 0 on success, -1 with errno set otherwise.
+ */
+int nvme_dsm_plan_add(nvme_dsm_plan_t p, __u64 slba, __u64 nlb);
+
+/**
+ * nvme_dsm_plan_submit() - Send the collected extents
+ * @p:		Plan
+ * @max_threads: Maximum number of commands in flight; 0 selects the
+ *		library default
+ * @nr_cmds:	If not NULL, set to the number of commands the extents
+ *		were packed into
+ *
+ * The extents are sorted, overlapping and adjacent ones are merged, and
+ * the result is packed greedily into as few Dataset Management commands
+ * as the range limits allow, splitting ranges where a limit is reached.
+ * The commands are submitted concurrently. On success the plan is empty
+ * afterwards and can be reused. On failure it keeps the merged extents,
+ * so submitting it again retries all of them.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_dsm_plan_submit(nvme_dsm_plan_t p, int max_threads, __u32 *nr_cmds);
+
+/**
+ * typedef nvme_copy_plan_t - Collector of data moves within a namespace
+ *
+ * Created by nvme_copy_plan_create().
+ */
+typedef struct nvme_copy_plan *nvme_copy_plan_t;
+
+/**
+ * nvme_copy_plan_create() - Create a collector of data moves
+ * @fd:		File descriptor of nvme device
+ * @nsid:	Namespace ID
+ *
+ * The Copy limits MSSRL, MCL and MSRC are read from Identify Namespace.
+ * Source range descriptor format 1h is used if the namespace is formatted
+ * with 64b Guard protection information, format 0h otherwise. If the
+ * controller supports neither Copy nor the required descriptor format,
+ * the moves are done with Read and Write commands, which requires a
+ * namespace without metadata and an LBA size within MDTS.
+ *
+ * Return: The plan, or NULL with errno set; errno is %ENOTSUP if the
+ * moves could be done neither with Copy nor with Read and Write, and
+ * %EPROTO if the namespace reports an invalid LBA data size.
+ */
+nvme_copy_plan_t nvme_copy_plan_create(int fd, __u32 nsid);
+
+/**
+ * nvme_copy_plan_free() - Free a collector of data moves
+ * @p:		Plan created by nvme_copy_plan_create()
+ */
+void nvme_copy_plan_free(nvme_copy_plan_t p);
+
+/**
+ * nvme_copy_plan_format() - Descriptor format used by a plan
+ * @p:		Plan
+ *
+ * Return: The source range descriptor format of the Copy commands, or -1
+ * if the moves are done with Read and Write commands
+ */
+int nvme_copy_plan_format(nvme_copy_plan_t p);
+
+/**
+ * nvme_copy_plan_add() - Add a data move to a plan
+ * @p:		Plan
+ * @slba:	First source LBA
+ * @nlb:	Number of LBAs to move
+ * @dlba:	First destination LBA
+ *
+ * Return: 0 on success, -1 with errno set otherwise.
+ */
+int nvme_copy_plan_add(nvme_copy_plan_t p, __u64 slba, __u64 nlb, __u64 dlba);
+
+/**
+ * nvme_copy_plan_submit() - Execute the collected data moves
+ * @p:		Plan
+ * @max_threads: Maximum number of commands in flight; 0 selects the
+ *		library default
+ * @nr_cmds:	If not NULL, set to the number of Copy commands, or of
+ *		read and write pairs, the moves were split into
+ *
+ * The moves are sorted by destination. Moves with consecutive destinations
+ * are gathered into one Copy command as source ranges, within the MSSRL,
+ * MCL and MSRC limits of the namespace. The commands are executed
+ * concurrently, so no move may read LBAs that another move of the same
+ * submission writes. If the controller rejects Copy with Invalid Command
+ * Opcode, that and all later commands fall back to Read and Write, unless
+ * the namespace has metadata which Read and Write would not move, or an
+ * LBA does not fit into a single transfer. The
+ * plan is empty afterwards, also on failure, and can be reused.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise; errno is
+ * %ENOTSUP if Copy was rejected and Read and Write cannot be used.
+ */
+int nvme_copy_plan_submit(nvme_copy_plan_t p, int max_threads,
+			  __u32 *nr_cmds);
+
 /**
  * nvme_namespace_attach_ctrls() - Attach namespace to controller(s)
  * @fd:		File descriptor of nvme device
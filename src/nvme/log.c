@@ -20,20 +20,23 @@
 #define LOG_FUNCNAME 1
 #include "private.h"
 #include "log.h"
-#include "cleanup.h"
 
 #ifndef LOG_CLOCK
 #define LOG_CLOCK CLOCK_MONOTONIC
 #endif
 
-void __attribute__((format(printf, 4, 5)))
-__nvme_msg(nvme_root_t r, int lvl,
-	   const char *func, const char *format, ...)
+/*
+ * Messages are formatted into a buffer on the stack, longer messages are
+ * truncated. Callers check the level with nvme_log_enabled() before any
+ * of the arguments are evaluated.
+ */
+#define NVME_LOG_BUF_SIZE	1024
+
+static void nvme_log_default_sink(nvme_root_t r,
+				  const struct nvme_log_record *rec, void *arg)
 {
 	FILE *fp = r ? r->fp : stderr;
-	va_list ap;
-	char pidbuf[16];
-	char timebuf[32];
+	char header[80];
 	static const char *const formats[] = {
 		"%s%s%s",
 		"%s%s%s: ",
@@ -44,13 +47,10 @@ __nvme_msg(nvme_root_t r, int lvl,
 		"[%s] <%s>%s ",
 		"[%s] <%s> %s: ",
 	};
-	char *header __cleanup__(cleanup_charp) = NULL;
-	char *message __cleanup__(cleanup_charp) = NULL;
+	char pidbuf[16];
+	char timebuf[32];
 	int idx = 0;
 
-	if (r && lvl > r->log_level)
-		return;
-
 	if (r && r->log_timestamp) {
 		struct timespec now;
 
@@ -67,21 +67,62 @@ __nvme_msg(nvme_root_t r, int lvl,
 	} else
 		*pidbuf = '\0';
 
-	if (func)
+	if (rec->func)
 		idx |= 1 << 0;
 
-	if (asprintf(&header, formats[idx],
-		     timebuf, pidbuf, func ? func : "") == -1)
-		header = NULL;
+	snprintf(header, sizeof(header), formats[idx],
+		 timebuf, pidbuf, rec->func ? rec->func : "");
+
+	flockfile(fp);
+	fputs_unlocked(header, fp);
+	fwrite_unlocked(rec->msg, 1, rec->len, fp);
+	funlockfile(fp);
+}
+
+void __attribute__((format(printf, 5, 6)))
+__nvme_msg(nvme_root_t r, int lvl, const char *func,
+	   const struct nvme_log_fields *fields, const char *format, ...)
+{
+	static const struct nvme_log_fields no_fields = {
+		.opcode = -1,
+	};
+	struct nvme_log_record rec = {
+		.level = lvl,
+		.func = func,
+		.fields = fields ? fields : &no_fields,
+	};
+	char buf[NVME_LOG_BUF_SIZE];
+	va_list ap;
+	int len;
+
+	if (!nvme_log_enabled(r, lvl))
+		return;
 
 	va_start(ap, format);
-	if (vasprintf(&message, format, ap) == -1)
-		message = NULL;
+	len = vsnprintf(buf, sizeof(buf), format, ap);
 	va_end(ap);
+	if (len < 0) {
+		strcpy(buf, "<error>");
+		len = strlen(buf);
+	} else if (len >= sizeof(buf)) {
+		/* Keep the line terminated */
+		len = sizeof(buf) - 1;
+		if (format[strlen(format) - 1] == '\n')
+			buf[len - 1] = '\n';
+	}
+	rec.msg = buf;
+	rec.len = len;
 
-	fprintf(fp, "%s%s",
-		header ? header : "<error>",
-		message ? message : "<error>");
+	if (r && r->log_sink)
+		r->log_sink(r, &rec, r->log_sink_arg);
+	else
+		nvme_log_default_sink(r, &rec, NULL);
+}
+
+void nvme_set_log_sink(nvme_root_t r, nvme_log_sink_t sink, void *arg)
+{
+	r->log_sink = sink;
+	r->log_sink_arg = arg;
 }
 
 void nvme_init_logging(nvme_root_t r, int lvl, bool log_pid, bool log_tstamp)
@@ -6,8 +6,11 @@
 #define _LOG_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <syslog.h>
 
+#include <linux/types.h>
+
 /* for nvme_root_t */
 #include "tree.h"
 
@@ -35,4 +38,60 @@
  */
 void nvme_init_logging(nvme_root_t r, int lvl, bool log_pid, bool log_tstamp);
 
+/**
+ * struct nvme_log_fields - Structured context of a log message
+ * @ctrl:	Controller name, or NULL if the message is not about a
+ *		controller
+ * @nsid:	Namespace ID the message refers to, or 0
+ * @opcode:	Opcode of the command the message refers to, or -1
+ * @status:	Result of that command: the NVMe status if positive, a
+ *		negative errno if the command could not be completed, or 0
+ */
+struct nvme_log_fields {
+	const char *ctrl;
+	__u32 nsid;
+	int opcode;
+	int status;
+};
+
+/**
+ * struct nvme_log_record - A single log message passed to a log sink
+ * @level:	Syslog level of the message
+ * @func:	Name of the function which emitted the message, or NULL
+ * @fields:	Structured context, never NULL
+ * @msg:	Formatted message, not NUL terminated
+ * @len:	Length of @msg
+ */
+struct nvme_log_record {
+	int level;
+	const char *func;
+	const struct nvme_log_fields *fields;
+	const char *msg;
+	size_t len;
+};
+
+/**
+ * typedef nvme_log_sink_t - Log sink callback
+ * @r:		nvme_root_t context which emitted the message
+ * @rec:	Log record, only valid for the duration of the call
+ * @arg:	Argument passed to nvme_set_log_sink()
+ */
+typedef void (*nvme_log_sink_t)(nvme_root_t r,
+				const struct nvme_log_record *rec, void *arg);
+
+/**
+ * nvme_set_log_sink() - Redirect log messages to a callback
+ * @r:		nvme_root_t context
+ * @sink:	Callback receiving each message, or NULL to restore the
+ *		default sink
+ * @arg:	Argument passed to @sink
+ *
+ * Messages are filtered by the level set with nvme_init_logging() before
+ * they are formatted, so @sink is only called for messages which pass
+ * the filter. The default sink writes the message to the file stream of
+ * @r, prefixed with the timestamp and PID if enabled. The sink may be
+ * called concurrently from several threads.
+ */
+void nvme_set_log_sink(nvme_root_t r, nvme_log_sink_t sink, void *arg);
+
 #endif /* _LOG_H */
@@ -7,6 +7,7 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdlib.h>
 
@@ -15,6 +16,8 @@
 #include "log.h"
 #include "mi.h"
 #include "private.h"
+#include "stats.h"
+#include "trace.h"
 
 /* MI-equivalent of nvme_create_root, but avoids clashing symbol names
  * when linking against both libnvme and libnvme-mi.
@@ -39,6 +42,68 @@ void nvme_mi_free_root(nvme_root_t root)
 	free(root);
 }
 
+void nvme_mi_set_log_sink(nvme_root_t root, nvme_log_sink_t sink, void *arg)
+{
+	nvme_set_log_sink(root, sink, arg);
+}
+
+void nvme_mi_stats_enable(bool enable)
+{
+	nvme_stats_enable(enable);
+}
+
+void nvme_mi_stats_reset(void)
+{
+	nvme_stats_reset();
+}
+
+int nvme_mi_stats_snapshot(struct nvme_stats_entry **entries)
+{
+	return nvme_stats_snapshot(entries);
+}
+
+__u64 nvme_mi_stats_hist_lower(int bucket)
+{
+	return nvme_stats_hist_lower(bucket);
+}
+
+__u64 nvme_mi_stats_percentile(const struct nvme_stats_entry *e, double pct)
+{
+	return nvme_stats_percentile(e, pct);
+}
+
+int nvme_mi_trace_open(const char *path, unsigned int nr_rings,
+		       unsigned int ring_size)
+{
+	return nvme_trace_open(path, nr_rings, ring_size);
+}
+
+void nvme_mi_trace_close(void)
+{
+	nvme_trace_close();
+}
+
+struct nvme_trace_reader *nvme_mi_trace_reader_open(const char *path)
+{
+	return nvme_trace_reader_open(path);
+}
+
+int nvme_mi_trace_reader_read(struct nvme_trace_reader *rd,
+			      struct nvme_trace_record *recs, int nr)
+{
+	return nvme_trace_reader_read(rd, recs, nr);
+}
+
+__u64 nvme_mi_trace_reader_lost(struct nvme_trace_reader *rd)
+{
+	return nvme_trace_reader_lost(rd);
+}
+
+void nvme_mi_trace_reader_close(struct nvme_trace_reader *rd)
+{
+	nvme_trace_reader_close(rd);
+}
+
 struct nvme_mi_ep *nvme_mi_init_ep(nvme_root_t root)
 {
 	struct nvme_mi_ep *ep;
@@ -96,29 +161,103 @@ static int nvme_mi_verify_resp_mic(struct nvme_mi_resp *resp)
 	return resp->mic != ~crc;
 }
 
+static void nvme_mi_cmd_done(nvme_mi_ep_t ep, __u64 start,
+			     struct nvme_mi_req *req,
+			     struct nvme_mi_resp *resp, int rc)
+{
+	struct nvme_trace_record rec = { 0 };
+	__u32 cls, src, opcode = 0;
+	int err = rc ? -1 : 0;
+
+	/* MI and admin messages both carry the opcode and status at byte 4 */
+	switch ((req->hdr->nmp >> 3) & 0xf) {
+	case NVME_MI_MT_MI:
+		cls = NVME_STATS_MI;
+		src = NVME_TRACE_MI;
+		break;
+	case NVME_MI_MT_ADMIN:
+		cls = NVME_STATS_MI_ADMIN;
+		src = NVME_TRACE_MI_ADMIN;
+		break;
+	default:
+		cls = NVME_STATS_MI_OTHER;
+		src = NVME_TRACE_MI_OTHER;
+		break;
+	}
+	if (cls != NVME_STATS_MI_OTHER) {
+		if (req->hdr_len > sizeof(*req->hdr))
+			opcode = ((__u8 *)req->hdr)[sizeof(*req->hdr)];
+		if (!rc && resp->hdr_len > sizeof(*resp->hdr))
+			err = ((__u8 *)resp->hdr)[sizeof(*resp->hdr)];
+	}
+
+	rec.start_ns = start;
+	rec.id = (uintptr_t)ep;
+	rec.source = src;
+	rec.opcode = opcode;
+	rec.data_len = req->data_len;
+	if (cls == NVME_STATS_MI &&
+	    req->hdr_len >= sizeof(struct nvme_mi_mi_req_hdr)) {
+		struct nvme_mi_mi_req_hdr *hdr = (void *)req->hdr;
+
+		rec.cdw10 = le32_to_cpu(hdr->cdw0);
+		rec.cdw11 = le32_to_cpu(hdr->cdw1);
+	} else if (cls == NVME_STATS_MI_ADMIN &&
+		   req->hdr_len >= sizeof(struct nvme_mi_admin_req_hdr)) {
+		struct nvme_mi_admin_req_hdr *hdr = (void *)req->hdr;
+
+		rec.flags = hdr->flags;
+		rec.nsid = le32_to_cpu(hdr->cdw1);
+		rec.cdw10 = le32_to_cpu(hdr->cdw10);
+		rec.cdw11 = le32_to_cpu(hdr->cdw11);
+		rec.cdw12 = le32_to_cpu(hdr->cdw12);
+		rec.cdw13 = le32_to_cpu(hdr->cdw13);
+		rec.cdw14 = le32_to_cpu(hdr->cdw14);
+		rec.cdw15 = le32_to_cpu(hdr->cdw15);
+	}
+	if (!err && cls == NVME_STATS_MI_ADMIN &&
+	    resp->hdr_len >= sizeof(struct nvme_mi_admin_resp_hdr)) {
+		struct nvme_mi_admin_resp_hdr *hdr = (void *)resp->hdr;
+
+		rec.result = le32_to_cpu(hdr->cdw0);
+	}
+
+	nvme_trace_probe(src, rec.id, opcode, rec.nsid, rec.cdw10, rec.cdw11,
+			 rec.data_len, err);
+	if (nvme_tracing(start)) {
+		rec.status = err < 0 ? -errno : err;
+		__nvme_trace_cmd(&rec);
+	}
+	nvme_stats_record(start, cls, opcode, (uintptr_t)ep, err);
+}
+
 int nvme_mi_submit(nvme_mi_ep_t ep, struct nvme_mi_req *req,
 		   struct nvme_mi_resp *resp)
 {
+	__u64 start;
 	int rc;
 
 	if (ep->transport->mic_enabled)
 		nvme_mi_calc_req_mic(req);
 
+	start = nvme_cmd_start();
 	rc = ep->transport->submit(ep, req, resp);
 	if (rc) {
 		nvme_msg(ep->root, LOG_INFO, "transport failure\n");
-		return rc;
+		goto out;
 	}
 
 	if (ep->transport->mic_enabled) {
 		rc = nvme_mi_verify_resp_mic(resp);
 		if (rc) {
 			nvme_msg(ep->root, LOG_WARNING, "crc mismatch\n");
-			return rc;
+			goto out;
 		}
 	}
 
-	return 0;
+out:
+	nvme_mi_cmd_done(ep, start, req, resp, rc);
+	return rc;
 }
 
 static void nvme_mi_admin_init_req(struct nvme_mi_req *req,
@@ -67,6 +67,9 @@
 
 #include "types.h"
 #include "tree.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
 
 /**
  * NVME_MI_MSGTYPE_NVME - MCTP message type for NVMe-MI messages.
@@ -267,6 +270,139 @@ nvme_root_t nvme_mi_create_root(FILE *fp, int log_level);
  */
 void nvme_mi_free_root(nvme_root_t root);
 
+/**
+ * nvme_mi_set_log_sink() - Redirect MI log messages to a callback
+ * @root:	root object created by nvme_mi_create_root()
+ * @sink:	Callback receiving each message, or NULL to restore the
+ *		default sink
+ * @arg:	Argument passed to @sink
+ *
+ * MI-equivalent of nvme_set_log_sink(), for use without the core libnvme.
+ *
+ * See &nvme_set_log_sink.
+ */
+void nvme_mi_set_log_sink(nvme_root_t root, nvme_log_sink_t sink, void *arg);
+
+/**
+ * nvme_mi_stats_enable() - Enable or disable MI command statistics
+ * @enable:	True to start recording, false to stop
+ *
+ * MI-equivalent of nvme_stats_enable(). libnvme-mi records the commands
+ * sent to its endpoints separately from libnvme, so these statistics
+ * have to be enabled and read through the nvme_mi_stats_ functions.
+ *
+ * See &nvme_stats_enable.
+ */
+void nvme_mi_stats_enable(bool enable);
+
+/**
+ * nvme_mi_stats_reset() - Clear all recorded MI statistics
+ *
+ * See &nvme_stats_reset.
+ */
+void nvme_mi_stats_reset(void);
+
+/**
+ * nvme_mi_stats_snapshot() - Sum up the MI statistics of all threads
+ * @entries:	On success, set to an array with one element per class,
+ *		opcode and endpoint which the caller has to free()
+ *
+ * Return: The number of entries in @entries, or -1 with errno set.
+ *
+ * See &nvme_stats_snapshot.
+ */
+int nvme_mi_stats_snapshot(struct nvme_stats_entry **entries);
+
+/**
+ * nvme_mi_stats_hist_lower() - Lower bound of a histogram bucket
+ * @bucket:	Index into &struct nvme_stats_entry.hist
+ *
+ * Return: The smallest latency in microseconds counted in @bucket.
+ *
+ * See &nvme_stats_hist_lower.
+ */
+__u64 nvme_mi_stats_hist_lower(int bucket);
+
+/**
+ * nvme_mi_stats_percentile() - Estimate a latency percentile
+ * @e:		Statistics entry
+ * @pct:	Percentile between 0 and 100
+ *
+ * Return: The lower bound in microseconds of the histogram bucket which
+ * holds the requested percentile, or 0 if @e has no samples.
+ *
+ * See &nvme_stats_percentile.
+ */
+__u64 nvme_mi_stats_percentile(const struct nvme_stats_entry *e, double pct);
+
+/**
+ * nvme_mi_trace_open() - Start tracing MI commands into a file
+ * @path:	Trace file to create, typically below /dev/shm
+ * @nr_rings:	Maximum number of threads tracing at the same time
+ * @ring_size:	Number of records kept per thread, rounded up to a power
+ *		of two
+ *
+ * MI-equivalent of nvme_trace_open(). libnvme-mi traces the commands sent
+ * to its endpoints independently of libnvme, into its own trace file.
+ *
+ * Return: 0 on success, or -1 with errno set. EBUSY if a trace file is
+ * already open.
+ *
+ * See &nvme_trace_open.
+ */
+int nvme_mi_trace_open(const char *path, unsigned int nr_rings,
+		       unsigned int ring_size);
+
+/**
+ * nvme_mi_trace_close() - Stop tracing MI commands
+ *
+ * See &nvme_trace_close.
+ */
+void nvme_mi_trace_close(void);
+
+/**
+ * nvme_mi_trace_reader_open() - Open a trace file for draining
+ * @path:	Trace file created by nvme_mi_trace_open() or
+ *		nvme_trace_open()
+ *
+ * Return: Reader handle, or NULL with errno set. EPROTO if @path is not
+ * a trace file.
+ *
+ * See &nvme_trace_reader_open.
+ */
+struct nvme_trace_reader *nvme_mi_trace_reader_open(const char *path);
+
+/**
+ * nvme_mi_trace_reader_read() - Drain records from a trace file
+ * @rd:		Reader returned by nvme_mi_trace_reader_open()
+ * @recs:	Array receiving the records
+ * @nr:		Number of elements in @recs
+ *
+ * Return: The number of records stored in @recs, 0 if there are no new
+ * records.
+ *
+ * See &nvme_trace_reader_read.
+ */
+int nvme_mi_trace_reader_read(struct nvme_trace_reader *rd,
+			      struct nvme_trace_record *recs, int nr);
+
+/**
+ * nvme_mi_trace_reader_lost() - Number of records missed by a reader
+ * @rd:		Reader returned by nvme_mi_trace_reader_open()
+ *
+ * Return: The number of records overwritten before @rd read them, plus
+ * those which were not recorded because all rings were in use.
+ *
+ * See &nvme_trace_reader_lost.
+ */
+__u64 nvme_mi_trace_reader_lost(struct nvme_trace_reader *rd);
+
+/**
+ * nvme_mi_trace_reader_close() - Close a trace file reader
+ * @rd:		Reader returned by nvme_mi_trace_reader_open()
+ */
+void nvme_mi_trace_reader_close(struct nvme_trace_reader *rd);
+
 /* Top level management object: NVMe-MI Management Endpoint */
 struct nvme_mi_ep;
 
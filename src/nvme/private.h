@@ -9,9 +9,14 @@
 #ifndef _LIBNVME_PRIVATE_H
 #define _LIBNVME_PRIVATE_H
 
+#include <pthread.h>
+#include <time.h>
+
 #include <ccan/list/list.h>
 
+#include "backend.h"
 #include "fabrics.h"
+#include "log.h"
 #include "mi.h"
 
 #include <uuid.h>
@@ -59,6 +64,16 @@ struct nvme_ns {
 	enum nvme_csi csi;
 };
 
+struct nvme_ana_cache {
+	struct nvme_ana_log *log;
+	struct nvme_ana_group_desc **grps;
+	size_t len;
+	__u64 chgcnt;
+	__u32 nanagrpid;
+	bool groups_only;
+	bool valid;
+};
+
 struct nvme_ctrl {
 	struct list_node entry;
 	struct list_head paths;
@@ -71,7 +86,7 @@ struct nvme_ctrl {
 	char *address;
 	char *firmware;
 	char *model;
-	char *state;
+	enum nvme_ctrl_state state;
 	char *numa_node;
 	char *queue_count;
 	char *serial;
@@ -83,10 +98,20 @@ struct nvme_ctrl {
 	char *dhchap_key;
 	char *cntrltype;
 	char *dctype;
+	__u32 max_xfer_len;
+	__u32 fw_xfer_len;
+	struct nvme_ana_cache ana;
+	struct nvme_cmd_effects_log *effects[NVME_CSI_ZNS + 1];
+	pthread_mutex_t effects_lock;
+	pthread_rwlock_t cmd_lock;
+	bool effects_checked;
+	bool effects_supported;
 	bool discovery_ctrl;
 	bool discovered;
 	bool persistent;
 	struct nvme_fabrics_config cfg;
+	/* Cached JSON configuration, NULL when stale */
+	char *config_json;
 };
 
 struct nvme_subsystem {
@@ -102,6 +127,8 @@ struct nvme_subsystem {
 	char *serial;
 	char *firmware;
 	char *subsystype;
+	/* Cached JSON configuration, NULL when stale */
+	char *config_json;
 };
 
 struct nvme_host {
@@ -117,12 +144,18 @@ struct nvme_host {
 
 struct nvme_root {
 	char *config_file;
+	char *hostnqn;
+	char *hostid;
+	char *host_cache_file;
 	struct list_head hosts;
 	FILE *fp;
 	int log_level;
 	bool log_pid;
 	bool log_timestamp;
 	bool modified;
+	nvme_log_sink_t log_sink;
+	void *log_sink_arg;
+	pthread_rwlock_t lock;
 };
 
 int nvme_set_attr(const char *dir, const char *attr, const char *value);
@@ -131,29 +164,100 @@ int json_read_config(nvme_root_t r, const char *config_file);
 
 int json_update_config(nvme_root_t r, const char *config_file);
 
-int json_dump_tree(nvme_root_t r);
+void nvme_subsystem_invalidate_config(struct nvme_subsystem *s);
+void nvme_ctrl_invalidate_config(struct nvme_ctrl *c);
+
+int json_dump_tree(nvme_root_t r, int fd, FILE *fp);
+
+/*
+ * Name of the controller a kernel uevent of @len bytes is for, or NULL if
+ * the event is not for an NVMe device. Strings which are not terminated
+ * within @len are ignored.
+ */
+const char *nvme_uevent_ctrl(const char *buf, size_t len);
+
+int nvmf_host_identity(nvme_root_t r, const char **hostnqn,
+		       const char **hostid);
+
+/*
+ * Transfer sizes used when splitting commands. The upper bound keeps
+ * buffers small and stays below the max_hw_sectors limit of the kernel.
+ */
+#define NVME_MIN_XFER_LEN	4096
+#define NVME_MAX_XFER_LEN	(1024 * 1024)
+
+__u32 nvme_mdts_to_xfer_len(__u8 mdts);
+
+__u32 nvme_fwug_to_xfer_len(const struct nvme_id_ctrl *id);
+
+#define NVME_PARALLEL_MAX_THREADS	16
+
+/**
+ * nvme_run_parallel() - Run a function over an index range on worker threads
+ * @nr:		Number of work items
+ * @max_threads: Maximum number of threads, including the caller; 0 selects
+ *		%NVME_PARALLEL_MAX_THREADS
+ * @fn:		Function called once for every index in [0, @nr)
+ * @arg:	Argument passed to @fn
+ *
+ * Returns once @fn has completed for every index. If threads cannot be
+ * created the remaining work is done by the calling thread.
+ */
+void nvme_run_parallel(int nr, int max_threads,
+		       void (*fn)(void *arg, int i), void *arg);
 
 nvme_ctrl_t __nvme_lookup_ctrl(nvme_subsystem_t s, const char *transport,
 			       const char *traddr, const char *host_traddr,
 			       const char *host_iface, const char *trsvcid,
 			       nvme_ctrl_t p);
 
+nvme_ctrl_t __nvme_add_ctrl(nvme_subsystem_t s, const char *transport,
+			    const char *traddr, const char *host_traddr,
+			    const char *host_iface, const char *trsvcid);
+
+void __nvme_free_host(struct nvme_host *h);
+struct nvme_subsystem *nvme_alloc_subsystem(struct nvme_host *h,
+					    const char *name,
+					    const char *subsysnqn);
+
 #if (LOG_FUNCNAME == 1)
 #define __nvme_log_func __func__
 #else
 #define __nvme_log_func NULL
 #endif
 
-void __attribute__((format(printf, 4, 5)))
-__nvme_msg(nvme_root_t r, int lvl, const char *func, const char *format, ...);
+void __attribute__((format(printf, 5, 6)))
+__nvme_msg(nvme_root_t r, int lvl, const char *func,
+	   const struct nvme_log_fields *fields, const char *format, ...);
+
+/* Checked before the message arguments are evaluated */
+static inline bool nvme_log_enabled(nvme_root_t r, int lvl)
+{
+	return lvl <= MAX_LOGLEVEL && (!r || lvl <= r->log_level);
+}
 
 #define nvme_msg(r, lvl, format, ...)					\
 	do {								\
-		if ((lvl) <= MAX_LOGLEVEL)				\
-			__nvme_msg(r, lvl, __nvme_log_func,		\
+		if (nvme_log_enabled(r, lvl))				\
+			__nvme_msg(r, lvl, __nvme_log_func, NULL,	\
 				   format, ##__VA_ARGS__);		\
 	} while (0)
 
+/* Tags the message with a controller, and a command if @opcode >= 0 */
+#define nvme_msg_cmd(r, lvl, ctrl, nsid, opcode, status, format, ...)	\
+	do {								\
+		if (nvme_log_enabled(r, lvl)) {				\
+			struct nvme_log_fields __f = {			\
+				(ctrl), (nsid), (opcode), (status)	\
+			};						\
+			__nvme_msg(r, lvl, __nvme_log_func, &__f,	\
+				   format, ##__VA_ARGS__);		\
+		}							\
+	} while (0)
+
+#define nvme_msg_ctrl(r, lvl, ctrl, format, ...)			\
+	nvme_msg_cmd(r, lvl, ctrl, 0, -1, 0, format, ##__VA_ARGS__)
+
 /* mi internal headers */
 
 /* internal transport API */
@@ -198,4 +302,92 @@ struct nvme_mi_ep *nvme_mi_init_ep(struct nvme_root *root);
 /* for tests, we need to calculate the correct MICs */
 __u32 nvme_mi_crc32_update(__u32 crc, void *data, size_t len);
 
+extern nvme_submit_fn_t nvme_submit_backend;
+extern void *nvme_submit_backend_arg;
+
+extern bool nvme_stats_on;
+extern bool nvme_trace_on;
+
+static inline __u64 nvme_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns 0 when neither statistics nor tracing are enabled, so the
+ * clock is not read.
+ */
+static inline __u64 nvme_cmd_start(void)
+{
+	if (!__atomic_load_n(&nvme_stats_on, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&nvme_trace_on, __ATOMIC_RELAXED))
+		return 0;
+	return nvme_now_ns();
+}
+
+void __nvme_stats_record(__u64 start, __u32 cls, __u32 opcode, __u64 id,
+			 int err);
+
+/*
+ * @err is negative if the command failed in the kernel or transport and
+ * positive if it completed with an error status.
+ */
+static inline void nvme_stats_record(__u64 start, __u32 cls, __u32 opcode,
+				     __u64 id, int err)
+{
+	if (start && __atomic_load_n(&nvme_stats_on, __ATOMIC_RELAXED))
+		__nvme_stats_record(start, cls, opcode, id, err);
+}
+
+struct nvme_trace_record;
+
+/* Fills in the completion time and writes @rec to the thread's ring */
+void __nvme_trace_cmd(struct nvme_trace_record *rec);
+
+static inline bool nvme_tracing(__u64 start)
+{
+	return start && __atomic_load_n(&nvme_trace_on, __ATOMIC_RELAXED);
+}
+
+#ifdef CONFIG_USDT
+#include <sys/sdt.h>
+#define nvme_trace_probe(src, id, opcode, nsid, cdw10, cdw11, len, err)	\
+	DTRACE_PROBE8(libnvme, cmd, src, id, opcode, nsid, cdw10, cdw11,	\
+		      len, err)
+#else
+#define nvme_trace_probe(src, id, opcode, nsid, cdw10, cdw11, len, err)	\
+	do { } while (0)
+#endif
+
+/* Traces a struct nvme_passthru_cmd or nvme_passthru_cmd64 */
+#define nvme_trace_passthru(start, src, fd, cmd, err)			\
+	do {								\
+		nvme_trace_probe(src, fd, (cmd)->opcode, (cmd)->nsid,	\
+				 (cmd)->cdw10, (cmd)->cdw11,		\
+				 (cmd)->data_len, err);			\
+		if (nvme_tracing(start)) {				\
+			struct nvme_trace_record __r = {		\
+				.start_ns = start,			\
+				.result = (cmd)->result,		\
+				.id = fd,				\
+				.source = src,				\
+				.opcode = (cmd)->opcode,		\
+				.flags = (cmd)->flags,			\
+				.nsid = (cmd)->nsid,			\
+				.cdw10 = (cmd)->cdw10,			\
+				.cdw11 = (cmd)->cdw11,			\
+				.cdw12 = (cmd)->cdw12,			\
+				.cdw13 = (cmd)->cdw13,			\
+				.cdw14 = (cmd)->cdw14,			\
+				.cdw15 = (cmd)->cdw15,			\
+				.data_len = (cmd)->data_len,		\
+				.status = (err) < 0 ? -errno : (err),	\
+			};						\
+			__nvme_trace_cmd(&__r);				\
+		}							\
+	} while (0)
+
 #endif /* _LIBNVME_PRIVATE_H */
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ *
+ * Simulated controller backend, answering the commands the library issues
+ * during scanning, log fetching and simple I/O from memory.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ccan/endian/endian.h>
+
+#include "backend.h"
+#include "private.h"
+
+struct nvme_sim {
+	struct nvme_sim_config cfg;
+	pthread_mutex_t lock;
+	unsigned int seed;
+	__u8 **ns_data;
+	__u32 features[256];
+};
+
+struct nvme_sim *nvme_sim_create(const struct nvme_sim_config *cfg)
+{
+	struct nvme_sim *sim;
+
+	if (cfg->nr_namespaces > NVME_ID_NS_LIST_MAX ||
+	    (cfg->lba_shift && (cfg->lba_shift < 9 || cfg->lba_shift > 16)) ||
+	    cfg->ns_blocks > (SIZE_MAX >> 16)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	sim->cfg = *cfg;
+	if (!sim->cfg.lba_shift)
+		sim->cfg.lba_shift = 9;
+	if (!sim->cfg.fail_status)
+		sim->cfg.fail_status = NVME_SC_INTERNAL;
+	sim->seed = cfg->seed;
+	sim->ns_data = calloc(cfg->nr_namespaces ? : 1, sizeof(*sim->ns_data));
+	if (!sim->ns_data) {
+		free(sim);
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&sim->lock, NULL);
+	return sim;
+}
+
+void nvme_sim_free(struct nvme_sim *sim)
+{
+	__u32 i;
+
+	for (i = 0; i < sim->cfg.nr_namespaces; i++)
+		free(sim->ns_data[i]);
+	free(sim->ns_data);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+static void nvme_sim_copy_out(struct nvme_passthru_cmd64 *cmd,
+			      const void *data, size_t len)
+{
+	if (!cmd->addr)
+		return;
+	memcpy((void *)(uintptr_t)cmd->addr, data,
+	       len < cmd->data_len ? len : cmd->data_len);
+}
+
+static int nvme_sim_identify(struct nvme_sim *sim,
+			     struct nvme_passthru_cmd64 *cmd)
+{
+	__u8 buf[NVME_IDENTIFY_DATA_SIZE] = { 0 };
+	__u32 i, n = 0;
+
+	switch (cmd->cdw10 & 0xff) {
+	case NVME_IDENTIFY_CNS_CTRL: {
+		struct nvme_id_ctrl *id = (struct nvme_id_ctrl *)buf;
+
+		id->vid = cpu_to_le16(0x1b36);
+		id->ssvid = cpu_to_le16(0x1b36);
+		memset(id->sn, ' ', sizeof(id->sn));
+		memcpy(id->sn, "SIM0001", 7);
+		memset(id->mn, ' ', sizeof(id->mn));
+		memcpy(id->mn, "libnvme simulated controller", 28);
+		memset(id->fr, ' ', sizeof(id->fr));
+		memcpy(id->fr, "1.0", 3);
+		id->mdts = 5;
+		id->ver = cpu_to_le32(0x10400);
+		id->sqes = 0x66;
+		id->cqes = 0x44;
+		id->nn = cpu_to_le32(sim->cfg.nr_namespaces);
+		id->oncs = cpu_to_le16(NVME_CTRL_ONCS_DSM |
+				       NVME_CTRL_ONCS_WRITE_ZEROES);
+		break;
+	}
+	case NVME_IDENTIFY_CNS_NS: {
+		struct nvme_id_ns *ns = (struct nvme_id_ns *)buf;
+
+		if (!cmd->nsid || cmd->nsid > sim->cfg.nr_namespaces)
+			return NVME_SC_INVALID_NS;
+		ns->nsze = cpu_to_le64(sim->cfg.ns_blocks);
+		ns->ncap = cpu_to_le64(sim->cfg.ns_blocks);
+		ns->nuse = cpu_to_le64(sim->cfg.ns_blocks);
+		ns->lbaf[0].ds = sim->cfg.lba_shift;
+		break;
+	}
+	case NVME_IDENTIFY_CNS_NS_ACTIVE_LIST: {
+		struct nvme_ns_list *list = (struct nvme_ns_list *)buf;
+
+		for (i = cmd->nsid + 1; i <= sim->cfg.nr_namespaces; i++)
+			list->ns[n++] = cpu_to_le32(i);
+		break;
+	}
+	default:
+		return NVME_SC_INVALID_FIELD;
+	}
+
+	nvme_sim_copy_out(cmd, buf, sizeof(buf));
+	return 0;
+}
+
+static int nvme_sim_admin(struct nvme_sim *sim,
+			  struct nvme_passthru_cmd64 *cmd)
+{
+	__u8 fid = cmd->cdw10 & 0xff;
+
+	switch (cmd->opcode) {
+	case nvme_admin_identify:
+		return nvme_sim_identify(sim, cmd);
+	case nvme_admin_get_log_page:
+		if (cmd->addr)
+			memset((void *)(uintptr_t)cmd->addr, 0, cmd->data_len);
+		return 0;
+	case nvme_admin_get_features:
+		cmd->result = sim->features[fid];
+		return 0;
+	case nvme_admin_set_features:
+		sim->features[fid] = cmd->cdw11;
+		cmd->result = cmd->cdw11;
+		return 0;
+	default:
+		return NVME_SC_INVALID_OPCODE;
+	}
+}
+
+static int nvme_sim_io(struct nvme_sim *sim, struct nvme_passthru_cmd64 *cmd)
+{
+	__u64 slba = (__u64)cmd->cdw11 << 32 | cmd->cdw10;
+	__u32 nlb = (cmd->cdw12 & 0xffff) + 1;
+	int shift = sim->cfg.lba_shift;
+	size_t off, len;
+	__u8 **data;
+
+	if (!cmd->nsid || cmd->nsid > sim->cfg.nr_namespaces)
+		return NVME_SC_INVALID_NS;
+	data = &sim->ns_data[cmd->nsid - 1];
+
+	switch (cmd->opcode) {
+	case nvme_cmd_flush:
+	case nvme_cmd_dsm:
+		return 0;
+	case nvme_cmd_read:
+	case nvme_cmd_write:
+	case nvme_cmd_write_zeroes:
+		break;
+	default:
+		return NVME_SC_INVALID_OPCODE;
+	}
+
+	if (slba >= sim->cfg.ns_blocks || nlb > sim->cfg.ns_blocks - slba)
+		return NVME_SC_LBA_RANGE;
+	off = slba << shift;
+	len = (size_t)nlb << shift;
+	if (cmd->opcode != nvme_cmd_write_zeroes &&
+	    (!cmd->addr || cmd->data_len < len))
+		return NVME_SC_INVALID_FIELD;
+
+	if (cmd->opcode == nvme_cmd_read) {
+		if (*data)
+			nvme_sim_copy_out(cmd, *data + off, len);
+		else
+			memset((void *)(uintptr_t)cmd->addr, 0, len);
+		return 0;
+	}
+
+	if (!*data) {
+		if (cmd->opcode == nvme_cmd_write_zeroes)
+			return 0;
+		*data = calloc(sim->cfg.ns_blocks, 1 << shift);
+		if (!*data)
+			return NVME_SC_INTERNAL;
+	}
+	if (cmd->opcode == nvme_cmd_write)
+		memcpy(*data + off, (void *)(uintptr_t)cmd->addr, len);
+	else
+		memset(*data + off, 0, len);
+	return 0;
+}
+
+int nvme_sim_submit(void *s, int fd, bool admin,
+		    struct nvme_passthru_cmd64 *cmd)
+{
+	struct nvme_sim *sim = s;
+	bool fail;
+	int ret;
+
+	if (sim->cfg.latency_us) {
+		struct timespec ts = {
+			.tv_sec = sim->cfg.latency_us / 1000000,
+			.tv_nsec = (sim->cfg.latency_us % 1000000) * 1000,
+		};
+
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+
+	cmd->result = 0;
+	pthread_mutex_lock(&sim->lock);
+	fail = sim->cfg.fail_ppm &&
+		rand_r(&sim->seed) % 1000000 < sim->cfg.fail_ppm;
+	if (fail)
+		ret = sim->cfg.fail_status;
+	else if (admin)
+		ret = nvme_sim_admin(sim, cmd);
+	else
+		ret = nvme_sim_io(sim, cmd);
+	pthread_mutex_unlock(&sim->lock);
+
+	return ret;
+}
@@ -0,0 +1,833 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ *
+ * Binary snapshot of the topology tree, so that short lived processes
+ * can reload the tree without rescanning sysfs and identifying every
+ * namespace.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/list/list.h>
+
+#include "filters.h"
+#include "tree.h"
+#include "log.h"
+#include "private.h"
+
+/*
+ * A snapshot is a header followed by the host, subsystem, controller,
+ * namespace and path records and a string table. Records refer to their
+ * parents by index and to strings by offset into the table, so a mapped
+ * file is validated by bounds checks alone. The layout is native endian,
+ * the magic doubles as the byte order check.
+ *
+ * Every object scanned from sysfs records the inode of its sysfs
+ * directory, which changes when the device is removed and re-created
+ * even if the instance number is reused. Together with the number of
+ * controller, subsystem and namespace entries in sysfs this detects a
+ * topology that changed since the snapshot was taken.
+ *
+ * DH-HMAC-CHAP secrets are not stored, they stay in the configuration
+ * file.
+ */
+#define NVME_SNAPSHOT_MAGIC	0x50414e53454d564eULL	/* "NVMESNAP" */
+#define NVME_SNAPSHOT_VERSION	3
+#define NVME_SNAPSHOT_NONE	UINT32_MAX
+
+struct nvme_snapshot_hdr {
+	__u64 magic;
+	__u32 version;
+	__u32 hdr_size;
+	__u64 size;
+	__u32 nr_hosts;
+	__u32 nr_subsys;
+	__u32 nr_ctrls;
+	__u32 nr_ns;
+	__u32 nr_paths;
+	__u32 nr_sysfs_ctrls;
+	__u32 nr_sysfs_subsys;
+	__u32 nr_sysfs_ns;
+	__u32 strings_len;
+	__u32 rsvd;
+};
+
+static const size_t host_strs[] = {
+	offsetof(struct nvme_host, hostnqn),
+	offsetof(struct nvme_host, hostid),
+	offsetof(struct nvme_host, hostsymname),
+};
+
+struct nvme_snapshot_host {
+	__u32 str[ARRAY_SIZE(host_strs)];
+};
+
+static const size_t subsys_strs[] = {
+	offsetof(struct nvme_subsystem, name),
+	offsetof(struct nvme_subsystem, sysfs_dir),
+	offsetof(struct nvme_subsystem, subsysnqn),
+	offsetof(struct nvme_subsystem, model),
+	offsetof(struct nvme_subsystem, serial),
+	offsetof(struct nvme_subsystem, firmware),
+	offsetof(struct nvme_subsystem, subsystype),
+};
+
+struct nvme_snapshot_subsys {
+	__u64 sysfs_ino;
+	__u32 host;
+	__u32 str[ARRAY_SIZE(subsys_strs)];
+};
+
+static const size_t ctrl_strs[] = {
+	offsetof(struct nvme_ctrl, name),
+	offsetof(struct nvme_ctrl, sysfs_dir),
+	offsetof(struct nvme_ctrl, address),
+	offsetof(struct nvme_ctrl, firmware),
+	offsetof(struct nvme_ctrl, model),
+	offsetof(struct nvme_ctrl, numa_node),
+	offsetof(struct nvme_ctrl, queue_count),
+	offsetof(struct nvme_ctrl, serial),
+	offsetof(struct nvme_ctrl, sqsize),
+	offsetof(struct nvme_ctrl, transport),
+	offsetof(struct nvme_ctrl, subsysnqn),
+	offsetof(struct nvme_ctrl, traddr),
+	offsetof(struct nvme_ctrl, trsvcid),
+	offsetof(struct nvme_ctrl, cntrltype),
+	offsetof(struct nvme_ctrl, dctype),
+	offsetof(struct nvme_ctrl, cfg.host_traddr),
+	offsetof(struct nvme_ctrl, cfg.host_iface),
+};
+
+static const size_t ctrl_ints[] = {
+	offsetof(struct nvme_ctrl, state),
+	offsetof(struct nvme_ctrl, cfg.queue_size),
+	offsetof(struct nvme_ctrl, cfg.nr_io_queues),
+	offsetof(struct nvme_ctrl, cfg.reconnect_delay),
+	offsetof(struct nvme_ctrl, cfg.ctrl_loss_tmo),
+	offsetof(struct nvme_ctrl, cfg.fast_io_fail_tmo),
+	offsetof(struct nvme_ctrl, cfg.keep_alive_tmo),
+	offsetof(struct nvme_ctrl, cfg.nr_write_queues),
+	offsetof(struct nvme_ctrl, cfg.nr_poll_queues),
+	offsetof(struct nvme_ctrl, cfg.tos),
+};
+
+/* One bit each in nvme_snapshot_ctrl.flags */
+static const size_t ctrl_bools[] = {
+	offsetof(struct nvme_ctrl, discovery_ctrl),
+	offsetof(struct nvme_ctrl, discovered),
+	offsetof(struct nvme_ctrl, persistent),
+	offsetof(struct nvme_ctrl, cfg.duplicate_connect),
+	offsetof(struct nvme_ctrl, cfg.disable_sqflow),
+	offsetof(struct nvme_ctrl, cfg.hdr_digest),
+	offsetof(struct nvme_ctrl, cfg.data_digest),
+	offsetof(struct nvme_ctrl, cfg.tls),
+};
+
+struct nvme_snapshot_ctrl {
+	__u64 sysfs_ino;
+	__u32 subsys;
+	__u32 flags;
+	__u32 str[ARRAY_SIZE(ctrl_strs)];
+	__s32 val[ARRAY_SIZE(ctrl_ints)];
+};
+
+static const size_t ns_strs[] = {
+	offsetof(struct nvme_ns, name),
+	offsetof(struct nvme_ns, generic_name),
+	offsetof(struct nvme_ns, sysfs_dir),
+};
+
+struct nvme_snapshot_ns {
+	__u64 sysfs_ino;
+	__u64 lba_count;
+	__u64 lba_util;
+	/* The owning controller for private namespaces, else NONE */
+	__u32 ctrl;
+	__u32 subsys;
+	__u32 nsid;
+	__u32 csi;
+	__s32 lba_shift;
+	__s32 lba_size;
+	__s32 meta_size;
+	__u32 str[ARRAY_SIZE(ns_strs)];
+	__u8 eui64[8];
+	__u8 nguid[16];
+	__u8 uuid[16];
+};
+
+static const size_t path_strs[] = {
+	offsetof(struct nvme_path, name),
+	offsetof(struct nvme_path, sysfs_dir),
+	offsetof(struct nvme_path, ana_state),
+};
+
+struct nvme_snapshot_path {
+	__u64 sysfs_ino;
+	__u32 ctrl;
+	__u32 ns;
+	__s32 grpid;
+	__u32 str[ARRAY_SIZE(path_strs)];
+};
+
+struct nvme_snapshot {
+	struct nvme_snapshot_hdr *hdr;
+	struct nvme_snapshot_host *hosts;
+	struct nvme_snapshot_subsys *subsys;
+	struct nvme_snapshot_ctrl *ctrls;
+	struct nvme_snapshot_ns *ns;
+	struct nvme_snapshot_path *paths;
+	char *strings;
+	size_t strings_alloc;
+};
+
+/* Position of sysfs_dir in the string tables above */
+#define SNAPSHOT_SUBSYS_SYSFS_DIR	1
+#define SNAPSHOT_CTRL_SYSFS_DIR		1
+#define SNAPSHOT_NS_SYSFS_DIR		2
+#define SNAPSHOT_PATH_SYSFS_DIR		1
+
+#define SNAPSHOT_STR(obj, off)	(*(char **)((char *)(obj) + (off)))
+#define SNAPSHOT_INT(obj, off)	(*(int *)((char *)(obj) + (off)))
+#define SNAPSHOT_BOOL(obj, off)	(*(bool *)((char *)(obj) + (off)))
+
+/* Record offsets relative to the header, in file order */
+static __u64 nvme_snapshot_layout(const struct nvme_snapshot_hdr *hdr,
+				  __u64 off[5])
+{
+	__u64 size = sizeof(*hdr);
+
+	off[0] = size;
+	size += (__u64)hdr->nr_hosts * sizeof(struct nvme_snapshot_host);
+	off[1] = size;
+	size += (__u64)hdr->nr_subsys * sizeof(struct nvme_snapshot_subsys);
+	off[2] = size;
+	size += (__u64)hdr->nr_ctrls * sizeof(struct nvme_snapshot_ctrl);
+	off[3] = size;
+	size += (__u64)hdr->nr_ns * sizeof(struct nvme_snapshot_ns);
+	off[4] = size;
+	size += (__u64)hdr->nr_paths * sizeof(struct nvme_snapshot_path);
+	return size;
+}
+
+static void nvme_snapshot_map(struct nvme_snapshot *snap, void *base)
+{
+	__u64 off[5], size;
+
+	snap->hdr = base;
+	size = nvme_snapshot_layout(snap->hdr, off);
+	snap->hosts = base + off[0];
+	snap->subsys = base + off[1];
+	snap->ctrls = base + off[2];
+	snap->ns = base + off[3];
+	snap->paths = base + off[4];
+	snap->strings = base + size;
+}
+
+static int nvme_snapshot_count(const char *dir,
+			       int (*filter)(const struct dirent *))
+{
+	struct dirent **ents;
+	int i, n;
+
+	n = scandir(dir, &ents, filter, NULL);
+	if (n < 0)
+		return 0;
+	for (i = 0; i < n; i++)
+		free(ents[i]);
+	free(ents);
+	return n;
+}
+
+static __u64 nvme_snapshot_ino(const char *sysfs_dir)
+{
+	struct stat st;
+
+	if (!sysfs_dir || stat(sysfs_dir, &st))
+		return 0;
+	return st.st_ino;
+}
+
+static __u32 nvme_snapshot_add_str(struct nvme_snapshot *snap,
+				   struct nvme_snapshot_hdr *hdr,
+				   const char *s)
+{
+	size_t len, off = hdr->strings_len;
+	char *strings;
+
+	if (!s)
+		return NVME_SNAPSHOT_NONE;
+	len = strlen(s) + 1;
+	if (off + len > snap->strings_alloc) {
+		size_t alloc = snap->strings_alloc ? snap->strings_alloc : 4096;
+
+		while (off + len > alloc)
+			alloc *= 2;
+		strings = realloc(snap->strings, alloc);
+		if (!strings)
+			return NVME_SNAPSHOT_NONE;
+		snap->strings = strings;
+		snap->strings_alloc = alloc;
+	}
+	memcpy(snap->strings + off, s, len);
+	hdr->strings_len += len;
+	return off;
+}
+
+static int nvme_snapshot_add_strs(struct nvme_snapshot *snap, void *obj,
+				  const size_t *strs, __u32 *str, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		const char *s = SNAPSHOT_STR(obj, strs[i]);
+
+		str[i] = nvme_snapshot_add_str(snap, snap->hdr, s);
+		if (s && str[i] == NVME_SNAPSHOT_NONE)
+			return -1;
+	}
+	return 0;
+}
+
+#define SNAPSHOT_ADD_STRS(snap, rec, obj, strs)				\
+	nvme_snapshot_add_strs(snap, obj, strs, (rec)->str, ARRAY_SIZE(strs))
+
+static int nvme_snapshot_write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int nvme_snapshot_write_file(const char *path, const void *a,
+				    size_t a_len, const void *b, size_t b_len)
+{
+	char *tmp_file;
+	int fd, err = 0;
+
+	if (asprintf(&tmp_file, "%s.XXXXXX", path) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	fd = mkostemp(tmp_file, O_CLOEXEC);
+	if (fd < 0) {
+		free(tmp_file);
+		return -1;
+	}
+	/* Readable by everyone, the snapshot holds no secrets */
+	if (fchmod(fd, 0644) || nvme_snapshot_write_all(fd, a, a_len) ||
+	    nvme_snapshot_write_all(fd, b, b_len))
+		err = errno;
+	if (close(fd) && !err)
+		err = errno;
+	/* Readers only ever see a complete snapshot */
+	if (!err && rename(tmp_file, path))
+		err = errno;
+	if (err)
+		unlink(tmp_file);
+	free(tmp_file);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int nvme_snapshot_save(nvme_root_t r, const char *path)
+{
+	struct nvme_snapshot_hdr hdr = {
+		.magic = NVME_SNAPSHOT_MAGIC,
+		.version = NVME_SNAPSHOT_VERSION,
+		.hdr_size = sizeof(hdr),
+	};
+	struct nvme_snapshot snap = { };
+	__u32 hi = 0, si = 0, ci = 0, ni = 0, pi = 0;
+	nvme_ns_t *ns_ptrs = NULL;
+	__u64 off[5], size;
+	nvme_subsystem_t s;
+	void *buf = NULL;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	nvme_path_t p;
+	nvme_ns_t n;
+	int i, ret = -1;
+
+	if (!r || !path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nvme_for_each_host(r, h) {
+		hdr.nr_hosts++;
+		nvme_for_each_subsystem(h, s) {
+			hdr.nr_subsys++;
+			nvme_subsystem_for_each_ns(s, n)
+				hdr.nr_ns++;
+			nvme_subsystem_for_each_ctrl(s, c) {
+				hdr.nr_ctrls++;
+				nvme_ctrl_for_each_ns(c, n)
+					hdr.nr_ns++;
+				nvme_ctrl_for_each_path(c, p)
+					hdr.nr_paths++;
+			}
+		}
+	}
+	hdr.nr_sysfs_ctrls = nvme_snapshot_count(nvme_ctrl_sysfs_dir,
+						 nvme_ctrls_filter);
+	hdr.nr_sysfs_subsys = nvme_snapshot_count(nvme_subsys_sysfs_dir,
+						  nvme_subsys_filter);
+	hdr.nr_sysfs_ns = nvme_snapshot_count(nvme_ns_sysfs_dir,
+					      nvme_namespace_filter);
+
+	size = nvme_snapshot_layout(&hdr, off);
+	buf = calloc(1, size);
+	ns_ptrs = calloc(hdr.nr_ns + 1, sizeof(*ns_ptrs));
+	if (!buf || !ns_ptrs) {
+		errno = ENOMEM;
+		goto out;
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	nvme_snapshot_map(&snap, buf);
+	snap.strings = NULL;
+
+	nvme_for_each_host(r, h) {
+		if (SNAPSHOT_ADD_STRS(&snap, &snap.hosts[hi], h, host_strs))
+			goto out_nomem;
+
+		nvme_for_each_subsystem(h, s) {
+			struct nvme_snapshot_subsys *srec = &snap.subsys[si];
+			__u32 ns_first = ni;
+
+			srec->host = hi;
+			srec->sysfs_ino = nvme_snapshot_ino(s->sysfs_dir);
+			if (SNAPSHOT_ADD_STRS(&snap, srec, s, subsys_strs))
+				goto out_nomem;
+
+			nvme_subsystem_for_each_ns(s, n) {
+				snap.ns[ni].ctrl = NVME_SNAPSHOT_NONE;
+				snap.ns[ni].subsys = si;
+				ns_ptrs[ni++] = n;
+			}
+
+			nvme_subsystem_for_each_ctrl(s, c) {
+				struct nvme_snapshot_ctrl *crec = &snap.ctrls[ci];
+
+				crec->subsys = si;
+				crec->sysfs_ino = nvme_snapshot_ino(c->sysfs_dir);
+				if (SNAPSHOT_ADD_STRS(&snap, crec, c, ctrl_strs))
+					goto out_nomem;
+				for (i = 0; i < ARRAY_SIZE(ctrl_ints); i++)
+					crec->val[i] = SNAPSHOT_INT(c, ctrl_ints[i]);
+				for (i = 0; i < ARRAY_SIZE(ctrl_bools); i++)
+					if (SNAPSHOT_BOOL(c, ctrl_bools[i]))
+						crec->flags |= 1 << i;
+
+				nvme_ctrl_for_each_ns(c, n) {
+					snap.ns[ni].ctrl = ci;
+					snap.ns[ni].subsys = si;
+					ns_ptrs[ni++] = n;
+				}
+
+				nvme_ctrl_for_each_path(c, p) {
+					struct nvme_snapshot_path *prec =
+						&snap.paths[pi++];
+					__u32 j;
+
+					prec->ctrl = ci;
+					prec->ns = NVME_SNAPSHOT_NONE;
+					for (j = ns_first; j < ni; j++) {
+						if (ns_ptrs[j] == p->n) {
+							prec->ns = j;
+							break;
+						}
+					}
+					prec->grpid = p->grpid;
+					prec->sysfs_ino =
+						nvme_snapshot_ino(p->sysfs_dir);
+					if (SNAPSHOT_ADD_STRS(&snap, prec, p,
+							      path_strs))
+						goto out_nomem;
+				}
+				ci++;
+			}
+			si++;
+		}
+		hi++;
+	}
+
+	for (i = 0; i < hdr.nr_ns; i++) {
+		struct nvme_snapshot_ns *nrec = &snap.ns[i];
+
+		n = ns_ptrs[i];
+		nrec->nsid = n->nsid;
+		nrec->csi = n->csi;
+		nrec->lba_shift = n->lba_shift;
+		nrec->lba_size = n->lba_size;
+		nrec->meta_size = n->meta_size;
+		nrec->lba_count = n->lba_count;
+		nrec->lba_util = n->lba_util;
+		memcpy(nrec->eui64, n->eui64, sizeof(nrec->eui64));
+		memcpy(nrec->nguid, n->nguid, sizeof(nrec->nguid));
+		memcpy(nrec->uuid, n->uuid, sizeof(nrec->uuid));
+		nrec->sysfs_ino = nvme_snapshot_ino(n->sysfs_dir);
+		if (SNAPSHOT_ADD_STRS(&snap, nrec, n, ns_strs))
+			goto out_nomem;
+	}
+
+	snap.hdr->size = size + snap.hdr->strings_len;
+	ret = nvme_snapshot_write_file(path, buf, size, snap.strings,
+				       snap.hdr->strings_len);
+	if (ret)
+		nvme_msg(r, LOG_ERR, "Failed to write snapshot %s, %s\n",
+			 path, strerror(errno));
+	goto out;
+
+out_nomem:
+	errno = ENOMEM;
+out:
+	free(snap.strings);
+	free(ns_ptrs);
+	free(buf);
+	return ret;
+}
+
+static bool nvme_snapshot_str_valid(const struct nvme_snapshot *snap,
+				    const __u32 *str, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		if (str[i] != NVME_SNAPSHOT_NONE &&
+		    str[i] >= snap->hdr->strings_len)
+			return false;
+	return true;
+}
+
+static bool nvme_snapshot_valid(const struct nvme_snapshot *snap)
+{
+	const struct nvme_snapshot_hdr *hdr = snap->hdr;
+	__u32 i;
+
+	/* The table ends in a NUL, so every string in it is terminated */
+	if (hdr->strings_len && snap->strings[hdr->strings_len - 1])
+		return false;
+
+	for (i = 0; i < hdr->nr_hosts; i++)
+		if (!nvme_snapshot_str_valid(snap, snap->hosts[i].str,
+					     ARRAY_SIZE(host_strs)) ||
+		    snap->hosts[i].str[0] == NVME_SNAPSHOT_NONE)
+			return false;
+	/* Parents always precede their children */
+	for (i = 0; i < hdr->nr_subsys; i++)
+		if (!nvme_snapshot_str_valid(snap, snap->subsys[i].str,
+					     ARRAY_SIZE(subsys_strs)) ||
+		    snap->subsys[i].host >= hdr->nr_hosts)
+			return false;
+	for (i = 0; i < hdr->nr_ctrls; i++)
+		if (!nvme_snapshot_str_valid(snap, snap->ctrls[i].str,
+					     ARRAY_SIZE(ctrl_strs)) ||
+		    snap->ctrls[i].subsys >= hdr->nr_subsys)
+			return false;
+	for (i = 0; i < hdr->nr_ns; i++) {
+		const struct nvme_snapshot_ns *nrec = &snap->ns[i];
+
+		if (!nvme_snapshot_str_valid(snap, nrec->str,
+					     ARRAY_SIZE(ns_strs)) ||
+		    nrec->subsys >= hdr->nr_subsys ||
+		    (nrec->ctrl != NVME_SNAPSHOT_NONE &&
+		     (nrec->ctrl >= hdr->nr_ctrls ||
+		      snap->ctrls[nrec->ctrl].subsys != nrec->subsys)))
+			return false;
+	}
+	for (i = 0; i < hdr->nr_paths; i++) {
+		const struct nvme_snapshot_path *prec = &snap->paths[i];
+
+		if (!nvme_snapshot_str_valid(snap, prec->str,
+					     ARRAY_SIZE(path_strs)) ||
+		    prec->ctrl >= hdr->nr_ctrls ||
+		    (prec->ns != NVME_SNAPSHOT_NONE &&
+		     prec->ns >= hdr->nr_ns))
+			return false;
+	}
+	return true;
+}
+
+static bool nvme_snapshot_ino_changed(const struct nvme_snapshot *snap,
+				      __u32 sysfs_dir, __u64 ino)
+{
+	if (sysfs_dir == NVME_SNAPSHOT_NONE)
+		return false;
+	return nvme_snapshot_ino(snap->strings + sysfs_dir) != ino;
+}
+
+static bool nvme_snapshot_current(const struct nvme_snapshot *snap)
+{
+	const struct nvme_snapshot_hdr *hdr = snap->hdr;
+	__u32 i;
+
+	if (nvme_snapshot_count(nvme_ctrl_sysfs_dir, nvme_ctrls_filter) !=
+	    hdr->nr_sysfs_ctrls ||
+	    nvme_snapshot_count(nvme_subsys_sysfs_dir, nvme_subsys_filter) !=
+	    hdr->nr_sysfs_subsys ||
+	    nvme_snapshot_count(nvme_ns_sysfs_dir, nvme_namespace_filter) !=
+	    hdr->nr_sysfs_ns)
+		return false;
+
+	for (i = 0; i < hdr->nr_subsys; i++)
+		if (nvme_snapshot_ino_changed(snap,
+				snap->subsys[i].str[SNAPSHOT_SUBSYS_SYSFS_DIR],
+				snap->subsys[i].sysfs_ino))
+			return false;
+	for (i = 0; i < hdr->nr_ctrls; i++)
+		if (nvme_snapshot_ino_changed(snap,
+				snap->ctrls[i].str[SNAPSHOT_CTRL_SYSFS_DIR],
+				snap->ctrls[i].sysfs_ino))
+			return false;
+	for (i = 0; i < hdr->nr_ns; i++)
+		if (nvme_snapshot_ino_changed(snap,
+				snap->ns[i].str[SNAPSHOT_NS_SYSFS_DIR],
+				snap->ns[i].sysfs_ino))
+			return false;
+	for (i = 0; i < hdr->nr_paths; i++)
+		if (nvme_snapshot_ino_changed(snap,
+				snap->paths[i].str[SNAPSHOT_PATH_SYSFS_DIR],
+				snap->paths[i].sysfs_ino))
+			return false;
+	return true;
+}
+
+static int nvme_snapshot_strdup(const struct nvme_snapshot *snap, void *obj,
+				const size_t *strs, const __u32 *str,
+				size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		char *s;
+
+		if (str[i] == NVME_SNAPSHOT_NONE)
+			continue;
+		s = strdup(snap->strings + str[i]);
+		if (!s)
+			return -1;
+		SNAPSHOT_STR(obj, strs[i]) = s;
+	}
+	return 0;
+}
+
+#define SNAPSHOT_STRDUP(snap, obj, rec, strs)				\
+	nvme_snapshot_strdup(snap, obj, strs, (rec)->str, ARRAY_SIZE(strs))
+
+static int nvme_snapshot_build(nvme_root_t r, const struct nvme_snapshot *snap)
+{
+	const struct nvme_snapshot_hdr *hdr = snap->hdr;
+	struct nvme_subsystem **subsys;
+	struct nvme_host **hosts;
+	struct nvme_ctrl **ctrls;
+	struct nvme_ns **ns;
+	int ret = -1;
+	__u32 i, j;
+
+	hosts = calloc(hdr->nr_hosts + 1, sizeof(*hosts));
+	subsys = calloc(hdr->nr_subsys + 1, sizeof(*subsys));
+	ctrls = calloc(hdr->nr_ctrls + 1, sizeof(*ctrls));
+	ns = calloc(hdr->nr_ns + 1, sizeof(*ns));
+	if (!hosts || !subsys || !ctrls || !ns)
+		goto out;
+
+	/* Objects are linked as soon as allocated so that errors free them */
+	for (i = 0; i < hdr->nr_hosts; i++) {
+		struct nvme_host *h = calloc(1, sizeof(*h));
+
+		if (!h)
+			goto out;
+		list_head_init(&h->subsystems);
+		h->r = r;
+		list_add_tail(&r->hosts, &h->entry);
+		hosts[i] = h;
+		if (SNAPSHOT_STRDUP(snap, h, &snap->hosts[i], host_strs))
+			goto out;
+	}
+	for (i = 0; i < hdr->nr_subsys; i++) {
+		const struct nvme_snapshot_subsys *srec = &snap->subsys[i];
+		struct nvme_subsystem *s = calloc(1, sizeof(*s));
+
+		if (!s)
+			goto out;
+		list_head_init(&s->ctrls);
+		list_head_init(&s->namespaces);
+		s->h = hosts[srec->host];
+		list_add_tail(&s->h->subsystems, &s->entry);
+		subsys[i] = s;
+		if (SNAPSHOT_STRDUP(snap, s, srec, subsys_strs))
+			goto out;
+	}
+	for (i = 0; i < hdr->nr_ctrls; i++) {
+		const struct nvme_snapshot_ctrl *crec = &snap->ctrls[i];
+		struct nvme_ctrl *c = calloc(1, sizeof(*c));
+
+		if (!c)
+			goto out;
+		c->fd = -1;
+		pthread_mutex_init(&c->effects_lock, NULL);
+		pthread_rwlock_init(&c->cmd_lock, NULL);
+		list_head_init(&c->namespaces);
+		list_head_init(&c->paths);
+		c->s = subsys[crec->subsys];
+		list_add_tail(&c->s->ctrls, &c->entry);
+		ctrls[i] = c;
+		if (SNAPSHOT_STRDUP(snap, c, crec, ctrl_strs))
+			goto out;
+		for (j = 0; j < ARRAY_SIZE(ctrl_ints); j++)
+			SNAPSHOT_INT(c, ctrl_ints[j]) = crec->val[j];
+		for (j = 0; j < ARRAY_SIZE(ctrl_bools); j++)
+			SNAPSHOT_BOOL(c, ctrl_bools[j]) = crec->flags & (1 << j);
+	}
+	for (i = 0; i < hdr->nr_ns; i++) {
+		const struct nvme_snapshot_ns *nrec = &snap->ns[i];
+		struct nvme_ns *n = calloc(1, sizeof(*n));
+
+		if (!n)
+			goto out;
+		/* Opened on first use */
+		n->fd = -1;
+		list_head_init(&n->paths);
+		n->s = subsys[nrec->subsys];
+		if (nrec->ctrl != NVME_SNAPSHOT_NONE) {
+			n->c = ctrls[nrec->ctrl];
+			list_add_tail(&n->c->namespaces, &n->entry);
+		} else {
+			list_add_tail(&n->s->namespaces, &n->entry);
+		}
+		ns[i] = n;
+		n->nsid = nrec->nsid;
+		n->csi = nrec->csi;
+		n->lba_shift = nrec->lba_shift;
+		n->lba_size = nrec->lba_size;
+		n->meta_size = nrec->meta_size;
+		n->lba_count = nrec->lba_count;
+		n->lba_util = nrec->lba_util;
+		memcpy(n->eui64, nrec->eui64, sizeof(n->eui64));
+		memcpy(n->nguid, nrec->nguid, sizeof(n->nguid));
+		memcpy(n->uuid, nrec->uuid, sizeof(n->uuid));
+		if (SNAPSHOT_STRDUP(snap, n, nrec, ns_strs))
+			goto out;
+	}
+	for (i = 0; i < hdr->nr_paths; i++) {
+		const struct nvme_snapshot_path *prec = &snap->paths[i];
+		struct nvme_path *p = calloc(1, sizeof(*p));
+
+		if (!p)
+			goto out;
+		list_node_init(&p->nentry);
+		p->c = ctrls[prec->ctrl];
+		list_add_tail(&p->c->paths, &p->entry);
+		if (prec->ns != NVME_SNAPSHOT_NONE) {
+			p->n = ns[prec->ns];
+			list_add_tail(&p->n->paths, &p->nentry);
+		}
+		p->grpid = prec->grpid;
+		if (SNAPSHOT_STRDUP(snap, p, prec, path_strs))
+			goto out;
+	}
+	ret = 0;
+out:
+	free(ns);
+	free(ctrls);
+	free(subsys);
+	free(hosts);
+	if (ret)
+		errno = ENOMEM;
+	return ret;
+}
+
+int nvme_snapshot_load(nvme_root_t r, const char *path)
+{
+	struct nvme_snapshot_hdr *hdr;
+	struct nvme_snapshot snap;
+	struct nvme_host *h, *_h;
+	__u64 off[5];
+	struct stat st;
+	void *map;
+	int fd, ret = -1;
+	bool modified;
+
+	if (!r || !path) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (nvme_first_host(r)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (hdr->magic != NVME_SNAPSHOT_MAGIC ||
+	    hdr->version != NVME_SNAPSHOT_VERSION ||
+	    hdr->hdr_size != sizeof(*hdr) || hdr->size != st.st_size ||
+	    nvme_snapshot_layout(hdr, off) + hdr->strings_len != st.st_size) {
+		nvme_msg(r, LOG_DEBUG, "Invalid snapshot header in %s\n", path);
+		errno = EPROTO;
+		goto out;
+	}
+	nvme_snapshot_map(&snap, map);
+	if (!nvme_snapshot_valid(&snap)) {
+		nvme_msg(r, LOG_DEBUG, "Invalid snapshot %s\n", path);
+		errno = EPROTO;
+		goto out;
+	}
+	if (!nvme_snapshot_current(&snap)) {
+		nvme_msg(r, LOG_DEBUG, "Snapshot %s is stale\n", path);
+		errno = ESTALE;
+		goto out;
+	}
+
+	modified = r->modified;
+	ret = nvme_snapshot_build(r, &snap);
+	if (ret) {
+		nvme_for_each_host_safe(r, h, _h)
+			__nvme_free_host(h);
+		errno = ENOMEM;
+	}
+	r->modified = modified;
+out:
+	munmap(map, st.st_size);
+	return ret;
+}
@@ -0,0 +1,307 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ *
+ * Per-thread command statistics. Each thread owns a block of counters
+ * which only it writes to, readers sum up all blocks. Blocks of exited
+ * threads are kept and handed to the next new thread, so their counts
+ * are not lost and memory is bounded by the number of concurrent threads.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ccan/list/list.h>
+
+#include "private.h"
+#include "stats.h"
+
+#define NVME_STATS_SLOTS	512
+
+struct nvme_stats_thread {
+	struct list_node entry;
+	bool owned;
+	unsigned int gen;
+	struct nvme_stats_entry *slots[NVME_STATS_SLOTS];
+};
+
+bool nvme_stats_on;
+
+static unsigned int nvme_stats_gen;
+static pthread_mutex_t nvme_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(nvme_stats_threads);
+static pthread_key_t nvme_stats_key;
+static pthread_once_t nvme_stats_once = PTHREAD_ONCE_INIT;
+static __thread struct nvme_stats_thread *nvme_stats_self;
+
+/* Number of counters following, and including, nvme_stats_entry.count */
+#define NVME_STATS_NR_COUNTERS						\
+	((sizeof(struct nvme_stats_entry) -				\
+	  offsetof(struct nvme_stats_entry, count)) / sizeof(__u64))
+
+static inline __u64 *nvme_stats_counters(struct nvme_stats_entry *e)
+{
+	return &e->count;
+}
+
+static void nvme_stats_release(void *arg)
+{
+	struct nvme_stats_thread *t = arg;
+
+	pthread_mutex_lock(&nvme_stats_lock);
+	t->owned = false;
+	pthread_mutex_unlock(&nvme_stats_lock);
+}
+
+static void nvme_stats_init_key(void)
+{
+	pthread_key_create(&nvme_stats_key, nvme_stats_release);
+}
+
+static struct nvme_stats_thread *nvme_stats_thread(void)
+{
+	struct nvme_stats_thread *t;
+
+	if (nvme_stats_self)
+		return nvme_stats_self;
+
+	pthread_once(&nvme_stats_once, nvme_stats_init_key);
+
+	pthread_mutex_lock(&nvme_stats_lock);
+	list_for_each(&nvme_stats_threads, t, entry) {
+		if (!t->owned)
+			goto found;
+	}
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		pthread_mutex_unlock(&nvme_stats_lock);
+		return NULL;
+	}
+	t->gen = __atomic_load_n(&nvme_stats_gen, __ATOMIC_RELAXED);
+	list_add_tail(&nvme_stats_threads, &t->entry);
+found:
+	t->owned = true;
+	pthread_mutex_unlock(&nvme_stats_lock);
+
+	pthread_setspecific(nvme_stats_key, t);
+	nvme_stats_self = t;
+	return t;
+}
+
+static void nvme_stats_clear(struct nvme_stats_entry *e)
+{
+	__u64 *v = nvme_stats_counters(e);
+	int i;
+
+	for (i = 0; i < NVME_STATS_NR_COUNTERS; i++)
+		__atomic_store_n(&v[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->min_us, UINT64_MAX, __ATOMIC_RELAXED);
+}
+
+static int nvme_stats_bucket(__u64 us)
+{
+	int msb, b;
+
+	if (us < 4)
+		return us;
+	msb = 63 - __builtin_clzll(us);
+	b = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+	return b < NVME_STATS_HIST_BUCKETS ? b : NVME_STATS_HIST_BUCKETS - 1;
+}
+
+__u64 nvme_stats_hist_lower(int bucket)
+{
+	if (bucket < 4)
+		return bucket < 0 ? 0 : bucket;
+	if (bucket >= NVME_STATS_HIST_BUCKETS)
+		bucket = NVME_STATS_HIST_BUCKETS - 1;
+	return (__u64)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static struct nvme_stats_entry *
+nvme_stats_lookup(struct nvme_stats_thread *t, __u32 cls, __u32 opcode,
+		  __u64 id)
+{
+	__u64 key = ((__u64)cls << 8 | opcode) ^ (id * 0x9e3779b97f4a7c15ULL);
+	unsigned int i, n;
+
+	i = (key ^ key >> 32) % NVME_STATS_SLOTS;
+	for (n = 0; n < NVME_STATS_SLOTS; n++) {
+		struct nvme_stats_entry *e = t->slots[i];
+
+		if (!e) {
+			e = calloc(1, sizeof(*e));
+			if (!e)
+				return NULL;
+			e->cls = cls;
+			e->opcode = opcode;
+			e->id = id;
+			e->min_us = UINT64_MAX;
+			/* Publish a fully initialized entry to readers */
+			__atomic_store_n(&t->slots[i], e, __ATOMIC_RELEASE);
+			return e;
+		}
+		if (e->cls == cls && e->opcode == opcode && e->id == id)
+			return e;
+		i = (i + 1) % NVME_STATS_SLOTS;
+	}
+	return NULL;
+}
+
+/* Only the owning thread writes, so plain increments need no lock prefix */
+#define stats_add(p, v)							\
+	__atomic_store_n(p, *(p) + (v), __ATOMIC_RELAXED)
+
+void __nvme_stats_record(__u64 start, __u32 cls, __u32 opcode, __u64 id,
+			 int err)
+{
+	unsigned int gen = __atomic_load_n(&nvme_stats_gen, __ATOMIC_ACQUIRE);
+	struct nvme_stats_thread *t = nvme_stats_thread();
+	struct nvme_stats_entry *e;
+	__u64 us;
+	int i;
+
+	if (!t)
+		return;
+
+	if (t->gen != gen) {
+		for (i = 0; i < NVME_STATS_SLOTS; i++)
+			if (t->slots[i])
+				nvme_stats_clear(t->slots[i]);
+		__atomic_store_n(&t->gen, gen, __ATOMIC_RELEASE);
+	}
+
+	e = nvme_stats_lookup(t, cls, opcode, id);
+	if (!e)
+		return;
+
+	us = (nvme_now_ns() - start) / 1000;
+	stats_add(&e->count, 1);
+	if (err < 0)
+		stats_add(&e->errors, 1);
+	else if (err > 0)
+		stats_add(&e->failed, 1);
+	stats_add(&e->total_us, us);
+	if (us < e->min_us)
+		__atomic_store_n(&e->min_us, us, __ATOMIC_RELAXED);
+	if (us > e->max_us)
+		__atomic_store_n(&e->max_us, us, __ATOMIC_RELAXED);
+	stats_add(&e->hist[nvme_stats_bucket(us)], 1);
+}
+
+void nvme_stats_enable(bool enable)
+{
+	__atomic_store_n(&nvme_stats_on, enable, __ATOMIC_RELAXED);
+}
+
+void nvme_stats_reset(void)
+{
+	__atomic_add_fetch(&nvme_stats_gen, 1, __ATOMIC_RELEASE);
+}
+
+static int nvme_stats_cmp(const void *a, const void *b)
+{
+	const struct nvme_stats_entry *x = a, *y = b;
+
+	if (x->cls != y->cls)
+		return x->cls < y->cls ? -1 : 1;
+	if (x->opcode != y->opcode)
+		return x->opcode < y->opcode ? -1 : 1;
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return 0;
+}
+
+static void nvme_stats_merge(struct nvme_stats_entry *dst,
+			     struct nvme_stats_entry *src)
+{
+	__u64 *d = nvme_stats_counters(dst), *s = nvme_stats_counters(src);
+	__u64 min = dst->min_us, max = dst->max_us;
+	int i;
+
+	for (i = 0; i < NVME_STATS_NR_COUNTERS; i++)
+		d[i] += s[i];
+	dst->min_us = min < src->min_us ? min : src->min_us;
+	dst->max_us = max > src->max_us ? max : src->max_us;
+}
+
+int nvme_stats_snapshot(struct nvme_stats_entry **entries)
+{
+	unsigned int gen = __atomic_load_n(&nvme_stats_gen, __ATOMIC_ACQUIRE);
+	struct nvme_stats_entry *out = NULL, *tmp;
+	struct nvme_stats_thread *t;
+	int nr = 0, alloc = 0, i, j, k;
+
+	pthread_mutex_lock(&nvme_stats_lock);
+	list_for_each(&nvme_stats_threads, t, entry) {
+		if (__atomic_load_n(&t->gen, __ATOMIC_ACQUIRE) != gen)
+			continue;
+		for (i = 0; i < NVME_STATS_SLOTS; i++) {
+			struct nvme_stats_entry *e;
+			__u64 *v, *c;
+
+			e = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+			if (!e)
+				continue;
+			if (nr == alloc) {
+				alloc = alloc ? alloc * 2 : 16;
+				tmp = realloc(out, alloc * sizeof(*out));
+				if (!tmp) {
+					pthread_mutex_unlock(&nvme_stats_lock);
+					free(out);
+					errno = ENOMEM;
+					return -1;
+				}
+				out = tmp;
+			}
+			out[nr].cls = e->cls;
+			out[nr].opcode = e->opcode;
+			out[nr].id = e->id;
+			v = nvme_stats_counters(e);
+			c = nvme_stats_counters(&out[nr]);
+			for (k = 0; k < NVME_STATS_NR_COUNTERS; k++)
+				c[k] = __atomic_load_n(&v[k], __ATOMIC_RELAXED);
+			if (out[nr].count)
+				nr++;
+		}
+	}
+	pthread_mutex_unlock(&nvme_stats_lock);
+
+	if (nr)
+		qsort(out, nr, sizeof(*out), nvme_stats_cmp);
+	for (i = 0, j = 0; i < nr; i++) {
+		if (j && !nvme_stats_cmp(&out[j - 1], &out[i]))
+			nvme_stats_merge(&out[j - 1], &out[i]);
+		else if (j++ != i)
+			out[j - 1] = out[i];
+	}
+
+	*entries = out;
+	return j;
+}
+
+__u64 nvme_stats_percentile(const struct nvme_stats_entry *e, double pct)
+{
+	__u64 want, seen = 0;
+	int i;
+
+	if (!e->count)
+		return 0;
+	if (pct < 0)
+		pct = 0;
+	if (pct > 100)
+		pct = 100;
+	want = (__u64)(pct / 100 * e->count + 0.5);
+	if (!want)
+		want = 1;
+	for (i = 0; i < NVME_STATS_HIST_BUCKETS; i++) {
+		seen += e->hist[i];
+		if (seen >= want)
+			return nvme_stats_hist_lower(i);
+	}
+	return nvme_stats_hist_lower(NVME_STATS_HIST_BUCKETS - 1);
+}
@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_STATS_H
+#define _LIBNVME_STATS_H
+
+#include <stdbool.h>
+
+#include "types.h"
+
+/**
+ * DOC: stats.h
+ *
+ * Command statistics
+ *
+ * When enabled with nvme_stats_enable(), every passthrough command
+ * submitted through the ioctl interface is counted per command class,
+ * opcode and device. Each thread records into its own counters without
+ * taking a lock; nvme_stats_snapshot() sums them up.
+ *
+ * Commands sent to NVMe-MI endpoints are counted by libnvme-mi, which
+ * keeps its own statistics behind nvme_mi_stats_enable() and
+ * nvme_mi_stats_snapshot().
+ */
+
+/**
+ * NVME_STATS_HIST_BUCKETS - Number of latency histogram buckets
+ *
+ * Latencies are recorded in microseconds. Values below 4 have a bucket
+ * each, every following power of two is split into 4 buckets of equal
+ * width. The last bucket also holds all larger values.
+ */
+#define NVME_STATS_HIST_BUCKETS	128
+
+/**
+ * enum nvme_stats_class - Command class of a statistics entry
+ * @NVME_STATS_ADMIN:	Admin command submitted through the ioctl interface
+ * @NVME_STATS_IO:	I/O command submitted through the ioctl interface
+ * @NVME_STATS_MI:	NVMe-MI command
+ * @NVME_STATS_MI_ADMIN: Admin command tunnelled over NVMe-MI
+ * @NVME_STATS_MI_OTHER: Any other NVMe-MI message type, the opcode is
+ *			 not meaningful
+ */
+enum nvme_stats_class {
+	NVME_STATS_ADMIN,
+	NVME_STATS_IO,
+	NVME_STATS_MI,
+	NVME_STATS_MI_ADMIN,
+	NVME_STATS_MI_OTHER,
+};
+
+/**
+ * struct nvme_stats_entry - Aggregated statistics of one command
+ * @cls:	Command class, see &enum nvme_stats_class
+ * @opcode:	Command opcode
+ * @id:		File descriptor for ioctl commands, endpoint handle
+ *		(&nvme_mi_ep_t cast to an integer) for NVMe-MI commands
+ * @count:	Number of commands submitted
+ * @errors:	Number of commands which could not be submitted or failed
+ *		in the transport
+ * @failed:	Number of commands completed with a non-zero status
+ * @total_us:	Sum of all latencies in microseconds
+ * @min_us:	Smallest latency in microseconds
+ * @max_us:	Largest latency in microseconds
+ * @hist:	Latency histogram, see nvme_stats_hist_lower()
+ */
+struct nvme_stats_entry {
+	__u32 cls;
+	__u32 opcode;
+	__u64 id;
+	__u64 count;
+	__u64 errors;
+	__u64 failed;
+	__u64 total_us;
+	__u64 min_us;
+	__u64 max_us;
+	__u64 hist[NVME_STATS_HIST_BUCKETS];
+};
+
+/**
+ * nvme_stats_enable() - Enable or disable command statistics
+ * @enable:	True to start recording, false to stop
+ *
+ * Statistics are disabled by default. Disabling them keeps the recorded
+ * values, use nvme_stats_reset() to clear them.
+ */
+void nvme_stats_enable(bool enable);
+
+/**
+ * nvme_stats_reset() - Clear all recorded statistics
+ *
+ * The counters of each thread are cleared by that thread before it
+ * records its next command. Until then they are left out of snapshots.
+ */
+void nvme_stats_reset(void);
+
+/**
+ * nvme_stats_snapshot() - Sum up the statistics of all threads
+ * @entries:	On success, set to an array with one element per class,
+ *		opcode and device which the caller has to free()
+ *
+ * The counters are read while other threads may update them, so the
+ * snapshot is not an atomic view across entries.
+ *
+ * Return: The number of entries in @entries, or -1 with errno set.
+ */
+int nvme_stats_snapshot(struct nvme_stats_entry **entries);
+
+/**
+ * nvme_stats_hist_lower() - Lower bound of a histogram bucket
+ * @bucket:	Index into &struct nvme_stats_entry.hist
+ *
+ * Return: The smallest latency in microseconds counted in @bucket.
+ */
+__u64 nvme_stats_hist_lower(int bucket);
+
+/**
+ * nvme_stats_percentile() - Estimate a latency percentile
+ * @e:		Statistics entry
+ * @pct:	Percentile between 0 and 100
+ *
+ * Return: The lower bound in microseconds of the histogram bucket which
+ * holds the requested percentile, or 0 if @e has no samples.
+ */
+__u64 nvme_stats_percentile(const struct nvme_stats_entry *e, double pct);
+
+#endif /* _LIBNVME_STATS_H */
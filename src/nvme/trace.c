@@ -0,0 +1,387 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ *
+ * Flight recorder for submitted commands. The trace file holds a header,
+ * one ring header per thread slot and the record rings. Each ring has a
+ * single writer, readers in other processes detect torn or overwritten
+ * records by checking the sequence number before and after copying.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <ccan/build_assert/build_assert.h>
+
+#include "private.h"
+#include "trace.h"
+
+#define NVME_TRACE_MAGIC	"NVMETRC"
+#define NVME_TRACE_VERSION	1
+#define NVME_TRACE_MIN_RING	16
+#define NVME_TRACE_MAX_RING	(1U << 24)
+#define NVME_TRACE_MAX_RINGS	4096
+
+struct nvme_trace_file_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 record_size;
+	__u32 nr_rings;
+	__u32 ring_size;
+	__u64 dropped;
+	__u8 rsvd[32];
+};
+
+struct nvme_trace_ring {
+	__u64 head;
+	__u32 tid;
+	__u32 owned;
+	__u8 rsvd[48];
+};
+
+struct nvme_trace_map {
+	void *addr;
+	size_t len;
+	struct nvme_trace_file_hdr *hdr;
+	struct nvme_trace_ring *rings;
+	struct nvme_trace_record *recs;
+};
+
+struct nvme_trace_reader {
+	struct nvme_trace_map map;
+	__u64 *tail;
+	__u64 lost;
+	unsigned int next;
+};
+
+struct nvme_trace_thread {
+	struct nvme_trace_ring *ring;
+	struct nvme_trace_record *recs;
+	unsigned int gen;
+	unsigned int misses;
+	__u32 tid;
+};
+
+bool nvme_trace_on;
+
+static struct nvme_trace_map nvme_trace;
+static unsigned int nvme_trace_gen;
+static pthread_mutex_t nvme_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t nvme_trace_key;
+static pthread_once_t nvme_trace_once = PTHREAD_ONCE_INIT;
+static __thread struct nvme_trace_thread nvme_trace_self;
+
+static size_t nvme_trace_file_size(__u32 nr_rings, __u32 ring_size)
+{
+	return sizeof(struct nvme_trace_file_hdr) +
+		(size_t)nr_rings * sizeof(struct nvme_trace_ring) +
+		(size_t)nr_rings * ring_size * sizeof(struct nvme_trace_record);
+}
+
+static void nvme_trace_map_init(struct nvme_trace_map *m, void *addr,
+				size_t len)
+{
+	m->addr = addr;
+	m->len = len;
+	m->hdr = addr;
+	m->rings = (struct nvme_trace_ring *)(m->hdr + 1);
+	m->recs = (struct nvme_trace_record *)(m->rings + m->hdr->nr_rings);
+}
+
+/* Called with nvme_trace_lock held */
+static void nvme_trace_release(struct nvme_trace_thread *self)
+{
+	if (self->ring && self->gen == nvme_trace_gen)
+		__atomic_store_n(&self->ring->owned, 0, __ATOMIC_RELEASE);
+	self->ring = NULL;
+}
+
+static void nvme_trace_thread_exit(void *arg)
+{
+	pthread_mutex_lock(&nvme_trace_lock);
+	nvme_trace_release(arg);
+	pthread_mutex_unlock(&nvme_trace_lock);
+}
+
+static void nvme_trace_init_key(void)
+{
+	pthread_key_create(&nvme_trace_key, nvme_trace_thread_exit);
+}
+
+static struct nvme_trace_thread *nvme_trace_thread(void)
+{
+	struct nvme_trace_thread *self = &nvme_trace_self;
+	unsigned int gen = __atomic_load_n(&nvme_trace_gen, __ATOMIC_ACQUIRE);
+	struct nvme_trace_map *m = &nvme_trace;
+	__u32 i;
+
+	if (self->ring && self->gen == gen)
+		return self;
+	/* Retry only now and then when all rings are taken */
+	if (self->gen == gen && self->misses++ % 256)
+		goto miss;
+
+	pthread_once(&nvme_trace_once, nvme_trace_init_key);
+	if (!self->tid)
+		self->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&nvme_trace_lock);
+	if (!m->addr) {
+		pthread_mutex_unlock(&nvme_trace_lock);
+		return NULL;
+	}
+	if (self->gen != nvme_trace_gen)
+		self->ring = NULL;
+	self->gen = nvme_trace_gen;
+	for (i = 0; i < m->hdr->nr_rings; i++) {
+		struct nvme_trace_ring *ring = &m->rings[i];
+
+		if (ring->owned)
+			continue;
+		ring->tid = self->tid;
+		__atomic_store_n(&ring->owned, 1, __ATOMIC_RELEASE);
+		self->ring = ring;
+		self->recs = m->recs + (size_t)i * m->hdr->ring_size;
+		self->misses = 0;
+		break;
+	}
+	pthread_mutex_unlock(&nvme_trace_lock);
+
+	if (self->ring) {
+		pthread_setspecific(nvme_trace_key, self);
+		return self;
+	}
+	self->misses = 1;
+miss:
+	__atomic_add_fetch(&m->hdr->dropped, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+void __nvme_trace_cmd(struct nvme_trace_record *rec)
+{
+	struct nvme_trace_thread *self;
+	struct nvme_trace_record *r;
+	__u64 head;
+
+	rec->end_ns = nvme_now_ns();
+
+	self = nvme_trace_thread();
+	if (!self)
+		return;
+
+	head = self->ring->head;
+	rec->seq = head + 1;
+	rec->tid = self->tid;
+
+	r = &self->recs[head & (nvme_trace.hdr->ring_size - 1)];
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((__u8 *)r + sizeof(r->seq), (__u8 *)rec + sizeof(rec->seq),
+	       sizeof(*r) - sizeof(r->seq));
+	__atomic_store_n(&r->seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&self->ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int nvme_trace_open(const char *path, unsigned int nr_rings,
+		    unsigned int ring_size)
+{
+	struct nvme_trace_file_hdr *hdr;
+	unsigned int size = NVME_TRACE_MIN_RING;
+	void *addr;
+	size_t len;
+	int fd;
+
+	BUILD_ASSERT(sizeof(struct nvme_trace_file_hdr) == 64);
+	BUILD_ASSERT(sizeof(struct nvme_trace_ring) == 64);
+	BUILD_ASSERT(sizeof(struct nvme_trace_record) == 96);
+
+	if (!nr_rings || nr_rings > NVME_TRACE_MAX_RINGS ||
+	    ring_size > NVME_TRACE_MAX_RING) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (size < ring_size)
+		size <<= 1;
+	len = nvme_trace_file_size(nr_rings, size);
+
+	pthread_mutex_lock(&nvme_trace_lock);
+	if (nvme_trace.addr) {
+		pthread_mutex_unlock(&nvme_trace_lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto err_unlock;
+	if (ftruncate(fd, len) < 0)
+		goto err_close;
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto err_close;
+	close(fd);
+
+	hdr = addr;
+	hdr->version = NVME_TRACE_VERSION;
+	hdr->record_size = sizeof(struct nvme_trace_record);
+	hdr->nr_rings = nr_rings;
+	hdr->ring_size = size;
+	/* Readers check the magic last */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, NVME_TRACE_MAGIC, sizeof(hdr->magic));
+
+	nvme_trace_map_init(&nvme_trace, addr, len);
+	__atomic_add_fetch(&nvme_trace_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&nvme_trace_lock);
+
+	__atomic_store_n(&nvme_trace_on, true, __ATOMIC_RELAXED);
+	return 0;
+
+err_close:
+	close(fd);
+	unlink(path);
+err_unlock:
+	pthread_mutex_unlock(&nvme_trace_lock);
+	return -1;
+}
+
+void nvme_trace_close(void)
+{
+	__atomic_store_n(&nvme_trace_on, false, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&nvme_trace_lock);
+	if (nvme_trace.addr) {
+		munmap(nvme_trace.addr, nvme_trace.len);
+		memset(&nvme_trace, 0, sizeof(nvme_trace));
+	}
+	__atomic_add_fetch(&nvme_trace_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&nvme_trace_lock);
+}
+
+struct nvme_trace_reader *nvme_trace_reader_open(const char *path)
+{
+	struct nvme_trace_file_hdr *hdr;
+	struct nvme_trace_reader *rd;
+	struct stat st;
+	void *addr;
+	__u32 i;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	hdr = addr;
+	if (memcmp(hdr->magic, NVME_TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != NVME_TRACE_VERSION ||
+	    hdr->record_size != sizeof(struct nvme_trace_record) ||
+	    !hdr->nr_rings || hdr->nr_rings > NVME_TRACE_MAX_RINGS ||
+	    hdr->ring_size < NVME_TRACE_MIN_RING ||
+	    hdr->ring_size > NVME_TRACE_MAX_RING ||
+	    (hdr->ring_size & (hdr->ring_size - 1)) ||
+	    st.st_size < nvme_trace_file_size(hdr->nr_rings,
+					      hdr->ring_size)) {
+		munmap(addr, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	rd = calloc(1, sizeof(*rd));
+	if (!rd)
+		goto err_unmap;
+	rd->tail = calloc(hdr->nr_rings, sizeof(*rd->tail));
+	if (!rd->tail)
+		goto err_free;
+	nvme_trace_map_init(&rd->map, addr, st.st_size);
+
+	for (i = 0; i < hdr->nr_rings; i++) {
+		__u64 head = __atomic_load_n(&rd->map.rings[i].head,
+					     __ATOMIC_ACQUIRE);
+
+		rd->tail[i] = head > hdr->ring_size ? head - hdr->ring_size : 0;
+	}
+	return rd;
+
+err_free:
+	free(rd);
+err_unmap:
+	munmap(addr, st.st_size);
+	errno = ENOMEM;
+	return NULL;
+}
+
+int nvme_trace_reader_read(struct nvme_trace_reader *rd,
+			   struct nvme_trace_record *recs, int nr)
+{
+	struct nvme_trace_map *m = &rd->map;
+	__u32 size = m->hdr->ring_size;
+	unsigned int scanned;
+	int n = 0;
+
+	for (scanned = 0; scanned < m->hdr->nr_rings && n < nr; scanned++) {
+		unsigned int i = rd->next;
+		struct nvme_trace_record *ring = m->recs + (size_t)i * size;
+		__u64 head = __atomic_load_n(&m->rings[i].head,
+					     __ATOMIC_ACQUIRE);
+
+		if (head - rd->tail[i] > size) {
+			rd->lost += head - size - rd->tail[i];
+			rd->tail[i] = head - size;
+		}
+		while (rd->tail[i] < head && n < nr) {
+			struct nvme_trace_record *r = &ring[rd->tail[i] % size];
+			__u64 seq = rd->tail[i] + 1;
+
+			rd->tail[i]++;
+			if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq) {
+				rd->lost++;
+				continue;
+			}
+			memcpy(&recs[n], r, sizeof(*r));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq) {
+				rd->lost++;
+				continue;
+			}
+			recs[n++].seq = seq;
+		}
+		if (rd->tail[i] == head)
+			rd->next = (i + 1) % m->hdr->nr_rings;
+	}
+	return n;
+}
+
+__u64 nvme_trace_reader_lost(struct nvme_trace_reader *rd)
+{
+	return rd->lost +
+		__atomic_load_n(&rd->map.hdr->dropped, __ATOMIC_RELAXED);
+}
+
+void nvme_trace_reader_close(struct nvme_trace_reader *rd)
+{
+	munmap(rd->map.addr, rd->map.len);
+	free(rd->tail);
+	free(rd);
+}
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_TRACE_H
+#define _LIBNVME_TRACE_H
+
+#include "types.h"
+
+/**
+ * DOC: trace.h
+ *
+ * Command tracing
+ *
+ * nvme_trace_open() creates a trace file which is mapped into memory.
+ * From then on every command submitted through the ioctl interface or
+ * the fabrics connect interface is written to it as a
+ * &struct nvme_trace_record. Each thread writes to its own ring of
+ * records without taking a lock, overwriting the oldest records when the
+ * ring is full.
+ *
+ * Commands sent to NVMe-MI endpoints are traced by libnvme-mi into the
+ * file opened with nvme_mi_trace_open().
+ *
+ * Another process can drain the file while it is written with
+ * nvme_trace_reader_open() and nvme_trace_reader_read().
+ *
+ * When libnvme is built with the usdt option, each command also fires
+ * the libnvme:cmd static probe, whether or not a trace file is open.
+ */
+
+/**
+ * enum nvme_trace_source - Interface a traced command was submitted to
+ * @NVME_TRACE_ADMIN:	Admin command submitted through the ioctl interface
+ * @NVME_TRACE_IO:	I/O command submitted through the ioctl interface
+ * @NVME_TRACE_MI:	NVMe-MI command, @cdw10 and @cdw11 hold the request
+ *			doublewords 0 and 1
+ * @NVME_TRACE_MI_ADMIN: Admin command tunnelled over NVMe-MI
+ * @NVME_TRACE_MI_OTHER: Any other NVMe-MI message type
+ * @NVME_TRACE_CONNECT:	Fabrics connect request, @data_len is the length
+ *			of the option string, @result the controller
+ *			instance and @status the negated
+ *			&enum nvme_connect_err on failure
+ */
+enum nvme_trace_source {
+	NVME_TRACE_ADMIN,
+	NVME_TRACE_IO,
+	NVME_TRACE_MI,
+	NVME_TRACE_MI_ADMIN,
+	NVME_TRACE_MI_OTHER,
+	NVME_TRACE_CONNECT,
+};
+
+/**
+ * struct nvme_trace_record - A traced command
+ * @seq:	Sequence number of the record within its ring, starting at 1
+ * @start_ns:	CLOCK_MONOTONIC time the command was submitted, in ns
+ * @end_ns:	CLOCK_MONOTONIC time the command completed, in ns
+ * @result:	Command specific result
+ * @id:		File descriptor for ioctl commands, endpoint handle for
+ *		NVMe-MI commands
+ * @tid:	Thread ID of the submitter
+ * @source:	Interface the command was submitted to, see
+ *		&enum nvme_trace_source
+ * @opcode:	Command opcode
+ * @flags:	Command flags
+ * @nsid:	Namespace ID
+ * @cdw10:	Command dword 10
+ * @cdw11:	Command dword 11
+ * @cdw12:	Command dword 12
+ * @cdw13:	Command dword 13
+ * @cdw14:	Command dword 14
+ * @cdw15:	Command dword 15
+ * @data_len:	Length of the data buffer
+ * @status:	NVMe status if positive, negative errno if the command could
+ *		not be submitted or failed in the transport, 0 on success
+ * @rsvd:	Reserved
+ */
+struct nvme_trace_record {
+	__u64 seq;
+	__u64 start_ns;
+	__u64 end_ns;
+	__u64 result;
+	__u64 id;
+	__u32 tid;
+	__u8 source;
+	__u8 opcode;
+	__u16 flags;
+	__u32 nsid;
+	__u32 cdw10;
+	__u32 cdw11;
+	__u32 cdw12;
+	__u32 cdw13;
+	__u32 cdw14;
+	__u32 cdw15;
+	__u32 data_len;
+	__s32 status;
+	__u32 rsvd[3];
+};
+
+/**
+ * nvme_trace_open() - Start tracing commands into a file
+ * @path:	Trace file to create, typically below /dev/shm
+ * @nr_rings:	Maximum number of threads tracing at the same time
+ * @ring_size:	Number of records kept per thread, rounded up to a power
+ *		of two
+ *
+ * The file is created or truncated. Threads beyond @nr_rings are not
+ * traced until a tracing thread exits.
+ *
+ * Return: 0 on success, or -1 with errno set. EBUSY if a trace file is
+ * already open.
+ */
+int nvme_trace_open(const char *path, unsigned int nr_rings,
+		    unsigned int ring_size);
+
+/**
+ * nvme_trace_close() - Stop tracing commands
+ *
+ * The trace file is left in place for readers. Must not be called while
+ * other threads submit commands.
+ */
+void nvme_trace_close(void);
+
+/**
+ * struct nvme_trace_reader - Opaque trace file reader
+ */
+struct nvme_trace_reader;
+
+/**
+ * nvme_trace_reader_open() - Open a trace file for draining
+ * @path:	Trace file created by nvme_trace_open()
+ *
+ * Reading starts at the oldest record still held in each ring.
+ *
+ * Return: Reader handle, or NULL with errno set. EPROTO if @path is not
+ * a trace file.
+ */
+struct nvme_trace_reader *nvme_trace_reader_open(const char *path);
+
+/**
+ * nvme_trace_reader_read() - Drain records from a trace file
+ * @rd:		Reader returned by nvme_trace_reader_open()
+ * @recs:	Array receiving the records
+ * @nr:		Number of elements in @recs
+ *
+ * Records are returned ring by ring, in submission order within each
+ * ring. Records which were overwritten before they could be read are
+ * counted in nvme_trace_reader_lost().
+ *
+ * Return: The number of records stored in @recs, 0 if there are no new
+ * records.
+ */
+int nvme_trace_reader_read(struct nvme_trace_reader *rd,
+			   struct nvme_trace_record *recs, int nr);
+
+/**
+ * nvme_trace_reader_lost() - Number of records missed by a reader
+ * @rd:		Reader returned by nvme_trace_reader_open()
+ *
+ * Return: The number of records overwritten before @rd read them, plus
+ * those which were not recorded because all rings were in use.
+ */
+__u64 nvme_trace_reader_lost(struct nvme_trace_reader *rd);
+
+/**
+ * nvme_trace_reader_close() - Close a trace file reader
+ * @rd:		Reader returned by nvme_trace_reader_open()
+ */
+void nvme_trace_reader_close(struct nvme_trace_reader *rd);
+
+#endif /* _LIBNVME_TRACE_H */
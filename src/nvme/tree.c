@@ -12,17 +12,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <linux/netlink.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
 #include <ccan/endian/endian.h>
 #include <ccan/list/list.h>
+#include <ccan/array_size/array_size.h>
 
 #include "ioctl.h"
 #include "linux.h"
@@ -34,9 +40,6 @@
 #include "log.h"
 #include "private.h"
 
-static struct nvme_host *default_host;
-
-static void __nvme_free_host(nvme_host_t h);
 static void __nvme_free_ctrl(nvme_ctrl_t c);
 static int nvme_subsystem_scan_namespace(nvme_root_t r,
 		struct nvme_subsystem *s, char *name,
@@ -58,21 +61,16 @@ static inline void nvme_free_dirents(struct dirent **d, int i)
 nvme_host_t nvme_default_host(nvme_root_t r)
 {
 	struct nvme_host *h;
-	char *hostnqn, *hostid;
+	const char *hostnqn, *hostid;
 
-	hostnqn = nvmf_hostnqn_from_file();
-	if (!hostnqn)
-		hostnqn = nvmf_hostnqn_generate();
-	hostid = nvmf_hostid_from_file();
+	if (nvmf_host_identity(r, &hostnqn, &hostid) < 0)
+		return NULL;
 
 	h = nvme_lookup_host(r, hostnqn, hostid);
+	if (!h)
+		return NULL;
 
 	nvme_host_set_hostsymname(h, NULL);
-
-	default_host = h;
-	free(hostnqn);
-	if (hostid)
-		free(hostid);
 	return h;
 }
 
@@ -131,6 +129,7 @@ int nvme_scan_topology(struct nvme_root *r, nvme_scan_filter_t f, void *f_args)
 nvme_root_t nvme_create_root(FILE *fp, int log_level)
 {
 	struct nvme_root *r = calloc(1, sizeof(*r));
+	pthread_rwlockattr_t attr;
 
 	if (!r) {
 		errno = ENOMEM;
@@ -141,9 +140,36 @@ nvme_root_t nvme_create_root(FILE *fp, int log_level)
 	if (fp)
 		r->fp = fp;
 	list_head_init(&r->hosts);
+
+	/* Keep a steady stream of readers from starving refreshes */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&r->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
 	return r;
 }
 
+void nvme_root_read_lock(nvme_root_t r)
+{
+	pthread_rwlock_rdlock(&r->lock);
+}
+
+void nvme_root_read_unlock(nvme_root_t r)
+{
+	pthread_rwlock_unlock(&r->lock);
+}
+
+void nvme_root_write_lock(nvme_root_t r)
+{
+	pthread_rwlock_wrlock(&r->lock);
+}
+
+void nvme_root_write_unlock(nvme_root_t r)
+{
+	pthread_rwlock_unlock(&r->lock);
+}
+
 int nvme_read_config(nvme_root_t r, const char *config_file)
 {
 	int err = -1;
@@ -180,10 +206,15 @@ nvme_root_t nvme_scan(const char *config_file)
 
 int nvme_update_config(nvme_root_t r)
 {
+	int ret;
+
 	if (!r->modified || !r->config_file)
 		return 0;
 
-	return json_update_config(r, r->config_file);
+	ret = json_update_config(r, r->config_file);
+	if (!ret)
+		r->modified = false;
+	return ret;
 }
 
 int nvme_dump_config(nvme_root_t r)
@@ -193,7 +224,17 @@ int nvme_dump_config(nvme_root_t r)
 
 int nvme_dump_tree(nvme_root_t r)
 {
-	return json_dump_tree(r);
+	return json_dump_tree(r, STDOUT_FILENO, NULL);
+}
+
+int nvme_dump_tree_fd(nvme_root_t r, int fd)
+{
+	return json_dump_tree(r, fd, NULL);
+}
+
+int nvme_dump_tree_file(nvme_root_t r, FILE *fp)
+{
+	return json_dump_tree(r, -1, fp);
 }
 
 nvme_host_t nvme_first_host(nvme_root_t r)
@@ -228,12 +269,15 @@ const char *nvme_host_get_hostsymname(nvme_host_t h)
 
 void nvme_host_set_hostsymname(nvme_host_t h, const char *hostsymname)
 {
+	if (!h->hostsymname && !hostsymname)
+		return;
 	if (h->hostsymname) {
 		free(h->hostsymname);
 		h->hostsymname = NULL;
 	}
 	if (hostsymname)
 		h->hostsymname = strdup(hostsymname);
+	h->r->modified = true;
 }
 
 const char *nvme_host_get_dhchap_key(nvme_host_t h)
@@ -249,6 +293,7 @@ void nvme_host_set_dhchap_key(nvme_host_t h, const char *key)
 	}
 	if (key)
 		h->dhchap_key = strdup(key);
+	h->r->modified = true;
 }
 
 nvme_subsystem_t nvme_first_subsystem(nvme_host_t h)
@@ -261,13 +306,61 @@ nvme_subsystem_t nvme_next_subsystem(nvme_host_t h, nvme_subsystem_t s)
 	return s ? list_next(&h->subsystems, s, entry) : NULL;
 }
 
+static char *nvme_strdup_opt(const char *s)
+{
+	return s ? strdup(s) : NULL;
+}
+
 void nvme_refresh_topology(nvme_root_t r)
 {
 	struct nvme_host *h, *_h;
+	struct nvme_root *n;
+	LIST_HEAD(old);
 
-	nvme_for_each_host_safe(r, h, _h)
+	n = nvme_create_root(r->fp, r->log_level);
+	if (!n) {
+		nvme_root_write_lock(r);
+		nvme_for_each_host_safe(r, h, _h)
+			__nvme_free_host(h);
+		nvme_scan_topology(r, NULL, NULL);
+		nvme_root_write_unlock(r);
+		return;
+	}
+
+	nvme_root_read_lock(r);
+	n->log_pid = r->log_pid;
+	n->log_timestamp = r->log_timestamp;
+	n->log_sink = r->log_sink;
+	n->log_sink_arg = r->log_sink_arg;
+	n->hostnqn = nvme_strdup_opt(r->hostnqn);
+	n->hostid = nvme_strdup_opt(r->hostid);
+	n->host_cache_file = nvme_strdup_opt(r->host_cache_file);
+	nvme_root_read_unlock(r);
+
+	/* Readers keep traversing the old tree while the new one is built */
+	nvme_scan_topology(n, NULL, NULL);
+
+	nvme_root_write_lock(r);
+	list_append_list(&old, &r->hosts);
+	list_append_list(&r->hosts, &n->hosts);
+	nvme_for_each_host(r, h)
+		h->r = r;
+	/* The old hosts are freed through the new root, outside the lock */
+	list_for_each(&old, h, entry) {
+		h->r = n;
+		r->modified = true;
+	}
+	if (!r->hostnqn) {
+		r->hostnqn = n->hostnqn;
+		r->hostid = n->hostid;
+		n->hostnqn = n->hostid = NULL;
+	}
+	nvme_root_write_unlock(r);
+
+	/* No reader can reach the old tree once the write lock was taken */
+	list_for_each_safe(&old, h, _h, entry)
 		__nvme_free_host(h);
-	nvme_scan_topology(r, NULL, NULL);
+	nvme_free_tree(n);
 }
 
 void nvme_free_tree(nvme_root_t r)
@@ -278,6 +371,10 @@ void nvme_free_tree(nvme_root_t r)
 		__nvme_free_host(h);
 	if (r->config_file)
 		free(r->config_file);
+	free(r->hostnqn);
+	free(r->hostid);
+	free(r->host_cache_file);
+	pthread_rwlock_destroy(&r->lock);
 	free(r);
 }
 
@@ -339,7 +436,8 @@ nvme_path_t nvme_namespace_next_path(nvme_ns_t ns, nvme_path_t p)
 static void __nvme_free_ns(struct nvme_ns *n)
 {
 	list_del_init(&n->entry);
-	close(n->fd);
+	if (n->fd >= 0)
+		close(n->fd);
 	free(n->generic_name);
 	free(n->name);
 	free(n->sysfs_dir);
@@ -375,6 +473,7 @@ static void __nvme_free_subsystem(struct nvme_subsystem *s)
 		free(s->firmware);
 	if (s->subsystype)
 		free(s->subsystype);
+	free(s->config_json);
 	free(s);
 }
 
@@ -425,7 +524,7 @@ struct nvme_subsystem *nvme_lookup_subsystem(struct nvme_host *h,
 	return nvme_alloc_subsystem(h, name, subsysnqn);
 }
 
-static void __nvme_free_host(struct nvme_host *h)
+void __nvme_free_host(struct nvme_host *h)
 {
 	struct nvme_subsystem *s, *_s;
 
@@ -623,6 +722,11 @@ const char *nvme_path_get_ana_state(nvme_path_t p)
 	return p->ana_state;
 }
 
+int nvme_path_get_ana_grpid(nvme_path_t p)
+{
+	return p->grpid;
+}
+
 void nvme_free_path(struct nvme_path *p)
 {
 	list_del_init(&p->entry);
@@ -658,8 +762,8 @@ static int nvme_ctrl_scan_path(nvme_root_t r, struct nvme_ctrl *c, char *name)
 	char *path, *grpid;
 	int ret;
 
-	nvme_msg(r, LOG_DEBUG, "scan controller %s path %s\n",
-		 c->name, name);
+	nvme_msg_ctrl(r, LOG_DEBUG, c->name,
+		      "scan controller %s path %s\n", c->name, name);
 	if (!c->s) {
 		errno = ENXIO;
 		return -1;
@@ -700,18 +804,38 @@ free_path:
 	return -1;
 }
 
+/*
+ * Open @name unless *@fdp already holds a descriptor. Threads racing to
+ * open the same device under the read lock keep the first descriptor
+ * published and close their own.
+ */
+static int nvme_open_once(int *fdp, const char *name)
+{
+	int fd = __atomic_load_n(fdp, __ATOMIC_ACQUIRE), old = -1;
+
+	if (fd >= 0)
+		return fd;
+	fd = nvme_open(name);
+	if (fd < 0)
+		return fd;
+	if (!__atomic_compare_exchange_n(fdp, &old, fd, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(fd);
+		fd = old;
+	}
+	return fd;
+}
+
 int nvme_ctrl_get_fd(nvme_ctrl_t c)
 {
 	nvme_root_t r = c->s && c->s->h ? c->s->h->r : NULL;
+	int fd;
 
-	if (c->fd < 0) {
-		c->fd = nvme_open(c->name);
-		if (c->fd < 0)
-			nvme_msg(r, LOG_ERR,
-				 "Failed to open ctrl %s, errno %d\n",
-				 c->name, errno);
-	}
-	return c->fd;
+	fd = nvme_open_once(&c->fd, c->name);
+	if (fd < 0)
+		nvme_msg(r, LOG_ERR, "Failed to open ctrl %s, errno %d\n",
+			 c->name, errno);
+	return fd;
 }
 
 nvme_subsystem_t nvme_ctrl_get_subsystem(nvme_ctrl_t c)
@@ -749,14 +873,244 @@ const char *nvme_ctrl_get_model(nvme_ctrl_t c)
 	return c->model;
 }
 
+/* These string definitions must match with the kernel */
+static const char * const ctrl_state_str[] = {
+	[NVME_CTRL_STATE_UNKNOWN] = "unknown",
+	[NVME_CTRL_STATE_NEW] = "new",
+	[NVME_CTRL_STATE_LIVE] = "live",
+	[NVME_CTRL_STATE_RESETTING] = "resetting",
+	[NVME_CTRL_STATE_CONNECTING] = "connecting",
+	[NVME_CTRL_STATE_DELETING] = "deleting",
+	[NVME_CTRL_STATE_DELETING_NOIO] = "deleting (no IO)",
+	[NVME_CTRL_STATE_DEAD] = "dead",
+};
+
+const char *nvme_ctrl_state_to_string(enum nvme_ctrl_state state)
+{
+	if (state >= ARRAY_SIZE(ctrl_state_str))
+		state = NVME_CTRL_STATE_UNKNOWN;
+	return ctrl_state_str[state];
+}
+
+enum nvme_ctrl_state nvme_ctrl_state_from_string(const char *state)
+{
+	int i;
+
+	if (!state)
+		return NVME_CTRL_STATE_UNKNOWN;
+	for (i = NVME_CTRL_STATE_NEW; i < ARRAY_SIZE(ctrl_state_str); i++)
+		if (!strcmp(state, ctrl_state_str[i]))
+			return i;
+	return NVME_CTRL_STATE_UNKNOWN;
+}
+
+static enum nvme_ctrl_state nvme_ctrl_parse_state(char *state)
+{
+	enum nvme_ctrl_state ret = nvme_ctrl_state_from_string(state);
+
+	free(state);
+	return ret;
+}
+
+enum nvme_ctrl_state nvme_ctrl_refresh_state(nvme_ctrl_t c)
+{
+	enum nvme_ctrl_state state = NVME_CTRL_STATE_UNKNOWN;
+
+	if (c->sysfs_dir)
+		state = nvme_ctrl_parse_state(nvme_get_ctrl_attr(c, "state"));
+	/* Readers racing with the update see either state */
+	__atomic_store_n(&c->state, state, __ATOMIC_RELAXED);
+	return state;
+}
+
+enum nvme_ctrl_state nvme_ctrl_get_cached_state(nvme_ctrl_t c)
+{
+	return __atomic_load_n(&c->state, __ATOMIC_RELAXED);
+}
+
 const char *nvme_ctrl_get_state(nvme_ctrl_t c)
 {
-	char *state = c->state;
+	return nvme_ctrl_state_to_string(nvme_ctrl_refresh_state(c));
+}
+
+struct nvme_state_monitor {
+	nvme_root_t r;
+	int fd;			/* epoll set of the two below */
+	int uevent_fd;
+	int timer_fd;
+};
+
+static int nvme_state_monitor_add_fd(struct nvme_state_monitor *m, int fd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.fd = fd,
+	};
+
+	return epoll_ctl(m->fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+nvme_state_monitor_t nvme_state_monitor_create(nvme_root_t r)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,		/* kernel uevents */
+	};
+	struct nvme_state_monitor *m;
+	int err;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	m->r = r;
+	m->uevent_fd = m->timer_fd = -1;
+	m->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (m->fd < 0)
+		goto free;
+	m->uevent_fd = socket(AF_NETLINK,
+			      SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			      NETLINK_KOBJECT_UEVENT);
+	if (m->uevent_fd < 0 ||
+	    bind(m->uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto free;
+	/* Disarmed until nvme_state_monitor_set_interval() */
+	m->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m->timer_fd < 0 ||
+	    nvme_state_monitor_add_fd(m, m->uevent_fd) < 0 ||
+	    nvme_state_monitor_add_fd(m, m->timer_fd) < 0)
+		goto free;
+	return m;
+
+free:
+	err = errno;
+	nvme_state_monitor_free(m);
+	errno = err;
+	return NULL;
+}
+
+void nvme_state_monitor_free(nvme_state_monitor_t m)
+{
+	if (m->timer_fd >= 0)
+		close(m->timer_fd);
+	if (m->uevent_fd >= 0)
+		close(m->uevent_fd);
+	if (m->fd >= 0)
+		close(m->fd);
+	free(m);
+}
+
+int nvme_state_monitor_get_fd(nvme_state_monitor_t m)
+{
+	return m->fd;
+}
+
+int nvme_state_monitor_set_interval(nvme_state_monitor_t m,
+				    unsigned int interval_ms)
+{
+	struct itimerspec its = {
+		.it_interval.tv_sec = interval_ms / 1000,
+		.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L,
+	};
 
-	c->state = nvme_get_ctrl_attr(c, "state");
-	if (state)
-		free(state);
-	return c->state;
+	its.it_value = its.it_interval;
+	return timerfd_settime(m->timer_fd, 0, &its, NULL);
+}
+
+const char *nvme_uevent_ctrl(const char *buf, size_t len)
+{
+	const char *p, *end = buf + len, *devname = NULL;
+	bool nvme = false;
+	size_t n;
+
+	/* "action@devpath" followed by KEY=value strings */
+	for (p = buf; p < end; p += n + 1) {
+		n = strnlen(p, end - p);
+		if (n == end - p)
+			break;
+		if (!strcmp(p, "SUBSYSTEM=nvme"))
+			nvme = true;
+		else if (!strncmp(p, "DEVNAME=", 8) && p[8])
+			devname = p + 8;
+	}
+	return nvme ? devname : NULL;
+}
+
+static bool nvme_ctrl_state_changed(nvme_ctrl_t c, nvme_state_change_fn fn,
+				    void *arg)
+{
+	enum nvme_ctrl_state old = nvme_ctrl_get_cached_state(c);
+	enum nvme_ctrl_state state = nvme_ctrl_refresh_state(c);
+
+	if (old == state)
+		return false;
+	if (fn)
+		fn(c, old, state, arg);
+	return true;
+}
+
+int nvme_state_monitor_process(nvme_state_monitor_t m,
+			       nvme_state_change_fn fn, void *arg)
+{
+	struct sockaddr_nl src;
+	socklen_t src_len;
+	nvme_subsystem_t s;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	const char *name;
+	bool lost = false;
+	int changed = 0;
+	char buf[8192];
+	__u64 expired;
+	ssize_t len;
+
+	for (;;) {
+		src_len = sizeof(src);
+		len = recvfrom(m->uevent_fd, buf, sizeof(buf) - 1, 0,
+			       (struct sockaddr *)&src, &src_len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				lost = true;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		/* Only trust messages sent by the kernel */
+		if (src.nl_pid || lost)
+			continue;
+		buf[len] = '\0';
+		name = nvme_uevent_ctrl(buf, len);
+		if (!name)
+			continue;
+
+		nvme_for_each_host(m->r, h)
+			nvme_for_each_subsystem(h, s)
+				nvme_subsystem_for_each_ctrl(s, c)
+					if (c->name && !strcmp(c->name, name) &&
+					    nvme_ctrl_state_changed(c, fn, arg))
+						changed++;
+	}
+
+	/*
+	 * The socket overflowed, so any controller may have changed. The
+	 * periodic refresh catches the transitions without a uevent.
+	 */
+	if (read(m->timer_fd, &expired, sizeof(expired)) == sizeof(expired))
+		lost = true;
+	if (lost) {
+		nvme_for_each_host(m->r, h)
+			nvme_for_each_subsystem(h, s)
+				nvme_subsystem_for_each_ctrl(s, c)
+					if (nvme_ctrl_state_changed(c, fn, arg))
+						changed++;
+	}
+	return changed;
 }
 
 const char *nvme_ctrl_get_numa_node(nvme_ctrl_t c)
@@ -804,8 +1158,31 @@ const char *nvme_ctrl_get_host_iface(nvme_ctrl_t c)
 	return c->cfg.host_iface;
 }
 
+void nvme_subsystem_invalidate_config(struct nvme_subsystem *s)
+{
+	free(s->config_json);
+	s->config_json = NULL;
+}
+
+void nvme_ctrl_invalidate_config(struct nvme_ctrl *c)
+{
+	free(c->config_json);
+	c->config_json = NULL;
+	if (c->s)
+		nvme_subsystem_invalidate_config(c->s);
+}
+
+static void nvme_ctrl_config_modified(nvme_ctrl_t c)
+{
+	nvme_ctrl_invalidate_config(c);
+	if (c->s && c->s->h)
+		c->s->h->r->modified = true;
+}
+
 struct nvme_fabrics_config *nvme_ctrl_get_config(nvme_ctrl_t c)
 {
+	/* The caller may change the configuration through the pointer */
+	nvme_ctrl_invalidate_config(c);
 	return &c->cfg;
 }
 
@@ -822,6 +1199,7 @@ void nvme_ctrl_set_dhchap_key(nvme_ctrl_t c, const char *key)
 	}
 	if (key)
 		c->dhchap_key = strdup(key);
+	nvme_ctrl_config_modified(c);
 }
 
 void nvme_ctrl_set_discovered(nvme_ctrl_t c, bool discovered)
@@ -837,6 +1215,7 @@ bool nvme_ctrl_is_discovered(nvme_ctrl_t c)
 void nvme_ctrl_set_persistent(nvme_ctrl_t c, bool persistent)
 {
 	c->persistent = persistent;
+	nvme_ctrl_config_modified(c);
 }
 
 bool nvme_ctrl_is_persistent(nvme_ctrl_t c)
@@ -847,6 +1226,7 @@ bool nvme_ctrl_is_persistent(nvme_ctrl_t c)
 void nvme_ctrl_set_discovery_ctrl(nvme_ctrl_t c, bool discovery)
 {
 	c->discovery_ctrl = discovery;
+	nvme_ctrl_config_modified(c);
 }
 
 bool nvme_ctrl_is_discovery_ctrl(nvme_ctrl_t c)
@@ -859,6 +1239,666 @@ int nvme_ctrl_identify(nvme_ctrl_t c, struct nvme_id_ctrl *id)
 	return nvme_identify_ctrl(nvme_ctrl_get_fd(c), id);
 }
 
+static int nvme_ctrl_fetch_xfer_len(nvme_ctrl_t c)
+{
+	struct nvme_id_ctrl id;
+	int ret;
+
+	if (c->max_xfer_len)
+		return 0;
+
+	ret = nvme_ctrl_identify(c, &id);
+	if (ret)
+		return ret;
+
+	c->max_xfer_len = nvme_mdts_to_xfer_len(id.mdts);
+	c->fw_xfer_len = nvme_fwug_to_xfer_len(&id);
+	return 0;
+}
+
+__u32 nvme_ctrl_get_max_xfer_len(nvme_ctrl_t c)
+{
+	if (nvme_ctrl_fetch_xfer_len(c))
+		return NVME_MIN_XFER_LEN;
+	return c->max_xfer_len;
+}
+
+int nvme_ctrl_get_log_page(nvme_ctrl_t c, struct nvme_get_log_args *args)
+{
+	args->fd = nvme_ctrl_get_fd(c);
+	return nvme_get_log_page(args->fd, nvme_ctrl_get_max_xfer_len(c),
+				 args);
+}
+
+int nvme_ctrl_fw_download_seq(nvme_ctrl_t c, __u32 size, __u32 offset,
+			      void *buf)
+{
+	int ret;
+
+	ret = nvme_ctrl_fetch_xfer_len(c);
+	if (ret)
+		return ret;
+
+	return nvme_fw_download_seq(nvme_ctrl_get_fd(c), size,
+				    c->fw_xfer_len, offset, buf);
+}
+
+/* These string definitions must match with the kernel */
+static const char *ana_state_str[] = {
+	[NVME_ANA_STATE_OPTIMIZED] = "optimized",
+	[NVME_ANA_STATE_NONOPTIMIZED] = "non-optimized",
+	[NVME_ANA_STATE_INACCESSIBLE] = "inaccessible",
+	[NVME_ANA_STATE_PERSISTENT_LOSS] = "persistent-loss",
+	[NVME_ANA_STATE_CHANGE] = "change",
+};
+
+static void nvme_ctrl_free_ana(nvme_ctrl_t c)
+{
+	free(c->ana.log);
+	free(c->ana.grps);
+	memset(&c->ana, 0, sizeof(c->ana));
+}
+
+static int nvme_ctrl_fetch_ana(nvme_ctrl_t c, bool groups_only, __u32 len)
+{
+	struct nvme_get_log_args args = {
+		.args_size = sizeof(args),
+		.lid = NVME_LOG_LID_ANA,
+		.nsid = NVME_NSID_NONE,
+		.lsp = groups_only ? NVME_LOG_ANA_LSP_RGO_GROUPS_ONLY :
+			NVME_LOG_ANA_LSP_RGO_NAMESPACES,
+		.lsi = NVME_LOG_LSI_NONE,
+		.uuidx = NVME_UUID_NONE,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.result = NULL,
+		.csi = NVME_CSI_NVM,
+		.log = c->ana.log,
+		.len = len,
+		/* the kernel handles ANA change notices itself */
+		.rae = true,
+		.ot = false,
+	};
+
+	return nvme_ctrl_get_log_page(c, &args);
+}
+
+static int nvme_ctrl_index_ana(nvme_ctrl_t c)
+{
+	struct nvme_ana_log *log = c->ana.log;
+	size_t off = sizeof(*log);
+	nvme_path_t p;
+	int i;
+
+	memset(c->ana.grps, 0,
+	       (c->ana.nanagrpid + 1) * sizeof(*c->ana.grps));
+	for (i = 0; i < le16_to_cpu(log->ngrps); i++) {
+		struct nvme_ana_group_desc *desc;
+		__u32 grpid, nnsids;
+
+		if (off + sizeof(*desc) > c->ana.len)
+			goto invalid;
+		desc = (void *)log + off;
+		grpid = le32_to_cpu(desc->grpid);
+		nnsids = c->ana.groups_only ? 0 : le32_to_cpu(desc->nnsids);
+		if (!grpid || grpid > c->ana.nanagrpid ||
+		    off + sizeof(*desc) + nnsids * sizeof(__le32) > c->ana.len)
+			goto invalid;
+		c->ana.grps[grpid] = desc;
+		off += sizeof(*desc) + nnsids * sizeof(__le32);
+	}
+
+	nvme_ctrl_for_each_path(c, p) {
+		struct nvme_ana_group_desc *desc;
+		__u8 state;
+
+		if (p->grpid <= 0 || p->grpid > c->ana.nanagrpid)
+			continue;
+		desc = c->ana.grps[p->grpid];
+		if (!desc)
+			continue;
+		state = desc->state & 0xf;
+		if (state >= ARRAY_SIZE(ana_state_str) || !ana_state_str[state])
+			continue;
+		if (p->ana_state && !strcmp(p->ana_state, ana_state_str[state]))
+			continue;
+		free(p->ana_state);
+		p->ana_state = strdup(ana_state_str[state]);
+	}
+	return 0;
+
+invalid:
+	c->ana.valid = false;
+	errno = EPROTO;
+	return -1;
+}
+
+int nvme_ctrl_ana_refresh(nvme_ctrl_t c, bool groups_only)
+{
+	struct nvme_ana_log hdr;
+	struct nvme_get_log_args args = {
+		.args_size = sizeof(args),
+		.lid = NVME_LOG_LID_ANA,
+		.nsid = NVME_NSID_NONE,
+		.lsp = NVME_LOG_ANA_LSP_RGO_GROUPS_ONLY,
+		.lsi = NVME_LOG_LSI_NONE,
+		.uuidx = NVME_UUID_NONE,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.result = NULL,
+		.csi = NVME_CSI_NVM,
+		.log = &hdr,
+		.len = sizeof(hdr),
+		.rae = true,
+		.ot = false,
+	};
+	int ret;
+
+	if (!c->ana.log) {
+		struct nvme_id_ctrl id;
+
+		ret = nvme_ctrl_identify(c, &id);
+		if (ret)
+			return ret;
+		if (!(id.cmic & NVME_CTRL_CMIC_MULTI_ANA_REPORTING)) {
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		c->ana.nanagrpid = le32_to_cpu(id.nanagrpid);
+		c->ana.len = sizeof(struct nvme_ana_log) +
+			c->ana.nanagrpid * sizeof(struct nvme_ana_group_desc) +
+			le32_to_cpu(id.mnan) * sizeof(__le32);
+		c->ana.log = malloc(c->ana.len);
+		c->ana.grps = calloc(c->ana.nanagrpid + 1,
+				     sizeof(*c->ana.grps));
+		if (!c->ana.log || !c->ana.grps) {
+			nvme_ctrl_free_ana(c);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	/* A valid cache only needs the change count to be checked */
+	if (c->ana.valid && (groups_only || !c->ana.groups_only)) {
+		args.fd = nvme_ctrl_get_fd(c);
+		ret = nvme_get_log(&args);
+		if (ret)
+			return ret;
+		if (le64_to_cpu(hdr.chgcnt) == c->ana.chgcnt)
+			return 0;
+	}
+
+	c->ana.valid = false;
+	ret = nvme_ctrl_fetch_ana(c, groups_only, c->ana.len);
+	if (ret)
+		return ret;
+
+	c->ana.chgcnt = le64_to_cpu(c->ana.log->chgcnt);
+	c->ana.groups_only = groups_only;
+	c->ana.valid = true;
+	return nvme_ctrl_index_ana(c);
+}
+
+void nvme_ctrl_ana_invalidate(nvme_ctrl_t c)
+{
+	c->ana.valid = false;
+}
+
+struct nvme_ana_group_desc *nvme_ctrl_ana_group(nvme_ctrl_t c, __u32 grpid)
+{
+	if (!c->ana.valid || !grpid || grpid > c->ana.nanagrpid) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if (!c->ana.grps[grpid])
+		errno = ENOENT;
+	return c->ana.grps[grpid];
+}
+
+struct nvme_health_sampler {
+	struct nvme_health_snapshot snap;
+	struct nvme_smart_log *smart[2];
+	struct nvme_endurance_group_log *endgrp[2];
+	bool *valid[2];
+	bool *endgrp_valid[2];
+	struct timespec ts[2];
+	int cur;
+	int nr_samples;
+	__u16 endgid;
+};
+
+static void nvme_health_read(void *arg, int i)
+{
+	struct nvme_health_sampler *hs = arg;
+	nvme_ctrl_t c = hs->snap.ctrls[i];
+	int cur = hs->cur, fd, ret;
+
+	hs->valid[cur][i] = false;
+	hs->endgrp_valid[cur][i] = false;
+	hs->snap.endgrp_status[i] = 0;
+	if (!c->name) {
+		hs->snap.status[i] = -ENODEV;
+		return;
+	}
+	fd = nvme_ctrl_get_fd(c);
+	if (fd < 0) {
+		hs->snap.status[i] = -errno;
+		return;
+	}
+
+	ret = nvme_get_log_smart(fd, NVME_NSID_ALL, true,
+				 &hs->smart[cur][i]);
+	if (ret < 0)
+		ret = -errno;
+	hs->snap.status[i] = ret;
+	hs->valid[cur][i] = !ret;
+	if (ret || !hs->endgid)
+		return;
+
+	/* Not every controller has the endurance group, keep SMART then */
+	ret = nvme_get_log_endurance_group(fd, hs->endgid,
+					   &hs->endgrp[cur][i]);
+	if (ret < 0)
+		ret = -errno;
+	hs->snap.endgrp_status[i] = ret;
+	hs->endgrp_valid[cur][i] = !ret;
+}
+
+/* Counters are 128 bit little endian; deltas saturate at 64 bit */
+static __u64 nvme_health_delta(const __u8 *cur, const __u8 *prev)
+{
+	__u64 cur_lo = 0, cur_hi = 0, prev_lo = 0, prev_hi = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		cur_lo = cur_lo << 8 | cur[i];
+		cur_hi = cur_hi << 8 | cur[i + 8];
+		prev_lo = prev_lo << 8 | prev[i];
+		prev_hi = prev_hi << 8 | prev[i + 8];
+	}
+
+	/* a counter going backwards means the device was reset */
+	if (cur_hi < prev_hi || (cur_hi == prev_hi && cur_lo < prev_lo))
+		return 0;
+	if (cur_hi - prev_hi - (cur_lo < prev_lo))
+		return UINT64_MAX;
+	return cur_lo - prev_lo;
+}
+
+nvme_health_sampler_t nvme_health_sampler_create(nvme_root_t r, __u16 endgid)
+{
+	struct nvme_health_sampler *hs;
+	struct nvme_health_snapshot *snap;
+	nvme_subsystem_t s;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	int i, nr = 0;
+
+	nvme_for_each_host(r, h)
+		nvme_for_each_subsystem(h, s)
+			nvme_subsystem_for_each_ctrl(s, c)
+				nr++;
+
+	hs = calloc(1, sizeof(*hs));
+	if (!hs) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	hs->endgid = endgid;
+	snap = &hs->snap;
+	snap->nr_ctrls = nr;
+	if (!nr)
+		return hs;
+
+	snap->ctrls = calloc(nr, sizeof(*snap->ctrls));
+	snap->status = calloc(nr, sizeof(*snap->status));
+	snap->data_units_read = calloc(nr, sizeof(__u64));
+	snap->data_units_written = calloc(nr, sizeof(__u64));
+	snap->host_read_cmds = calloc(nr, sizeof(__u64));
+	snap->host_write_cmds = calloc(nr, sizeof(__u64));
+	snap->media_errors = calloc(nr, sizeof(__u64));
+	snap->media_units_written = calloc(nr, sizeof(__u64));
+	snap->read_bytes_rate = calloc(nr, sizeof(double));
+	snap->write_bytes_rate = calloc(nr, sizeof(double));
+	snap->read_cmds_rate = calloc(nr, sizeof(double));
+	snap->write_cmds_rate = calloc(nr, sizeof(double));
+	snap->media_errors_rate = calloc(nr, sizeof(double));
+	snap->temperature = calloc(nr, sizeof(__u16));
+	snap->temperature_delta = calloc(nr, sizeof(__s16));
+	snap->percent_used = calloc(nr, sizeof(__u8));
+	snap->critical_warning = calloc(nr, sizeof(__u8));
+	snap->endgrp_status = calloc(nr, sizeof(*snap->endgrp_status));
+	for (i = 0; i < 2; i++) {
+		hs->smart[i] = calloc(nr, sizeof(*hs->smart[i]));
+		hs->valid[i] = calloc(nr, sizeof(*hs->valid[i]));
+		hs->endgrp_valid[i] = calloc(nr, sizeof(*hs->endgrp_valid[i]));
+		if (endgid)
+			hs->endgrp[i] = calloc(nr, sizeof(*hs->endgrp[i]));
+		if (!hs->smart[i] || !hs->valid[i] || !hs->endgrp_valid[i] ||
+		    (endgid && !hs->endgrp[i]))
+			goto free;
+	}
+	if (!snap->ctrls || !snap->status || !snap->data_units_read ||
+	    !snap->data_units_written || !snap->host_read_cmds ||
+	    !snap->host_write_cmds || !snap->media_errors ||
+	    !snap->media_units_written || !snap->read_bytes_rate ||
+	    !snap->write_bytes_rate || !snap->read_cmds_rate ||
+	    !snap->write_cmds_rate || !snap->media_errors_rate ||
+	    !snap->temperature || !snap->temperature_delta ||
+	    !snap->percent_used || !snap->critical_warning ||
+	    !snap->endgrp_status)
+		goto free;
+
+	i = 0;
+	nvme_for_each_host(r, h)
+		nvme_for_each_subsystem(h, s)
+			nvme_subsystem_for_each_ctrl(s, c)
+				snap->ctrls[i++] = c;
+	return hs;
+
+free:
+	nvme_health_sampler_free(hs);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void nvme_health_sampler_free(nvme_health_sampler_t hs)
+{
+	struct nvme_health_snapshot *snap;
+	int i;
+
+	if (!hs)
+		return;
+	snap = &hs->snap;
+	free(snap->ctrls);
+	free(snap->status);
+	free(snap->data_units_read);
+	free(snap->data_units_written);
+	free(snap->host_read_cmds);
+	free(snap->host_write_cmds);
+	free(snap->media_errors);
+	free(snap->media_units_written);
+	free(snap->read_bytes_rate);
+	free(snap->write_bytes_rate);
+	free(snap->read_cmds_rate);
+	free(snap->write_cmds_rate);
+	free(snap->media_errors_rate);
+	free(snap->temperature);
+	free(snap->temperature_delta);
+	free(snap->percent_used);
+	free(snap->critical_warning);
+	free(snap->endgrp_status);
+	for (i = 0; i < 2; i++) {
+		free(hs->smart[i]);
+		free(hs->endgrp[i]);
+		free(hs->valid[i]);
+		free(hs->endgrp_valid[i]);
+	}
+	free(hs);
+}
+
+const struct nvme_health_snapshot *
+nvme_health_sample(nvme_health_sampler_t hs, int max_threads)
+{
+	struct nvme_health_snapshot *snap = &hs->snap;
+	int cur = hs->cur, prev = cur ^ 1, i;
+	double interval = 0;
+
+	nvme_run_parallel(snap->nr_ctrls, max_threads, nvme_health_read, hs);
+	clock_gettime(CLOCK_MONOTONIC, &hs->ts[cur]);
+
+	if (hs->nr_samples++)
+		interval = (hs->ts[cur].tv_sec - hs->ts[prev].tv_sec) +
+			(hs->ts[cur].tv_nsec - hs->ts[prev].tv_nsec) / 1e9;
+	snap->interval = interval;
+
+	for (i = 0; i < snap->nr_ctrls; i++) {
+		struct nvme_smart_log *sc = &hs->smart[cur][i];
+		struct nvme_smart_log *sp = &hs->smart[prev][i];
+		bool delta = hs->valid[cur][i] && hs->valid[prev][i] &&
+			interval > 0;
+
+		snap->data_units_read[i] = 0;
+		snap->data_units_written[i] = 0;
+		snap->host_read_cmds[i] = 0;
+		snap->host_write_cmds[i] = 0;
+		snap->media_errors[i] = 0;
+		snap->media_units_written[i] = 0;
+		snap->temperature_delta[i] = 0;
+		snap->read_bytes_rate[i] = 0;
+		snap->write_bytes_rate[i] = 0;
+		snap->read_cmds_rate[i] = 0;
+		snap->write_cmds_rate[i] = 0;
+		snap->media_errors_rate[i] = 0;
+		snap->temperature[i] = 0;
+		snap->percent_used[i] = 0;
+		snap->critical_warning[i] = 0;
+		if (!hs->valid[cur][i])
+			continue;
+
+		snap->temperature[i] = sc->temperature[0] |
+			sc->temperature[1] << 8;
+		snap->critical_warning[i] = sc->critical_warning;
+		snap->percent_used[i] = hs->endgrp_valid[cur][i] ?
+			hs->endgrp[cur][i].percent_used : sc->percent_used;
+		if (!delta)
+			continue;
+
+		snap->data_units_read[i] = nvme_health_delta(
+			sc->data_units_read, sp->data_units_read);
+		snap->data_units_written[i] = nvme_health_delta(
+			sc->data_units_written, sp->data_units_written);
+		snap->host_read_cmds[i] = nvme_health_delta(
+			sc->host_reads, sp->host_reads);
+		snap->host_write_cmds[i] = nvme_health_delta(
+			sc->host_writes, sp->host_writes);
+		snap->media_errors[i] = nvme_health_delta(
+			sc->media_errors, sp->media_errors);
+		if (hs->endgrp_valid[cur][i] && hs->endgrp_valid[prev][i])
+			snap->media_units_written[i] = nvme_health_delta(
+				hs->endgrp[cur][i].media_units_written,
+				hs->endgrp[prev][i].media_units_written);
+		snap->temperature_delta[i] = snap->temperature[i] -
+			(sp->temperature[0] | sp->temperature[1] << 8);
+
+		/* a data unit is 1000 512 byte units */
+		snap->read_bytes_rate[i] =
+			snap->data_units_read[i] * 512000.0 / interval;
+		snap->write_bytes_rate[i] =
+			snap->data_units_written[i] * 512000.0 / interval;
+		snap->read_cmds_rate[i] = snap->host_read_cmds[i] / interval;
+		snap->write_cmds_rate[i] = snap->host_write_cmds[i] / interval;
+		snap->media_errors_rate[i] = snap->media_errors[i] / interval;
+	}
+
+	hs->cur = prev;
+	return snap;
+}
+
+static void nvme_ctrl_free_effects(nvme_ctrl_t c)
+{
+	int i;
+
+	pthread_mutex_lock(&c->effects_lock);
+	for (i = 0; i < ARRAY_SIZE(c->effects); i++) {
+		free(c->effects[i]);
+		c->effects[i] = NULL;
+	}
+	c->effects_checked = false;
+	c->effects_supported = false;
+	pthread_mutex_unlock(&c->effects_lock);
+}
+
+static int nvme_ctrl_fetch_effects(nvme_ctrl_t c, enum nvme_csi csi)
+{
+	struct nvme_cmd_effects_log *log;
+	struct nvme_id_ctrl id;
+	int ret;
+
+	if (!c->effects_checked) {
+		ret = nvme_ctrl_identify(c, &id);
+		if (ret)
+			return ret;
+		c->effects_supported = !!(id.lpa & NVME_CTRL_LPA_CMD_EFFECTS);
+		c->effects_checked = true;
+	}
+	if (!c->effects_supported || c->effects[csi])
+		return 0;
+
+	log = malloc(sizeof(*log));
+	if (!log) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ret = nvme_get_log_cmd_effects(nvme_ctrl_get_fd(c), csi, log);
+	if (ret) {
+		free(log);
+		return ret;
+	}
+	c->effects[csi] = log;
+	return 0;
+}
+
+/*
+ * Effects the kernel and the specification imply for admin commands,
+ * used in addition to the log and in place of it if it is unsupported.
+ */
+static __u32 nvme_known_admin_effects(__u8 opcode)
+{
+	switch (opcode) {
+	case nvme_admin_ns_mgmt:
+	case nvme_admin_ns_attach:
+		return NVME_CMD_EFFECTS_CSUPP | NVME_CMD_EFFECTS_NIC |
+			NVME_CMD_EFFECTS_NCC;
+	case nvme_admin_format_nvm:
+		return NVME_CMD_EFFECTS_CSUPP | NVME_CMD_EFFECTS_LBCC |
+			NVME_CMD_EFFECTS_NCC | NVME_CMD_EFFECTS_CSE_MASK;
+	case nvme_admin_sanitize_nvm:
+		return NVME_CMD_EFFECTS_CSUPP | NVME_CMD_EFFECTS_LBCC |
+			NVME_CMD_EFFECTS_CSE_MASK;
+	default:
+		return 0;
+	}
+}
+
+int nvme_ctrl_get_cmd_effects(nvme_ctrl_t c, enum nvme_csi csi, bool admin,
+			      __u8 opcode, __u32 *effects)
+{
+	int ret;
+
+	if (csi >= ARRAY_SIZE(c->effects)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->effects_lock);
+	ret = nvme_ctrl_fetch_effects(c, csi);
+	if (!ret) {
+		*effects = admin ? nvme_known_admin_effects(opcode) : 0;
+		if (c->effects[csi])
+			*effects |= le32_to_cpu(admin ?
+						c->effects[csi]->acs[opcode] :
+						c->effects[csi]->iocs[opcode]);
+	}
+	pthread_mutex_unlock(&c->effects_lock);
+	return ret;
+}
+
+static bool nvme_cmd_effects_exclusive(bool admin, __u32 effects)
+{
+	/* Nothing is known about the command, trust only I/O commands */
+	if (!(effects & NVME_CMD_EFFECTS_CSUPP))
+		return admin;
+	if (effects & (NVME_CMD_EFFECTS_CSE_MASK | NVME_CMD_EFFECTS_NIC |
+		       NVME_CMD_EFFECTS_NCC | NVME_CMD_EFFECTS_CCC))
+		return true;
+	/* Reads and writes change LBA content but never need serialising */
+	return admin && (effects & NVME_CMD_EFFECTS_LBCC);
+}
+
+static nvme_ns_t nvme_ctrl_lookup_ns(nvme_ctrl_t c, __u32 nsid)
+{
+	nvme_ns_t n;
+
+	nvme_ctrl_for_each_ns(c, n) {
+		if (n->nsid == nsid)
+			return n;
+	}
+	return c->s ? nvme_subsystem_lookup_namespace(c->s, nsid) : NULL;
+}
+
+static int nvme_ctrl_passthru_target(nvme_ctrl_t c, bool admin, __u32 nsid,
+				     enum nvme_csi *csi)
+{
+	nvme_ns_t n;
+
+	*csi = NVME_CSI_NVM;
+	if (admin)
+		return nvme_ctrl_get_fd(c);
+
+	n = nvme_ctrl_lookup_ns(c, nsid);
+	if (!n) {
+		errno = ENODEV;
+		return -1;
+	}
+	*csi = n->csi;
+	return nvme_ns_get_fd(n);
+}
+
+int nvme_ctrl_submit_passthru(nvme_ctrl_t c, bool admin,
+			      struct nvme_passthru_cmd *cmd, __u32 *result,
+			      bool *rescan)
+{
+	enum nvme_csi csi;
+	__u32 effects;
+	bool excl;
+	int fd, ret;
+
+	if (rescan)
+		*rescan = false;
+
+	pthread_rwlock_rdlock(&c->cmd_lock);
+	fd = nvme_ctrl_passthru_target(c, admin, cmd->nsid, &csi);
+	if (fd < 0) {
+		ret = -1;
+		goto out_unlock;
+	}
+	if (nvme_ctrl_get_cmd_effects(c, csi, admin, cmd->opcode, &effects))
+		effects = 0;
+
+	excl = nvme_cmd_effects_exclusive(admin, effects);
+	if (excl) {
+		/* The namespace may have gone while the lock was dropped */
+		pthread_rwlock_unlock(&c->cmd_lock);
+		pthread_rwlock_wrlock(&c->cmd_lock);
+		fd = nvme_ctrl_passthru_target(c, admin, cmd->nsid, &csi);
+		if (fd < 0) {
+			ret = -1;
+			goto out_unlock;
+		}
+	}
+
+	if (admin)
+		ret = nvme_submit_admin_passthru(fd, cmd, result);
+	else
+		ret = nvme_submit_io_passthru(fd, cmd, result);
+	if (ret || !excl)
+		goto out_unlock;
+
+	if (effects & NVME_CMD_EFFECTS_CCC) {
+		c->max_xfer_len = 0;
+		c->fw_xfer_len = 0;
+		nvme_ctrl_ana_invalidate(c);
+		nvme_ctrl_free_effects(c);
+	}
+	/* Changing the tree needs the write lock, which the caller takes */
+	if (rescan && (effects & (NVME_CMD_EFFECTS_NIC | NVME_CMD_EFFECTS_NCC)))
+		*rescan = true;
+
+out_unlock:
+	pthread_rwlock_unlock(&c->cmd_lock);
+	return ret;
+}
+
 nvme_ns_t nvme_ctrl_first_ns(nvme_ctrl_t c)
 {
 	return list_top(&c->namespaces, struct nvme_ns, entry);
@@ -891,7 +1931,7 @@ void nvme_deconfigure_ctrl(nvme_ctrl_t c)
 	FREE_CTRL_ATTR(c->sysfs_dir);
 	FREE_CTRL_ATTR(c->firmware);
 	FREE_CTRL_ATTR(c->model);
-	FREE_CTRL_ATTR(c->state);
+	c->state = NVME_CTRL_STATE_UNKNOWN;
 	FREE_CTRL_ATTR(c->numa_node);
 	FREE_CTRL_ATTR(c->queue_count);
 	FREE_CTRL_ATTR(c->serial);
@@ -899,6 +1939,10 @@ void nvme_deconfigure_ctrl(nvme_ctrl_t c)
 	FREE_CTRL_ATTR(c->address);
 	FREE_CTRL_ATTR(c->dctype);
 	FREE_CTRL_ATTR(c->cntrltype);
+	c->max_xfer_len = 0;
+	c->fw_xfer_len = 0;
+	nvme_ctrl_free_ana(c);
+	nvme_ctrl_free_effects(c);
 }
 
 int nvme_disconnect_ctrl(nvme_ctrl_t c)
@@ -909,17 +1953,20 @@ int nvme_disconnect_ctrl(nvme_ctrl_t c)
 	ret = nvme_set_attr(nvme_ctrl_get_sysfs_dir(c),
 			    "delete_controller", "1");
 	if (ret < 0) {
-		nvme_msg(r, LOG_ERR, "%s: failed to disconnect, error %d\n",
-			 c->name, errno);
+		nvme_msg_cmd(r, LOG_ERR, c->name, 0, -1, -errno,
+			     "%s: failed to disconnect, error %d\n",
+			     c->name, errno);
 		return ret;
 	}
-	nvme_msg(r, LOG_INFO, "%s: disconnected\n", c->name);
+	nvme_msg_ctrl(r, LOG_INFO, c->name, "%s: disconnected\n", c->name);
 	nvme_deconfigure_ctrl(c);
 	return 0;
 }
 
 void nvme_unlink_ctrl(nvme_ctrl_t c)
 {
+	if (c->s)
+		nvme_ctrl_config_modified(c);
 	list_del_init(&c->entry);
 	c->s = NULL;
 }
@@ -945,6 +1992,9 @@ static void __nvme_free_ctrl(nvme_ctrl_t c)
 	FREE_CTRL_ATTR(c->cfg.host_traddr);
 	FREE_CTRL_ATTR(c->cfg.host_iface);
 	FREE_CTRL_ATTR(c->trsvcid);
+	free(c->config_json);
+	pthread_rwlock_destroy(&c->cmd_lock);
+	pthread_mutex_destroy(&c->effects_lock);
 	free(c);
 }
 
@@ -998,6 +2048,8 @@ struct nvme_ctrl *nvme_create_ctrl(nvme_root_t r,
 		return NULL;
 	}
 	c->fd = -1;
+	pthread_mutex_init(&c->effects_lock, NULL);
+	pthread_rwlock_init(&c->cmd_lock, NULL);
 	nvmf_default_config(&c->cfg);
 	list_head_init(&c->namespaces);
 	list_head_init(&c->paths);
@@ -1050,12 +2102,29 @@ nvme_ctrl_t __nvme_lookup_ctrl(nvme_subsystem_t s, const char *transport,
 	return NULL;
 }
 
+nvme_ctrl_t __nvme_add_ctrl(nvme_subsystem_t s, const char *transport,
+			    const char *traddr, const char *host_traddr,
+			    const char *host_iface, const char *trsvcid)
+{
+	nvme_root_t r = s->h ? s->h->r : NULL;
+	struct nvme_ctrl *c;
+
+	c = nvme_create_ctrl(r, s->subsysnqn, transport, traddr,
+			     host_traddr, host_iface, trsvcid);
+	if (c) {
+		c->s = s;
+		list_add(&s->ctrls, &c->entry);
+		nvme_subsystem_invalidate_config(s);
+		s->h->r->modified = true;
+	}
+	return c;
+}
+
 nvme_ctrl_t nvme_lookup_ctrl(nvme_subsystem_t s, const char *transport,
 			     const char *traddr, const char *host_traddr,
 			     const char *host_iface, const char *trsvcid,
 			     nvme_ctrl_t p)
 {
-	nvme_root_t r;
 	struct nvme_ctrl *c;
 
 	if (!s || !transport)
@@ -1066,15 +2135,8 @@ nvme_ctrl_t nvme_lookup_ctrl(nvme_subsystem_t s, const char *transport,
 	if (c)
 		return c;
 
-	r = s->h ? s->h->r : NULL;
-	c = nvme_create_ctrl(r, s->subsysnqn, transport, traddr,
-			     host_traddr, host_iface, trsvcid);
-	if (c) {
-		c->s = s;
-		list_add(&s->ctrls, &c->entry);
-		s->h->r->modified = true;
-	}
-	return c;
+	return __nvme_add_ctrl(s, transport, traddr, host_traddr,
+			       host_iface, trsvcid);
 }
 
 static int nvme_ctrl_scan_paths(nvme_root_t r, struct nvme_ctrl *c)
@@ -1157,7 +2219,7 @@ static int nvme_configure_ctrl(nvme_root_t r, nvme_ctrl_t c, const char *path,
 	c->sysfs_dir = (char *)path;
 	c->firmware = nvme_get_ctrl_attr(c, "firmware_rev");
 	c->model = nvme_get_ctrl_attr(c, "model");
-	c->state = nvme_get_ctrl_attr(c, "state");
+	c->state = nvme_ctrl_parse_state(nvme_get_ctrl_attr(c, "state"));
 	c->numa_node = nvme_get_ctrl_attr(c, "numa_node");
 	c->queue_count = nvme_get_ctrl_attr(c, "queue_count");
 	c->serial = nvme_get_ctrl_attr(c, "serial");
@@ -1169,6 +2231,7 @@ static int nvme_configure_ctrl(nvme_root_t r, nvme_ctrl_t c, const char *path,
 	}
 	c->cntrltype = nvme_get_ctrl_attr(c, "cntrltype");
 	c->dctype = nvme_get_ctrl_attr(c, "dctype");
+	nvme_ctrl_invalidate_config(c);
 
 	errno = 0; /* cleanup after nvme_get_ctrl_attr() */
 	return 0;
@@ -1224,6 +2287,7 @@ int nvme_init_ctrl(nvme_host_t h, nvme_ctrl_t c, int instance)
 		c->discovery_ctrl = true;
 	c->s = s;
 	list_add(&s->ctrls, &c->entry);
+	nvme_ctrl_invalidate_config(c);
 out_free_subsys:
 	free(subsys_name);
  out_free_name:
@@ -1341,7 +2405,7 @@ nvme_ctrl_t nvme_scan_ctrl(nvme_root_t r, const char *name)
 	char *hostnqn, *hostid, *subsysnqn, *subsysname;
 	int ret;
 
-	nvme_msg(r, LOG_DEBUG, "scan controller %s\n", name);
+	nvme_msg_ctrl(r, LOG_DEBUG, name, "scan controller %s\n", name);
 	ret = asprintf(&path, "%s/%s", nvme_ctrl_sysfs_dir, name);
 	if (ret < 0) {
 		errno = ENOMEM;
@@ -1420,6 +2484,91 @@ void nvme_rescan_ctrl(struct nvme_ctrl *c)
 	nvme_subsystem_scan_namespaces(r, c->s, NULL, NULL);
 }
 
+static __u32 nvme_name_to_nsid(const char *name)
+{
+	const char *n = strrchr(name, 'n');
+
+	return n ? strtoul(n + 1, NULL, 10) : 0;
+}
+
+int nvme_ctrl_rescan_ns(nvme_ctrl_t c, __u32 nsid)
+{
+	nvme_root_t r = c->s && c->s->h ? c->s->h->r : NULL;
+	struct dirent **ents;
+	struct nvme_path *p, *_p;
+	struct nvme_ns *n, *_n;
+	nvme_ctrl_t sib;
+	int i, num;
+
+	if (!c->s) {
+		errno = ENXIO;
+		return -1;
+	}
+	if (!nsid || nsid == NVME_NSID_ALL) {
+		nvme_rescan_ctrl(c);
+		return 0;
+	}
+
+	/*
+	 * Drop everything known about @nsid first so a namespace which
+	 * was deleted or detached does not linger in the tree.
+	 */
+	nvme_ctrl_for_each_path_safe(c, p, _p) {
+		if (nvme_name_to_nsid(p->name) == nsid)
+			nvme_free_path(p);
+	}
+	nvme_ctrl_for_each_ns_safe(c, n, _n) {
+		if (n->nsid == nsid)
+			__nvme_free_ns(n);
+	}
+	nvme_subsystem_for_each_ns_safe(c->s, n, _n) {
+		if (n->nsid != nsid)
+			continue;
+		nvme_namespace_for_each_path_safe(n, p, _p) {
+			list_del_init(&p->nentry);
+			p->n = NULL;
+		}
+		__nvme_free_ns(n);
+	}
+
+	num = nvme_scan_ctrl_namespaces(c, &ents);
+	for (i = 0; i < num; i++) {
+		if (nvme_name_to_nsid(ents[i]->d_name) == nsid)
+			nvme_ctrl_scan_namespace(r, c, ents[i]->d_name);
+	}
+	if (num >= 0)
+		nvme_free_dirents(ents, num);
+
+	num = nvme_scan_subsystem_namespaces(c->s, &ents);
+	for (i = 0; i < num; i++) {
+		if (nvme_name_to_nsid(ents[i]->d_name) == nsid)
+			nvme_subsystem_scan_namespace(r, c->s,
+					ents[i]->d_name, NULL, NULL);
+	}
+	if (num >= 0)
+		nvme_free_dirents(ents, num);
+
+	num = nvme_scan_ctrl_namespace_paths(c, &ents);
+	for (i = 0; i < num; i++) {
+		if (nvme_name_to_nsid(ents[i]->d_name) == nsid)
+			nvme_ctrl_scan_path(r, c, ents[i]->d_name);
+	}
+	if (num >= 0)
+		nvme_free_dirents(ents, num);
+
+	/* The paths of the other controllers lost their namespace above */
+	nvme_subsystem_for_each_ctrl(c->s, sib) {
+		if (sib == c)
+			continue;
+		nvme_ctrl_for_each_path(sib, p) {
+			if (!p->n && nvme_name_to_nsid(p->name) == nsid)
+				nvme_subsystem_set_path_ns(c->s, p);
+		}
+	}
+
+	return 0;
+}
+
 static int nvme_bytes_to_lba(nvme_ns_t n, off_t offset, size_t count,
 			    __u64 *lba, __u16 *nlb)
 {
@@ -1438,7 +2587,8 @@ static int nvme_bytes_to_lba(nvme_ns_t n, off_t offset, size_t count,
 
 int nvme_ns_get_fd(nvme_ns_t n)
 {
-	return n->fd;
+	/* Namespaces loaded from a snapshot are opened on first use */
+	return nvme_open_once(&n->fd, n->name);
 }
 
 nvme_subsystem_t nvme_ns_get_subsystem(nvme_ns_t n)
@@ -1842,8 +2992,8 @@ static int nvme_ctrl_scan_namespace(nvme_root_t r, struct nvme_ctrl *c,
 {
 	struct nvme_ns *n, *_n, *__n;
 
-	nvme_msg(r, LOG_DEBUG, "scan controller %s namespace %s\n",
-		 c->name, name);
+	nvme_msg_ctrl(r, LOG_DEBUG, c->name,
+		      "scan controller %s namespace %s\n", c->name, name);
 	if (!c->s) {
 		nvme_msg(r, LOG_DEBUG, "no subsystem for %s\n", name);
 		errno = EINVAL;
@@ -1851,7 +3001,8 @@ static int nvme_ctrl_scan_namespace(nvme_root_t r, struct nvme_ctrl *c,
 	}
 	n = __nvme_scan_namespace(c->sysfs_dir, name);
 	if (!n) {
-		nvme_msg(r, LOG_DEBUG, "failed to scan namespace %s\n", name);
+		nvme_msg_ctrl(r, LOG_DEBUG, c->name,
+			      "failed to scan namespace %s\n", name);
 		return -1;
 	}
 	nvme_ctrl_for_each_ns_safe(c, _n, __n) {
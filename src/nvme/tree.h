@@ -24,6 +24,13 @@
  * DOC: tree.h
  *
  * libnvme tree object interface
+ *
+ * The tree may be shared between threads. Threads traversing it or
+ * calling the getters hold the read lock of the root, see
+ * nvme_root_read_lock(), threads modifying it hold the write lock.
+ * Objects must not be used after the lock under which they were looked
+ * up is dropped. nvme_refresh_topology() takes the write lock itself,
+ * and only for swapping in the rescanned tree.
  */
 
 typedef struct nvme_ns *nvme_ns_t;
@@ -53,6 +60,39 @@ nvme_root_t nvme_create_root(FILE *fp, int log_level);
  */
 void nvme_free_tree(nvme_root_t r);
 
+/**
+ * nvme_root_read_lock() - Lock the tree for traversal
+ * @r:	&nvme_root_t object
+ *
+ * Any number of threads may hold the read lock at the same time. Getters
+ * which read sysfs or open the device, such as nvme_ctrl_get_state() and
+ * nvme_ctrl_get_fd(), may be called under the read lock.
+ */
+void nvme_root_read_lock(nvme_root_t r);
+
+/**
+ * nvme_root_read_unlock() - Release the read lock of the tree
+ * @r:	&nvme_root_t object
+ */
+void nvme_root_read_unlock(nvme_root_t r);
+
+/**
+ * nvme_root_write_lock() - Lock the tree for modification
+ * @r:	&nvme_root_t object
+ *
+ * Must be held around calls which add, remove or change objects, such as
+ * scanning, reading the configuration, the lookup and setter functions
+ * and nvme_ctrl_ana_refresh(). Waiting writers take precedence over new
+ * readers.
+ */
+void nvme_root_write_lock(nvme_root_t r);
+
+/**
+ * nvme_root_write_unlock() - Release the write lock of the tree
+ * @r:	&nvme_root_t object
+ */
+void nvme_root_write_unlock(nvme_root_t r);
+
 /**
  * nvme_first_host() - Start host iterator
  * @r:	&nvme_root_t object
@@ -113,6 +153,8 @@ void nvme_host_set_dhchap_key(nvme_host_t h, const char *key);
  *
  * Initializes the default host object based on the values in
  * /etc/nvme/hostnqn and /etc/nvme/hostid and attaches it to @r.
+ * The resolved identity is cached in @r, see also
+ * nvme_set_host_identity_cache().
  *
  * Return: &nvme_host_t object
  */
@@ -714,6 +756,14 @@ const char *nvme_path_get_sysfs_dir(nvme_path_t p);
  */
 const char *nvme_path_get_ana_state(nvme_path_t p);
 
+/**
+ * nvme_path_get_ana_grpid() - ANA group of an nvme_path_t object
+ * @p:	&nvme_path_t object
+ *
+ * Return: ANA group identifier of @p, or 0 if not reported
+ */
+int nvme_path_get_ana_grpid(nvme_path_t p);
+
 /**
  * nvme_path_get_ctrl() - Parent controller of an nvme_path_t object
  * @p:	&nvme_path_t object
@@ -779,14 +829,164 @@ const char *nvme_ctrl_get_firmware(nvme_ctrl_t c);
  */
 const char *nvme_ctrl_get_model(nvme_ctrl_t c);
 
+/**
+ * enum nvme_ctrl_state - Running state of a controller
+ * @NVME_CTRL_STATE_UNKNOWN:	State not known, or the controller is gone
+ * @NVME_CTRL_STATE_NEW:	Controller is being initialized
+ * @NVME_CTRL_STATE_LIVE:	Controller is operational
+ * @NVME_CTRL_STATE_RESETTING:	Controller is being reset
+ * @NVME_CTRL_STATE_CONNECTING:	Transport is (re)connecting
+ * @NVME_CTRL_STATE_DELETING:	Controller is being removed
+ * @NVME_CTRL_STATE_DELETING_NOIO: Controller is being removed, I/O has
+ *				been shut down
+ * @NVME_CTRL_STATE_DEAD:	Controller failed and cannot be used
+ */
+enum nvme_ctrl_state {
+	NVME_CTRL_STATE_UNKNOWN,
+	NVME_CTRL_STATE_NEW,
+	NVME_CTRL_STATE_LIVE,
+	NVME_CTRL_STATE_RESETTING,
+	NVME_CTRL_STATE_CONNECTING,
+	NVME_CTRL_STATE_DELETING,
+	NVME_CTRL_STATE_DELETING_NOIO,
+	NVME_CTRL_STATE_DEAD,
+};
+
+/**
+ * nvme_ctrl_state_to_string() - Kernel name of a controller state
+ * @state:	Controller state
+ *
+ * Return: The string the kernel uses for @state, or "unknown" for
+ * %NVME_CTRL_STATE_UNKNOWN and values outside the enum
+ */
+const char *nvme_ctrl_state_to_string(enum nvme_ctrl_state state);
+
+/**
+ * nvme_ctrl_state_from_string() - Parse a kernel controller state
+ * @state:	Contents of the sysfs state attribute, or NULL
+ *
+ * Return: The state named by @state, or %NVME_CTRL_STATE_UNKNOWN if
+ * @state is NULL or not a state this library knows of
+ */
+enum nvme_ctrl_state nvme_ctrl_state_from_string(const char *state);
+
 /**
  * nvme_ctrl_get_state() - Running state of an controller
  * @c:	Controller instance
  *
- * Return: String indicating the running state of @c
+ * Reads the state from sysfs, see nvme_ctrl_refresh_state(). The string
+ * is static and remains valid.
+ *
+ * Return: String indicating the running state of @c, "unknown" if the
+ * state could not be read or is not one this library knows of. Earlier
+ * versions returned the raw sysfs string, and NULL if it could not be
+ * read; callers checking for NULL now have to compare with "unknown".
  */
 const char *nvme_ctrl_get_state(nvme_ctrl_t c);
 
+/**
+ * nvme_ctrl_get_cached_state() - Last known running state of a controller
+ * @c:	Controller instance
+ *
+ * Returns the state read when @c was scanned or last refreshed, without
+ * accessing sysfs.
+ *
+ * Return: The cached state of @c
+ */
+enum nvme_ctrl_state nvme_ctrl_get_cached_state(nvme_ctrl_t c);
+
+/**
+ * nvme_ctrl_refresh_state() - Update the cached state of a controller
+ * @c:	Controller instance
+ *
+ * Return: The state read from sysfs, %NVME_CTRL_STATE_UNKNOWN if it
+ * could not be read
+ */
+enum nvme_ctrl_state nvme_ctrl_refresh_state(nvme_ctrl_t c);
+
+/**
+ * typedef nvme_state_monitor_t - Controller state change monitor
+ *
+ * Created by nvme_state_monitor_create().
+ */
+typedef struct nvme_state_monitor *nvme_state_monitor_t;
+
+/**
+ * typedef nvme_state_change_fn - Controller state change callback
+ * @c:		Controller whose state changed
+ * @old:	Previously cached state
+ * @state:	New state
+ * @arg:	Argument passed to nvme_state_monitor_process()
+ */
+typedef void (*nvme_state_change_fn)(nvme_ctrl_t c, enum nvme_ctrl_state old,
+				     enum nvme_ctrl_state state, void *arg);
+
+/**
+ * nvme_state_monitor_create() - Monitor controller state changes
+ * @r:	&nvme_root_t object
+ *
+ * Listens for kernel uevents of the controllers in @r. The kernel only
+ * sends them when a controller is added, removed or reconnected, not on
+ * every transition between live, resetting, connecting and deleting.
+ * To be notified of those as well, set a refresh interval with
+ * nvme_state_monitor_set_interval(). Controllers added to the system
+ * afterwards are picked up once they are scanned into @r.
+ *
+ * Return: The monitor, or NULL with errno set on failure
+ */
+nvme_state_monitor_t nvme_state_monitor_create(nvme_root_t r);
+
+/**
+ * nvme_state_monitor_get_fd() - Pollable descriptor of a state monitor
+ * @m:	Monitor returned by nvme_state_monitor_create()
+ *
+ * The descriptor becomes readable when events are pending. Call
+ * nvme_state_monitor_process() then.
+ *
+ * Return: The file descriptor
+ */
+int nvme_state_monitor_get_fd(nvme_state_monitor_t m);
+
+/**
+ * nvme_state_monitor_set_interval() - Periodically refresh all controllers
+ * @m:		Monitor returned by nvme_state_monitor_create()
+ * @interval_ms: Refresh interval in milliseconds, 0 to disable
+ *
+ * The descriptor of @m also becomes readable each time the interval
+ * elapses, and nvme_state_monitor_process() then refreshes every
+ * controller. This reports the transitions the kernel sends no uevent
+ * for, at most @interval_ms late. The refresh is disabled by default.
+ *
+ * Return: 0 on success, or -1 with errno set on failure
+ */
+int nvme_state_monitor_set_interval(nvme_state_monitor_t m,
+				    unsigned int interval_ms);
+
+/**
+ * nvme_state_monitor_process() - Handle pending controller events
+ * @m:	Monitor returned by nvme_state_monitor_create()
+ * @fn:	Callback invoked for each controller whose state changed, or NULL
+ * @arg: Argument passed to @fn
+ *
+ * Refreshes the cached state of each controller an event was received
+ * for. If events were lost or the refresh interval elapsed, all
+ * controllers are refreshed. Without a refresh interval, only the
+ * transitions the kernel sends a uevent for are reported, see
+ * nvme_state_monitor_create(). Does not block. Only needs the read lock
+ * of the tree.
+ *
+ * Return: The number of controllers whose state changed, or -1 with
+ * errno set on failure
+ */
+int nvme_state_monitor_process(nvme_state_monitor_t m,
+			       nvme_state_change_fn fn, void *arg);
+
+/**
+ * nvme_state_monitor_free() - Free a state monitor
+ * @m:	Monitor returned by nvme_state_monitor_create()
+ */
+void nvme_state_monitor_free(nvme_state_monitor_t m);
+
 /**
  * nvme_ctrl_get_numa_node() - NUMA node of a controller
  * @c:	Controller instance
@@ -966,6 +1166,240 @@ bool nvme_ctrl_is_discovery_ctrl(nvme_ctrl_t c);
  */
 int nvme_ctrl_identify(nvme_ctrl_t c, struct nvme_id_ctrl *id);
 
+/**
+ * nvme_ctrl_get_max_xfer_len() - Largest data transfer size of a controller
+ * @c:	Controller instance
+ *
+ * Derived from the MDTS field of the Identify Controller data, which is
+ * fetched once and cached in @c until it is deconfigured. The value is
+ * capped to keep buffers bounded and to stay within the limits of the
+ * kernel.
+ *
+ * Return: Transfer size in bytes, or 4096, which every controller
+ * supports, if the controller could not be identified
+ */
+__u32 nvme_ctrl_get_max_xfer_len(nvme_ctrl_t c);
+
+/**
+ * nvme_ctrl_get_log_page() - Get log page data from a controller
+ * @c:		Controller instance
+ * @args:	&struct nvme_get_log_args argument structure; the fd field is
+ *		filled in from @c
+ *
+ * Like nvme_get_log_page(), but the log is split into transfers of
+ * nvme_ctrl_get_max_xfer_len() bytes.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_ctrl_get_log_page(nvme_ctrl_t c, struct nvme_get_log_args *args);
+
+/**
+ * nvme_ctrl_fw_download_seq() - Firmware download sequence on a controller
+ * @c:		Controller instance
+ * @size:	Total size of the firmware image to transfer
+ * @offset:	Starting offset to send with this firmware download
+ * @buf:	Address of buffer containing all or part of the firmware image.
+ *
+ * Like nvme_fw_download_seq(), with the piece size derived from the cached
+ * MDTS and Firmware Update Granularity of @c.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_ctrl_fw_download_seq(nvme_ctrl_t c, __u32 size, __u32 offset,
+			      void *buf);
+
+/**
+ * nvme_ctrl_ana_refresh() - Update the cached ANA log of a controller
+ * @c:		Controller instance
+ * @groups_only: Only group states are needed, not the namespace lists
+ *
+ * The first call reads the ANA log into a buffer sized from Identify
+ * Controller and indexes the group descriptors by ANA group id. Later
+ * calls only read the log header and fetch the full log again if the
+ * change count has advanced, nvme_ctrl_ana_invalidate() was called, or
+ * namespace lists are requested after a @groups_only fetch. The ANA state
+ * of the paths of @c is updated from the cached group states.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise; errno is
+ * %ENOTSUP if the controller does not report ANA.
+ */
+int nvme_ctrl_ana_refresh(nvme_ctrl_t c, bool groups_only);
+
+/**
+ * nvme_ctrl_ana_invalidate() - Mark the cached ANA log as outdated
+ * @c:		Controller instance
+ *
+ * Call this on an ANA change asynchronous event so the next
+ * nvme_ctrl_ana_refresh() fetches the full log.
+ */
+void nvme_ctrl_ana_invalidate(nvme_ctrl_t c);
+
+/**
+ * nvme_ctrl_ana_group() - Look up a cached ANA group descriptor
+ * @c:		Controller instance
+ * @grpid:	ANA group identifier
+ *
+ * The descriptor only carries namespace identifiers if the cache was last
+ * refreshed with @groups_only unset. It remains valid until the next
+ * refresh of @c.
+ *
+ * Return: The group descriptor, or NULL with errno set to %ENOENT if the
+ * cache is not valid or holds no such group
+ */
+struct nvme_ana_group_desc *nvme_ctrl_ana_group(nvme_ctrl_t c, __u32 grpid);
+
+/**
+ * typedef nvme_health_sampler_t - Periodic SMART / health sampler
+ *
+ * Created by nvme_health_sampler_create().
+ */
+typedef struct nvme_health_sampler *nvme_health_sampler_t;
+
+/**
+ * struct nvme_health_snapshot - Health of all sampled controllers
+ * @interval:		Seconds since the previous sample, 0 for the first one
+ * @nr_ctrls:		Number of entries in each of the arrays below
+ * @ctrls:		Sampled controllers
+ * @status:		0 on success, the nvme status if the SMART / Health log
+ *			read failed, or a negative errno value
+ * @data_units_read:	Data units read during @interval
+ * @data_units_written:	Data units written during @interval
+ * @host_read_cmds:	Host read commands completed during @interval
+ * @host_write_cmds:	Host write commands completed during @interval
+ * @media_errors:	Media and data integrity errors during @interval
+ * @media_units_written: Media units written during @interval, from the
+ *			Endurance Group log if one was requested and read
+ * @read_bytes_rate:	Bytes read per second
+ * @write_bytes_rate:	Bytes written per second
+ * @read_cmds_rate:	Read commands per second
+ * @write_cmds_rate:	Write commands per second
+ * @media_errors_rate:	Media errors per second
+ * @temperature:	Composite temperature in Kelvin
+ * @temperature_delta:	Change of @temperature during @interval
+ * @percent_used:	Percentage used, from the Endurance Group log if one
+ *			was requested and read, from the SMART / Health log
+ *			otherwise
+ * @critical_warning:	Critical warning bits, see &enum nvme_smart_crit
+ * @endgrp_status:	Like @status, for the Endurance Group log. Controllers
+ *			without the requested endurance group still report
+ *			the SMART / Health data.
+ *
+ * All counters are the difference between two samples, saturated to 64
+ * bit. They are 0 if either sample of a controller failed or a counter
+ * went backwards. @temperature, @percent_used and @critical_warning are
+ * 0 if the current sample failed, check @status to tell this apart from
+ * a controller reporting 0.
+ */
+struct nvme_health_snapshot {
+	double interval;
+	int nr_ctrls;
+	nvme_ctrl_t *ctrls;
+	int *status;
+	__u64 *data_units_read;
+	__u64 *data_units_written;
+	__u64 *host_read_cmds;
+	__u64 *host_write_cmds;
+	__u64 *media_errors;
+	__u64 *media_units_written;
+	double *read_bytes_rate;
+	double *write_bytes_rate;
+	double *read_cmds_rate;
+	double *write_cmds_rate;
+	double *media_errors_rate;
+	__u16 *temperature;
+	__s16 *temperature_delta;
+	__u8 *percent_used;
+	__u8 *critical_warning;
+	int *endgrp_status;
+};
+
+/**
+ * nvme_health_sampler_create() - Create a health sampler for a tree
+ * @r:		&nvme_root_t object
+ * @endgid:	Endurance group to read in addition to SMART, or 0 for none
+ *
+ * The controllers in @r are captured at creation time. Create a new
+ * sampler when the tree changes.
+ *
+ * Return: The sampler, or NULL with errno set on failure
+ */
+nvme_health_sampler_t nvme_health_sampler_create(nvme_root_t r, __u16 endgid);
+
+/**
+ * nvme_health_sampler_free() - Free a health sampler
+ * @hs:		Sampler returned by nvme_health_sampler_create()
+ */
+void nvme_health_sampler_free(nvme_health_sampler_t hs);
+
+/**
+ * nvme_health_sample() - Sample the health of all controllers
+ * @hs:		Health sampler
+ * @max_threads: Maximum number of concurrent log reads, or 0 for the
+ *		library default
+ *
+ * Reads the SMART / Health log, and the Endurance Group log if requested,
+ * of every controller concurrently. The result is compared with the
+ * previous sample.
+ *
+ * Return: The snapshot, valid until the next call on @hs
+ */
+const struct nvme_health_snapshot *
+nvme_health_sample(nvme_health_sampler_t hs, int max_threads);
+
+/**
+ * nvme_ctrl_get_cmd_effects() - Look up the effects of a command
+ * @c:		Controller instance
+ * @csi:	Command Set Identifier of the command
+ * @admin:	@opcode is an admin command opcode
+ * @opcode:	Command opcode
+ * @effects:	Returns the effects, see &enum nvme_cmd_effects
+ *
+ * The Commands Supported and Effects log is read once per command set and
+ * cached until the controller is reconfigured or a command with
+ * %NVME_CMD_EFFECTS_CCC set completes through nvme_ctrl_submit_passthru().
+ * The effects of namespace management, format and sanitize are always
+ * reported. If the controller does not support the log, all other commands
+ * report no effects, not even %NVME_CMD_EFFECTS_CSUPP.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_ctrl_get_cmd_effects(nvme_ctrl_t c, enum nvme_csi csi, bool admin,
+			      __u8 opcode, __u32 *effects);
+
+/**
+ * nvme_ctrl_submit_passthru() - Submit a passthrough command by its effects
+ * @c:		Controller instance
+ * @admin:	@cmd is an admin command, otherwise an I/O command for the
+ *		namespace @cmd->nsid
+ * @cmd:	Passthrough command
+ * @result:	Optional field to return the result from the CQE dword 0
+ * @rescan:	Optional, set to whether the namespace inventory or
+ *		capabilities changed
+ *
+ * Commands of @c submitted through this function run concurrently unless
+ * their effects (see nvme_ctrl_get_cmd_effects()) require a restricted
+ * submission and execution, or an admin command changes namespace
+ * inventory or capabilities, LBA content or controller capabilities. Those
+ * run alone. Admin commands without known effects are serialised as well.
+ *
+ * The tree is not modified, so holding the read lock of the root is
+ * enough. After a successful command which changes the namespace
+ * inventory or capabilities @rescan is set; the caller then updates the
+ * tree with nvme_ctrl_rescan_ns() for @cmd->nsid under the write lock.
+ * After a controller capability change the cached transfer sizes, ANA
+ * log and command effects are dropped.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_ctrl_submit_passthru(nvme_ctrl_t c, bool admin,
+			      struct nvme_passthru_cmd *cmd, __u32 *result,
+			      bool *rescan);
+
 /**
  * nvme_disconnect_ctrl() - Disconnect a controller
  * @c:	Controller instance
@@ -993,6 +1427,22 @@ nvme_ctrl_t nvme_scan_ctrl(nvme_root_t r, const char *name);
  */
 void nvme_rescan_ctrl(nvme_ctrl_t c);
 
+/**
+ * nvme_ctrl_rescan_ns() - Rescan a single namespace of a controller
+ * @c:		Controller instance
+ * @nsid:	Namespace identifier
+ *
+ * Updates the namespaces and paths of @c, and the namespaces of its
+ * subsystem, with identifier @nsid from sysfs. Namespaces which are gone
+ * are removed from the tree, and the paths of the other controllers of
+ * the subsystem are linked to the new subsystem namespace. An @nsid of 0
+ * or %NVME_NSID_ALL rescans the whole controller as nvme_rescan_ctrl()
+ * does. Requires the write lock of the root.
+ *
+ * Return: 0 on success, -1 with errno set otherwise.
+ */
+int nvme_ctrl_rescan_ns(nvme_ctrl_t c, __u32 nsid);
+
 /**
  * nvme_init_ctrl() - Initialize nvme_ctrl_t object for an existing controller.
  * @h:		nvme_host_t object
@@ -1108,7 +1558,10 @@ int nvme_read_config(nvme_root_t r, const char *config_file);
  * nvme_refresh_topology() - Refresh nvme_root_t object contents
  * @r:	nvme_root_t object
  *
- * Removes all elements in @r and rescans the existing topology.
+ * Removes all elements in @r and rescans the existing topology. The
+ * topology is scanned into a new tree while readers keep traversing the
+ * old one, which is then replaced under the write lock. Must not be
+ * called with the lock of @r held.
  */
 void nvme_refresh_topology(nvme_root_t r);
 
@@ -1116,7 +1569,12 @@ void nvme_refresh_topology(nvme_root_t r);
  * nvme_update_config() - Update JSON configuration
  * @r:	nvme_root_t object
  *
- * Updates the JSON configuration file with the contents of @r.
+ * Updates the JSON configuration file with the contents of @r if
+ * anything was modified since it was read or last updated. The new
+ * contents are written to a temporary file which is synced and renamed
+ * over the configuration file, under an advisory lock on
+ * '<config file>.lock'. The file is left untouched if its contents
+ * would not change.
  *
  * Return: 0 on success, -1 on failure.
  */
@@ -1144,6 +1602,64 @@ int nvme_dump_config(nvme_root_t r);
  */
 int nvme_dump_tree(nvme_root_t r);
 
+/**
+ * nvme_dump_tree_fd() - Dump internal object tree to a file descriptor
+ * @r:	nvme_root_t object
+ * @fd:	File descriptor to write to
+ *
+ * Writes the same JSON as nvme_dump_tree() to @fd. The tree is written
+ * while it is walked, through a fixed size buffer.
+ *
+ * Return: 0 on success, -1 on failure.
+ */
+int nvme_dump_tree_fd(nvme_root_t r, int fd);
+
+/**
+ * nvme_dump_tree_file() - Dump internal object tree to a stream
+ * @r:	nvme_root_t object
+ * @fp:	Stream to write to
+ *
+ * Writes the same JSON as nvme_dump_tree() to @fp and flushes it.
+ *
+ * Return: 0 on success, -1 on failure.
+ */
+int nvme_dump_tree_file(nvme_root_t r, FILE *fp);
+
+/**
+ * nvme_snapshot_save() - Save the object tree as a binary snapshot
+ * @r:		nvme_root_t object
+ * @path:	Snapshot file
+ *
+ * Writes hosts, subsystems, controllers, namespaces and paths of @r,
+ * including the namespace identification data, to @path so that
+ * nvme_snapshot_load() can recreate the tree without scanning sysfs.
+ * The file is replaced atomically, so a daemon can keep a snapshot
+ * in e.g. /run up to date for other processes to load. DH-HMAC-CHAP
+ * keys are not saved; read them from the configuration file with
+ * nvme_read_config() after loading the snapshot.
+ *
+ * Return: 0 on success, -1 with errno set otherwise.
+ */
+int nvme_snapshot_save(nvme_root_t r, const char *path);
+
+/**
+ * nvme_snapshot_load() - Load the object tree from a binary snapshot
+ * @r:		nvme_root_t object without any hosts
+ * @path:	Snapshot file written by nvme_snapshot_save()
+ *
+ * Maps @path, validates it and recreates the object tree in @r. The
+ * snapshot is only used if the controllers, subsystems and namespaces
+ * in sysfs are the same as when it was taken; device files are opened
+ * on first use. On failure callers should fall back to
+ * nvme_scan_topology().
+ *
+ * Return: 0 on success, -1 with errno set otherwise: ESTALE if the
+ * topology changed since the snapshot was taken, EPROTO if @path is
+ * not a valid snapshot of this libnvme version, EBUSY if @r already
+ * contains hosts.
+ */
+int nvme_snapshot_load(nvme_root_t r, const char *path);
+
 /**
  * nvme_get_attr() - Read sysfs attribute
  * @d:		sysfs directory
@@ -4108,6 +4108,22 @@ struct nvme_lba_status {
 	struct nvme_lba_status_desc descs[];
 };
 
+/**
+ * enum nvme_lba_status_cmpc - Get LBA Status Completion Condition
+ * @NVME_LBA_STATUS_CMPC_NO_CMPC:	No indication of the completion
+ *					condition
+ * @NVME_LBA_STATUS_CMPC_INCOMPLETE:	The command completed because the
+ *					Maximum Number of Dwords was reached
+ * @NVME_LBA_STATUS_CMPC_COMPLETE:	The command completed because the
+ *					Range Length or the end of the
+ *					namespace was reached
+ */
+enum nvme_lba_status_cmpc {
+	NVME_LBA_STATUS_CMPC_NO_CMPC	= 0x0,
+	NVME_LBA_STATUS_CMPC_INCOMPLETE	= 0x1,
+	NVME_LBA_STATUS_CMPC_COMPLETE	= 0x2,
+};
+
 /**
  * struct nvme_feat_auto_pst - Autonomous Power State Transition
  * @apst_entry: See &enum nvme_apst_entry
@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 
 #include <sys/param.h>
 #include <sys/types.h>
@@ -706,6 +708,56 @@ static size_t copy_value(char *buf, size_t buflen, const char *value)
 	return val_len;
 }
 
+struct nvme_parallel {
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int nr;
+	int next;
+};
+
+static void *nvme_parallel_worker(void *data)
+{
+	struct nvme_parallel *p = data;
+	int i;
+
+	while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->nr)
+		p->fn(p->arg, i);
+
+	return NULL;
+}
+
+void nvme_run_parallel(int nr, int max_threads,
+		       void (*fn)(void *arg, int i), void *arg)
+{
+	struct nvme_parallel p = {
+		.fn = fn,
+		.arg = arg,
+		.nr = nr,
+	};
+	pthread_t *threads = NULL;
+	int i, nr_threads, started = 0;
+
+	if (max_threads <= 0)
+		max_threads = NVME_PARALLEL_MAX_THREADS;
+	/* the calling thread takes part in the work */
+	nr_threads = MIN(nr, max_threads) - 1;
+	if (nr_threads > 0)
+		threads = calloc(nr_threads, sizeof(*threads));
+
+	for (i = 0; threads && i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL,
+				   nvme_parallel_worker, &p))
+			break;
+		started++;
+	}
+
+	nvme_parallel_worker(&p);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
 size_t get_entity_name(char *buffer, size_t bufsz)
 {
 	size_t len = !gethostname(buffer, bufsz) ? strlen(buffer) : 0;
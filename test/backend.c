@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Runs commands against the simulated controller, records them and
+ * checks that replaying the recording gives the same results.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/endian/endian.h>
+
+#include <libnvme.h>
+
+#define NR_BLOCKS	64
+#define BLOCK_SIZE	512
+
+/* The backends ignore the file descriptor */
+static const int fd = -1;
+
+static int io(__u8 opcode, __u32 nsid, __u64 slba, __u16 nlb, void *buf)
+{
+	struct nvme_passthru_cmd cmd = {
+		.opcode = opcode,
+		.nsid = nsid,
+		.addr = (__u64)(uintptr_t)buf,
+		.data_len = (nlb + 1) * BLOCK_SIZE,
+		.cdw10 = slba & 0xffffffff,
+		.cdw11 = slba >> 32,
+		.cdw12 = nlb,
+	};
+
+	return nvme_submit_io_passthru(fd, &cmd, NULL);
+}
+
+static int read64(__u32 nsid, __u64 slba, __u16 nlb, void *buf)
+{
+	struct nvme_passthru_cmd64 cmd = {
+		.opcode = nvme_cmd_read,
+		.nsid = nsid,
+		.addr = (__u64)(uintptr_t)buf,
+		.data_len = (nlb + 1) * BLOCK_SIZE,
+		.cdw10 = slba & 0xffffffff,
+		.cdw11 = slba >> 32,
+		.cdw12 = nlb,
+	};
+
+	return nvme_submit_io_passthru64(fd, &cmd, NULL);
+}
+
+/* Commands which are both run on the simulator and replayed */
+static void run(void)
+{
+	__u8 wbuf[4 * BLOCK_SIZE], rbuf[4 * BLOCK_SIZE];
+	struct nvme_error_log_page err_log[4];
+	struct nvme_id_ctrl id;
+	struct nvme_id_ns ns;
+	struct nvme_ns_list list;
+	__u32 result;
+	int i;
+
+	assert(!nvme_identify_ctrl(fd, &id));
+	assert(!memcmp(id.mn, "libnvme simulated controller", 28));
+	assert(le32_to_cpu(id.nn) == 2);
+
+	assert(!nvme_identify_ns(fd, 2, &ns));
+	assert(le64_to_cpu(ns.nsze) == NR_BLOCKS);
+	assert(ns.lbaf[0].ds == 9);
+	assert(nvme_identify_ns(fd, 3, &ns) == NVME_SC_INVALID_NS);
+
+	assert(!nvme_identify_active_ns_list(fd, 0, &list));
+	assert(le32_to_cpu(list.ns[0]) == 1 && le32_to_cpu(list.ns[1]) == 2);
+	assert(!list.ns[2]);
+
+	memset(err_log, 0xff, sizeof(err_log));
+	assert(!nvme_get_log_error(fd, 4, true, err_log));
+	assert(!err_log[3].error_count);
+
+	assert(!nvme_set_features_arbitration(fd, 1, 2, 3, 4, false, &result));
+	assert(!nvme_get_features_arbitration(fd, 0, &result));
+	assert(result == (1 | 2 << 8 | 3 << 16 | 4 << 24));
+
+	for (i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = i * 7;
+	assert(!io(nvme_cmd_write, 1, 10, 3, wbuf));
+	assert(!read64(1, 10, 3, rbuf));
+	assert(!memcmp(wbuf, rbuf, sizeof(rbuf)));
+	assert(!read64(2, 10, 3, rbuf));
+	assert(!rbuf[0] && !rbuf[sizeof(rbuf) - 1]);
+	assert(io(nvme_cmd_read, 1, NR_BLOCKS - 2, 3, rbuf) ==
+	       NVME_SC_LBA_RANGE);
+	assert(!nvme_flush(fd, 1));
+}
+
+int main(int argc, char **argv)
+{
+	struct nvme_sim_config cfg = {
+		.nr_namespaces = 2,
+		.ns_blocks = NR_BLOCKS,
+	};
+	char path[] = "/tmp/libnvme-record-XXXXXX";
+	struct nvme_recorder *rec;
+	struct nvme_replay *rp;
+	struct nvme_id_ctrl id;
+	struct nvme_sim *sim;
+	int tmp, i, failed;
+	__u32 zero = 0;
+
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+	nvme_set_submit_backend(nvme_sim_submit, sim);
+	run();
+	nvme_sim_free(sim);
+
+	/* Every second command fails, on average */
+	cfg.fail_ppm = 500000;
+	cfg.fail_status = NVME_SC_NS_NOT_READY;
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+	nvme_set_submit_backend(nvme_sim_submit, sim);
+	for (i = 0, failed = 0; i < 1000; i++) {
+		int err = nvme_identify_ctrl(fd, &id);
+
+		assert(!err || err == NVME_SC_NS_NOT_READY);
+		failed += !!err;
+	}
+	assert(failed > 400 && failed < 600);
+	nvme_sim_free(sim);
+
+	/* Record a run against the simulator and replay it */
+	tmp = mkstemp(path);
+	assert(tmp >= 0);
+	close(tmp);
+	cfg.fail_ppm = 0;
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+	rec = nvme_recorder_open(path, nvme_sim_submit, sim);
+	assert(rec);
+	nvme_set_submit_backend(nvme_recorder_submit, rec);
+	run();
+	assert(!nvme_recorder_close(rec));
+	nvme_sim_free(sim);
+
+	rp = nvme_replay_open(path);
+	assert(rp);
+	nvme_set_submit_backend(nvme_replay_submit, rp);
+	run();
+	/* Repeats the last matching record */
+	run();
+	assert(nvme_identify_ns(fd, 1, (struct nvme_id_ns *)&id) < 0 &&
+	       errno == ENODATA);
+	nvme_replay_close(rp);
+
+	nvme_set_submit_backend(NULL, NULL);
+	assert(nvme_identify_ctrl(fd, &id) < 0 && errno == EBADF);
+
+	/*
+	 * Shrink the buffer of the first command below its recorded data,
+	 * skipping the 16 byte file header and the 24 bytes of the record
+	 * which precede the command.
+	 */
+	tmp = open(path, O_WRONLY);
+	assert(tmp >= 0);
+	assert(pwrite(tmp, &zero, sizeof(zero), 16 + 24 +
+		      offsetof(struct nvme_passthru_cmd64, data_len)) ==
+	       sizeof(zero));
+	close(tmp);
+	assert(!nvme_replay_open(path) && errno == EPROTO);
+
+	assert(truncate(path, 20) == 0);
+	assert(!nvme_replay_open(path) && errno == EPROTO);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Times reading generated JSON configuration files of increasing size.
+ * Each size is measured with all ports in a single subsystem and with
+ * one port per subsystem, reading into an empty tree and merging into
+ * the tree from the first read.
+ *
+ * Usage: test-config-bench [entries...]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libnvme.h>
+
+static void write_config(FILE *fp, int entries, int ports_per_subsys)
+{
+	int i;
+
+	fprintf(fp, "[\n  {\n    \"hostnqn\":\"nqn.2014-08.org.nvmexpress:uuid:bench\",\n"
+		"    \"subsystems\":[\n");
+	for (i = 0; i < entries; i++) {
+		if (!(i % ports_per_subsys))
+			fprintf(fp, "%s      {\n        \"nqn\":\"nqn.2019-08.org.example:subsys%d\",\n"
+				"        \"ports\":[\n", i ? ",\n" : "",
+				i / ports_per_subsys);
+		fprintf(fp, "          {\n"
+			"            \"transport\":\"tcp\",\n"
+			"            \"traddr\":\"10.%d.%d.%d\",\n"
+			"            \"trsvcid\":\"4420\",\n"
+			"            \"nr_io_queues\":4,\n"
+			"            \"hdr_digest\":true\n"
+			"          }%s\n",
+			(i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff,
+			(i + 1) % ports_per_subsys && i + 1 < entries ?
+			"," : "\n        ]\n      }");
+	}
+	fprintf(fp, "\n    ]\n  }\n]\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(const char *path, int entries, int ports_per_subsys)
+{
+	double start, read, merge;
+	nvme_root_t r;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+	write_config(fp, entries, ports_per_subsys);
+	fclose(fp);
+
+	r = nvme_create_root(NULL, LOG_ERR);
+	if (!r)
+		return -1;
+	start = now();
+	if (nvme_read_config(r, path))
+		return -1;
+	read = now() - start;
+	start = now();
+	if (nvme_read_config(r, path))
+		return -1;
+	merge = now() - start;
+	nvme_free_tree(r);
+
+	printf("%8d entries, %8d ports/subsystem: read %9.3f ms, merge %9.3f ms\n",
+	       entries, ports_per_subsys, read * 1e3, merge * 1e3);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1000, 10000, 100000 };
+	char path[] = "/tmp/libnvme-config-bench-XXXXXX";
+	int fd, i, n, ret = EXIT_SUCCESS;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	for (i = 0; i < (argc > 1 ? argc - 1 : 3); i++) {
+		n = argc > 1 ? atoi(argv[i + 1]) : sizes[i];
+		if (n <= 0)
+			continue;
+		if (bench(path, n, n) || bench(path, n, 1)) {
+			fprintf(stderr, "failed to read %s\n", path);
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	unlink(path);
+	return ret;
+}
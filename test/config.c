@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Reads a JSON configuration file and checks the resulting tree against
+ * a reference dump, that writing it back preserves the tree, and that
+ * malformed files are rejected.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libnvme.h>
+
+static const char *malformed[] = {
+	"",
+	"[",
+	"[{\"hostnqn\": \"nqn.x\",\n \"subsystems\": [ {\"nqn\": \"y\",, } ]}]",
+	"[{\"hostnqn\": \"nqn.\x01\"}]",
+	"[{\"hostnqn\": \"nqn.\\q\"}]",
+	"[{\"hostnqn\": \"nqn.\\ud800\"}]",
+	"[{\"queue_size\": 01}]",
+	"[{\"queue_size\": 1.}]",
+	"[{\"discovery\": tru}]",
+	"[{\"hostnqn\" \"nqn.x\"}]",
+	"[1, 2",
+	"[1, 2] x",
+	"[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]",
+};
+
+static char *read_all(FILE *fp, size_t *len)
+{
+	char *buf = NULL;
+	size_t size = 0;
+
+	*len = 0;
+	rewind(fp);
+	for (;;) {
+		size_t n;
+
+		buf = realloc(buf, size + 4096);
+		assert(buf);
+		n = fread(buf + size, 1, 4096, fp);
+		size += n;
+		if (n < 4096)
+			break;
+	}
+	*len = size;
+	return buf;
+}
+
+static void check(const char *what, nvme_root_t r, const char *ref,
+		  size_t ref_len)
+{
+	FILE *out;
+	size_t len;
+	char *buf;
+
+	out = tmpfile();
+	assert(out);
+	assert(!nvme_dump_tree_file(r, out));
+	buf = read_all(out, &len);
+	fclose(out);
+	if (len != ref_len || memcmp(buf, ref, len)) {
+		fprintf(stderr, "%s: output differs from reference\n", what);
+		fwrite(buf, 1, len, stderr);
+		exit(EXIT_FAILURE);
+	}
+	free(buf);
+}
+
+static void copy_file(const char *from, const char *to)
+{
+	FILE *in, *out;
+	size_t len;
+	char *buf;
+
+	in = fopen(from, "r");
+	assert(in);
+	buf = read_all(in, &len);
+	fclose(in);
+	out = fopen(to, "w");
+	assert(out);
+	assert(fwrite(buf, 1, len, out) == len);
+	fclose(out);
+	free(buf);
+}
+
+static void check_update(const char *config_file, const char *update_file)
+{
+	char path[] = "/tmp/libnvme-config-XXXXXX";
+	char lock[sizeof(path) + 5];
+	size_t ref_len, len;
+	nvme_subsystem_t s;
+	struct stat st;
+	nvme_root_t r;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	char *ref, *buf;
+	FILE *fp;
+	ino_t ino;
+	int fd;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	copy_file(config_file, path);
+
+	fp = fopen(update_file, "r");
+	assert(fp);
+	ref = read_all(fp, &ref_len);
+	fclose(fp);
+
+	r = nvme_create_root(NULL, LOG_ERR);
+	assert(r);
+	assert(!nvme_read_config(r, path));
+	assert(!nvme_update_config(r));
+	fp = fopen(path, "r");
+	assert(fp);
+	buf = read_all(fp, &len);
+	fclose(fp);
+	if (len != ref_len || memcmp(buf, ref, len)) {
+		fprintf(stderr, "update: output differs from reference\n");
+		fwrite(buf, 1, len, stderr);
+		exit(EXIT_FAILURE);
+	}
+	free(buf);
+	free(ref);
+
+	/* An update without changes must not replace the file */
+	assert(!stat(path, &st));
+	ino = st.st_ino;
+	nvme_for_each_host(r, h)
+		nvme_for_each_subsystem(h, s)
+			nvme_subsystem_for_each_ctrl(s, c)
+				nvme_ctrl_set_discovery_ctrl(c,
+					nvme_ctrl_is_discovery_ctrl(c));
+	assert(!nvme_update_config(r));
+	assert(!stat(path, &st));
+	assert(st.st_ino == ino);
+	nvme_free_tree(r);
+
+	unlink(path);
+	sprintf(lock, "%s.lock", path);
+	unlink(lock);
+}
+
+static void check_malformed(void)
+{
+	char path[] = "/tmp/libnvme-config-XXXXXX";
+	nvme_root_t r;
+	int fd, i;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	for (i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+		FILE *fp = fopen(path, "w");
+
+		assert(fp);
+		fputs(malformed[i], fp);
+		fclose(fp);
+
+		r = nvme_create_root(NULL, LOG_CRIT);
+		assert(r);
+		errno = 0;
+		if (nvme_read_config(r, path) != -1 || errno != EPROTO) {
+			fprintf(stderr, "malformed config %d accepted\n", i);
+			exit(EXIT_FAILURE);
+		}
+		nvme_free_tree(r);
+	}
+	unlink(path);
+
+	/* A missing configuration file is not an error */
+	r = nvme_create_root(NULL, LOG_CRIT);
+	assert(r);
+	assert(!nvme_read_config(r, path));
+	nvme_free_tree(r);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *ref_fp;
+	nvme_root_t r;
+	size_t ref_len;
+	char *ref;
+
+	assert(argc > 1);
+	r = nvme_create_root(NULL, LOG_ERR);
+	assert(r);
+	assert(!nvme_read_config(r, argv[1]));
+
+	/* Without a reference file print the dump, to create one */
+	if (argc < 3)
+		return nvme_dump_tree(r) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	ref_fp = fopen(argv[2], "r");
+	assert(ref_fp);
+	ref = read_all(ref_fp, &ref_len);
+	fclose(ref_fp);
+
+	check("read", r, ref, ref_len);
+	/* Merging the same file again must not change the tree */
+	assert(!nvme_read_config(r, argv[1]));
+	check("merge", r, ref, ref_len);
+	nvme_free_tree(r);
+
+	free(ref);
+
+	if (argc > 3)
+		check_update(argv[1], argv[3]);
+
+	check_malformed();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Runs a copy plan against a simulated controller which advertises Copy
+ * but rejects it, and checks the fallback to Read and Write, and that it
+ * is refused where Read and Write cannot move the data.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ccan/endian/endian.h>
+
+#include <libnvme.h>
+
+#define NR_BLOCKS	64
+#define BLOCK_SIZE	512
+
+/* The backends ignore the file descriptor */
+static const int fd = -1;
+
+static struct nvme_sim *sim;
+static bool metadata;
+static __u8 mdts, ds;
+static int nr_copies, nr_writes;
+
+static int submit(void *arg, int fd, bool admin,
+		  struct nvme_passthru_cmd64 *cmd)
+{
+	int ret;
+
+	if (!admin && cmd->opcode == nvme_cmd_copy)
+		nr_copies++;
+	if (!admin && cmd->opcode == nvme_cmd_write)
+		nr_writes++;
+
+	ret = nvme_sim_submit(sim, fd, admin, cmd);
+	if (ret || !admin || cmd->opcode != nvme_admin_identify)
+		return ret;
+
+	if ((cmd->cdw10 & 0xff) == NVME_IDENTIFY_CNS_CTRL) {
+		struct nvme_id_ctrl *id = (void *)(uintptr_t)cmd->addr;
+
+		id->oncs |= cpu_to_le16(NVME_CTRL_ONCS_COPY);
+		id->ocfs = cpu_to_le16(1);
+		id->mdts = mdts;
+	} else if ((cmd->cdw10 & 0xff) == NVME_IDENTIFY_CNS_NS) {
+		struct nvme_id_ns *ns = (void *)(uintptr_t)cmd->addr;
+
+		if (metadata)
+			ns->lbaf[0].ms = cpu_to_le16(8);
+		if (ds)
+			ns->lbaf[0].ds = ds;
+	}
+	return ret;
+}
+
+static void io(__u8 opcode, __u64 slba, __u16 nlb, void *buf)
+{
+	struct nvme_passthru_cmd cmd = {
+		.opcode = opcode,
+		.nsid = 1,
+		.addr = (__u64)(uintptr_t)buf,
+		.data_len = (nlb + 1) * BLOCK_SIZE,
+		.cdw10 = slba & 0xffffffff,
+		.cdw11 = slba >> 32,
+		.cdw12 = nlb,
+	};
+
+	assert(!nvme_submit_io_passthru(fd, &cmd, NULL));
+}
+
+static void fallback(void)
+{
+	__u8 wbuf[4 * BLOCK_SIZE], rbuf[4 * BLOCK_SIZE];
+	nvme_copy_plan_t p;
+	__u32 n;
+	int i;
+
+	for (i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = i * 7;
+	io(nvme_cmd_write, 0, 3, wbuf);
+
+	p = nvme_copy_plan_create(fd, 1);
+	assert(p);
+	assert(nvme_copy_plan_format(p) == 0);
+	assert(!nvme_copy_plan_add(p, 0, 4, 32));
+
+	nr_copies = nr_writes = 0;
+	assert(!nvme_copy_plan_submit(p, 1, &n));
+	assert(n == 1 && nr_copies == 1 && nr_writes == 1);
+	assert(nvme_copy_plan_format(p) == -1);
+
+	io(nvme_cmd_read, 32, 3, rbuf);
+	assert(!memcmp(wbuf, rbuf, sizeof(rbuf)));
+	nvme_copy_plan_free(p);
+}
+
+static void no_fallback_with_metadata(void)
+{
+	nvme_copy_plan_t p;
+
+	metadata = true;
+	p = nvme_copy_plan_create(fd, 1);
+	assert(p);
+	assert(!nvme_copy_plan_add(p, 0, 4, 32));
+
+	nr_copies = nr_writes = 0;
+	errno = 0;
+	assert(nvme_copy_plan_submit(p, 1, NULL) == -1);
+	assert(errno == ENOTSUP);
+	assert(nr_copies == 1 && nr_writes == 0);
+	assert(nvme_copy_plan_format(p) == 0);
+	nvme_copy_plan_free(p);
+	metadata = false;
+}
+
+static void no_fallback_with_large_lba(void)
+{
+	struct nvme_sim_config cfg = {
+		.nr_namespaces = 1,
+		.ns_blocks = 4,
+		.lba_shift = 16,
+	};
+	struct nvme_sim *small = sim;
+	nvme_copy_plan_t p;
+
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+
+	/* 8 KiB transfers cannot hold a single 64 KiB LBA */
+	mdts = 1;
+	p = nvme_copy_plan_create(fd, 1);
+	assert(p);
+	assert(!nvme_copy_plan_add(p, 0, 1, 2));
+
+	nr_copies = nr_writes = 0;
+	errno = 0;
+	assert(nvme_copy_plan_submit(p, 1, NULL) == -1);
+	assert(errno == ENOTSUP);
+	assert(nr_copies == 1 && nr_writes == 0);
+	nvme_copy_plan_free(p);
+	mdts = 0;
+
+	nvme_sim_free(sim);
+	sim = small;
+}
+
+static void invalid_lba_size(void)
+{
+	ds = 20;
+	errno = 0;
+	assert(!nvme_copy_plan_create(fd, 1));
+	assert(errno == EPROTO);
+	ds = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct nvme_sim_config cfg = {
+		.nr_namespaces = 1,
+		.ns_blocks = NR_BLOCKS,
+	};
+
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+	nvme_set_submit_backend(submit, NULL);
+
+	fallback();
+	no_fallback_with_metadata();
+	no_fallback_with_large_lba();
+	invalid_lba_size();
+
+	nvme_set_submit_backend(NULL, NULL);
+	nvme_sim_free(sim);
+	return 0;
+}
@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Indexes hand-built discovery log pages against a tree of controllers
+ * and checks lookups and the differences reported between them.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <ccan/endian/endian.h>
+
+#include <libnvme.h>
+
+/* There is no setter for the controller name */
+#include "nvme/private.h"
+
+#define SUBNQN1	"nqn.2014-08.org.example:sub1"
+#define SUBNQN2	"nqn.2014-08.org.example:sub2"
+#define SUBNQN3	"nqn.2014-08.org.example:sub3"
+#define SUBNQN4	"nqn.2014-08.org.example:sub4"
+
+#define MAX_DIFFS	16
+
+struct diff {
+	enum nvmf_disc_diff diff;
+	struct nvmf_disc_log_entry *e;
+	nvme_ctrl_t c;
+};
+
+static struct diff diffs[MAX_DIFFS];
+static int nr_diffs;
+
+/* Discovery log page fields are space padded */
+static void set_field(char *dst, const char *src, size_t len)
+{
+	memset(dst, ' ', len);
+	memcpy(dst, src, strlen(src));
+}
+
+static void set_entry(struct nvmf_disc_log_entry *e, __u8 trtype,
+		      const char *subnqn, const char *traddr,
+		      const char *trsvcid)
+{
+	memset(e, 0, sizeof(*e));
+	e->trtype = trtype;
+	e->subtype = NVME_NQN_NVME;
+	set_field(e->subnqn, subnqn, sizeof(e->subnqn));
+	set_field(e->traddr, traddr, sizeof(e->traddr));
+	set_field(e->trsvcid, trsvcid, sizeof(e->trsvcid));
+}
+
+static struct nvmf_discovery_log *alloc_log(__u64 numrec)
+{
+	struct nvmf_discovery_log *log;
+
+	log = calloc(1, sizeof(*log) + numrec * sizeof(log->entries[0]));
+	assert(log);
+	log->numrec = cpu_to_le64(numrec);
+	return log;
+}
+
+static int record(nvmf_disc_index_t idx, enum nvmf_disc_diff diff,
+		  struct nvmf_disc_log_entry *e, nvme_ctrl_t c, void *arg)
+{
+	assert(nr_diffs < MAX_DIFFS);
+	diffs[nr_diffs++] = (struct diff) { .diff = diff, .e = e, .c = c };
+	return 0;
+}
+
+static int stop(nvmf_disc_index_t idx, enum nvmf_disc_diff diff,
+		struct nvmf_disc_log_entry *e, nvme_ctrl_t c, void *arg)
+{
+	return 42;
+}
+
+static void check_diff(int i, enum nvmf_disc_diff diff,
+		       struct nvmf_disc_log_entry *e, nvme_ctrl_t c)
+{
+	assert(diffs[i].diff == diff);
+	assert(diffs[i].e == e);
+	assert(diffs[i].c == c);
+}
+
+/* Stale controllers are reported in tree order */
+static bool stale(nvme_ctrl_t c)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nr_diffs; i++)
+		if (diffs[i].diff == NVMF_DISC_DIFF_STALE && diffs[i].c == c &&
+		    !diffs[i].e)
+			n++;
+	return n == 1;
+}
+
+int main(int argc, char *argv[])
+{
+	nvme_ctrl_t c1, c2, c3, c4, dc;
+	struct nvmf_discovery_log *log;
+	struct nvmf_disc_log_entry *e;
+	nvmf_disc_index_t idx;
+	nvme_subsystem_t s;
+	nvme_root_t r;
+	nvme_host_t h;
+
+	r = nvme_create_root(stderr, LOG_ERR);
+	assert(r);
+	h = nvme_lookup_host(r, "nqn.2014-08.org.example:host", NULL);
+	assert(h);
+
+	/* Connected, and configured but not connected */
+	s = nvme_lookup_subsystem(h, NULL, SUBNQN1);
+	c1 = nvme_lookup_ctrl(s, "tcp", "fe80::1", NULL, NULL, "4420", NULL);
+	c1->name = strdup("nvme1");
+	c2 = nvme_lookup_ctrl(s, "tcp", "10.0.0.2", NULL, NULL, "4420", NULL);
+	/* Not in the log */
+	s = nvme_lookup_subsystem(h, NULL, SUBNQN2);
+	c3 = nvme_lookup_ctrl(s, "tcp", "10.0.0.3", NULL, NULL, "4420", NULL);
+	c3->name = strdup("nvme3");
+	/* No trsvcid */
+	s = nvme_lookup_subsystem(h, NULL, SUBNQN4);
+	c4 = nvme_lookup_ctrl(s, "fc", "nn-0x1:pn-0x2", NULL, NULL, NULL,
+			      NULL);
+	/* Never reported as stale */
+	s = nvme_lookup_subsystem(h, NULL, NVME_DISC_SUBSYS_NAME);
+	dc = nvme_lookup_ctrl(s, "tcp", "10.0.0.1", NULL, NULL, "8009", NULL);
+	nvme_ctrl_set_discovery_ctrl(dc, true);
+	assert(c1 && c2 && c3 && c4 && dc);
+
+	log = alloc_log(5);
+	set_entry(&log->entries[0], NVMF_TRTYPE_TCP, SUBNQN1, "FE80::1",
+		  "4420");
+	set_entry(&log->entries[1], NVMF_TRTYPE_TCP, SUBNQN1, "10.0.0.2",
+		  "4420");
+	/* Duplicate of the previous entry */
+	set_entry(&log->entries[2], NVMF_TRTYPE_TCP, SUBNQN1, "10.0.0.2",
+		  "4420");
+	set_entry(&log->entries[3], NVMF_TRTYPE_TCP, SUBNQN3, "10.0.0.5",
+		  "4420");
+	set_entry(&log->entries[4], NVMF_TRTYPE_FC, SUBNQN4, "nn-0x1:pn-0x2",
+		  "");
+
+	idx = nvmf_disc_index_create(h, log);
+	assert(idx);
+
+	/* traddr is compared case-insensitively, padding is stripped */
+	assert(nvmf_disc_index_lookup(idx, SUBNQN1, "tcp", "fe80::1",
+				      "4420") == &log->entries[0]);
+	assert(nvmf_disc_index_lookup(idx, SUBNQN1, "tcp", "FE80::1",
+				      "4420") == &log->entries[0]);
+	e = nvmf_disc_index_lookup(idx, SUBNQN1, "tcp", "10.0.0.2", "4420");
+	assert(e == &log->entries[1] || e == &log->entries[2]);
+	assert(nvmf_disc_index_lookup(idx, SUBNQN4, "fc", "nn-0x1:pn-0x2",
+				      NULL) == &log->entries[4]);
+	assert(!nvmf_disc_index_lookup(idx, SUBNQN1, "tcp", "fe80::1",
+				       "4421"));
+	assert(!nvmf_disc_index_lookup(idx, SUBNQN1, "rdma", "fe80::1",
+				       "4420"));
+	assert(!nvmf_disc_index_lookup(idx, SUBNQN2, "tcp", "10.0.0.3",
+				       "4420"));
+
+	/* Only controllers with a device are connected */
+	assert(nvmf_disc_index_connected(idx, &log->entries[0]) == c1);
+	assert(!nvmf_disc_index_connected(idx, &log->entries[1]));
+	assert(!nvmf_disc_index_connected(idx, &log->entries[3]));
+
+	/* Entries in log order, then the stale controllers */
+	nr_diffs = 0;
+	assert(!nvmf_disc_index_diff(idx, record, NULL));
+	assert(nr_diffs == 6);
+	check_diff(0, NVMF_DISC_DIFF_KNOWN, &log->entries[0], c1);
+	check_diff(1, NVMF_DISC_DIFF_KNOWN, &log->entries[1], c2);
+	check_diff(2, NVMF_DISC_DIFF_KNOWN, &log->entries[2], c2);
+	check_diff(3, NVMF_DISC_DIFF_NEW, &log->entries[3], NULL);
+	check_diff(4, NVMF_DISC_DIFF_KNOWN, &log->entries[4], c4);
+	check_diff(5, NVMF_DISC_DIFF_STALE, NULL, c3);
+
+	/* The walk can be repeated and stopped */
+	nr_diffs = 0;
+	assert(!nvmf_disc_index_diff(idx, record, NULL));
+	assert(nr_diffs == 6);
+	assert(nvmf_disc_index_diff(idx, stop, NULL) == 42);
+	nvmf_disc_index_free(idx);
+	free(log);
+
+	/* Every controller but the discovery controller is stale */
+	log = alloc_log(0);
+	idx = nvmf_disc_index_create(h, log);
+	assert(idx);
+	assert(!nvmf_disc_index_lookup(idx, SUBNQN1, "tcp", "fe80::1",
+				       "4420"));
+	nr_diffs = 0;
+	assert(!nvmf_disc_index_diff(idx, record, NULL));
+	assert(nr_diffs == 4);
+	assert(stale(c1) && stale(c2) && stale(c3) && stale(c4));
+	nvmf_disc_index_free(idx);
+
+	/* A record count no log page can hold */
+	log->numrec = cpu_to_le64(1ULL << 40);
+	errno = 0;
+	assert(!nvmf_disc_index_create(h, log));
+	assert(errno == EINVAL);
+	free(log);
+
+	nvme_free_tree(r);
+	return 0;
+}
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Submits a Dataset Management plan to the simulated controller and
+ * checks how the extents were merged and packed into commands.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ccan/endian/endian.h>
+
+#include <libnvme.h>
+
+#define MAX_RANGES	16
+#define MAX_CMDS	8
+
+/* The backends ignore the file descriptor */
+static const int fd = -1;
+
+static struct nvme_sim *sim;
+static bool fail;
+static int nr_cmds;
+static int nr_ranges[MAX_CMDS];
+static struct nvme_dsm_range ranges[MAX_CMDS][MAX_RANGES];
+
+static int submit(void *arg, int fd, bool admin,
+		  struct nvme_passthru_cmd64 *cmd)
+{
+	if (!admin && cmd->opcode == nvme_cmd_dsm) {
+		int nr = (cmd->cdw10 & 0xff) + 1;
+
+		assert(nr <= MAX_RANGES && nr_cmds < MAX_CMDS);
+		assert(cmd->data_len == nr * sizeof(struct nvme_dsm_range));
+		nr_ranges[nr_cmds] = nr;
+		memcpy(ranges[nr_cmds++], (void *)(uintptr_t)cmd->addr,
+		       cmd->data_len);
+		if (fail)
+			return NVME_SC_INTERNAL;
+	}
+	return nvme_sim_submit(sim, fd, admin, cmd);
+}
+
+static void check_range(int cmd, int i, __u64 slba, __u32 nlb)
+{
+	assert(le64_to_cpu(ranges[cmd][i].slba) == slba);
+	assert(le32_to_cpu(ranges[cmd][i].nlb) == nlb);
+}
+
+static void check(void)
+{
+	assert(nr_cmds == 3);
+	assert(nr_ranges[0] == 2 && nr_ranges[1] == 2 && nr_ranges[2] == 2);
+	check_range(0, 0, 0, 100);
+	check_range(0, 1, 200, 50);
+	check_range(1, 0, 250, 100);
+	check_range(1, 1, 350, 50);
+	check_range(2, 0, 400, 50);
+	check_range(2, 1, 1000, 10);
+}
+
+int main(int argc, char *argv[])
+{
+	struct nvme_sim_config cfg = {
+		.nr_namespaces = 1,
+		.ns_blocks = 4096,
+	};
+	nvme_dsm_plan_t p;
+	__u32 n;
+
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+	nvme_set_submit_backend(submit, NULL);
+
+	p = nvme_dsm_plan_create(fd, 1, NVME_DSMGMT_AD);
+	assert(p);
+	/* 2 ranges of up to 100 LBAs, 150 LBAs per command */
+	nvme_dsm_plan_set_limits(p, 2, 100, 150);
+
+	/* Adjacent, contained and unordered extents */
+	assert(!nvme_dsm_plan_add(p, 1000, 10));
+	assert(!nvme_dsm_plan_add(p, 50, 50));
+	assert(!nvme_dsm_plan_add(p, 200, 250));
+	assert(!nvme_dsm_plan_add(p, 0, 50));
+	assert(!nvme_dsm_plan_add(p, 30, 10));
+	assert(!nvme_dsm_plan_add(p, 5, 0));
+
+	/* A failed submission keeps the extents for a retry */
+	fail = true;
+	assert(nvme_dsm_plan_submit(p, 1, &n) == NVME_SC_INTERNAL);
+	assert(n == 3);
+	assert(nr_cmds >= 1);
+
+	fail = false;
+	nr_cmds = 0;
+	assert(!nvme_dsm_plan_submit(p, 1, &n));
+	assert(n == 3);
+	check();
+
+	/* The plan is empty after a successful submission */
+	nr_cmds = 0;
+	assert(!nvme_dsm_plan_submit(p, 1, &n));
+	assert(n == 0 && nr_cmds == 0);
+
+	nvme_dsm_plan_free(p);
+	nvme_set_submit_backend(NULL, NULL);
+	nvme_sim_free(sim);
+	return 0;
+}
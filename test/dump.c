@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Checks the output of the tree dump against a reference file.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnvme.h>
+
+static nvme_root_t build_tree(void)
+{
+	struct nvme_fabrics_config *cfg;
+	nvme_subsystem_t s;
+	nvme_root_t r;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+
+	r = nvme_create_root(NULL, LOG_ERR);
+	assert(r);
+
+	h = nvme_lookup_host(r, "nqn.2014-08.org.nvmexpress:uuid:host-a",
+			     "6ad2e5d0-0b0d-4c6c-a4f3-4c3ff6e16c3e");
+	assert(h);
+	nvme_host_set_dhchap_key(h, "DHHC-1:00:ia6zGodOr/DpGwK3sygQe0LH7pDpRa3n:");
+
+	s = nvme_lookup_subsystem(h, "nvme-subsys0",
+				  "nqn.2014-08.org.nvmexpress.discovery");
+	assert(s);
+	c = nvme_lookup_ctrl(s, "tcp", "192.168.1.10", NULL, NULL, "8009",
+			     NULL);
+	assert(c);
+	nvme_ctrl_set_discovery_ctrl(c, true);
+	nvme_ctrl_set_persistent(c, true);
+
+	s = nvme_lookup_subsystem(h, "nvme-subsys1", "nqn.io-1");
+	assert(s);
+	c = nvme_lookup_ctrl(s, "rdma", "fe80::1", "fe80::2", "eth\"0\t",
+			     "4420", NULL);
+	assert(c);
+	nvme_ctrl_set_dhchap_key(c, "DHHC-1:01:c2VjcmV0\\/key:");
+	cfg = nvme_ctrl_get_config(c);
+	cfg->nr_io_queues = 8;
+	cfg->queue_size = 128;
+	cfg->keep_alive_tmo = 5;
+	cfg->ctrl_loss_tmo = -1;
+	cfg->tos = 0;
+	cfg->hdr_digest = true;
+	cfg->data_digest = true;
+	c = nvme_lookup_ctrl(s, "loop", NULL, NULL, NULL, NULL, NULL);
+	assert(c);
+	cfg = nvme_ctrl_get_config(c);
+	cfg->ctrl_loss_tmo = 30;
+	cfg->duplicate_connect = true;
+
+	/* A subsystem without controllers and a host without subsystems */
+	s = nvme_lookup_subsystem(h, "nvme-subsys2", "nqn.io-2");
+	assert(s);
+	h = nvme_lookup_host(r, "nqn.2014-08.org.nvmexpress:uuid:host-b",
+			     NULL);
+	assert(h);
+
+	return r;
+}
+
+static char *read_all(FILE *fp, size_t *len)
+{
+	char *buf = NULL;
+	size_t size = 0;
+
+	*len = 0;
+	rewind(fp);
+	for (;;) {
+		size_t n;
+
+		buf = realloc(buf, size + 4096);
+		assert(buf);
+		n = fread(buf + size, 1, 4096, fp);
+		size += n;
+		if (n < 4096)
+			break;
+	}
+	*len = size;
+	return buf;
+}
+
+static void check(const char *what, FILE *out, const char *ref, size_t ref_len)
+{
+	size_t len;
+	char *buf;
+
+	buf = read_all(out, &len);
+	if (len != ref_len || memcmp(buf, ref, len)) {
+		fprintf(stderr, "%s: output differs from reference\n", what);
+		fwrite(buf, 1, len, stderr);
+		exit(EXIT_FAILURE);
+	}
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *ref_fp, *out;
+	nvme_root_t r;
+	size_t ref_len;
+	char *ref;
+
+	r = build_tree();
+
+	/* Without a reference file print the dump, to create one */
+	if (argc < 2)
+		return nvme_dump_tree(r) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	ref_fp = fopen(argv[1], "r");
+	assert(ref_fp);
+	ref = read_all(ref_fp, &ref_len);
+	fclose(ref_fp);
+
+	out = tmpfile();
+	assert(out);
+	assert(!nvme_dump_tree_fd(r, fileno(out)));
+	check("fd", out, ref, ref_len);
+	fclose(out);
+
+	out = tmpfile();
+	assert(out);
+	assert(!nvme_dump_tree_file(r, out));
+	check("FILE", out, ref, ref_len);
+	fclose(out);
+
+	free(ref);
+	nvme_free_tree(r);
+	return EXIT_SUCCESS;
+}
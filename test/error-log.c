@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Reads new entries of an Error Information log which a wrapper around
+ * the simulated controller fills from a ring of errors, and checks that
+ * every error is reported once.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ccan/endian/endian.h>
+
+#include <libnvme.h>
+
+#define NR_ENTRIES	8
+
+/* The backends ignore the file descriptor */
+static const int fd = -1;
+
+static struct nvme_sim *sim;
+/* Error counts, the most recent error first */
+static __u64 ring[NR_ENTRIES];
+static __u64 error_count;
+/* Errors logged right after the next single entry read */
+static int racing_errors;
+static int nr_reads, nr_read_entries;
+
+static void log_errors(int n)
+{
+	while (n--) {
+		memmove(&ring[1], &ring[0], sizeof(ring) - sizeof(ring[0]));
+		ring[0] = ++error_count;
+	}
+}
+
+static void reset_errors(void)
+{
+	memset(ring, 0, sizeof(ring));
+	error_count = 0;
+}
+
+static int submit(void *arg, int fd, bool admin,
+		  struct nvme_passthru_cmd64 *cmd)
+{
+	struct nvme_error_log_page *log = (void *)(uintptr_t)cmd->addr;
+	int ret, i, n;
+
+	ret = nvme_sim_submit(sim, fd, admin, cmd);
+	if (ret || !admin)
+		return ret;
+
+	if (cmd->opcode == nvme_admin_identify &&
+	    (cmd->cdw10 & 0xff) == NVME_IDENTIFY_CNS_CTRL) {
+		struct nvme_id_ctrl *id = (void *)(uintptr_t)cmd->addr;
+
+		id->elpe = NR_ENTRIES - 1;
+	} else if (cmd->opcode == nvme_admin_get_log_page &&
+		   (cmd->cdw10 & 0xff) == NVME_LOG_LID_ERROR) {
+		n = cmd->data_len / sizeof(*log);
+		/* Entries beyond the ring read as zero */
+		for (i = 0; i < n && i < NR_ENTRIES; i++)
+			log[i].error_count = cpu_to_le64(ring[i]);
+		nr_reads++;
+		nr_read_entries += n;
+		if (n == 1 && racing_errors) {
+			log_errors(racing_errors);
+			racing_errors = 0;
+		}
+	}
+	return 0;
+}
+
+static void read_new(struct nvme_error_log_reader *rd, __u32 max,
+		     __u32 expect_nr, __u64 expect_newest, __u64 expect_lost)
+{
+	struct nvme_error_log_page log[NR_ENTRIES];
+	__u64 lost;
+	__u32 nr, i;
+
+	assert(max <= NR_ENTRIES);
+	assert(!nvme_error_log_read_new(rd, log, max, &nr, &lost));
+	assert(nr == expect_nr);
+	assert(lost == expect_lost);
+	/* Newest first, without gaps */
+	for (i = 0; i < nr; i++)
+		assert(le64_to_cpu(log[i].error_count) == expect_newest - i);
+}
+
+int main(int argc, char *argv[])
+{
+	struct nvme_sim_config cfg = {
+		.nr_namespaces = 1,
+		.ns_blocks = 16,
+	};
+	struct nvme_error_log_reader rd, rd2;
+
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+	nvme_set_submit_backend(submit, NULL);
+
+	assert(!nvme_error_log_reader_init(&rd, fd, false));
+	assert(rd.nr_entries == NR_ENTRIES);
+
+	/* Nothing logged yet */
+	read_new(&rd, NR_ENTRIES, 0, 0, 0);
+
+	log_errors(2);
+	read_new(&rd, NR_ENTRIES, 2, 2, 0);
+
+	/* A poll without new errors reads a single entry */
+	nr_reads = nr_read_entries = 0;
+	read_new(&rd, NR_ENTRIES, 0, 0, 0);
+	assert(nr_reads == 1 && nr_read_entries == 1);
+
+	/* Only the new entries are read */
+	log_errors(3);
+	nr_reads = nr_read_entries = 0;
+	read_new(&rd, NR_ENTRIES, 3, 5, 0);
+	assert(nr_reads == 2 && nr_read_entries == 4);
+
+	/* More errors than the ring holds */
+	log_errors(NR_ENTRIES + 3);
+	read_new(&rd, NR_ENTRIES, NR_ENTRIES, 16, 3);
+
+	/* More errors than the caller's buffer holds */
+	log_errors(3);
+	read_new(&rd, 2, 2, 19, 1);
+	read_new(&rd, NR_ENTRIES, 0, 0, 0);
+
+	/* Errors logged between the first and the second read */
+	log_errors(2);
+	racing_errors = 3;
+	read_new(&rd, NR_ENTRIES, 5, 24, 0);
+	read_new(&rd, NR_ENTRIES, 0, 0, 0);
+
+	/* The error count went back, everything in the ring is new */
+	reset_errors();
+	log_errors(3);
+	read_new(&rd, NR_ENTRIES, 3, 3, 0);
+	read_new(&rd, NR_ENTRIES, 0, 0, 0);
+
+	/* A new reader can skip the errors logged so far */
+	assert(!nvme_error_log_reader_init(&rd2, fd, true));
+	read_new(&rd2, NR_ENTRIES, 0, 0, 0);
+	log_errors(1);
+	read_new(&rd2, NR_ENTRIES, 1, 4, 0);
+	read_new(&rd, NR_ENTRIES, 1, 4, 0);
+
+	/* A zero sized buffer is rejected */
+	errno = 0;
+	assert(nvme_error_log_read_new(&rd, NULL, 0, &(__u32){ 0 }, NULL) < 0);
+	assert(errno == EINVAL);
+
+	nvme_set_submit_backend(NULL, NULL);
+	nvme_sim_free(sim);
+	return 0;
+}
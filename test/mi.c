@@ -6,6 +6,7 @@
 
 #undef NDEBUG
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -314,6 +315,75 @@ static void test_admin_err_resp(nvme_mi_ep_t ep)
 	assert(rc != 0);
 }
 
+/* test: MI commands are counted in the libnvme-mi statistics */
+static void test_stats(nvme_mi_ep_t ep)
+{
+	struct nvme_mi_read_nvm_ss_info ss_info;
+	struct nvme_stats_entry *entries;
+	int i, nr, found = 0;
+
+	nvme_mi_stats_reset();
+	nvme_mi_stats_enable(true);
+
+	test_set_transport_callback(ep, test_read_mi_data_cb, NULL);
+	assert(!nvme_mi_mi_read_mi_data_subsys(ep, &ss_info));
+	test_set_transport_callback(ep, test_transport_fail_cb, NULL);
+	assert(nvme_mi_mi_read_mi_data_subsys(ep, &ss_info));
+
+	nvme_mi_stats_enable(false);
+
+	nr = nvme_mi_stats_snapshot(&entries);
+	assert(nr > 0);
+	for (i = 0; i < nr; i++) {
+		struct nvme_stats_entry *e = &entries[i];
+
+		if (e->cls != NVME_STATS_MI || e->id != (uintptr_t)ep ||
+		    e->opcode != nvme_mi_mi_opcode_mi_data_read)
+			continue;
+		assert(e->count == 2 && e->errors == 1 && e->failed == 0);
+		assert(nvme_mi_stats_percentile(e, 100) <= e->max_us);
+		found++;
+	}
+	assert(found == 1);
+	free(entries);
+
+	nvme_mi_stats_reset();
+	assert(nvme_mi_stats_snapshot(&entries) == 0);
+}
+
+/* test: MI commands are written to the libnvme-mi trace file */
+static void test_trace(nvme_mi_ep_t ep)
+{
+	char path[] = "/tmp/libnvme-mi-trace-XXXXXX";
+	struct nvme_mi_read_nvm_ss_info ss_info;
+	struct nvme_trace_record rec;
+	struct nvme_trace_reader *rd;
+	int tmp;
+
+	tmp = mkstemp(path);
+	assert(tmp >= 0);
+	close(tmp);
+
+	assert(!nvme_mi_trace_open(path, 1, 4));
+	rd = nvme_mi_trace_reader_open(path);
+	assert(rd);
+
+	test_set_transport_callback(ep, test_read_mi_data_cb, NULL);
+	assert(!nvme_mi_mi_read_mi_data_subsys(ep, &ss_info));
+
+	assert(nvme_mi_trace_reader_read(rd, &rec, 1) == 1);
+	assert(rec.source == NVME_TRACE_MI);
+	assert(rec.id == (uintptr_t)ep);
+	assert(rec.opcode == nvme_mi_mi_opcode_mi_data_read);
+	assert(rec.status == 0);
+	assert(nvme_mi_trace_reader_read(rd, &rec, 1) == 0);
+	assert(nvme_mi_trace_reader_lost(rd) == 0);
+
+	nvme_mi_trace_close();
+	nvme_mi_trace_reader_close(rd);
+	unlink(path);
+}
+
 #define DEFINE_TEST(name) { #name, test_ ## name }
 struct test {
 	const char *name;
@@ -324,6 +394,8 @@ struct test {
 	DEFINE_TEST(invalid_crc),
 	DEFINE_TEST(admin_id),
 	DEFINE_TEST(admin_err_resp),
+	DEFINE_TEST(stats),
+	DEFINE_TEST(trace),
 };
 
 static void print_log_buf(FILE *logfd)
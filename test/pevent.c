@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Walks crafted Persistent Event Logs, served by a wrapper around the
+ * simulated controller, with a buffer smaller than the log, and checks
+ * the events returned and the handling of inconsistent lengths.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ccan/endian/endian.h>
+
+#include <libnvme.h>
+
+#define LOG_SIZE	4096
+#define HDR_SIZE	sizeof(struct nvme_persistent_event_log)
+#define EVENT_HDR_SIZE	sizeof(struct nvme_persistent_event_entry)
+#define BUF_SIZE	512
+
+/* The backends ignore the file descriptor */
+static const int fd = -1;
+
+static struct nvme_sim *sim;
+static __u8 image[LOG_SIZE];
+static size_t image_len;
+static bool context;
+
+static int submit(void *arg, int fd, bool admin,
+		  struct nvme_passthru_cmd64 *cmd)
+{
+	__u64 lpo = (__u64)cmd->cdw13 << 32 | cmd->cdw12;
+	__u8 lsp = (cmd->cdw10 >> 8) & 0x7f;
+	int ret;
+
+	ret = nvme_sim_submit(sim, fd, admin, cmd);
+	if (ret || !admin || cmd->opcode != nvme_admin_get_log_page ||
+	    (cmd->cdw10 & 0xff) != NVME_LOG_LID_PERSISTENT_EVENT)
+		return ret;
+
+	assert(!(lpo & 3));
+	switch (lsp) {
+	case NVME_PEVENT_LOG_EST_CTX_AND_READ:
+		assert(!context);
+		context = true;
+		break;
+	case NVME_PEVENT_LOG_READ:
+		if (!context)
+			return NVME_SC_CMD_SEQ_ERROR;
+		break;
+	case NVME_PEVENT_LOG_RELEASE_CTX:
+		assert(context);
+		context = false;
+		return 0;
+	}
+	if (lpo < image_len)
+		memcpy((void *)(uintptr_t)cmd->addr, image + lpo,
+		       cmd->data_len < image_len - lpo ?
+		       cmd->data_len : image_len - lpo);
+	return 0;
+}
+
+static void set_header(__u32 tnev, __u64 tll)
+{
+	struct nvme_persistent_event_log *hdr = (void *)image;
+
+	hdr->lid = NVME_LOG_LID_PERSISTENT_EVENT;
+	hdr->tnev = cpu_to_le32(tnev);
+	hdr->tll = cpu_to_le64(tll);
+}
+
+/* Event at @pos with @vsil bytes of 0xee and @len bytes of @etype */
+static size_t add_event(size_t pos, __u8 etype, __u16 vsil, __u16 len)
+{
+	struct nvme_persistent_event_entry *e = (void *)(image + pos);
+
+	assert(pos + EVENT_HDR_SIZE + vsil + len <= LOG_SIZE);
+	memset(e, 0, EVENT_HDR_SIZE);
+	e->etype = etype;
+	e->ehl = EVENT_HDR_SIZE - 3;
+	e->vsil = cpu_to_le16(vsil);
+	e->el = cpu_to_le16(vsil + len);
+	memset(image + pos + EVENT_HDR_SIZE, 0xee, vsil);
+	memset(image + pos + EVENT_HDR_SIZE + vsil, etype, len);
+	image_len = pos + EVENT_HDR_SIZE + vsil + len;
+	return image_len;
+}
+
+static bool filled(const void *p, __u8 c, size_t len)
+{
+	const __u8 *b = p;
+
+	while (len--)
+		if (*b++ != c)
+			return false;
+	return true;
+}
+
+static void check_event(struct nvme_pevent_iter *it, size_t offset,
+			__u8 etype, __u16 vsil, __u16 len)
+{
+	struct nvme_pevent ev;
+
+	assert(!nvme_pevent_iter_next(it, &ev));
+	assert(ev.entry && ev.entry->etype == etype);
+	assert(ev.offset == offset);
+	assert(ev.vsil == vsil && ev.data_len == len);
+	assert(vsil ? filled(ev.vsi, 0xee, vsil) : !ev.vsi);
+	assert(filled(ev.data, etype, len));
+}
+
+static void check_end(struct nvme_pevent_iter *it)
+{
+	struct nvme_pevent ev;
+
+	assert(!nvme_pevent_iter_next(it, &ev));
+	assert(!ev.entry);
+}
+
+static void check_error(struct nvme_pevent_iter *it, int err)
+{
+	struct nvme_pevent ev;
+
+	errno = 0;
+	assert(nvme_pevent_iter_next(it, &ev) == -1);
+	assert(errno == err && !ev.entry);
+}
+
+static void start(struct nvme_pevent_iter *it, void *buf)
+{
+	assert(!nvme_pevent_iter_init(it, fd, buf, BUF_SIZE));
+	assert(context);
+}
+
+static void stop(struct nvme_pevent_iter *it)
+{
+	assert(!nvme_pevent_iter_release(it));
+	assert(!context);
+	memset(image, 0, sizeof(image));
+}
+
+int main(int argc, char *argv[])
+{
+	struct nvme_sim_config cfg = {
+		.nr_namespaces = 1,
+		.ns_blocks = 16,
+	};
+	struct nvme_pevent_iter it;
+	size_t e1, e2, e3, e4, end;
+	__u8 buf[BUF_SIZE];
+
+	sim = nvme_sim_create(&cfg);
+	assert(sim);
+	nvme_set_submit_backend(submit, NULL);
+
+	errno = 0;
+	assert(nvme_pevent_iter_init(&it, fd, buf, HDR_SIZE - 1) == -1);
+	assert(errno == EINVAL);
+
+	/* Events spread over several windows, one larger than the buffer */
+	e1 = HDR_SIZE;
+	e2 = add_event(e1, 1, 4, 41);
+	e3 = add_event(e2, 2, 0, 300);
+	e4 = add_event(e3, 3, 0, 600);
+	end = add_event(e4, 4, 0, 8);
+	set_header(4, end);
+	start(&it, buf);
+	check_event(&it, e1, 1, 4, 41);
+	check_event(&it, e2, 2, 0, 300);
+	check_error(&it, EMSGSIZE);
+	check_event(&it, e4, 4, 0, 8);
+	check_end(&it);
+	check_end(&it);
+	stop(&it);
+
+	/* The total number of events ends the walk */
+	e2 = add_event(e1, 1, 0, 16);
+	end = add_event(e2, 2, 0, 16);
+	set_header(1, end);
+	start(&it, buf);
+	check_event(&it, e1, 1, 0, 16);
+	check_end(&it);
+	stop(&it);
+
+	/* The total log length cuts off the header of the last event */
+	e2 = add_event(e1, 1, 0, 16);
+	add_event(e2, 2, 0, 16);
+	set_header(2, e2 + EVENT_HDR_SIZE - 1);
+	start(&it, buf);
+	check_event(&it, e1, 1, 0, 16);
+	check_end(&it);
+	stop(&it);
+
+	/* An event reaching beyond the total log length */
+	end = add_event(e1, 1, 0, 16);
+	set_header(1, end - 1);
+	start(&it, buf);
+	check_error(&it, EPROTO);
+	stop(&it);
+
+	/* Vendor specific information longer than the event */
+	end = add_event(e1, 1, 8, 0);
+	((struct nvme_persistent_event_entry *)(image + e1))->vsil =
+		cpu_to_le16(9);
+	set_header(1, end);
+	start(&it, buf);
+	check_error(&it, EPROTO);
+	stop(&it);
+
+	/* An event header shorter than the fixed fields */
+	end = add_event(e1, 1, 0, 16);
+	((struct nvme_persistent_event_entry *)(image + e1))->ehl = 0;
+	set_header(1, end);
+	start(&it, buf);
+	check_error(&it, EPROTO);
+	stop(&it);
+
+	/* No events at all */
+	image_len = HDR_SIZE;
+	set_header(0, HDR_SIZE);
+	start(&it, buf);
+	check_end(&it);
+	stop(&it);
+
+	/* The iterator is unusable once released */
+	check_error(&it, EINVAL);
+	assert(!nvme_pevent_iter_release(&it));
+
+	nvme_set_submit_backend(NULL, NULL);
+	nvme_sim_free(sim);
+	return 0;
+}
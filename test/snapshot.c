@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Saves a tree read from a JSON configuration file as a snapshot and
+ * checks that loading it recreates the same tree.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnvme.h>
+
+static char *dump(nvme_root_t r, size_t *len)
+{
+	char *buf = NULL;
+	FILE *fp;
+
+	fp = open_memstream(&buf, len);
+	assert(fp);
+	assert(!nvme_dump_tree_file(r, fp));
+	fclose(fp);
+	return buf;
+}
+
+static void corrupt(const char *path, long off, size_t len)
+{
+	FILE *fp = fopen(path, "r+");
+	char junk[64];
+
+	memset(junk, 0xff, sizeof(junk));
+	assert(fp);
+	assert(!fseek(fp, off, SEEK_SET));
+	assert(fwrite(junk, 1, len, fp) == len);
+	fclose(fp);
+}
+
+static bool contains(const char *path, const char *str)
+{
+	FILE *fp = fopen(path, "r");
+	char *buf;
+	long len;
+	bool found;
+
+	assert(fp);
+	assert(!fseek(fp, 0, SEEK_END));
+	len = ftell(fp);
+	rewind(fp);
+	buf = malloc(len);
+	assert(buf && fread(buf, 1, len, fp) == len);
+	fclose(fp);
+	found = memmem(buf, len, str, strlen(str));
+	free(buf);
+	return found;
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/libnvme-snapshot-XXXXXX";
+	size_t len, snap_len;
+	char *buf, *snap_buf;
+	nvme_root_t r, s;
+	int fd;
+
+	assert(argc > 1);
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	r = nvme_create_root(NULL, LOG_ERR);
+	assert(r);
+	assert(!nvme_read_config(r, argv[1]));
+	assert(!nvme_snapshot_save(r, path));
+	buf = dump(r, &len);
+
+	/* The keys are not saved, they come from the configuration */
+	assert(!contains(path, "DHHC-1:"));
+
+	s = nvme_create_root(NULL, LOG_ERR);
+	assert(s);
+	assert(!nvme_snapshot_load(s, path));
+	assert(!nvme_read_config(s, argv[1]));
+	snap_buf = dump(s, &snap_len);
+	if (len != snap_len || memcmp(buf, snap_buf, len)) {
+		fprintf(stderr, "snapshot differs from the original tree\n");
+		fwrite(snap_buf, 1, snap_len, stderr);
+		return EXIT_FAILURE;
+	}
+	free(snap_buf);
+
+	/* Only an empty tree can be loaded into */
+	assert(nvme_snapshot_load(s, path) == -1 && errno == EBUSY);
+	nvme_free_tree(s);
+
+	/* Corrupt the records following the header, then the header */
+	corrupt(path, 64, 64);
+	s = nvme_create_root(NULL, LOG_ERR);
+	assert(s);
+	assert(nvme_snapshot_load(s, path) == -1 && errno == EPROTO);
+	assert(!nvme_first_host(s));
+	corrupt(path, 0, 8);
+	assert(nvme_snapshot_load(s, path) == -1 && errno == EPROTO);
+	nvme_free_tree(s);
+
+	unlink(path);
+	free(buf);
+	nvme_free_tree(r);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Checks the parsing of controller states and of the kernel uevents the
+ * state monitor listens to, and the periodic refresh of the monitor.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <libnvme.h>
+
+/* nvme_uevent_ctrl() and the cached state are internal */
+#include "nvme/private.h"
+
+/* A uevent is a list of NUL terminated strings */
+#define UEVENT(s)	s, sizeof(s) - 1
+
+static void test_states(void)
+{
+	enum nvme_ctrl_state state;
+	nvme_root_t r;
+	nvme_ctrl_t c;
+
+	for (state = NVME_CTRL_STATE_NEW; state <= NVME_CTRL_STATE_DEAD;
+	     state++)
+		assert(nvme_ctrl_state_from_string(
+			nvme_ctrl_state_to_string(state)) == state);
+	assert(nvme_ctrl_state_from_string("deleting (no IO)") ==
+	       NVME_CTRL_STATE_DELETING_NOIO);
+
+	assert(!strcmp(nvme_ctrl_state_to_string(NVME_CTRL_STATE_UNKNOWN),
+		       "unknown"));
+	assert(!strcmp(nvme_ctrl_state_to_string(100), "unknown"));
+	assert(nvme_ctrl_state_from_string(NULL) == NVME_CTRL_STATE_UNKNOWN);
+	assert(nvme_ctrl_state_from_string("") == NVME_CTRL_STATE_UNKNOWN);
+	assert(nvme_ctrl_state_from_string("unknown") ==
+	       NVME_CTRL_STATE_UNKNOWN);
+	assert(nvme_ctrl_state_from_string("suspended") ==
+	       NVME_CTRL_STATE_UNKNOWN);
+
+	/* A controller without sysfs entry still has a state string */
+	r = nvme_create_root(stderr, LOG_ERR);
+	assert(r);
+	c = nvme_create_ctrl(r, "nqn.2014-08.org.nvmexpress:test", "loop",
+			     NULL, NULL, NULL, NULL);
+	assert(c);
+	assert(!strcmp(nvme_ctrl_get_state(c), "unknown"));
+	assert(nvme_ctrl_get_cached_state(c) == NVME_CTRL_STATE_UNKNOWN);
+	nvme_free_ctrl(c);
+	nvme_free_tree(r);
+}
+
+static void test_uevents(void)
+{
+	const char *name;
+
+	name = nvme_uevent_ctrl(UEVENT(
+		"change@/devices/virtual/nvme-fabrics/ctl/nvme3\0"
+		"ACTION=change\0"
+		"DEVPATH=/devices/virtual/nvme-fabrics/ctl/nvme3\0"
+		"SUBSYSTEM=nvme\0"
+		"NVME_EVENT=connected\0"
+		"MAJOR=241\0"
+		"MINOR=3\0"
+		"DEVNAME=nvme3\0"
+		"SEQNUM=4242\0"));
+	assert(name && !strcmp(name, "nvme3"));
+
+	/* The order of the keys does not matter */
+	name = nvme_uevent_ctrl(UEVENT(
+		"add@/devices/pci0000:00/0000:00:04.0/nvme/nvme0\0"
+		"DEVNAME=nvme0\0"
+		"ACTION=add\0"
+		"SUBSYSTEM=nvme\0"));
+	assert(name && !strcmp(name, "nvme0"));
+
+	/* Namespace block devices are not controllers */
+	assert(!nvme_uevent_ctrl(UEVENT(
+		"add@/devices/virtual/nvme-subsystem/nvme-subsys0/nvme0n1\0"
+		"ACTION=add\0"
+		"SUBSYSTEM=block\0"
+		"DEVNAME=nvme0n1\0"
+		"DEVTYPE=disk\0")));
+
+	/* No device name, or an empty one */
+	assert(!nvme_uevent_ctrl(UEVENT(
+		"change@/devices/virtual/nvme-fabrics/ctl\0"
+		"ACTION=change\0"
+		"SUBSYSTEM=nvme\0")));
+	assert(!nvme_uevent_ctrl(UEVENT(
+		"change@/devices/virtual/nvme-fabrics/ctl/nvme1\0"
+		"SUBSYSTEM=nvme\0"
+		"DEVNAME=\0")));
+
+	/* Strings cut off at the end of the message are ignored */
+	assert(!nvme_uevent_ctrl("SUBSYSTEM=nvme\0DEVNAME=nvme1", 28));
+	assert(!nvme_uevent_ctrl("DEVNAME=nvme1\0SUBSYSTEM=nvme", 28));
+	assert(!nvme_uevent_ctrl("", 0));
+}
+
+static int nr_changes;
+
+static void changed(nvme_ctrl_t c, enum nvme_ctrl_state old,
+		    enum nvme_ctrl_state state, void *arg)
+{
+	assert(c == arg);
+	assert(old == NVME_CTRL_STATE_LIVE);
+	assert(state == NVME_CTRL_STATE_UNKNOWN);
+	nr_changes++;
+}
+
+static void test_monitor(void)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	nvme_state_monitor_t m;
+	nvme_subsystem_t s;
+	nvme_root_t r;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+
+	r = nvme_create_root(stderr, LOG_ERR);
+	assert(r);
+	h = nvme_lookup_host(r, "nqn.2014-08.org.example:host", NULL);
+	s = nvme_lookup_subsystem(h, NULL, "nqn.2014-08.org.example:sub");
+	c = nvme_lookup_ctrl(s, "loop", NULL, NULL, NULL, NULL, NULL);
+	assert(c);
+
+	m = nvme_state_monitor_create(r);
+	if (!m) {
+		/* No uevent socket in this environment */
+		printf("skipping monitor test: %m\n");
+		nvme_free_tree(r);
+		return;
+	}
+	pfd.fd = nvme_state_monitor_get_fd(m);
+
+	/* Without sysfs entry, a refresh finds the state unknown */
+	c->state = NVME_CTRL_STATE_LIVE;
+	assert(nvme_state_monitor_process(m, changed, c) == 0);
+	assert(nvme_ctrl_get_cached_state(c) == NVME_CTRL_STATE_LIVE);
+
+	assert(!nvme_state_monitor_set_interval(m, 10));
+	assert(poll(&pfd, 1, 5000) == 1);
+	assert(nvme_state_monitor_process(m, changed, c) == 1);
+	assert(nr_changes == 1);
+	assert(nvme_ctrl_get_cached_state(c) == NVME_CTRL_STATE_UNKNOWN);
+
+	assert(!nvme_state_monitor_set_interval(m, 0));
+	c->state = NVME_CTRL_STATE_LIVE;
+	assert(nvme_state_monitor_process(m, changed, c) == 0);
+	assert(poll(&pfd, 1, 50) == 0);
+
+	nvme_state_monitor_free(m);
+	nvme_free_tree(r);
+}
+
+int main(int argc, char *argv[])
+{
+	test_states();
+	test_uevents();
+	test_monitor();
+	return 0;
+}
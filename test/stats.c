@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Submits commands to a file which is not an NVMe device from several
+ * threads and checks the aggregated command statistics.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <libnvme.h>
+
+#define NR_THREADS	4
+#define NR_CMDS		100
+
+static int fd;
+
+static void *submit(void *arg)
+{
+	struct nvme_id_ctrl id;
+	__u32 result;
+	int i;
+
+	for (i = 0; i < NR_CMDS; i++) {
+		assert(nvme_identify_ctrl(fd, &id) < 0);
+		assert(nvme_flush(fd, 1) < 0);
+		assert(nvme_get_features_arbitration(fd, 0, &result) < 0);
+	}
+	return NULL;
+}
+
+static void run_threads(void)
+{
+	pthread_t threads[NR_THREADS];
+	int i;
+
+	for (i = 0; i < NR_THREADS; i++)
+		assert(!pthread_create(&threads[i], NULL, submit, NULL));
+	for (i = 0; i < NR_THREADS; i++)
+		assert(!pthread_join(threads[i], NULL));
+}
+
+static const struct nvme_stats_entry *find(struct nvme_stats_entry *e, int nr,
+					   __u32 cls, __u32 opcode)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (e[i].cls == cls && e[i].opcode == opcode && e[i].id == fd)
+			return &e[i];
+	return NULL;
+}
+
+static void check(__u64 expected)
+{
+	const struct nvme_stats_entry *e;
+	struct nvme_stats_entry *entries;
+	__u64 sum;
+	int nr, i;
+
+	nr = nvme_stats_snapshot(&entries);
+	assert(nr == 3);
+
+	e = find(entries, nr, NVME_STATS_ADMIN, nvme_admin_identify);
+	assert(e && e->count == expected && e->errors == expected);
+	e = find(entries, nr, NVME_STATS_ADMIN, nvme_admin_get_features);
+	assert(e && e->count == expected && e->failed == 0);
+	e = find(entries, nr, NVME_STATS_IO, nvme_cmd_flush);
+	assert(e && e->count == expected);
+
+	for (i = 0, sum = 0; i < NVME_STATS_HIST_BUCKETS; i++)
+		sum += e->hist[i];
+	assert(sum == expected);
+	assert(e->min_us <= e->max_us);
+	assert(nvme_stats_percentile(e, 0) <= nvme_stats_percentile(e, 100));
+	assert(nvme_stats_percentile(e, 100) <= e->max_us);
+	free(entries);
+}
+
+int main(int argc, char **argv)
+{
+	struct nvme_stats_entry *entries;
+	int i;
+
+	for (i = 1; i < NVME_STATS_HIST_BUCKETS; i++)
+		assert(nvme_stats_hist_lower(i) > nvme_stats_hist_lower(i - 1));
+	assert(nvme_stats_hist_lower(4) == 4);
+	assert(nvme_stats_hist_lower(8) == 8);
+	assert(nvme_stats_hist_lower(9) == 10);
+
+	fd = open("/dev/null", O_RDONLY);
+	assert(fd >= 0);
+
+	/* Disabled by default */
+	submit(NULL);
+	assert(nvme_stats_snapshot(&entries) == 0);
+	free(entries);
+
+	nvme_stats_enable(true);
+	run_threads();
+	check(NR_THREADS * NR_CMDS);
+
+	/* Counters of exited threads are kept and reused */
+	run_threads();
+	check(2 * NR_THREADS * NR_CMDS);
+
+	nvme_stats_reset();
+	assert(nvme_stats_snapshot(&entries) == 0);
+	free(entries);
+	submit(NULL);
+	check(NR_CMDS);
+
+	nvme_stats_enable(false);
+	submit(NULL);
+	check(NR_CMDS);
+
+	close(fd);
+	return 0;
+}
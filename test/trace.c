@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Traces commands submitted to a file which is not an NVMe device and
+ * drains the trace file with a reader.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <libnvme.h>
+
+#define NR_THREADS	2
+#define NR_CMDS		50
+#define RING_SIZE	128
+
+static int fd;
+static pthread_barrier_t barrier;
+
+static void *submit(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NR_CMDS; i++) {
+		assert(nvme_flush(fd, i + 1) < 0);
+		assert(nvme_zns_append(&(struct nvme_zns_append_args) {
+			.args_size = sizeof(struct nvme_zns_append_args),
+			.fd = fd,
+			.nsid = 1,
+			.zslba = i,
+		}) < 0);
+	}
+	return NULL;
+}
+
+/* Keeps all threads alive until each has its own ring */
+static void *submit_thread(void *arg)
+{
+	submit(arg);
+	pthread_barrier_wait(&barrier);
+	return NULL;
+}
+
+static void run_threads(void)
+{
+	pthread_t threads[NR_THREADS];
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, NR_THREADS);
+	for (i = 0; i < NR_THREADS; i++)
+		assert(!pthread_create(&threads[i], NULL, submit_thread,
+				       NULL));
+	for (i = 0; i < NR_THREADS; i++)
+		assert(!pthread_join(threads[i], NULL));
+	pthread_barrier_destroy(&barrier);
+}
+
+static int drain(struct nvme_trace_reader *rd)
+{
+	struct nvme_trace_record recs[16];
+	__u32 last_tid = 0;
+	__u64 last_seq = 0;
+	int n, i, total = 0;
+
+	while ((n = nvme_trace_reader_read(rd, recs, 16)) > 0) {
+		for (i = 0; i < n; i++) {
+			struct nvme_trace_record *r = &recs[i];
+
+			assert(r->id == fd);
+			assert(r->source == NVME_TRACE_IO);
+			assert(r->status == -ENOTTY);
+			assert(r->end_ns >= r->start_ns);
+			if (r->tid == last_tid)
+				assert(r->seq == last_seq + 1);
+			last_tid = r->tid;
+			last_seq = r->seq;
+			if (r->opcode == nvme_cmd_flush) {
+				assert(r->nsid >= 1 && r->nsid <= NR_CMDS);
+			} else {
+				assert(r->opcode == nvme_zns_cmd_append);
+				assert(r->nsid == 1 && r->cdw10 < NR_CMDS);
+			}
+		}
+		total += n;
+	}
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/libnvme-trace-XXXXXX";
+	struct nvme_trace_record rec;
+	struct nvme_trace_reader *rd;
+	int tmp;
+
+	fd = open("/dev/null", O_RDONLY);
+	assert(fd >= 0);
+	tmp = mkstemp(path);
+	assert(tmp >= 0);
+	close(tmp);
+
+	/* Not a trace file yet */
+	assert(!nvme_trace_reader_open(path) && errno == EPROTO);
+
+	assert(!nvme_trace_open(path, NR_THREADS, RING_SIZE));
+	assert(nvme_trace_open(path, NR_THREADS, RING_SIZE) < 0 &&
+	       errno == EBUSY);
+	rd = nvme_trace_reader_open(path);
+	assert(rd);
+	assert(nvme_trace_reader_read(rd, &rec, 1) == 0);
+
+	run_threads();
+	assert(drain(rd) == NR_THREADS * NR_CMDS * 2);
+	assert(nvme_trace_reader_lost(rd) == 0);
+	assert(nvme_trace_reader_read(rd, &rec, 1) == 0);
+
+	/* Overflow the ring of a single thread */
+	submit(NULL);
+	submit(NULL);
+	assert(drain(rd) == RING_SIZE);
+	assert(nvme_trace_reader_lost(rd) == 4 * NR_CMDS - RING_SIZE);
+
+	nvme_trace_close();
+	submit(NULL);
+	assert(nvme_trace_reader_read(rd, &rec, 1) == 0);
+	nvme_trace_reader_close(rd);
+
+	unlink(path);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Traverses a tree from several threads while another thread keeps
+ * refreshing it and reading the configuration back in, and checks that
+ * readers always see a consistent tree.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <syslog.h>
+
+#include <libnvme.h>
+
+#define NR_READERS	4
+#define NR_UPDATES	200
+
+static nvme_root_t r;
+static const char *config;
+static bool done;
+
+static int count_tree(void)
+{
+	nvme_host_t h;
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	int nr = 0;
+
+	nvme_for_each_host(r, h) {
+		assert(nvme_host_get_root(h) == r);
+		assert(nvme_host_get_hostnqn(h));
+		nvme_for_each_subsystem(h, s) {
+			assert(nvme_subsystem_get_host(s) == h);
+			nvme_subsystem_for_each_ctrl(s, c) {
+				assert(nvme_ctrl_get_subsystem(c) == s);
+				if (nvme_ctrl_get_sysfs_dir(c))
+					nvme_ctrl_get_state(c);
+				nr++;
+			}
+			nr++;
+		}
+		nr++;
+	}
+	return nr;
+}
+
+static void *reader(void *arg)
+{
+	int *traversals = arg;
+
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		int nr;
+
+		nvme_root_read_lock(r);
+		nr = count_tree();
+		/* The tree must not change while the read lock is held */
+		assert(count_tree() == nr);
+		nvme_root_read_unlock(r);
+		(*traversals)++;
+	}
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NR_UPDATES; i++) {
+		nvme_refresh_topology(r);
+		nvme_root_write_lock(r);
+		assert(!nvme_read_config(r, config));
+		nvme_root_write_unlock(r);
+	}
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t readers[NR_READERS], w;
+	int traversals[NR_READERS] = { 0 };
+	int i;
+
+	assert(argc == 2);
+	config = argv[1];
+
+	r = nvme_create_root(stderr, LOG_ERR);
+	assert(r);
+	assert(!nvme_read_config(r, config));
+	assert(nvme_first_host(r));
+
+	for (i = 0; i < NR_READERS; i++)
+		assert(!pthread_create(&readers[i], NULL, reader,
+				       &traversals[i]));
+	assert(!pthread_create(&w, NULL, writer, NULL));
+	assert(!pthread_join(w, NULL));
+	for (i = 0; i < NR_READERS; i++) {
+		assert(!pthread_join(readers[i], NULL));
+		printf("reader %d: %d traversals\n", i, traversals[i]);
+	}
+
+	nvme_free_tree(r);
+	return 0;
+}
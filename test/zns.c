@@ -23,6 +23,9 @@ static void show_zns_properties(nvme_ns_t n)
 	struct nvme_zns_id_ns zns_ns;
 	struct nvme_zns_id_ctrl zns_ctrl;
 	struct nvme_zone_report *zr;
+	struct nvme_zone_iter it;
+	struct nvme_zns_desc *zd;
+	uint64_t nr_zones = 0, nr_used = 0;
 	__u32 result;
 
 	zr = calloc(1, 0x1000);
@@ -58,6 +61,20 @@ static void show_zns_properties(nvme_ns_t n)
 
 	printf("nr_zones:%"PRIu64"\n", le64_to_cpu(zr->nr_zones));
 	free(zr);
+
+	if (nvme_zone_iter_init(&it, nvme_ns_get_fd(n), nvme_ns_get_nsid(n),
+				NVME_ZNS_ZRAS_REPORT_ALL, false, 0)) {
+		fprintf(stderr, "failed to start zone iterator\n");
+		return;
+	}
+	while (!nvme_zone_iter_next(&it, &zd, NULL) && zd) {
+		nr_zones++;
+		if ((zd->zs >> 4) != NVME_ZNS_ZS_EMPTY)
+			nr_used++;
+	}
+	nvme_zone_iter_free(&it);
+	printf("iterated zones:%"PRIu64" non-empty:%"PRIu64"\n",
+	       nr_zones, nr_used);
 }
 
 int main()